@@ -0,0 +1,484 @@
+/** FLAC multi-threaded encoder.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+Input PCM data is split into batches of MT_BATCH_FRAMES frames.
+Each batch is encoded by a separate FLAC encoder instance on one of the threads.
+Encoders number their frames from 0, so the threads rewrite the frame number in each frame header
+ and recompute CRC-8 and CRC-16.
+Encoded batches are returned in order.
+MD5 of the whole stream, total samples and min/max frame size are computed here
+ and are returned in ffflac_info at the end.
+
+main thread:   fill job -> submit -> ... -> wait for the oldest job -> return its frames -> free job
+worker thread: wait -> take the next submitted job -> encode -> renumber frames -> mark as done
+*/
+
+#include <fmedia.h>
+#include <FF/audio/flac.h>
+#include <FF/crc.h>
+#include <FF/crypto/md5.h>
+#include <FFOS/thread.h>
+#include <FFOS/semaphore.h>
+
+
+enum {
+	MT_BATCH_FRAMES = 64,
+	MT_MAXCHAN = 8,
+};
+
+enum MT_JOB_ST {
+	MT_JOB_FREE,
+	MT_JOB_FILL,
+	MT_JOB_PENDING,
+	MT_JOB_DONE,
+};
+
+struct mt_frame {
+	uint off, len;
+	uint samples;
+};
+
+struct mt_job {
+	uint state; //enum MT_JOB_ST
+	uint64 index; // batch number
+	void *pcm[MT_MAXCHAN];
+	size_t samples;
+	ffarr data; // encoded frames
+	struct mt_frame *frames;
+	uint nframes;
+	uint iframe; // next frame to return
+	int err;
+};
+
+
+typedef struct flac_mt {
+	fflock lk;
+	ffsem work; // posted for each submitted job
+	ffsem done; // posted for each finished job
+	ffthd *threads;
+	uint nthreads;
+	uint quit :1;
+	uint fin :1;
+
+	ffpcm fmt;
+	uint ssize; // bytes per 1 sample of 1 channel
+	uint level;
+	uint blocksize;
+	uint batch_samples;
+
+	struct mt_job *jobs;
+	uint njobs;
+	uint64 submitted, taken, head; // job sequence numbers
+	char *pcmbuf;
+
+	const void **in;
+	size_t inlen;
+	size_t inoff;
+
+	ffflac_info info;
+	uint md5 :1;
+	ffmd5_ctx md5ctx;
+	char *md5buf;
+	char errmsg[128];
+} flac_mt;
+
+void flac_mt_free(flac_mt *m);
+
+
+/** Decode UTF-8-like coded number from frame header.
+Return the number of bytes processed;  0 on error. */
+static uint mt_num_decode(const byte *d, size_t len, uint64 *val)
+{
+	uint n = 0;
+	while (n != 8 && (d[0] & (0x80 >> n)))
+		n++;
+	if (n == 1 || n > 7)
+		return 0;
+	if (n == 0) {
+		*val = d[0];
+		return 1;
+	}
+	if (n > len)
+		return 0;
+	uint64 v = d[0] & (0x7f >> n);
+	for (uint i = 1;  i != n;  i++) {
+		if ((d[i] & 0xc0) != 0x80)
+			return 0;
+		v = (v << 6) | (d[i] & 0x3f);
+	}
+	*val = v;
+	return n;
+}
+
+/** Encode number (up to 36 bits) for frame header.
+Return the number of bytes written. */
+static uint mt_num_encode(byte *d, uint64 v)
+{
+	if (v < 0x80) {
+		d[0] = (byte)v;
+		return 1;
+	}
+
+	uint n = 2;
+	while (n != 7 && v >= (1ULL << (5 * n + 1)))
+		n++;
+	for (uint i = n - 1;  i != 0;  i--) {
+		d[i] = 0x80 | (v & 0x3f);
+		v >>= 6;
+	}
+	d[0] = (byte)((0xff00 >> n) | v);
+	return n;
+}
+
+/** Append frame to job's output, add 'add' to the frame/sample number in the header.
+Return 0 on success. */
+static int mt_frame_add(struct mt_job *j, const byte *src, size_t len, uint samples, uint64 add)
+{
+	uint64 num;
+	if (len < 8 || src[0] != 0xff || (src[1] & 0xfe) != 0xf8)
+		return -1;
+
+	uint n = mt_num_decode(&src[4], len - 4, &num);
+	if (n == 0)
+		return -1;
+
+	uint bs = src[2] >> 4, sr = src[2] & 0x0f;
+	uint extra = ((bs == 6) ? 1 : (bs == 7) ? 2 : 0)
+		+ ((sr == 12) ? 1 : (sr == 13 || sr == 14) ? 2 : 0);
+	uint hdr = 4 + n + extra; // header length without CRC-8
+	if (hdr + 1 + 2 > len)
+		return -1;
+
+	if (NULL == ffarr_grow(&j->data, len + 8, 0))
+		return -1;
+	byte *d = (byte*)ffarr_end(&j->data);
+	ffmemcpy(d, src, 4);
+	uint i = 4 + mt_num_encode(&d[4], num + add);
+	ffmemcpy(&d[i], &src[4 + n], extra);
+	i += extra;
+	d[i] = crc8(d, i, 0);
+	i++;
+	size_t body = len - (hdr + 1) - 2;
+	ffmemcpy(&d[i], &src[hdr + 1], body);
+	i += body;
+	uint crc = crc16(d, i, 0);
+	d[i++] = (byte)(crc >> 8);
+	d[i++] = (byte)crc;
+
+	struct mt_frame *fr = &j->frames[j->nframes++];
+	fr->off = j->data.len;
+	fr->len = i;
+	fr->samples = samples;
+	j->data.len += i;
+	return 0;
+}
+
+/** Encode 1 batch. */
+static void mt_job_encode(flac_mt *m, struct mt_job *j)
+{
+	ffflac_enc fl;
+	int r;
+	ffpcm fmt = m->fmt;
+	uint64 first_frame = j->index * MT_BATCH_FRAMES;
+
+	j->data.len = 0;
+	j->nframes = 0;
+	j->iframe = 0;
+	j->err = 0;
+
+	ffflac_enc_init(&fl);
+	fl.level = m->level;
+	fl.opts |= FFFLAC_ENC_NOMD5;
+	if (0 != ffflac_create(&fl, &fmt)) {
+		j->err = -1;
+		goto end;
+	}
+	fl.pcm = (const void**)j->pcm;
+	fl.pcmlen = j->samples * m->ssize * m->fmt.channels;
+	ffflac_enc_fin(&fl);
+
+	for (;;) {
+		r = ffflac_encode(&fl);
+		switch (r) {
+		case FFFLAC_RDATA: {
+			if (j->nframes == MT_BATCH_FRAMES + 1) {
+				j->err = -1;
+				goto end;
+			}
+			// fixed block size: frame number;  variable block size: sample number
+			uint64 add = (((byte*)fl.data)[1] & 1) ? first_frame * m->blocksize : first_frame;
+			if (0 != mt_frame_add(j, (void*)fl.data, fl.datalen, fl.frsamps, add)) {
+				j->err = -1;
+				goto end;
+			}
+			break;
+		}
+
+		case FFFLAC_RDONE:
+			goto end;
+
+		case FFFLAC_RMORE:
+		default:
+			j->err = -1;
+			goto end;
+		}
+	}
+
+end:
+	ffflac_enc_close(&fl);
+}
+
+static FFTHDCALL int mt_worker(void *param)
+{
+	flac_mt *m = param;
+	for (;;) {
+		ffsem_wait(m->work, -1);
+		if (m->quit)
+			break;
+
+		fflk_lock(&m->lk);
+		struct mt_job *j = &m->jobs[m->taken++ % m->njobs];
+		fflk_unlock(&m->lk);
+
+		mt_job_encode(m, j);
+
+		fflk_lock(&m->lk);
+		j->state = MT_JOB_DONE;
+		fflk_unlock(&m->lk);
+		ffsem_post(m->done);
+	}
+	return 0;
+}
+
+flac_mt* flac_mt_create(const ffpcm *fmt, const ffflac_info *info, uint threads, uint level, uint md5)
+{
+	flac_mt *m;
+	if (fmt->channels > MT_MAXCHAN || info->maxblock == 0
+		|| NULL == (m = ffmem_new(flac_mt)))
+		return NULL;
+	m->work = FFSEM_INV;
+	m->done = FFSEM_INV;
+	fflk_init(&m->lk);
+
+	m->fmt = *fmt;
+	m->info = *info;
+	m->ssize = ffpcm_size(fmt->format, 1);
+	m->level = level;
+	m->blocksize = info->maxblock;
+	m->batch_samples = MT_BATCH_FRAMES * m->blocksize;
+	m->md5 = !!md5;
+	m->info.minframe = (uint)-1;
+	m->info.maxframe = 0;
+	m->info.total_samples = 0;
+	ffmd5_init(&m->md5ctx);
+
+	// 2 jobs per thread: one is being encoded while the other is being filled or returned
+	m->nthreads = threads;
+	m->njobs = threads * 2;
+	size_t chsize = m->batch_samples * m->ssize;
+	if (NULL == (m->jobs = ffmem_callocT(m->njobs, struct mt_job))
+		|| NULL == (m->pcmbuf = ffmem_alloc(m->njobs * chsize * fmt->channels))
+		|| NULL == (m->md5buf = ffmem_alloc(4096 * m->ssize * fmt->channels))
+		|| NULL == (m->threads = ffmem_callocT(threads, ffthd)))
+		goto err;
+	for (uint i = 0;  i != threads;  i++) {
+		m->threads[i] = FFTHD_INV;
+	}
+
+	for (uint i = 0;  i != m->njobs;  i++) {
+		struct mt_job *j = &m->jobs[i];
+		for (uint c = 0;  c != fmt->channels;  c++) {
+			j->pcm[c] = m->pcmbuf + (i * fmt->channels + c) * chsize;
+		}
+		if (NULL == (j->frames = ffmem_allocT(MT_BATCH_FRAMES + 1, struct mt_frame))
+			|| NULL == ffarr_alloc(&j->data, chsize * fmt->channels + 64 * 1024))
+			goto err;
+	}
+
+	if (FFSEM_INV == (m->work = ffsem_open(NULL, 0, 0))
+		|| FFSEM_INV == (m->done = ffsem_open(NULL, 0, 0)))
+		goto err;
+
+	for (uint i = 0;  i != threads;  i++) {
+		if (FFTHD_INV == (m->threads[i] = ffthd_create(&mt_worker, m, 0)))
+			goto err;
+	}
+	return m;
+
+err:
+	flac_mt_free(m);
+	return NULL;
+}
+
+void flac_mt_free(flac_mt *m)
+{
+	if (m == NULL)
+		return;
+
+	m->quit = 1;
+	if (m->threads != NULL) {
+		for (uint i = 0;  i != m->nthreads;  i++) {
+			if (m->threads[i] != FFTHD_INV)
+				ffsem_post(m->work);
+		}
+		for (uint i = 0;  i != m->nthreads;  i++) {
+			if (m->threads[i] != FFTHD_INV)
+				ffthd_join(m->threads[i], -1, NULL);
+		}
+		ffmem_free(m->threads);
+	}
+	if (m->work != FFSEM_INV)
+		ffsem_close(m->work);
+	if (m->done != FFSEM_INV)
+		ffsem_close(m->done);
+
+	if (m->jobs != NULL) {
+		for (uint i = 0;  i != m->njobs;  i++) {
+			ffarr_free(&m->jobs[i].data);
+			ffmem_free(m->jobs[i].frames);
+		}
+		ffmem_free(m->jobs);
+	}
+	ffmem_free(m->pcmbuf);
+	ffmem_free(m->md5buf);
+	ffmem_free(m);
+}
+
+void flac_mt_input(flac_mt *m, const void **pcm, size_t len, uint fin)
+{
+	m->in = pcm;
+	m->inlen = len;
+	m->inoff = 0;
+	if (fin)
+		m->fin = 1;
+}
+
+/** Update MD5 with interleaved little-endian samples as the reference encoder does. */
+static void mt_md5(flac_mt *m, const void **pcm, size_t off, size_t samples)
+{
+	uint nch = m->fmt.channels, ss = m->ssize;
+	size_t cap = 4096;
+	while (samples != 0) {
+		size_t n = ffmin(samples, cap);
+		char *d = m->md5buf;
+		for (size_t i = 0;  i != n;  i++) {
+			for (uint c = 0;  c != nch;  c++) {
+				ffmemcpy(d, (char*)pcm[c] + (off + i) * ss, ss);
+				d += ss;
+			}
+		}
+		ffmd5_update(&m->md5ctx, m->md5buf, n * ss * nch);
+		off += n;
+		samples -= n;
+	}
+}
+
+static void mt_submit(flac_mt *m, struct mt_job *j)
+{
+	fflk_lock(&m->lk);
+	j->state = MT_JOB_PENDING;
+	m->submitted++;
+	fflk_unlock(&m->lk);
+	ffsem_post(m->work);
+}
+
+static uint mt_job_state(flac_mt *m, struct mt_job *j)
+{
+	fflk_lock(&m->lk);
+	uint st = j->state;
+	fflk_unlock(&m->lk);
+	return st;
+}
+
+int flac_mt_encode(flac_mt *m, ffstr *out, uint *samples)
+{
+	uint nch = m->fmt.channels;
+
+	for (;;) {
+
+		// return frames of the oldest job if it's finished
+		if (m->head != m->submitted) {
+			struct mt_job *j = &m->jobs[m->head % m->njobs];
+			uint busy = (m->submitted - m->head == m->njobs) || m->fin;
+			uint st = mt_job_state(m, j);
+			if (st != MT_JOB_DONE && busy) {
+				ffsem_wait(m->done, -1);
+				continue;
+			}
+
+			if (st == MT_JOB_DONE) {
+				if (j->err != 0) {
+					ffs_fmt(m->errmsg, m->errmsg + sizeof(m->errmsg), "batch #%U: encoding failed%Z"
+						, j->index);
+					return FFFLAC_RERR;
+				}
+
+				if (j->iframe != j->nframes) {
+					const struct mt_frame *fr = &j->frames[j->iframe++];
+					ffstr_set(out, j->data.ptr + fr->off, fr->len);
+					*samples = fr->samples;
+					m->info.minframe = ffmin(m->info.minframe, fr->len);
+					m->info.maxframe = ffmax(m->info.maxframe, fr->len);
+					return FFFLAC_RDATA;
+				}
+
+				j->state = MT_JOB_FREE;
+				m->head++;
+				continue;
+			}
+		}
+
+		// copy input data into the current job
+		struct mt_job *j = &m->jobs[m->submitted % m->njobs];
+		if (m->inoff != m->inlen && j->state != MT_JOB_FREE && j->state != MT_JOB_FILL)
+			return FFFLAC_RERR; // no free jobs: shouldn't happen
+
+		if (m->inoff != m->inlen) {
+			if (j->state == MT_JOB_FREE) {
+				j->state = MT_JOB_FILL;
+				j->index = m->submitted;
+				j->samples = 0;
+			}
+
+			size_t off = m->inoff / (m->ssize * nch);
+			size_t n = ffmin((m->inlen - m->inoff) / (m->ssize * nch), m->batch_samples - j->samples);
+			for (uint c = 0;  c != nch;  c++) {
+				ffmemcpy((char*)j->pcm[c] + j->samples * m->ssize, (char*)m->in[c] + off * m->ssize, n * m->ssize);
+			}
+			if (m->md5)
+				mt_md5(m, m->in, off, n);
+			j->samples += n;
+			m->info.total_samples += n;
+			m->inoff += n * m->ssize * nch;
+
+			if (j->samples == m->batch_samples)
+				mt_submit(m, j);
+			continue;
+		}
+
+		if (!m->fin)
+			return FFFLAC_RMORE;
+
+		if (j->state == MT_JOB_FILL) {
+			mt_submit(m, j);
+			continue;
+		}
+
+		if (m->head == m->submitted)
+			break;
+	}
+
+	if (m->md5)
+		ffmd5_fin(&m->md5ctx, (void*)m->info.md5);
+	if (m->info.minframe == (uint)-1)
+		m->info.minframe = 0;
+	ffstr_set(out, &m->info, sizeof(m->info));
+	return FFFLAC_RDONE;
+}
+
+const char* flac_mt_errstr(flac_mt *m)
+{
+	return m->errmsg;
+}
+
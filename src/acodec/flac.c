@@ -14,6 +14,13 @@ extern const fmed_filter fmed_flac_input;
 extern const fmed_filter fmed_flacogg_input;
 extern int flac_out_config(ffpars_ctx *conf);
 
+typedef struct flac_mt flac_mt;
+extern flac_mt* flac_mt_create(const ffpcm *fmt, const ffflac_info *info, uint threads, uint level, uint md5);
+extern void flac_mt_free(flac_mt *m);
+extern void flac_mt_input(flac_mt *m, const void **pcm, size_t len, uint fin);
+extern int flac_mt_encode(flac_mt *m, ffstr *out, uint *samples);
+extern const char* flac_mt_errstr(flac_mt *m);
+
 struct flac_dec {
 	ffflac_dec fl;
 	ffpcmex fmt;
@@ -22,11 +29,13 @@ struct flac_dec {
 typedef struct flac_enc {
 	ffflac_enc fl;
 	uint state;
+	flac_mt *mt;
 } flac_enc;
 
 static struct flac_out_conf_t {
 	byte level;
 	byte md5;
+	byte threads;
 } flac_out_conf;
 
 
@@ -60,6 +69,7 @@ static const fmed_filter mod_flac_enc = {
 static const ffpars_arg flac_enc_conf_args[] = {
 	{ "compression",  FFPARS_TINT | FFPARS_F8BIT,  FFPARS_DSTOFF(struct flac_out_conf_t, level) },
 	{ "md5",	FFPARS_TBOOL | FFPARS_F8BIT,  FFPARS_DSTOFF(struct flac_out_conf_t, md5) },
+	{ "threads",	FFPARS_TINT | FFPARS_F8BIT,  FFPARS_DSTOFF(struct flac_out_conf_t, threads) },
 };
 
 
@@ -191,6 +201,7 @@ static int flac_enc_config(ffpars_ctx *conf)
 {
 	flac_out_conf.level = 6;
 	flac_out_conf.md5 = 1;
+	flac_out_conf.threads = 1;
 	ffpars_setargs(conf, &flac_out_conf, flac_enc_conf_args, FFCNT(flac_enc_conf_args));
 	return 0;
 }
@@ -212,10 +223,67 @@ static void* flac_enc_create(fmed_filt *d)
 static void flac_enc_free(void *ctx)
 {
 	flac_enc *f = ctx;
+	flac_mt_free(f->mt);
 	ffflac_enc_close(&f->fl);
 	ffmem_free(f);
 }
 
+/** Start multi-threaded encoder if enabled. */
+static int flac_enc_mt_init(flac_enc *f, fmed_filt *d)
+{
+	uint threads = flac_out_conf.threads;
+	if (threads == 0) {
+		ffsysconf sc;
+		ffsc_init(&sc);
+		threads = ffsc_get(&sc, FFSYSCONF_NPROCESSORS_ONLN);
+	}
+	if (threads <= 1)
+		return 0;
+
+	ffpcm fmt;
+	ffpcm_fmtcopy(&fmt, &d->audio.convfmt);
+	uint md5 = !(f->fl.opts & FFFLAC_ENC_NOMD5);
+	if (NULL == (f->mt = flac_mt_create(&fmt, &f->fl.info, threads, f->fl.level, md5))) {
+		syserrlog(core, d->trk, "flac", "flac_mt_create()");
+		return -1;
+	}
+	dbglog(core, d->trk, "flac", "using %u threads", threads);
+
+	if (d->flags & FMED_FFWD)
+		flac_mt_input(f->mt, (const void**)d->datani, d->datalen, d->flags & FMED_FLAST);
+	return 0;
+}
+
+static int flac_enc_mt_encode(flac_enc *f, fmed_filt *d)
+{
+	ffstr out;
+	uint samples;
+
+	switch (flac_mt_encode(f->mt, &out, &samples)) {
+	case FFFLAC_RMORE:
+		return FMED_RMORE;
+
+	case FFFLAC_RDATA:
+		fmed_setval("flac_in_frsamples", samples);
+		break;
+
+	case FFFLAC_RDONE:
+		d->out = out.ptr,  d->outlen = out.len;
+		return FMED_RDONE;
+
+	case FFFLAC_RERR:
+	default:
+		errlog(core, d->trk, "flac", "flac_mt_encode(): %s", flac_mt_errstr(f->mt));
+		return FMED_RERR;
+	}
+
+	d->out = out.ptr;
+	d->outlen = out.len;
+	dbglog(core, d->trk, NULL, "output: %L bytes"
+		, d->outlen);
+	return FMED_RDATA;
+}
+
 static int flac_enc_encode(void *ctx, fmed_filt *d)
 {
 	flac_enc *f = ctx;
@@ -263,18 +331,27 @@ static int flac_enc_encode(void *ctx, fmed_filt *d)
 	}
 
 	if (d->flags & FMED_FFWD) {
-		f->fl.pcm = (const void**)d->datani;
-		f->fl.pcmlen = d->datalen;
-		if (d->flags & FMED_FLAST)
-			ffflac_enc_fin(&f->fl);
+		if (f->mt != NULL) {
+			flac_mt_input(f->mt, (const void**)d->datani, d->datalen, d->flags & FMED_FLAST);
+		} else {
+			f->fl.pcm = (const void**)d->datani;
+			f->fl.pcmlen = d->datalen;
+			if (d->flags & FMED_FLAST)
+				ffflac_enc_fin(&f->fl);
+		}
 	}
 
 	if (f->state != 3) {
+		if (0 != flac_enc_mt_init(f, d))
+			return FMED_RERR;
 		f->state = 3;
 		d->out = (void*)&f->fl.info,  d->outlen = sizeof(ffflac_info);
 		return FMED_RDATA;
 	}
 
+	if (f->mt != NULL)
+		return flac_enc_mt_encode(f, d);
+
 	r = ffflac_encode(&f->fl);
 
 	switch (r) {
@@ -0,0 +1,686 @@
+/** MPEG Layer3 segmented multi-threaded encoder.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+Input PCM data is split into segments of equal length (a multiple of frame size).
+Each segment is encoded by a separate LAME instance on one of the threads.
+An encoder starts MT_WARMUP frames before its segment and stops MT_WARMUP frames after it,
+ so the psychoacoustic model is settled at the segment start,
+ and there's a window where the outputs of 2 neighbouring encoders describe the same audio.
+All encoders have the same settings and the segment boundaries are aligned to frame size,
+ so frame #N of one encoder and frame #N of the other (counting from the stream beginning)
+ start at the same audio sample.
+
+Joining 2 segments: the junction is the first frame N in the overlapping window
+ which takes from the bit reservoir (main_data_begin) not more bytes than
+ the previous encoder's frame N does.
+The stream contains frames [..N) from the previous segment and [N..] from the next one.
+The reservoir bytes the next segment's frame N refers to are copied over the tail
+ of the main data area of the previous segment's frames before N.
+These bytes belong to the dropped frame N of the previous segment, so no other frame uses them.
+
+The LAME tag returned by the first segment's encoder is updated at the end:
+ the number of frames and bytes, seek table, encoder padding, music length and CRC.
+
+main thread:   fill jobs -> submit -> ... -> wait for the oldest 2 jobs -> join -> return data of the oldest job -> free job
+worker thread: wait -> take the next submitted job -> encode -> parse frames -> mark as done
+*/
+
+#include <fmedia.h>
+#include <acodec/mpeg-tag.h>
+#include <FF/audio/mp3lame.h>
+#include <FF/audio/pcm.h>
+#include <FF/array.h>
+#include <FFOS/thread.h>
+#include <FFOS/semaphore.h>
+
+
+enum {
+	MT_WARMUP = 64, // frames encoded before and after segment
+	MT_MARGIN = 4, // frames at the end of encoder's output not used for joining
+	MT_TAG_MAX = 2048,
+	MT_MAXCHAN = 2,
+};
+
+enum MT_JOB_ST {
+	MT_JOB_FREE,
+	MT_JOB_FILL,
+	MT_JOB_PENDING,
+	MT_JOB_DONE,
+};
+
+struct mt_frame {
+	uint off, len;
+	uint hdr; // header + CRC + side info
+	uint mdb; // main_data_begin
+};
+
+struct mt_job {
+	uint state; //enum MT_JOB_ST
+	uint64 index; // segment number
+	uint64 start, end; // input samples range
+	char *pcm; // interleaved
+	size_t samples;
+
+	ffarr data; // encoded frames
+	ffarr frames; // struct mt_frame[], Xing frame isn't included
+	uint xing_len; // length of the leading Xing frame
+	uint first, last; // frames to return: [first..last)
+	uint joined :1;
+	uint skip :1; // all audio is already returned by the previous segment
+	uint returned :1;
+
+	byte tag[MT_TAG_MAX];
+	uint taglen;
+	uint delay; // encoder delay
+	uint peak; // peak signal amplitude
+	const char *err;
+};
+
+
+typedef struct mpeg_mt {
+	fflock lk;
+	ffsem work; // posted for each submitted job
+	ffsem done; // posted for each finished job
+	ffthd *threads;
+	uint nthreads;
+	uint quit :1;
+	uint fin :1;
+	uint in_ileaved :1;
+
+	ffpcm fmt;
+	uint ssize; // bytes per 1 sample of 1 channel
+	int qual;
+	uint spf; // samples per frame
+	uint64 seg; // samples per segment
+	uint64 warmup; // samples
+
+	struct mt_job *jobs;
+	uint njobs;
+	uint64 created, submitted, taken, head; // job sequence numbers
+	uint64 pos; // input samples received
+
+	const void *in; // interleaved data or channel pointers
+	size_t inlen;
+	size_t inoff;
+
+	uint64 nframes; // audio frames returned
+	uint64 nbytes; // bytes returned, including Xing frame
+	ffarr offsets; // uint[]: offsets of returned audio frames
+	uint crc; // CRC-16 of audio frames
+	uint peak;
+	uint badjoins;
+	ushort crctab[256];
+	byte tag[MT_TAG_MAX];
+	uint taglen;
+	char errmsg[128];
+} mpeg_mt;
+
+void mpeg_mt_free(mpeg_mt *m);
+
+
+static FFINL uint mt_job_max_samples(mpeg_mt *m)
+{
+	return m->seg + 2 * m->warmup;
+}
+
+static FFINL struct mt_job* mt_job(mpeg_mt *m, uint64 seq)
+{
+	return &m->jobs[seq % m->njobs];
+}
+
+static FFINL struct mt_frame* mt_frames(const struct mt_job *j)
+{
+	return (void*)j->frames.ptr;
+}
+
+/** Get encoder delay and peak value from LAME tag. */
+static void mt_job_tag(struct mt_job *j)
+{
+	if (0 != mpeg_tag_lame(j->tag, j->taglen, &j->delay, &j->peak)) {
+		j->delay = 576 + 529; // LAME default
+		j->peak = 0;
+	}
+}
+
+/** Split encoder output into frames. */
+static int mt_job_parse(mpeg_mt *m, struct mt_job *j)
+{
+	const byte *d = (void*)j->data.ptr;
+	size_t off = 0;
+	struct mpeg_frame fr;
+	struct mpeg_tag t;
+
+	j->xing_len = 0;
+	if (0 == mpeg_tag_find(d, j->data.len, &t)) {
+		mpeg_frame_parse(d, j->data.len, &fr);
+		j->xing_len = fr.len;
+		off = fr.len;
+	}
+
+	while (off != j->data.len) {
+		if (0 == mpeg_frame_parse(d + off, j->data.len - off, &fr)) {
+			j->err = "bad MPEG frame";
+			return -1;
+		}
+		if (fr.rate != m->fmt.sample_rate) {
+			j->err = "sample rate is changed by encoder";
+			return -1;
+		}
+		struct mt_frame *f;
+		if (NULL == (f = ffarr_pushT(&j->frames, struct mt_frame))) {
+			j->err = "not enough memory";
+			return -1;
+		}
+		f->off = off;
+		f->len = fr.len;
+		f->hdr = fr.hdr;
+		f->mdb = fr.mdb;
+		off += fr.len;
+	}
+	return 0;
+}
+
+/** Encode 1 segment. */
+static void mt_job_encode(mpeg_mt *m, struct mt_job *j)
+{
+	ffmpg_enc mpg;
+	int r;
+	ffpcm fmt = m->fmt;
+
+	ffmem_tzero(&mpg);
+	j->data.len = 0;
+	j->frames.len = 0;
+	j->taglen = 0;
+	j->err = NULL;
+
+	mpg.ileaved = 1;
+	if (0 != ffmpg_create(&mpg, &fmt, m->qual)) {
+		j->err = "ffmpg_create() failed";
+		goto end;
+	}
+	mpg.pcm = (void*)j->pcm;
+	mpg.pcmlen = j->samples * m->ssize * m->fmt.channels;
+
+	for (;;) {
+		r = ffmpg_encode(&mpg);
+		switch (r) {
+		case FFMPG_RDATA:
+			if (NULL == ffarr_append(&j->data, mpg.data, mpg.datalen)) {
+				j->err = "not enough memory";
+				goto end;
+			}
+			break;
+
+		case FFMPG_RMORE:
+			mpg.fin = 1;
+			break;
+
+		case FFMPG_RDONE:
+			// the final data is LAME tag which replaces the first frame
+			if (mpg.datalen <= MT_TAG_MAX) {
+				ffmemcpy(j->tag, mpg.data, mpg.datalen);
+				j->taglen = mpg.datalen;
+			}
+			goto done;
+
+		default:
+			j->err = ffmpg_enc_errstr(&mpg);
+			goto end;
+		}
+	}
+
+done:
+	if (0 != mt_job_parse(m, j))
+		goto end;
+	mt_job_tag(j);
+
+end:
+	ffmpg_enc_close(&mpg);
+}
+
+static FFTHDCALL int mt_worker(void *param)
+{
+	mpeg_mt *m = param;
+	for (;;) {
+		ffsem_wait(m->work, -1);
+		if (m->quit)
+			break;
+
+		fflk_lock(&m->lk);
+		struct mt_job *j = mt_job(m, m->taken++);
+		fflk_unlock(&m->lk);
+
+		mt_job_encode(m, j);
+
+		fflk_lock(&m->lk);
+		j->state = MT_JOB_DONE;
+		fflk_unlock(&m->lk);
+		ffsem_post(m->done);
+	}
+	return 0;
+}
+
+/**
+fmt: interleaved or non-interleaved input format supported by LAME
+segment: segment length (in seconds)
+Return NULL if the format isn't supported or on error. */
+mpeg_mt* mpeg_mt_create(const ffpcm *fmt, int qual, uint threads, uint segment)
+{
+	mpeg_mt *m;
+	uint spf;
+	switch (fmt->sample_rate) {
+	case 32000: case 44100: case 48000:
+		spf = 1152;  break;
+	case 8000: case 11025: case 12000: case 16000: case 22050: case 24000:
+		spf = 576;  break;
+	default:
+		return NULL; // LAME would resample
+	}
+	if (fmt->channels > MT_MAXCHAN
+		|| NULL == (m = ffmem_new(mpeg_mt)))
+		return NULL;
+	m->work = FFSEM_INV;
+	m->done = FFSEM_INV;
+	fflk_init(&m->lk);
+	mpeg_crc_init(m->crctab);
+
+	ffpcm_fmtcopy(&m->fmt, fmt);
+	m->in_ileaved = fmt->ileaved;
+	m->fmt.ileaved = 1;
+	m->ssize = ffpcm_size(fmt->format, 1);
+	m->qual = qual;
+	m->spf = spf;
+	m->warmup = MT_WARMUP * spf;
+	m->seg = (uint64)segment * fmt->sample_rate / spf * spf;
+	m->seg = ffmax(m->seg, 4 * m->warmup);
+
+	// the oldest job can't be returned until the next one is finished
+	m->nthreads = threads;
+	m->njobs = threads + 2;
+	size_t cap = mt_job_max_samples(m) * m->ssize * fmt->channels;
+	if (NULL == (m->jobs = ffmem_callocT(m->njobs, struct mt_job))
+		|| NULL == (m->threads = ffmem_callocT(threads, ffthd)))
+		goto err;
+	for (uint i = 0;  i != threads;  i++) {
+		m->threads[i] = FFTHD_INV;
+	}
+
+	for (uint i = 0;  i != m->njobs;  i++) {
+		struct mt_job *j = &m->jobs[i];
+		if (NULL == (j->pcm = ffmem_alloc(cap))
+			|| NULL == ffarr_alloc(&j->data, cap / 4))
+			goto err;
+	}
+
+	if (FFSEM_INV == (m->work = ffsem_open(NULL, 0, 0))
+		|| FFSEM_INV == (m->done = ffsem_open(NULL, 0, 0)))
+		goto err;
+
+	for (uint i = 0;  i != threads;  i++) {
+		if (FFTHD_INV == (m->threads[i] = ffthd_create(&mt_worker, m, 0)))
+			goto err;
+	}
+	return m;
+
+err:
+	mpeg_mt_free(m);
+	return NULL;
+}
+
+void mpeg_mt_free(mpeg_mt *m)
+{
+	if (m == NULL)
+		return;
+
+	m->quit = 1;
+	if (m->threads != NULL) {
+		for (uint i = 0;  i != m->nthreads;  i++) {
+			if (m->threads[i] != FFTHD_INV)
+				ffsem_post(m->work);
+		}
+		for (uint i = 0;  i != m->nthreads;  i++) {
+			if (m->threads[i] != FFTHD_INV)
+				ffthd_join(m->threads[i], -1, NULL);
+		}
+		ffmem_free(m->threads);
+	}
+	if (m->work != FFSEM_INV)
+		ffsem_close(m->work);
+	if (m->done != FFSEM_INV)
+		ffsem_close(m->done);
+
+	if (m->jobs != NULL) {
+		for (uint i = 0;  i != m->njobs;  i++) {
+			ffmem_safefree0(m->jobs[i].pcm);
+			ffarr_free(&m->jobs[i].data);
+			ffarr_free(&m->jobs[i].frames);
+		}
+		ffmem_free(m->jobs);
+	}
+	ffarr_free(&m->offsets);
+	ffmem_free(m);
+}
+
+/**
+pcm: interleaved data or an array of channel pointers */
+void mpeg_mt_input(mpeg_mt *m, const void *pcm, size_t len, uint fin)
+{
+	m->in = pcm;
+	m->inlen = len;
+	m->inoff = 0;
+	if (fin)
+		m->fin = 1;
+}
+
+uint mpeg_mt_badjoins(mpeg_mt *m)
+{
+	return m->badjoins;
+}
+
+const char* mpeg_mt_errstr(mpeg_mt *m)
+{
+	return m->errmsg;
+}
+
+static void mt_submit(mpeg_mt *m, struct mt_job *j)
+{
+	fflk_lock(&m->lk);
+	j->state = MT_JOB_PENDING;
+	m->submitted++;
+	fflk_unlock(&m->lk);
+	ffsem_post(m->work);
+}
+
+static uint mt_job_state(mpeg_mt *m, struct mt_job *j)
+{
+	fflk_lock(&m->lk);
+	uint st = j->state;
+	fflk_unlock(&m->lk);
+	return st;
+}
+
+/** Copy input samples into a job's buffer. */
+static void mt_job_copy(mpeg_mt *m, struct mt_job *j, size_t off, size_t n)
+{
+	uint nch = m->fmt.channels, ss = m->ssize;
+	char *dst = j->pcm + j->samples * ss * nch;
+
+	if (m->in_ileaved) {
+		ffmemcpy(dst, (char*)m->in + off * ss * nch, n * ss * nch);
+
+	} else {
+		const char **in = (const char**)m->in;
+		for (size_t i = 0;  i != n;  i++) {
+			for (uint c = 0;  c != nch;  c++) {
+				ffmemcpy(dst, in[c] + (off + i) * ss, ss);
+				dst += ss;
+			}
+		}
+	}
+	j->samples += n;
+}
+
+/** Copy the last 'n' bytes of main data stored before frame 'sfr' in 'src'
+ over the last 'n' bytes of main data before frame 'dfr' in 'dst'. */
+static void mt_reservoir_copy(struct mt_job *dst, uint dfr, const struct mt_job *src, uint sfr, uint n)
+{
+	const struct mt_frame *df = mt_frames(dst), *sf = mt_frames(src);
+	char *d = NULL;
+	const char *s = NULL;
+	uint dn = 0, sn = 0;
+
+	while (n != 0) {
+		if (dn == 0) {
+			if (dfr == 0)
+				break;
+			dfr--;
+			d = dst->data.ptr + df[dfr].off + df[dfr].len;
+			dn = df[dfr].len - df[dfr].hdr;
+			continue;
+		}
+		if (sn == 0) {
+			if (sfr == 0)
+				break;
+			sfr--;
+			s = src->data.ptr + sf[sfr].off + sf[sfr].len;
+			sn = sf[sfr].len - sf[sfr].hdr;
+			continue;
+		}
+
+		uint k = ffmin(n, ffmin(dn, sn));
+		d -= k;
+		s -= k;
+		ffmemcpy(d, s, k);
+		dn -= k;
+		sn -= k;
+		n -= k;
+	}
+}
+
+/** Find the junction frame of 2 neighbouring segments. */
+static int mt_join(mpeg_mt *m, struct mt_job *a, struct mt_job *b, uint b_last)
+{
+	uint64 abase = a->start / m->spf, bbase = b->start / m->spf;
+	uint64 g0 = bbase + MT_WARMUP;
+	uint64 g1 = abase + a->frames.len;
+	if (a->end > a->delay + MT_MARGIN * m->spf)
+		g1 = ffmin(g1, (a->end - a->delay) / m->spf - MT_MARGIN);
+	else
+		g1 = 0;
+	g1 = ffmin(g1, bbase + b->frames.len);
+
+	a->joined = 1;
+	if (g0 >= g1) {
+		if (b_last && a->end == m->pos) {
+			// the last segment contains only the audio which is already encoded
+			a->last = a->frames.len;
+			b->skip = 1;
+			return 0;
+		}
+		ffs_fmt(m->errmsg, m->errmsg + sizeof(m->errmsg), "segment #%U: no frames to join%Z"
+			, a->index);
+		return -1;
+	}
+
+	const struct mt_frame *af = mt_frames(a), *bf = mt_frames(b);
+	uint64 g;
+	for (g = g0;  g != g1;  g++) {
+		if (bf[g - bbase].mdb <= af[g - abase].mdb)
+			break;
+	}
+	if (g == g1) {
+		// the junction frame will be decoded partially
+		g = g0;
+		m->badjoins++;
+	}
+
+	uint n = ffmin(bf[g - bbase].mdb, af[g - abase].mdb);
+	mt_reservoir_copy(a, g - abase, b, g - bbase, n);
+	a->last = g - abase;
+	b->first = g - bbase;
+	return 0;
+}
+
+/** Update the counters with the data being returned. */
+static int mt_returned(mpeg_mt *m, struct mt_job *j)
+{
+	const struct mt_frame *fr = mt_frames(j);
+	uint n = j->last - j->first;
+	uint64 base = m->nbytes - ((n != 0) ? fr[j->first].off : 0);
+	for (uint i = 0;  i != n;  i++) {
+		uint *off;
+		if (NULL == (off = ffarr_pushT(&m->offsets, uint)))
+			return -1;
+		*off = (uint)(base + fr[j->first + i].off);
+	}
+
+	if (n != 0) {
+		const char *d = j->data.ptr + fr[j->first].off;
+		size_t len = fr[j->last - 1].off + fr[j->last - 1].len - fr[j->first].off;
+		m->crc = mpeg_crc16(m->crctab, m->crc, (void*)d, len);
+		m->nbytes += len;
+	}
+	m->nframes += n;
+
+	m->peak = ffmax(m->peak, j->peak);
+	return 0;
+}
+
+/** Update Xing and LAME tags of the whole stream. */
+static void mt_tag_update(mpeg_mt *m)
+{
+	struct mpeg_tag_info info = {};
+	const struct mt_job *j0 = &m->jobs[0];
+	int64 padding = (int64)(m->nframes * m->spf) - j0->delay - m->pos;
+	info.frames = m->nframes;
+	info.bytes = m->nbytes;
+	info.offsets = (void*)m->offsets.ptr;
+	info.delay = j0->delay;
+	info.padding = ffmax(padding, 0);
+	info.peak = m->peak;
+	info.crc = m->crc;
+	// ReplayGain values were computed for the first segment only
+	mpeg_tag_update(m->tag, m->taglen, &info, m->crctab);
+}
+
+/** Get the next chunk of output data.
+Return enum FFMPG_R;  -1 on error. */
+int mpeg_mt_encode(mpeg_mt *m, ffstr *out)
+{
+	uint nch = m->fmt.channels;
+	uint ssize = m->ssize * nch;
+
+	for (;;) {
+
+		// return data of the oldest job if it's finished and joined with the next one
+		if (m->head != m->created) {
+			struct mt_job *j = mt_job(m, m->head);
+
+			if (j->returned || j->skip) {
+				j->returned = 0;
+				j->skip = 0;
+				j->joined = 0;
+				j->state = MT_JOB_FREE;
+				m->head++;
+				continue;
+			}
+
+			uint all_in = m->fin && m->inoff == m->inlen && m->submitted == m->created;
+			uint last = all_in && m->head + 1 == m->created;
+			struct mt_job *next = (m->head + 1 != m->submitted) ? mt_job(m, m->head + 1) : NULL;
+
+			if (!j->joined
+				&& mt_job_state(m, j) == MT_JOB_DONE
+				&& (last || (next != NULL && mt_job_state(m, next) == MT_JOB_DONE))) {
+
+				if (j->err != NULL || (next != NULL && next->err != NULL)) {
+					const struct mt_job *e = (j->err != NULL) ? j : next;
+					ffs_fmt(m->errmsg, m->errmsg + sizeof(m->errmsg), "segment #%U: %s%Z"
+						, e->index, e->err);
+					return -1;
+				}
+				if (next != NULL && next->delay != j->delay) {
+					ffs_fmt(m->errmsg, m->errmsg + sizeof(m->errmsg), "segment #%U: encoder delay mismatch%Z"
+						, next->index);
+					return -1;
+				}
+
+				if (m->head == 0) {
+					ffmemcpy(m->tag, j->tag, j->taglen);
+					m->taglen = j->taglen;
+					m->nbytes = j->xing_len;
+				}
+
+				if (last) {
+					j->last = j->frames.len;
+					j->joined = 1;
+				} else if (0 != mt_join(m, j, next, all_in && m->head + 2 == m->created)) {
+					return -1;
+				}
+			}
+
+			if (j->joined) {
+				if (0 != mt_returned(m, j)) {
+					ffs_fmt(m->errmsg, m->errmsg + sizeof(m->errmsg), "not enough memory%Z");
+					return -1;
+				}
+				j->returned = 1;
+
+				const struct mt_frame *fr = mt_frames(j);
+				size_t off = (m->head == 0) ? 0 : fr[j->first].off;
+				size_t end = (j->last != 0) ? fr[j->last - 1].off + fr[j->last - 1].len : j->xing_len;
+				if (j->last == j->first && m->head != 0)
+					continue;
+				ffstr_set(out, j->data.ptr + off, end - off);
+				return FFMPG_RDATA;
+			}
+		}
+
+		// copy input data into the jobs containing the current position
+		if (m->inoff != m->inlen) {
+			uint64 next_start = (m->created == 0) ? 0 : m->created * m->seg - m->warmup;
+			if (m->pos == next_start) {
+				if (m->created - m->head == m->njobs) {
+					ffsem_wait(m->done, -1);
+					continue;
+				}
+				struct mt_job *j = mt_job(m, m->created);
+				j->state = MT_JOB_FILL;
+				j->index = m->created;
+				j->start = next_start;
+				j->end = (m->created + 1) * m->seg + m->warmup;
+				j->samples = 0;
+				j->first = 0;
+				j->last = 0;
+				m->created++;
+				continue;
+			}
+
+			size_t off = m->inoff / ssize;
+			uint64 n = (m->inlen - m->inoff) / ssize;
+			if (n == 0) {
+				m->inoff = m->inlen;
+				continue;
+			}
+			n = ffmin(n, next_start - m->pos);
+			for (uint64 i = m->submitted;  i != m->created;  i++) {
+				struct mt_job *j = mt_job(m, i);
+				n = ffmin(n, j->end - m->pos);
+			}
+
+			for (uint64 i = m->submitted;  i != m->created;  i++) {
+				mt_job_copy(m, mt_job(m, i), off, n);
+			}
+			m->pos += n;
+			m->inoff += n * ssize;
+
+			while (m->submitted != m->created) {
+				struct mt_job *j = mt_job(m, m->submitted);
+				if (j->start + j->samples != j->end)
+					break;
+				mt_submit(m, j);
+			}
+			continue;
+		}
+
+		if (!m->fin)
+			return FFMPG_RMORE;
+
+		if (m->submitted != m->created) {
+			struct mt_job *j = mt_job(m, m->submitted);
+			j->end = j->start + j->samples;
+			mt_submit(m, j);
+			continue;
+		}
+
+		if (m->head == m->created)
+			break;
+
+		ffsem_wait(m->done, -1);
+	}
+
+	mt_tag_update(m);
+	ffstr_set(out, m->tag, m->taglen);
+	return FFMPG_RDONE;
+}
@@ -0,0 +1,216 @@
+/** MPEG Layer3: frame header;  Xing and LAME tags.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+Xing frame: HDR SIDE_INFO "Xing"|"Info" FLAGS [FRAMES] [BYTES] [TOC] [QUALITY] [LAME]
+LAME extension (36 bytes):
+ +0 VERSION(9) REVISION_VBR(1) LOWPASS(1)
+ +11 PEAK(4) RADIO_GAIN(2) AUDIOPHILE_GAIN(2)
+ +19 FLAGS(1) BITRATE(1)
+ +21 DELAY(12bit) PADDING(12bit)
+ +24 MISC(1) MP3GAIN(1) PRESET(2)
+ +28 MUSIC_LENGTH(4) MUSIC_CRC(2) TAG_CRC(2)
+*/
+
+#include <acodec/mpeg-tag.h>
+
+
+enum {
+	XING_FRAMES = 1,
+	XING_BYTES = 2,
+	XING_TOC = 4,
+	XING_QUALITY = 8,
+	LAME_LEN = 36,
+	LAME_MAXDELAY = 0xfff,
+};
+
+static uint tag_be32(const byte *d)
+{
+	return ((uint)d[0] << 24) | ((uint)d[1] << 16) | ((uint)d[2] << 8) | d[3];
+}
+
+static void tag_set_be32(byte *d, uint v)
+{
+	d[0] = (byte)(v >> 24);
+	d[1] = (byte)(v >> 16);
+	d[2] = (byte)(v >> 8);
+	d[3] = (byte)v;
+}
+
+
+void mpeg_crc_init(ushort *tab)
+{
+	for (uint i = 0;  i != 256;  i++) {
+		uint crc = i;
+		for (uint k = 0;  k != 8;  k++) {
+			crc = (crc & 1) ? ((crc >> 1) ^ 0xa001) : (crc >> 1);
+		}
+		tab[i] = (ushort)crc;
+	}
+}
+
+uint mpeg_crc16(const ushort *tab, uint crc, const void *data, size_t len)
+{
+	const byte *d = data;
+	for (size_t i = 0;  i != len;  i++) {
+		crc = (crc >> 8) ^ tab[(crc ^ d[i]) & 0xff];
+	}
+	return crc;
+}
+
+
+static const ushort mpeg_bitrates[2][16] = {
+	{ 0,32,40,48,56,64,80,96,112,128,160,192,224,256,320,0 }, // MPEG-1
+	{ 0,8,16,24,32,40,48,56,64,80,96,112,128,144,160,0 }, // MPEG-2, 2.5
+};
+static const ushort mpeg_rates[3] = { 44100, 48000, 32000 };
+
+uint mpeg_frame_parse(const void *data, size_t len, struct mpeg_frame *fr)
+{
+	const byte *d = data;
+	if (len < 4 || d[0] != 0xff || (d[1] & 0xe0) != 0xe0)
+		return 0;
+
+	uint ver = (d[1] >> 3) & 3; // 3: MPEG-1;  2: MPEG-2;  0: MPEG-2.5
+	uint layer = (d[1] >> 1) & 3;
+	uint br_idx = d[2] >> 4, sr_idx = (d[2] >> 2) & 3;
+	if (ver == 1 || layer != 1 || mpeg_bitrates[0][br_idx] == 0 || sr_idx == 3)
+		return 0;
+
+	uint mpeg1 = (ver == 3);
+	uint sr = mpeg_rates[sr_idx] >> ((ver == 3) ? 0 : (ver == 2) ? 1 : 2);
+	uint br = mpeg_bitrates[!mpeg1][br_idx];
+	uint flen = (mpeg1 ? 144000 : 72000) * br / sr + ((d[2] >> 1) & 1);
+	uint mono = ((d[3] >> 6) == 3);
+	uint sidelen = (mpeg1) ? ((mono) ? 17 : 32) : ((mono) ? 9 : 17);
+	uint hdr = 4 + ((d[1] & 1) ? 0 : 2) + sidelen;
+	if (flen < hdr || flen > len)
+		return 0;
+
+	const byte *si = d + hdr - sidelen;
+	fr->len = flen;
+	fr->hdr = hdr;
+	fr->mdb = (mpeg1) ? (((uint)si[0] << 1) | (si[1] >> 7)) : si[0];
+	fr->rate = sr;
+	fr->samples = (mpeg1) ? 1152 : 576;
+	return flen;
+}
+
+
+int mpeg_tag_find(const void *data, size_t len, struct mpeg_tag *t)
+{
+	const byte *d = data;
+	struct mpeg_frame fr;
+	if (0 == mpeg_frame_parse(d, len, &fr))
+		return -1;
+	len = fr.len;
+
+	uint off = fr.hdr;
+	if (off + 8 > len
+		|| !(!ffmemcmp(d + off, "Xing", 4) || !ffmemcmp(d + off, "Info", 4)))
+		return -1;
+	t->xing = off;
+	t->flags = tag_be32(d + off + 4);
+	off += 8;
+	if (t->flags & XING_FRAMES)
+		off += 4;
+	if (t->flags & XING_BYTES)
+		off += 4;
+	if (t->flags & XING_TOC)
+		off += 100;
+	if (t->flags & XING_QUALITY)
+		off += 4;
+	t->lame = (off + LAME_LEN <= len && d[off] == 'L') ? off : 0;
+	return 0;
+}
+
+int mpeg_tag_lame(const void *data, size_t len, uint *delay, uint *peak)
+{
+	struct mpeg_tag t;
+	if (0 != mpeg_tag_find(data, len, &t) || t.lame == 0)
+		return -1;
+	const byte *d = (byte*)data + t.lame;
+	*delay = ((uint)d[21] << 4) | (d[22] >> 4);
+	*peak = tag_be32(d + 11);
+	return 0;
+}
+
+uint mpeg_tag_create(ffarr *buf, const void *hdr)
+{
+	const byte *h = hdr;
+	byte d[4];
+	struct mpeg_frame fr;
+
+	// the same stream parameters, no CRC, no padding;  the smallest bitrate to fit the tags
+	d[0] = 0xff;
+	d[1] = h[1] | 1;
+	d[3] = h[3];
+	uint br_idx;
+	for (br_idx = 1;  br_idx != 15;  br_idx++) {
+		d[2] = (byte)((br_idx << 4) | (h[2] & 0x0c));
+		if (0 != mpeg_frame_parse(d, (size_t)-1, &fr)
+			&& fr.hdr + 8 + 4 + 4 + 100 + LAME_LEN <= fr.len)
+			break;
+	}
+	if (br_idx == 15)
+		return 0;
+
+	if (NULL == ffarr_realloc(buf, fr.len))
+		return 0;
+	byte *p = (void*)buf->ptr;
+	ffmem_zero(p, fr.len);
+	ffmemcpy(p, d, 4);
+
+	uint off = fr.hdr;
+	ffmemcpy(p + off, "Xing", 4);
+	tag_set_be32(p + off + 4, XING_FRAMES | XING_BYTES | XING_TOC);
+	off += 8 + 4 + 4 + 100;
+	// decoders use delay and padding values only from the tag with LAME signature
+	ffmemcpy(p + off, "LAME3.100", 9);
+	buf->len = fr.len;
+	return fr.len;
+}
+
+void mpeg_tag_update(void *data, size_t len, const struct mpeg_tag_info *info, const ushort *crctab)
+{
+	struct mpeg_tag t;
+	byte *d = data;
+	if (0 != mpeg_tag_find(d, len, &t))
+		return;
+
+	if (info->id != NULL)
+		ffmemcpy(d + t.xing, info->id, 4);
+
+	uint off = t.xing + 8;
+	if (t.flags & XING_FRAMES) {
+		tag_set_be32(d + off, info->frames);
+		off += 4;
+	}
+	if (t.flags & XING_BYTES) {
+		tag_set_be32(d + off, info->bytes);
+		off += 4;
+	}
+	if (t.flags & XING_TOC) {
+		for (uint i = 0;  i != 100;  i++) {
+			uint64 pos = (info->frames != 0) ? info->offsets[i * info->frames / 100] : 0;
+			d[off + i] = (byte)ffmin(pos * 256 / ffmax(info->bytes, 1), 255);
+		}
+	}
+
+	if (t.lame == 0)
+		return;
+	byte *lame = d + t.lame;
+	tag_set_be32(lame + 11, info->peak);
+	ffmem_zero(lame + 15, 4);
+	uint delay = ffmin(info->delay, LAME_MAXDELAY);
+	uint padding = ffmin(info->padding, LAME_MAXDELAY);
+	lame[21] = (byte)(delay >> 4);
+	lame[22] = (byte)((delay << 4) | (padding >> 8));
+	lame[23] = (byte)padding;
+	tag_set_be32(lame + 28, info->bytes);
+	lame[32] = (byte)(info->crc >> 8);
+	lame[33] = (byte)info->crc;
+	uint crc = mpeg_crc16(crctab, 0, d, t.lame + 34);
+	lame[34] = (byte)(crc >> 8);
+	lame[35] = (byte)crc;
+}
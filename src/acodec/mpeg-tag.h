@@ -0,0 +1,58 @@
+/** MPEG Layer3: frame header;  Xing and LAME tags.
+Copyright (c) 2020 Simon Zolin */
+
+#pragma once
+#include <fmedia.h>
+#include <FF/array.h>
+
+
+struct mpeg_frame {
+	uint len;
+	uint hdr; // header + CRC + side info
+	uint mdb; // main_data_begin
+	uint rate; // sample rate
+	uint samples; // samples per frame
+};
+
+/** Parse MPEG-1/2/2.5 Layer3 frame header.
+Return frame length;  0 on error. */
+extern uint mpeg_frame_parse(const void *data, size_t len, struct mpeg_frame *fr);
+
+/** CRC-16 (polynomial 0x8005, reflected) as used in LAME tag. */
+extern void mpeg_crc_init(ushort *tab);
+extern uint mpeg_crc16(const ushort *tab, uint crc, const void *data, size_t len);
+
+struct mpeg_tag {
+	uint xing; // offset of "Xing"/"Info"
+	uint flags;
+	uint lame; // offset of LAME extension;  0 if not found
+};
+
+/** Find Xing and LAME tags within the first frame.
+Return 0 on success. */
+extern int mpeg_tag_find(const void *data, size_t len, struct mpeg_tag *t);
+
+/** Get encoder delay and peak value from LAME tag.
+Return 0 on success. */
+extern int mpeg_tag_lame(const void *data, size_t len, uint *delay, uint *peak);
+
+/** Create an empty Xing frame with LAME extension for the stream.
+hdr: header of an audio frame of the stream
+Return frame length;  0 on error. */
+extern uint mpeg_tag_create(ffarr *buf, const void *hdr);
+
+struct mpeg_tag_info {
+	uint64 frames; // audio frames
+	uint64 bytes; // including Xing frame
+	const uint *offsets; // offsets of audio frames from the beginning of Xing frame
+	uint delay; // encoder delay
+	uint64 padding; // encoder padding
+	uint peak; // peak signal amplitude
+	uint crc; // CRC-16 of audio frames
+	const char *id; // "Xing" (VBR) or "Info" (CBR);  NULL: don't change
+};
+
+/** Update Xing and LAME tags of the whole stream:
+ the number of frames and bytes, seek table, encoder delay and padding, music length and CRC.
+ReplayGain values are cleared. */
+extern void mpeg_tag_update(void *data, size_t len, const struct mpeg_tag_info *info, const ushort *crctab);
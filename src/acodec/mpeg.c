@@ -35,6 +35,14 @@ extern const fmed_filter fmed_mpeg_output;
 extern int mpeg_out_config(ffpars_ctx *ctx);
 extern const fmed_filter fmed_mpeg_copy;
 
+typedef struct mpeg_mt mpeg_mt;
+extern mpeg_mt* mpeg_mt_create(const ffpcm *fmt, int qual, uint threads, uint segment);
+extern void mpeg_mt_free(mpeg_mt *m);
+extern void mpeg_mt_input(mpeg_mt *m, const void *pcm, size_t len, uint fin);
+extern int mpeg_mt_encode(mpeg_mt *m, ffstr *out);
+extern uint mpeg_mt_badjoins(mpeg_mt *m);
+extern const char* mpeg_mt_errstr(mpeg_mt *m);
+
 //DECODE
 static void* mpeg_dec_open(fmed_filt *d);
 static void mpeg_dec_close(void *ctx);
@@ -55,14 +63,19 @@ static const fmed_filter fmed_mpeg_enc = {
 typedef struct mpeg_enc {
 	uint state;
 	ffmpg_enc mpg;
+	mpeg_mt *mt;
 } mpeg_enc;
 
 static struct mpeg_enc_conf_t {
 	uint qual;
+	uint segment;
+	byte threads;
 } mpeg_enc_conf;
 
 static const ffpars_arg mpeg_enc_conf_args[] = {
 	{ "quality",	FFPARS_TINT,  FFPARS_DSTOFF(struct mpeg_enc_conf_t, qual) },
+	{ "segment",	FFPARS_TINT,  FFPARS_DSTOFF(struct mpeg_enc_conf_t, segment) },
+	{ "threads",	FFPARS_TINT | FFPARS_F8BIT,  FFPARS_DSTOFF(struct mpeg_enc_conf_t, threads) },
 };
 
 
@@ -202,6 +215,8 @@ data:
 static int mpeg_enc_config(ffpars_ctx *ctx)
 {
 	mpeg_enc_conf.qual = 2;
+	mpeg_enc_conf.segment = 0;
+	mpeg_enc_conf.threads = 0;
 	ffpars_setargs(ctx, &mpeg_enc_conf, mpeg_enc_conf_args, FFCNT(mpeg_enc_conf_args));
 	return 0;
 }
@@ -223,10 +238,82 @@ static void* mpeg_enc_open(fmed_filt *d)
 static void mpeg_enc_close(void *ctx)
 {
 	mpeg_enc *m = ctx;
+	mpeg_mt_free(m->mt);
 	ffmpg_enc_close(&m->mpg);
 	ffmem_free(m);
 }
 
+/** Start segmented multi-threaded encoder if enabled. */
+static int mpeg_enc_mt_init(mpeg_enc *m, fmed_filt *d, int qual)
+{
+	uint segment = mpeg_enc_conf.segment;
+	if (segment == 0)
+		return 0;
+
+	if ((int64)d->audio.total != FMED_NULL) {
+		uint64 total = (d->audio.total - d->audio.pos) * d->audio.convfmt.sample_rate / d->audio.fmt.sample_rate;
+		if (total < (uint64)segment * 2 * d->audio.convfmt.sample_rate)
+			return 0; // too short to split
+	}
+
+	uint threads = mpeg_enc_conf.threads;
+	if (threads == 0) {
+		ffsysconf sc;
+		ffsc_init(&sc);
+		threads = ffsc_get(&sc, FFSYSCONF_NPROCESSORS_ONLN);
+	}
+	if (threads <= 1)
+		return 0;
+
+	ffpcm fmt;
+	ffpcm_fmtcopy(&fmt, &d->audio.convfmt);
+	if (NULL == (m->mt = mpeg_mt_create(&fmt, qual, threads, segment))) {
+		warnlog(core, d->trk, "mpeg", "segmented encoding isn't supported for %u Hz, %u channels"
+			, fmt.sample_rate, fmt.channels);
+		return 0;
+	}
+	dbglog(core, d->trk, "mpeg", "segmented encoding: %u sec, %u threads", segment, threads);
+	return 0;
+}
+
+static int mpeg_enc_mt_encode(mpeg_enc *m, fmed_filt *d)
+{
+	ffstr out;
+	int r;
+
+	if (d->flags & FMED_FFWD) {
+		const void *pcm = (d->audio.convfmt.ileaved) ? (void*)d->data : (void*)d->datani;
+		mpeg_mt_input(m->mt, pcm, d->datalen, d->flags & FMED_FLAST);
+		d->datalen = 0;
+	}
+
+	r = mpeg_mt_encode(m->mt, &out);
+	switch (r) {
+	case FFMPG_RMORE:
+		return FMED_RMORE;
+
+	case FFMPG_RDATA:
+		break;
+
+	case FFMPG_RDONE:
+		if (mpeg_mt_badjoins(m->mt) != 0)
+			warnlog(core, d->trk, "mpeg", "%u segments were joined with a partially decodable frame"
+				, mpeg_mt_badjoins(m->mt));
+		d->mpg_lametag = 1;
+		break;
+
+	default:
+		errlog(core, d->trk, "mpeg", "mpeg_mt_encode(): %s", mpeg_mt_errstr(m->mt));
+		return FMED_RERR;
+	}
+
+	d->out = out.ptr;
+	d->outlen = out.len;
+	dbglog(core, d->trk, "mpeg", "output: %L bytes"
+		, out.len);
+	return (r == FFMPG_RDONE) ? FMED_RDONE : FMED_RDATA;
+}
+
 static int mpeg_enc_process(void *ctx, fmed_filt *d)
 {
 	mpeg_enc *m = ctx;
@@ -258,10 +345,14 @@ static int mpeg_enc_process(void *ctx, fmed_filt *d)
 		}
 		d->datatype = "mpeg";
 
+		if (0 != mpeg_enc_mt_init(m, d, qual))
+			return FMED_RERR;
 		m->state = 2;
 		// break
 
 	case 2:
+		if (m->mt != NULL)
+			return mpeg_enc_mt_encode(m, d);
 		m->mpg.pcm = (void*)d->data;
 		m->mpg.pcmlen = d->datalen;
 		m->state = 3;
@@ -30,6 +30,42 @@ enum {
 	CONV_OUTBUF_MSEC = 500,
 };
 
+enum RESAMPLER {
+	RESAMPLER_AUTO, // soxr.conv if it's loaded and supports the format;  otherwise the built-in resampler
+	RESAMPLER_SOXR,
+	RESAMPLER_NATIVE,
+};
+
+static const char *const resamplers[] = { "auto", "soxr", "native" };
+
+struct conv_conf_t {
+	uint resampler; //enum RESAMPLER
+	byte dither; // apply dither when bit depth is reduced
+};
+static struct conv_conf_t conv_conf;
+
+static int conv_conf_resampler(ffparser_schem *p, void *obj, ffstr *val)
+{
+	ssize_t r = ffszarr_find(resamplers, FFCNT(resamplers), val->ptr, val->len);
+	if (r < 0)
+		return FFPARS_EBADVAL;
+	conv_conf.resampler = r;
+	return 0;
+}
+
+static const ffpars_arg conv_conf_args[] = {
+	{ "resampler",	FFPARS_TSTR | FFPARS_FNOTEMPTY, FFPARS_DST(&conv_conf_resampler) },
+	{ "dither",	FFPARS_TBOOL8, FFPARS_DSTOFF(struct conv_conf_t, dither) },
+};
+
+int sndmod_conv_conf(ffpars_ctx *ctx)
+{
+	conv_conf.resampler = RESAMPLER_AUTO;
+	conv_conf.dither = 1;
+	ffpars_setargs(ctx, &conv_conf, conv_conf_args, FFCNT(conv_conf_args));
+	return 0;
+}
+
 typedef struct sndmod_conv {
 	uint state;
 	uint out_samp_size;
@@ -91,16 +127,67 @@ static void log_pcmconv(const char *module, int r, const ffpcmex *in, const ffpc
 		, ffpcm_fmtstr(out->format), out->channels & FFPCM_CHMASK, out->sample_rate, (out->ileaved) ? "i" : "ni");
 }
 
+/** Get the name of sample rate converter module. */
+static const char* conv_resampler(const ffpcmex *in, const ffpcmex *out)
+{
+	switch (conv_conf.resampler) {
+	case RESAMPLER_SOXR:
+		return "soxr.conv";
+	case RESAMPLER_NATIVE:
+		return "#soundmod.resample";
+	}
+
+	// soxr doesn't support int24
+	if (in->format == FFPCM_24 || out->format == FFPCM_24
+		|| NULL == core->getmod2(FMED_MOD_IFACE | FMED_MOD_NOLOG, "soxr.conv", -1))
+		return "#soundmod.resample";
+	return "soxr.conv";
+}
+
+extern int dither_needed(uint in, uint out);
+
 static int sndmod_conv_prepare(sndmod_conv *c, fmed_filt *d)
 {
 	size_t cap;
 	const ffpcmex *in = &c->inpcm;
 	const ffpcmex *out = &c->outpcm;
 
+	if (conv_conf.dither && dither_needed(in->format, out->format)) {
+		// The last filter will apply dither and convert float to integer:
+		// conv -> (resampler) -> dither
+		const struct fmed_filter2 *dith = core->getmod("#soundmod.dither");
+		void *f = (void*)d->track->cmd(d->trk, FMED_TRACK_FILT_ADD, "#soundmod.dither");
+		if (dith == NULL || f == NULL)
+			return FMED_RERR;
+		void *fi = (void*)d->track->cmd(d->trk, FMED_TRACK_FILT_INSTANCE, f);
+		if (fi == NULL)
+			return FMED_RERR;
+		struct fmed_aconv conf = {};
+		conf.out = *out;
+		conf.out.channels = (out->channels & FFPCM_CHMASK);
+		conf.in = conf.out;
+		conf.in.format = FFPCM_FLOAT;
+		dith->cmd(fi, 0, &conf);
+		c->outpcm.format = FFPCM_FLOAT;
+
+		if (in->format == FFPCM_FLOAT
+			&& in->channels == out->channels
+			&& in->sample_rate == out->sample_rate
+			&& in->ileaved == out->ileaved) {
+			// dither
+			d->out = d->data;
+			d->outlen = d->datalen;
+			return FMED_RDONE;
+		}
+	}
+
 	if (in->sample_rate != out->sample_rate) {
 
-		const struct fmed_filter2 *soxr = core->getmod("soxr.conv");
-		void *f = (void*)d->track->cmd(d->trk, FMED_TRACK_FILT_ADD, "soxr.conv");
+		const char *rs_name = conv_resampler(in, out);
+		const struct fmed_filter2 *rs = core->getmod(rs_name);
+		if (rs == NULL)
+			return FMED_RERR;
+		void *f = (void*)d->track->cmd(d->trk, FMED_TRACK_FILT_ADD, rs_name);
 		if (f == NULL)
 			return FMED_RERR;
 		void *fi = (void*)d->track->cmd(d->trk, FMED_TRACK_FILT_INSTANCE, f);
@@ -110,17 +197,17 @@ static int sndmod_conv_prepare(sndmod_conv *c, fmed_filt *d)
 
 		if (in->channels == out->channels) {
 			// The next filter will convert format and sample rate:
-			// soxr
+			// resampler
 			conf.in = *in;
 			conf.out = *out;
 			d->out = d->data;
 			d->outlen = d->datalen;
-			soxr->cmd(fi, 0, &conf);
+			rs->cmd(fi, 0, &conf);
 			return FMED_RDONE;
 		}
 
 		// This filter will convert channels, the next filter will convert format and sample rate:
-		// conv -> soxr
+		// conv -> resampler
 		conf.out = c->outpcm;
 
 		c->outpcm.format = FFPCM_FLOAT;
@@ -129,7 +216,7 @@ static int sndmod_conv_prepare(sndmod_conv *c, fmed_filt *d)
 
 		conf.in = c->outpcm;
 		conf.in.channels = (c->outpcm.channels & FFPCM_CHMASK);
-		soxr->cmd(fi, 0, &conf);
+		rs->cmd(fi, 0, &conf);
 	}
 
 	if (c->inpcm.channels > 8)
@@ -0,0 +1,342 @@
+/** Dither: float -> int16/int24 conversion with TPDF dither and optional noise shaping.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+TPDF noise (-1..+1 LSB) is the difference of 2 uniform random values taken from 1 xorshift32 output.
+Each channel has 8 independent generators, so the noise for 8 consecutive samples is produced
+ by the same instructions - the compiler is able to vectorize this loop.
+Noise shaping is an error feedback loop:
+ order 1: E(z) = 1 - z^-1
+ order 2: E(z) = (1 - z^-1)^2
+*/
+
+#include <fmedia.h>
+#include <FF/array.h>
+
+
+extern const fmed_core *core;
+
+#undef errlog
+#define errlog(trk, ...)  fmed_errlog(core, trk, "dither", __VA_ARGS__)
+
+//DITHER
+static void* dith_open(fmed_filt *d);
+static int dith_process(void *ctx, fmed_filt *d);
+static void dith_close(void *ctx);
+static ssize_t dith_cmd(void *ctx, uint cmd, ...);
+const struct fmed_filter2 sndmod_dither = {
+	&dith_open, &dith_process, &dith_close, &dith_cmd
+};
+
+enum {
+	DITH_BUF_SAMPLES = 4096,
+	DITH_LANES = 8,
+	DITH_MAXCHAN = 8,
+};
+
+struct dith_conf_t {
+	uint noise_shaping; // 0: off;  1 or 2: filter order
+	byte reproducible; // use the same random sequence for every track
+};
+static struct dith_conf_t dith_conf;
+
+static int dith_conf_close(ffparser_schem *p, void *obj)
+{
+	if (dith_conf.noise_shaping > 2)
+		return FFPARS_EBADVAL;
+	return 0;
+}
+
+static const ffpars_arg dith_conf_args[] = {
+	{ "noise_shaping",	FFPARS_TINT, FFPARS_DSTOFF(struct dith_conf_t, noise_shaping) },
+	{ "reproducible",	FFPARS_TBOOL8, FFPARS_DSTOFF(struct dith_conf_t, reproducible) },
+	{ NULL,	FFPARS_TCLOSE, FFPARS_DST(&dith_conf_close) },
+};
+
+int sndmod_dither_conf(ffpars_ctx *ctx)
+{
+	ffpars_setargs(ctx, &dith_conf, dith_conf_args, FFCNT(dith_conf_args));
+	return 0;
+}
+
+
+struct dith_ch {
+	uint rnd[DITH_LANES];
+	float e1, e2; // previous quantization errors
+};
+
+typedef struct dither {
+	uint state;
+	ffpcmex inpcm, outpcm;
+	uint nch;
+	uint out_ssize; // bytes per 1 sample of 1 channel
+	float scale, lo, hi;
+	float noise[DITH_BUF_SAMPLES];
+	ffarr buf;
+	uint off; // input offset (bytes per channel)
+	struct dith_ch ch[DITH_MAXCHAN];
+} dither;
+
+static void* dith_open(fmed_filt *d)
+{
+	dither *c = ffmem_new(dither);
+	if (c == NULL)
+		return NULL;
+	return c;
+}
+
+static void dith_close(void *ctx)
+{
+	dither *c = ctx;
+	ffarr_free(&c->buf);
+	ffmem_free(c);
+}
+
+static ssize_t dith_cmd(void *ctx, uint cmd, ...)
+{
+	dither *c = ctx;
+	va_list va;
+	va_start(va, cmd);
+	ssize_t r = -1;
+
+	switch (cmd) {
+	case 0: {
+		const struct fmed_aconv *conf = va_arg(va, void*);
+		c->inpcm = conf->in;
+		c->outpcm = conf->out;
+		c->state = 1;
+		r = 0;
+		break;
+	}
+	}
+
+	va_end(va);
+	return r;
+}
+
+/** Return TRUE if dither should be applied when converting 'in' format to 'out'. */
+int dither_needed(uint in, uint out)
+{
+	uint out_bits;
+	switch (out) {
+	case FFPCM_16:
+		out_bits = 16;  break;
+	case FFPCM_24:
+		out_bits = 24;  break;
+	default:
+		return 0;
+	}
+
+	switch (in) {
+	case FFPCM_FLOAT:
+	case FFPCM_FLOAT64:
+	case FFPCM_32:
+		return 1;
+	case FFPCM_24:
+		return (out_bits < 24);
+	}
+	return 0;
+}
+
+/** Initialize random generators of each channel. */
+static void dith_seed(dither *c)
+{
+	uint seed = 0x12345678;
+	if (!dith_conf.reproducible) {
+		fftime t;
+		fftime_now(&t);
+		seed ^= (uint)fftime_sec(&t) ^ (uint)(size_t)c;
+	}
+
+	for (uint i = 0;  i != c->nch;  i++) {
+		for (uint k = 0;  k != DITH_LANES;  k++) {
+			// spread the seeds with an integer hash (xorshift32 state must not be 0)
+			uint x = seed + (i * DITH_LANES + k + 1) * 0x9e3779b9;
+			x = (x ^ (x >> 16)) * 0x85ebca6b;
+			x = (x ^ (x >> 13)) * 0xc2b2ae35;
+			x ^= x >> 16;
+			c->ch[i].rnd[k] = (x != 0) ? x : 1;
+		}
+	}
+}
+
+/** Generate TPDF noise for 'n' samples (rounded up to DITH_LANES). */
+static void dith_noise(struct dith_ch *ch, float *dst, size_t n)
+{
+	uint s[DITH_LANES];
+	ffmemcpy(s, ch->rnd, sizeof(s));
+	for (size_t i = 0;  i < n;  i += DITH_LANES) {
+		for (uint k = 0;  k != DITH_LANES;  k++) {
+			uint x = s[k];
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			s[k] = x;
+			dst[i + k] = ((int)(x & 0xffff) - (int)(x >> 16)) * (1.0f / 0x10000);
+		}
+	}
+	ffmemcpy(ch->rnd, s, sizeof(s));
+}
+
+static FFINL float dith_clip(float f, float lo, float hi)
+{
+	f = (f < lo) ? lo : f;
+	return (f > hi) ? hi : f;
+}
+
+/** Convert float samples of 1 channel to integer values. */
+static void dith_quantize(dither *c, struct dith_ch *ch, int *dst, const float *src, size_t n, size_t step)
+{
+	const float *noise = c->noise;
+	float scale = c->scale, lo = c->lo, hi = c->hi;
+
+	switch (dith_conf.noise_shaping) {
+	case 0:
+		for (size_t i = 0;  i != n;  i++) {
+			dst[i] = (int)lrintf(dith_clip(src[i * step] * scale + noise[i], lo, hi));
+		}
+		break;
+
+	case 1: {
+		float e1 = ch->e1;
+		for (size_t i = 0;  i != n;  i++) {
+			float w = src[i * step] * scale - e1;
+			float q = dith_clip(rintf(w + noise[i]), lo, hi);
+			e1 = q - w;
+			dst[i] = (int)q;
+		}
+		ch->e1 = e1;
+		break;
+	}
+
+	case 2: {
+		float e1 = ch->e1, e2 = ch->e2;
+		for (size_t i = 0;  i != n;  i++) {
+			float w = src[i * step] * scale - 2 * e1 + e2;
+			float q = dith_clip(rintf(w + noise[i]), lo, hi);
+			e2 = e1;
+			e1 = q - w;
+			dst[i] = (int)q;
+		}
+		ch->e1 = e1,  ch->e2 = e2;
+		break;
+	}
+	}
+}
+
+static void dith_store16(char *dst, const int *src, size_t n, size_t step)
+{
+	short *d = (void*)dst;
+	for (size_t i = 0;  i != n;  i++) {
+		d[i * step] = (short)src[i];
+	}
+}
+
+static void dith_store24(char *dst, const int *src, size_t n, size_t step)
+{
+	for (size_t i = 0;  i != n;  i++) {
+		byte *d = (byte*)dst + i * step * 3;
+		d[0] = (byte)src[i];
+		d[1] = (byte)(src[i] >> 8);
+		d[2] = (byte)(src[i] >> 16);
+	}
+}
+
+static int dith_init(dither *c, fmed_filt *d)
+{
+	c->nch = c->inpcm.channels;
+	if (c->inpcm.format != FFPCM_FLOAT
+		|| !dither_needed(c->inpcm.format, c->outpcm.format)
+		|| c->nch != (c->outpcm.channels & FFPCM_CHMASK) || c->nch > DITH_MAXCHAN
+		|| c->inpcm.sample_rate != c->outpcm.sample_rate
+		|| c->inpcm.ileaved != c->outpcm.ileaved) {
+		errlog(d->trk, "unsupported PCM conversion: %s/%u/%u -> %s/%u/%u"
+			, ffpcm_fmtstr(c->inpcm.format), c->inpcm.channels, c->inpcm.sample_rate
+			, ffpcm_fmtstr(c->outpcm.format), c->outpcm.channels & FFPCM_CHMASK, c->outpcm.sample_rate);
+		return FMED_RERR;
+	}
+
+	if (c->outpcm.format == FFPCM_16) {
+		c->scale = 0x8000;
+		c->lo = -0x8000,  c->hi = 0x7fff;
+	} else {
+		c->scale = 0x800000;
+		c->lo = -0x800000,  c->hi = 0x7fffff;
+	}
+
+	c->out_ssize = ffpcm_size(c->outpcm.format, 1);
+	size_t cap = DITH_BUF_SAMPLES * (sizeof(int) + c->out_ssize * c->nch);
+	if (NULL == ffarr_alloc(&c->buf, sizeof(void*) * c->nch + cap))
+		return FMED_RSYSERR;
+	if (!c->outpcm.ileaved)
+		ffarrp_setbuf((void**)c->buf.ptr, c->nch, c->buf.ptr + sizeof(void*) * c->nch, DITH_BUF_SAMPLES * c->out_ssize);
+
+	dith_seed(c);
+	return 0;
+}
+
+static int dith_process(void *ctx, fmed_filt *d)
+{
+	dither *c = ctx;
+	int r;
+
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	switch (c->state) {
+	case 0:
+		return FMED_RERR; // settings are empty
+	case 1:
+		if (0 != (r = dith_init(c, d)))
+			return r;
+		c->state = 2;
+		break;
+	case 2:
+		break;
+	}
+
+	if (d->flags & FMED_FFWD)
+		c->off = 0;
+
+	size_t samples = ffmin(d->datalen / (sizeof(float) * c->nch), DITH_BUF_SAMPLES);
+	if (samples == 0) {
+		if (d->flags & FMED_FLAST) {
+			d->outlen = 0;
+			return FMED_RDONE;
+		}
+		return FMED_RMORE;
+	}
+
+	// buffer layout: [ptrs[nch]] [data] [int tmp[]]
+	char *data = c->buf.ptr + sizeof(void*) * c->nch;
+	int *tmp = (void*)(data + DITH_BUF_SAMPLES * c->out_ssize * c->nch);
+
+	for (uint i = 0;  i != c->nch;  i++) {
+		const float *src;
+		char *dst;
+		size_t step = 1;
+		if (c->inpcm.ileaved) {
+			src = (float*)(d->data + c->off * c->nch) + i;
+			dst = data + i * c->out_ssize;
+			step = c->nch;
+		} else {
+			src = (float*)((char*)d->datani[i] + c->off);
+			dst = ((char**)c->buf.ptr)[i];
+		}
+
+		dith_noise(&c->ch[i], c->noise, samples);
+		dith_quantize(c, &c->ch[i], tmp, src, samples, step);
+		if (c->outpcm.format == FFPCM_16)
+			dith_store16(dst, tmp, samples, step);
+		else
+			dith_store24(dst, tmp, samples, step);
+	}
+
+	d->out = (c->outpcm.ileaved) ? data : c->buf.ptr;
+	d->outlen = samples * c->out_ssize * c->nch;
+	d->datalen -= samples * sizeof(float) * c->nch;
+	c->off += samples * sizeof(float);
+	return FMED_RDATA;
+}
@@ -0,0 +1,544 @@
+/** Dynamic Audio Normalizer: float32 implementation.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+The algorithm is the same as in libdynanorm (Dynamic Audio Normalizer by LoRd_MuldeR).
+Analysis of each frame:
+ DC correction -> compression -> local gain (peak, RMS, max. amplification)
+ -> minimum filter -> Gaussian filter.
+The smoothed gain of frame #N is known after frame #N+filter_size-1 is analyzed,
+ so the frames are kept in a ring buffer until then.
+A frame is amplified by the gain faded from the previous frame's value to its own.
+After the last frame, filter_size-1 padding frames are analyzed to get the gains of the remaining frames.
+
+A gain group is either all channels (coupled) or a single channel.
+The groups are independent, so when channels aren't coupled they are processed on several threads.
+The frames are passed to the threads in batches to reduce synchronization.
+
+caller: fill frames -> [batch is full] -> wake threads -> process groups -> wait for threads -> return amplified frames
+thread: wait -> process groups -> signal
+*/
+
+#include <afilt/dynanorm-f32.h>
+#include <FFOS/thread.h>
+#include <FFOS/semaphore.h>
+#include <math.h>
+#include <float.h>
+
+
+enum {
+	DANF_BATCH = 4, // frames per batch when processing on threads
+};
+
+/** Gain state of a group. */
+struct danf_gain {
+	float *orig; // local gains [filter_size]
+	float *min; // gains after minimum filter [filter_size]
+	uint norig, nmin;
+	float prev; // the gain of the previous frame
+	float thr; // compression threshold
+	uint64 namp; // the next frame to amplify
+};
+
+struct danf_frame {
+	float *ch[DANF_MAXCHAN];
+	size_t len;
+};
+
+struct danf {
+	struct danf_conf conf;
+	uint nch;
+	size_t flen; // samples per frame
+	uint fsize;
+	float *weights; // Gaussian filter [filter_size]
+	float dc[DANF_MAXCHAN]; // DC correction values
+	float *pad[DANF_MAXCHAN]; // padding frame
+	float pad_val;
+	float *mem;
+
+	struct danf_gain gains[DANF_MAXCHAN];
+	uint ngroups;
+	uint gch; // channels per group
+
+	struct danf_frame *frames;
+	uint nslots;
+	uint batch;
+	uint64 nin; // complete input frames
+	size_t fill; // samples in the frame being filled
+	uint64 nproc; // frames analyzed
+	uint64 nready; // frames amplified
+	uint64 nout; // frames returned
+
+	// the batch being processed
+	uint64 b_first;
+	uint b_frames, b_pad;
+
+	const float *const *in;
+	size_t inlen, inoff;
+	uint in_fin :1;
+	uint fin :1;
+
+	ffthd *threads;
+	uint nthreads;
+	ffsem work; // posted for each thread when a batch is submitted
+	ffsem done; // posted by each thread when it's finished with the batch
+	ffatomic next_group;
+	size_t group_base; // 'next_group' value at the start of the batch
+	uint quit :1;
+};
+
+
+static FFINL struct danf_frame* danf_frame(danf *n, uint64 i)
+{
+	return &n->frames[i % n->nslots];
+}
+
+/** Limit value by threshold smoothly. */
+static FFINL float danf_bound(float thr, float val)
+{
+	return erff(0.886226925f * (val / thr)) * thr;
+}
+
+/** Compute Gaussian filter weights. */
+static void danf_gauss_init(float *w, uint size)
+{
+	float total = 0;
+	float sigma = ((size / 2.0f) - 1) / 3 + 1.0f / 3;
+	int off = size / 2;
+	float c1 = 1 / sqrtf(2 * 3.14159265f * sigma * sigma);
+	float c2 = 2 * sigma * sigma;
+	for (uint i = 0;  i != size;  i++) {
+		int x = (int)i - off;
+		w[i] = c1 * expf(-(x * x) / c2);
+		total += w[i];
+	}
+	for (uint i = 0;  i != size;  i++) {
+		w[i] /= total;
+	}
+}
+
+/* Simple loops that the compiler is able to vectorize.
+The sample index is converted to float via int: there's no SIMD conversion from 64-bit integers. */
+
+static float danf_sum(const float *d, size_t n)
+{
+	float sum = 0;
+	for (size_t i = 0;  i != n;  i++) {
+		sum += d[i];
+	}
+	return sum;
+}
+
+static float danf_sum_sq(const float *d, size_t n)
+{
+	float sum = 0;
+	for (size_t i = 0;  i != n;  i++) {
+		sum += d[i] * d[i];
+	}
+	return sum;
+}
+
+static float danf_peak(const float *d, size_t n)
+{
+	float peak = 0;
+	for (size_t i = 0;  i != n;  i++) {
+		float v = fabsf(d[i]);
+		peak = (v > peak) ? v : peak;
+	}
+	return peak;
+}
+
+/** Subtract the value faded from 'prev' to 'next'. */
+static void danf_sub_fade(float *d, size_t n, float prev, float next)
+{
+	float step = (next - prev) / n;
+	for (uint i = 0;  i != (uint)n;  i++) {
+		d[i] -= prev + step * (int)(i + 1);
+	}
+}
+
+/** Multiply by the gain faded from 'prev' to 'next' and limit by 'peak'. */
+static void danf_amplify(float *d, size_t n, float prev, float next, float peak)
+{
+	float step = (next - prev) / n;
+	for (uint i = 0;  i != (uint)n;  i++) {
+		float v = d[i] * (prev + step * (int)(i + 1));
+		v = (v > peak) ? peak : v;
+		d[i] = (v < -peak) ? -peak : v;
+	}
+}
+
+/** Compress the values above the threshold faded from 'prev' to 'next'. */
+static void danf_compress_fade(float *d, size_t n, float prev, float next)
+{
+	float step = (next - prev) / n;
+	for (uint i = 0;  i != (uint)n;  i++) {
+		float thr = prev + step * (int)(i + 1);
+		d[i] = copysignf(danf_bound(thr, fabsf(d[i])), d[i]);
+	}
+}
+
+
+/** Find the threshold value which, after bound(), gives the requested threshold. */
+static float danf_compress_thr(float thr)
+{
+	if (!(thr > FLT_EPSILON && thr < 1 - FLT_EPSILON))
+		return thr;
+	float t = thr, step = 1;
+	while (step > FLT_EPSILON) {
+		while (t + step > t
+			&& danf_bound(t + step, 1) <= thr)
+			t += step;
+		step /= 2;
+	}
+	return t;
+}
+
+static void danf_dc_correct(danf *n, float **d, uint ch0, size_t len, uint first)
+{
+	for (uint c = 0;  c != n->gch;  c++) {
+		float avg = danf_sum(d[c], len) / len;
+		float prev = (first) ? avg : n->dc[ch0 + c];
+		n->dc[ch0 + c] = (first) ? avg : prev + 0.1f * (avg - prev);
+		danf_sub_fade(d[c], len, prev, n->dc[ch0 + c]);
+	}
+}
+
+static void danf_compress(danf *n, struct danf_gain *g, float **d, size_t len, uint first)
+{
+	float sq = 0;
+	for (uint c = 0;  c != n->gch;  c++) {
+		sq += danf_sum_sq(d[c], len);
+	}
+	size_t cnt = len * n->gch;
+	float dev = (cnt > 1) ? sqrtf(sq / (cnt - 1)) : 0;
+	dev = ffmax(dev, FLT_EPSILON);
+
+	float cur = ffmin(1, n->conf.compress * dev);
+	float prev = (first) ? cur : g->thr;
+	g->thr = (first) ? cur : prev + (cur - prev) / 3;
+	float prev_thr = danf_compress_thr(prev);
+	float cur_thr = danf_compress_thr(g->thr);
+	for (uint c = 0;  c != n->gch;  c++) {
+		danf_compress_fade(d[c], len, prev_thr, cur_thr);
+	}
+}
+
+/** Get the max. gain for the frame. */
+static float danf_local_gain(danf *n, float **d, size_t len)
+{
+	float peak = 0, sq = 0;
+	for (uint c = 0;  c != n->gch;  c++) {
+		peak = ffmax(peak, danf_peak(d[c], len));
+		if (n->conf.target_rms > FLT_EPSILON)
+			sq += danf_sum_sq(d[c], len);
+	}
+
+	float gain = n->conf.peak / ffmax(peak, FLT_EPSILON);
+	if (n->conf.target_rms > FLT_EPSILON) {
+		float rms = ffmax(sqrtf(sq / (len * n->gch)), FLT_EPSILON);
+		gain = ffmin(gain, n->conf.target_rms / rms);
+	}
+	return danf_bound(n->conf.max_amp, gain);
+}
+
+/** Pass the local gain through the minimum and Gaussian filters.
+Return 1 if the smoothed gain of the oldest frame is ready. */
+static int danf_gain_add(danf *n, struct danf_gain *g, float gain, float *smoothed)
+{
+	uint i, h = n->fsize / 2;
+
+	if (g->norig == 0) {
+		float init = (n->conf.alt_boundary) ? gain : 1;
+		g->prev = init;
+		for (i = 0;  i != h;  i++) {
+			g->orig[g->norig++] = init;
+		}
+	}
+	g->orig[g->norig++] = gain;
+	if (g->norig != n->fsize)
+		return 0;
+
+	if (g->nmin == 0) {
+		float init = (n->conf.alt_boundary) ? g->orig[0] : 1;
+		for (i = 0;  i != h;  i++) {
+			init = ffmin(init, g->orig[h + 1 + i]);
+			g->min[g->nmin++] = init;
+		}
+	}
+	float m = g->orig[0];
+	for (i = 1;  i != n->fsize;  i++) {
+		m = ffmin(m, g->orig[i]);
+	}
+	ffmemmove(g->orig, g->orig + 1, (n->fsize - 1) * sizeof(float));
+	g->norig--;
+
+	g->min[g->nmin++] = m;
+	if (g->nmin != n->fsize)
+		return 0;
+
+	float s = 0;
+	for (i = 0;  i != n->fsize;  i++) {
+		s += n->weights[i] * g->min[i];
+	}
+	ffmemmove(g->min, g->min + 1, (n->fsize - 1) * sizeof(float));
+	g->nmin--;
+	*smoothed = s;
+	return 1;
+}
+
+/** Analyze the frames of the current batch and amplify the frames whose gain is ready. */
+static void danf_group_process(danf *n, uint grp)
+{
+	struct danf_gain *g = &n->gains[grp];
+	uint ch0 = grp * n->gch, c;
+	float *d[DANF_MAXCHAN];
+	size_t len;
+
+	for (uint k = 0;  k != n->b_frames + n->b_pad;  k++) {
+		uint first = (g->norig == 0);
+
+		if (k < n->b_frames) {
+			struct danf_frame *f = danf_frame(n, n->b_first + k);
+			for (c = 0;  c != n->gch;  c++) {
+				d[c] = f->ch[ch0 + c];
+			}
+			len = f->len;
+		} else {
+			for (c = 0;  c != n->gch;  c++) {
+				float val = n->pad_val;
+				if (n->conf.dc_correction)
+					val += n->dc[ch0 + c];
+				d[c] = n->pad[ch0 + c];
+				for (size_t i = 0;  i != n->flen;  i++) {
+					d[c][i] = val;
+				}
+			}
+			len = n->flen;
+		}
+
+		if (n->conf.dc_correction)
+			danf_dc_correct(n, d, ch0, len, first);
+		if (n->conf.compress > FLT_EPSILON)
+			danf_compress(n, g, d, len, first);
+
+		float gain = danf_local_gain(n, d, len);
+		if (!danf_gain_add(n, g, gain, &gain))
+			continue;
+
+		uint64 i = g->namp++;
+		if (i >= n->b_first + n->b_frames)
+			continue; // padding frame
+		struct danf_frame *f = danf_frame(n, i);
+		for (c = 0;  c != n->gch;  c++) {
+			danf_amplify(f->ch[ch0 + c], f->len, g->prev, gain, n->conf.peak);
+		}
+		g->prev = gain;
+	}
+}
+
+static void danf_groups(danf *n)
+{
+	for (;;) {
+		size_t grp = ffatom_incret(&n->next_group) - 1 - n->group_base;
+		if (grp >= n->ngroups)
+			break;
+		danf_group_process(n, grp);
+	}
+}
+
+static FFTHDCALL int danf_worker(void *param)
+{
+	danf *n = param;
+	for (;;) {
+		ffsem_wait(n->work, -1);
+		if (n->quit)
+			break;
+		danf_groups(n);
+		ffsem_post(n->done);
+	}
+	return 0;
+}
+
+/** Process the current batch: the caller's thread takes part too. */
+static void danf_batch_process(danf *n)
+{
+	uint i, nt = ffmin(n->nthreads, n->ngroups - 1);
+	n->group_base = ffatom_get(&n->next_group);
+	for (i = 0;  i != nt;  i++) {
+		ffsem_post(n->work);
+	}
+	danf_groups(n);
+	for (i = 0;  i != nt;  i++) {
+		ffsem_wait(n->done, -1);
+	}
+}
+
+danf* danf_create(const struct danf_conf *conf)
+{
+	danf *n;
+	if (conf->channels == 0 || conf->channels > DANF_MAXCHAN
+		|| conf->filter_size < 3 || conf->filter_size % 2 == 0
+		|| NULL == (n = ffmem_new(danf)))
+		return NULL;
+	n->conf = *conf;
+	n->work = FFSEM_INV;
+	n->done = FFSEM_INV;
+	n->nch = conf->channels;
+	n->fsize = conf->filter_size;
+	n->flen = ffmax((uint64)conf->frame_len_msec * conf->sample_rate / 1000, 1);
+	n->pad_val = ((n->conf.alt_boundary) ? FLT_EPSILON
+		: (n->conf.target_rms > FLT_EPSILON) ? ffmin(n->conf.peak, n->conf.target_rms) : n->conf.peak)
+		/ n->conf.max_amp;
+
+	n->gch = (conf->coupled) ? n->nch : 1;
+	n->ngroups = n->nch / n->gch;
+	n->nthreads = (n->ngroups > 1) ? ffmin(conf->threads, n->ngroups - 1) : 0;
+	n->batch = (n->nthreads != 0) ? DANF_BATCH : 1;
+	n->nslots = n->fsize + n->batch;
+
+	// frames, padding frame, filter windows, Gaussian weights
+	size_t nfloats = (n->nslots + 1) * n->flen * n->nch
+		+ n->ngroups * 2 * n->fsize
+		+ n->fsize;
+	if (NULL == (n->mem = ffmem_calloc(nfloats, sizeof(float)))
+		|| NULL == (n->frames = ffmem_callocT(n->nslots, struct danf_frame)))
+		goto err;
+
+	float *p = n->mem;
+	for (uint i = 0;  i != n->nslots;  i++) {
+		for (uint c = 0;  c != n->nch;  c++) {
+			n->frames[i].ch[c] = p;
+			p += n->flen;
+		}
+	}
+	for (uint c = 0;  c != n->nch;  c++) {
+		n->pad[c] = p;
+		p += n->flen;
+	}
+	for (uint i = 0;  i != n->ngroups;  i++) {
+		n->gains[i].orig = p;
+		p += n->fsize;
+		n->gains[i].min = p;
+		p += n->fsize;
+	}
+	n->weights = p;
+	danf_gauss_init(n->weights, n->fsize);
+
+	if (n->nthreads != 0) {
+		if (NULL == (n->threads = ffmem_callocT(n->nthreads, ffthd)))
+			goto err;
+		for (uint i = 0;  i != n->nthreads;  i++) {
+			n->threads[i] = FFTHD_INV;
+		}
+		if (FFSEM_INV == (n->work = ffsem_open(NULL, 0, 0))
+			|| FFSEM_INV == (n->done = ffsem_open(NULL, 0, 0)))
+			goto err;
+		for (uint i = 0;  i != n->nthreads;  i++) {
+			if (FFTHD_INV == (n->threads[i] = ffthd_create(&danf_worker, n, 0)))
+				goto err;
+		}
+	}
+	return n;
+
+err:
+	danf_free(n);
+	return NULL;
+}
+
+void danf_free(danf *n)
+{
+	if (n == NULL)
+		return;
+
+	n->quit = 1;
+	if (n->threads != NULL) {
+		for (uint i = 0;  i != n->nthreads;  i++) {
+			if (n->threads[i] != FFTHD_INV)
+				ffsem_post(n->work);
+		}
+		for (uint i = 0;  i != n->nthreads;  i++) {
+			if (n->threads[i] != FFTHD_INV)
+				ffthd_join(n->threads[i], -1, NULL);
+		}
+		ffmem_free(n->threads);
+	}
+	if (n->work != FFSEM_INV)
+		ffsem_close(n->work);
+	if (n->done != FFSEM_INV)
+		ffsem_close(n->done);
+
+	ffmem_safefree(n->frames);
+	ffmem_safefree(n->mem);
+	ffmem_free(n);
+}
+
+void danf_input(danf *n, const float *const *in, size_t samples, uint fin)
+{
+	n->in = in;
+	n->inlen = samples;
+	n->inoff = 0;
+	n->in_fin = !!fin;
+}
+
+/** Copy input data into frames until the batch is full. */
+static void danf_fill(danf *n)
+{
+	while (n->inoff != n->inlen
+		&& n->nin - n->nproc != n->batch) {
+
+		struct danf_frame *f = danf_frame(n, n->nin);
+		size_t k = ffmin(n->flen - n->fill, n->inlen - n->inoff);
+		for (uint c = 0;  c != n->nch;  c++) {
+			ffmemcpy(f->ch[c] + n->fill, n->in[c] + n->inoff, k * sizeof(float));
+		}
+		n->fill += k;
+		n->inoff += k;
+		if (n->fill == n->flen) {
+			f->len = n->flen;
+			n->nin++;
+			n->fill = 0;
+		}
+	}
+}
+
+int danf_process(danf *n, float ***out, size_t *samples)
+{
+	for (;;) {
+		if (n->nout != n->nready) {
+			struct danf_frame *f = danf_frame(n, n->nout++);
+			*out = f->ch;
+			*samples = f->len;
+			return DANF_RDATA;
+		}
+
+		if (n->fin)
+			return DANF_RDONE;
+
+		danf_fill(n);
+
+		n->b_pad = 0;
+		if (n->in_fin && n->inoff == n->inlen
+			&& n->nin - n->nproc != n->batch) {
+			// the last frame may be incomplete
+			if (n->fill != 0) {
+				danf_frame(n, n->nin)->len = n->fill;
+				n->nin++;
+				n->fill = 0;
+			}
+			n->fin = 1;
+			if (n->nin == 0)
+				return DANF_RDONE;
+			n->b_pad = n->fsize - 1;
+
+		} else if (n->nin - n->nproc != n->batch) {
+			return DANF_RMORE;
+		}
+
+		n->b_first = n->nproc;
+		n->b_frames = n->nin - n->nproc;
+		danf_batch_process(n);
+		n->nproc = n->nin;
+		n->nready = ffmin(n->gains[0].namp, n->nin);
+	}
+}
@@ -0,0 +1,51 @@
+/** Dynamic Audio Normalizer: float32 implementation.
+Copyright (c) 2020 Simon Zolin */
+
+#pragma once
+#include <fmedia.h>
+
+
+enum {
+	DANF_MAXCHAN = 8,
+};
+
+struct danf_conf {
+	uint channels;
+	uint sample_rate;
+	uint frame_len_msec;
+	uint filter_size; // odd, >=3
+	float peak; // max. output amplitude
+	float max_amp; // max. amplification
+	float target_rms; // 0: disabled
+	float compress; // compression factor;  0: disabled
+	uint coupled :1; // the same gain for all channels
+	uint dc_correction :1;
+	uint alt_boundary :1; // initial gain is taken from the first frame rather than 1.0
+
+	/** The number of additional threads for processing channels in parallel (if channels aren't coupled).
+	0: process all channels on the caller's thread. */
+	uint threads;
+};
+
+typedef struct danf danf;
+
+/** Return NULL on error. */
+extern danf* danf_create(const struct danf_conf *conf);
+extern void danf_free(danf *n);
+
+/** Set input data: non-interleaved float32.
+The data must remain valid until danf_process() returns DANF_RMORE.
+fin: this is the last input data */
+extern void danf_input(danf *n, const float *const *in, size_t samples, uint fin);
+
+enum DANF_R {
+	DANF_RMORE, // more input data is needed
+	DANF_RDATA, // output data is ready
+	DANF_RDONE, // no more output data
+};
+
+/** Process the input data.
+out: non-interleaved output data, valid until the next call
+samples: the number of output samples (per channel)
+Return enum DANF_R. */
+extern int danf_process(danf *n, float ***out, size_t *samples);
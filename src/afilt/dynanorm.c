@@ -2,6 +2,7 @@
 Copyright (c) 2018 Simon Zolin */
 
 #include <fmedia.h>
+#include <afilt/dynanorm-f32.h>
 #include <dynanorm/DynamicAudioNormalizer-ff.h>
 
 
@@ -37,6 +38,8 @@ struct danconf {
 	byte channels_coupled;
 	byte enable_dc_correction;
 	byte alt_boundary_mode;
+	byte parallel_channels;
+	uint max_latency_msec;
 };
 static struct danconf *sconf;
 
@@ -51,6 +54,8 @@ static const ffpars_arg danorm_conf_args[] = {
 	{ "channels_coupled",	FFPARS_TBOOL8, FFPARS_DSTOFF(struct danconf, channels_coupled) },
 	{ "enable_dc_correction",	FFPARS_TBOOL8, FFPARS_DSTOFF(struct danconf, enable_dc_correction) },
 	{ "alt_boundary_mode",	FFPARS_TBOOL8, FFPARS_DSTOFF(struct danconf, alt_boundary_mode) },
+	{ "parallel_channels",	FFPARS_TBOOL8, FFPARS_DSTOFF(struct danconf, parallel_channels) },
+	{ "max_latency_msec",	FFPARS_TINT, FFPARS_DSTOFF(struct danconf, max_latency_msec) },
 };
 #undef OFF
 
@@ -95,6 +100,7 @@ static int danorm_f_conf(ffpars_ctx *ctx)
 	sconf->channels_coupled = 255;
 	sconf->enable_dc_correction = 255;
 	sconf->alt_boundary_mode = 255;
+	sconf->parallel_channels = 1;
 	dynanorm_init(&sconf->conf);
 	ffpars_setargs(ctx, sconf, danorm_conf_args, FFCNT(danorm_conf_args));
 	return 0;
@@ -102,9 +108,12 @@ static int danorm_f_conf(ffpars_ctx *ctx)
 
 struct danorm {
 	uint state;
-	void *ctx;
-	ffarr buf;
-	uint off;
+	uint nch;
+	void *ctx; // libdynanorm context for float64 input
+	danf *f32; // float32 input
+	size_t cap; // output buffer capacity (samples)
+	ffarr buf; // double *out[nch], data[]
+	uint off; // offset of input data (bytes per channel)
 	ffpcm fmt;
 };
 
@@ -119,11 +128,95 @@ static void* danorm_f_open(fmed_filt *d)
 static void danorm_f_close(void *ctx)
 {
 	struct danorm *c = ctx;
+	danf_free(c->f32);
 	dynanorm_close(c->ctx);
 	ffarr_free(&c->buf);
 	ffmem_free(c);
 }
 
+/** Reduce the look-ahead window (frame_len_msec * filter_size) so that it fits into 'max_msec'.
+Filter size must be odd and not less than 3;
+ frame length is reduced only if the minimum filter size doesn't fit. */
+static void danorm_latency_limit(struct dynanorm_conf *conf, uint max_msec)
+{
+	if (conf->frameLenMsec == 0)
+		return;
+	uint fsize = max_msec / conf->frameLenMsec;
+	if (fsize < 3) {
+		fsize = 3;
+		conf->frameLenMsec = ffmax(max_msec / 3, 10);
+	}
+	if (fsize % 2 == 0)
+		fsize--;
+	if ((uint)conf->filterSize > fsize)
+		conf->filterSize = fsize;
+}
+
+/** Create float32 normalizer.
+When channels aren't coupled, each channel may be processed on a separate thread. */
+static int danorm_f32_open(struct danorm *c, const struct dynanorm_conf *conf, fmed_filt *d)
+{
+	struct danf_conf fc = {};
+	fc.channels = conf->channels;
+	fc.sample_rate = conf->sampleRate;
+	fc.frame_len_msec = conf->frameLenMsec;
+	fc.filter_size = conf->filterSize;
+	fc.peak = conf->peakValue;
+	fc.max_amp = conf->maxAmplification;
+	fc.target_rms = conf->targetRms;
+	fc.compress = conf->compressFactor;
+	fc.coupled = !!conf->channelsCoupled;
+	fc.dc_correction = !!conf->enableDCCorrection;
+	fc.alt_boundary = !!conf->altBoundaryMode;
+	if (!fc.coupled && fc.channels > 1 && sconf->parallel_channels) {
+		ffsysconf sc;
+		ffsc_init(&sc);
+		uint cpus = ffsc_get(&sc, FFSYSCONF_NPROCESSORS_ONLN);
+		fc.threads = ffmin(cpus, fc.channels) - 1;
+	}
+
+	if (NULL == (c->f32 = danf_create(&fc))) {
+		errlog(d->trk, "danf_create(): bad settings or not enough memory");
+		return -1;
+	}
+	dbglog(d->trk, "frame:%ums  filter size:%u  format:float32  threads:%u"
+		, (int)conf->frameLenMsec, (int)conf->filterSize, fc.threads + 1);
+	return 0;
+}
+
+/** Allocate buffer for non-interleaved data: pointers to channels + data. */
+static int danorm_buf_alloc(ffarr *buf, uint nch, size_t cap, uint ssize)
+{
+	if (NULL == ffarr_alloc(buf, sizeof(void*) * nch + cap * ssize * nch))
+		return -1;
+	ffarrp_setbuf((void**)buf->ptr, nch, buf->ptr + sizeof(void*) * nch, cap * ssize);
+	return 0;
+}
+
+static int danorm_f32_process(struct danorm *c, fmed_filt *d)
+{
+	float **out;
+	size_t samples;
+
+	if (d->flags & FMED_FFWD) {
+		danf_input(c->f32, (const float*const*)d->datani, d->datalen / (sizeof(float) * c->nch), d->flags & FMED_FLAST);
+		d->datalen = 0;
+	}
+
+	switch (danf_process(c->f32, &out, &samples)) {
+	case DANF_RMORE:
+		return FMED_RMORE;
+	case DANF_RDONE:
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	dbglog(d->trk, "output:%L", samples);
+	d->outni = (void**)out;
+	d->outlen = samples * sizeof(float) * c->nch;
+	return FMED_RDATA;
+}
+
 static int danorm_f_process(void *ctx, fmed_filt *d)
 {
 	struct danorm *c = ctx;
@@ -132,11 +225,13 @@ static int danorm_f_process(void *ctx, fmed_filt *d)
 	switch (c->state) {
 
 	case 0:
-		if (d->audio.fmt.format != FFPCM_FLOAT64 || d->audio.fmt.ileaved) {
+		// float32 and float64 non-interleaved input is processed as is
+		if (d->audio.fmt.ileaved
+			|| !(d->audio.fmt.format == FFPCM_FLOAT || d->audio.fmt.format == FFPCM_FLOAT64)) {
 			struct fmed_aconv conv;
 			conv.in = d->audio.fmt;
 			conv.out = d->audio.fmt;
-			conv.out.format = FFPCM_FLOAT64;
+			conv.out.format = FFPCM_FLOAT;
 			conv.out.ileaved = 0;
 			if (d->audio.convfmt.format == 0)
 				d->audio.convfmt.format = d->audio.fmt.format;
@@ -169,23 +264,34 @@ static int danorm_f_process(void *ctx, fmed_filt *d)
 			conf.enableDCCorrection = sconf->enable_dc_correction;
 		if (sconf->alt_boundary_mode != 255)
 			conf.altBoundaryMode = sconf->alt_boundary_mode;
+		if (sconf->max_latency_msec != 0)
+			danorm_latency_limit(&conf, sconf->max_latency_msec);
 
-		if (0 != dynanorm_open(&c->ctx, &conf)) {
-			errlog(d->trk, "dynanorm_open()");
+		uint ch = d->audio.fmt.channels;
+		if (ch > DANF_MAXCHAN) {
+			errlog(d->trk, "%u channels aren't supported (max. %u)", ch, DANF_MAXCHAN);
 			return FMED_RERR;
 		}
+		c->nch = ch;
+		ffpcm_fmtcopy(&c->fmt, &d->audio.fmt);
+		c->state = 2;
 
-		uint ch = d->audio.fmt.channels;
-		size_t cap = ffpcm_samples(conf.frameLenMsec, d->audio.fmt.sample_rate);
-		if (NULL == ffarr_alloc(&c->buf, sizeof(void*) * ch + cap * sizeof(double) * ch))
+		if (d->audio.fmt.format == FFPCM_FLOAT) {
+			if (0 != danorm_f32_open(c, &conf, d))
+				return FMED_RERR;
+			break;
+		}
+
+		c->cap = ffpcm_samples(conf.frameLenMsec, d->audio.fmt.sample_rate);
+		if (0 != danorm_buf_alloc(&c->buf, ch, c->cap, sizeof(double)))
 			return FMED_RSYSERR;
-		if (d->audio.fmt.channels > 8)
+		if (0 != dynanorm_open(&c->ctx, &conf)) {
+			errlog(d->trk, "dynanorm_open()");
 			return FMED_RERR;
-		c->buf.len = cap;
-		ffarrp_setbuf((void**)c->buf.ptr, ch, c->buf.ptr + sizeof(void*) * ch, cap * sizeof(double));
-		ffpcm_fmtcopy(&c->fmt, &d->audio.fmt);
-		c->state = 2;
-		// fall through
+		}
+		dbglog(d->trk, "frame:%ums  filter size:%u  format:float64"
+			, (int)conf.frameLenMsec, (int)conf.filterSize);
+		break;
 	}
 
 	case 2:
@@ -197,43 +303,47 @@ static int danorm_f_process(void *ctx, fmed_filt *d)
 		return FMED_RDONE;
 	}
 
+	if (c->f32 != NULL)
+		return danorm_f32_process(c, d);
+
 	if (d->flags & FMED_FFWD)
 		c->off = 0;
 
 	ffbool done = 0;
-	uint sampsize = ffpcm_size1(&c->fmt);
-	void *in[8];
+	uint ssize = sizeof(double);
+	const double *in[DANF_MAXCHAN];
 	size_t samples;
 	while (d->datalen != 0) {
-		for (uint i = 0;  i != c->fmt.channels;  i++) {
-			in[i] = (char*)d->datani[i] + c->off;
+		for (uint i = 0;  i != c->nch;  i++) {
+			in[i] = (void*)((char*)d->datani[i] + c->off);
 		}
-		samples = d->datalen / sampsize;
+		samples = d->datalen / (ssize * c->nch);
 		size_t in_samps = samples;
-		r = dynanorm_process(c->ctx, (const double*const*)in, &samples, (double**)c->buf.ptr, c->buf.len);
+		r = dynanorm_process(c->ctx, (const double*const*)in, &samples, (double**)c->buf.ptr, c->cap);
 		dbglog(d->trk, "output:%L  input:%L/%L", r, samples, in_samps);
-		d->datalen -= samples * sampsize;
-		c->off += samples * sampsize;
 		if (r < 0) {
 			errlog(d->trk, "dynanorm_process()");
 			return FMED_RERR;
-		} else if (r != 0)
+		}
+		d->datalen -= samples * ssize * c->nch;
+		c->off += samples * ssize;
+		if (r != 0)
 			goto data;
 	}
 
 	if (!(d->flags & FMED_FLAST))
 		return FMED_RMORE;
 
-	r = dynanorm_process(c->ctx, NULL, NULL, (double**)c->buf.ptr, c->buf.len);
+	r = dynanorm_process(c->ctx, NULL, NULL, (double**)c->buf.ptr, c->cap);
 	if (r < 0) {
 		errlog(d->trk, "dynanorm_process()");
 		return FMED_RERR;
 	}
 	dbglog(d->trk, "output:%L", r);
-	done = ((size_t)r < c->buf.len);
+	done = ((size_t)r < c->cap);
 
 data:
 	d->outni = (void**)c->buf.ptr;
-	d->outlen = r * sampsize;
+	d->outlen = r * ssize * c->nch;
 	return (done) ? FMED_RDONE : FMED_RDATA;
 }
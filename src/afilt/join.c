@@ -0,0 +1,615 @@
+/** Join several input files into one output.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+main track:    #queue.track -> join -> ... -> OUTPUT
+                                 ^
+input tracks:  #file.in -> INPUT [-> DECODER] -> joinsink   (one input at a time)
+
+The main track starts the track for the first input file;  --seek is applied to this file only.
+joinsink copies the data blocks into the queue shared with the main track,
+ and join returns them in order, so the output filters see one continuous stream.
+When the queue is full, the input track waits until the main track takes the data.
+When an input track is finished, the track for the next file is started.
+
+PCM:  all inputs must have the same audio format.
+Stream copy:  the header packets of the next inputs (meta_block) are skipped
+ if they are compatible with the first input's;
+ audio positions and Ogg granule positions continue from the end of the previous input.
+ MPEG frames are passed through mpeg.copy on the main track:
+ it writes Xing/LAME tag with the encoder delay of the first input and the padding of the last input.
+Input tracks are created on the main thread;  the data is exchanged under the lock.
+*/
+
+#include <fmedia.h>
+#include <FF/audio/pcm.h>
+#include <FF/list.h>
+
+
+extern const fmed_core *core;
+
+#undef dbglog
+#undef errlog
+#define dbglog(trk, ...)  fmed_dbglog(core, trk, "join", __VA_ARGS__)
+#define errlog(trk, ...)  fmed_errlog(core, trk, "join", __VA_ARGS__)
+
+enum {
+	JOIN_MAXCHAN = 8,
+	JOIN_BUFSIZE = 1 * 1024 * 1024, // max. amount of data queued by an input track
+};
+
+struct joinblk {
+	fflist_item sib;
+	uint64 pos; // samples
+	int64 granpos; // Ogg granule position;  FMED_NULL: unset
+	size_t len;
+	uint meta :1;
+	uint flush :1; // Ogg:  the packet is the last on page
+	void *chan[JOIN_MAXCHAN]; // non-interleaved data
+	char data[0];
+};
+
+typedef struct join {
+	fflock lk;
+	uint refs; // main track + input track
+	const fmed_track *track;
+	void *trk;
+	fftask tsk;
+	uint tsk_posted :1;
+	uint closed :1; // main track is closed
+	uint waiting :1; // main track waits for data
+	uint info :1; // properties of the first input are received
+	uint info_set :1;
+	uint stmcopy :1;
+	uint err :1;
+	uint state;
+
+	char **names;
+	uint nnames;
+	uint cur; // the current input
+	uint nstarted; // inputs whose tracks are started
+	uint ndone; // inputs whose data is stored completely
+	uint64 seek; // msec
+
+	// current input track
+	void *in_trk;
+	uint in_running :1;
+	uint in_waiting :1; // input track waits until the queue is drained
+	uint in_first :1; // no blocks are received from the current input
+	uint in_hdr :1; // the header packets of the current input are being received
+	fflist blocks; // struct joinblk[]
+	size_t queued; // bytes
+	struct joinblk *outblk;
+
+	ffpcmex fmt;
+	uint sampsize;
+	const char *datatype;
+	const char *decoder;
+	uint bitrate;
+	ffarr conf; // the first input's codec configuration (MP4) or Vorbis codebook packet
+
+	// positions of the current input are shifted by 'pos_off'
+	uint64 pos_off;
+	uint64 pos_end; // end position (shifted) of the current input
+	uint64 last_pos, last_dur;
+	int64 gran_off, gran_end; // Ogg granule position
+	int64 end_padding; // stream copy: encoder padding of the current input;  FMED_NULL: unset
+} join;
+
+static void join_free(join *j)
+{
+	struct joinblk *b;
+	fflist_item *next;
+	FFLIST_WALKSAFE(&j->blocks, b, sib, next) {
+		ffmem_free(b);
+	}
+	ffmem_safefree(j->outblk);
+	for (uint i = 0;  i != j->nnames;  i++) {
+		ffmem_free(j->names[i]);
+	}
+	ffmem_safefree(j->names);
+	ffarr_free(&j->conf);
+	ffmem_free(j);
+}
+
+/** Wake the main track if it waits for data.  Must be called under the lock. */
+static void join_wake(join *j)
+{
+	if (j->waiting && !j->closed) {
+		j->waiting = 0;
+		j->track->cmd(j->trk, FMED_TRACK_WAKE);
+	}
+}
+
+static void join_start(void *param);
+
+/** Schedule starting of the next input track on the main thread.  Must be called under the lock. */
+static void join_post(join *j)
+{
+	if (j->tsk_posted || j->closed)
+		return;
+	j->tsk_posted = 1;
+	core->task(&j->tsk, FMED_TASK_POST);
+}
+
+/** Create and start the track for the current input.  Thread: main. */
+static int join_trk_start(join *j, uint64 seek)
+{
+	void *trk;
+	fmed_trk *conf;
+	ssize_t f;
+
+	trk = j->track->create(FMED_TRK_TYPE_SEGMENT, j->names[j->cur]);
+	if (trk == NULL || trk == FMED_TRK_EFMT)
+		return -1;
+	conf = j->track->conf(trk);
+	conf->stream_copy = j->stmcopy;
+	conf->join = 1;
+	if (seek != 0)
+		conf->audio.seek = seek;
+
+	j->track->setval(trk, "join_ctx", (size_t)j);
+	j->in_trk = trk;
+
+	// joinsink instance is created now so that its close() is called even if the track fails to start
+	if (0 == (f = j->track->cmd(trk, FMED_TRACK_FILT_ADDLAST, "#soundmod.joinsink"))) {
+		j->track->cmd(trk, FMED_TRACK_XSTART); // the track will be freed after it's finished
+		return -1;
+	}
+	j->track->cmd(trk, FMED_TRACK_FILT_INSTANCE, (void*)f);
+
+	dbglog(j->trk, "input #%u: %s", j->cur + 1, j->names[j->cur]);
+	j->track->cmd(trk, FMED_TRACK_XSTART);
+	return 0;
+}
+
+/** Start the track for the next input after the previous one is finished.  Thread: main. */
+static void join_start(void *param)
+{
+	join *j = param;
+
+	fflk_lock(&j->lk);
+	j->tsk_posted = 0;
+	if (j->closed || j->in_running || j->err
+		|| j->nstarted == j->nnames || j->ndone != j->nstarted) {
+		fflk_unlock(&j->lk);
+		return;
+	}
+
+	j->cur = j->nstarted++;
+	j->in_running = 1;
+	j->in_first = 1;
+	j->in_hdr = 1;
+	j->refs++;
+	uint64 seek = (j->cur == 0) ? j->seek : 0;
+	fflk_unlock(&j->lk);
+
+	int r = join_trk_start(j, seek);
+
+	fflk_lock(&j->lk);
+	if (r != 0) {
+		// joinsink instance wasn't created
+		j->in_running = 0;
+		j->in_trk = NULL;
+		j->err = 1;
+		j->refs--;
+		join_wake(j);
+	}
+	fflk_unlock(&j->lk);
+}
+
+/** Split the list of input file names. */
+static int join_names(join *j, const char *list)
+{
+	ffstr s, name;
+	ffstr_setz(&s, list);
+	uint n = 1;
+	for (size_t i = 0;  i != s.len;  i++) {
+		if (s.ptr[i] == '\n')
+			n++;
+	}
+	if (NULL == (j->names = ffmem_callocT(n, char*)))
+		return -1;
+
+	while (s.len != 0) {
+		ffstr_nextval3(&s, &name, '\n');
+		if (name.len == 0)
+			continue;
+		if (NULL == (j->names[j->nnames] = ffsz_alcopystr(&name)))
+			return -1;
+		j->nnames++;
+	}
+	return (j->nnames != 0) ? 0 : -1;
+}
+
+
+//JOIN
+static void* join_open(fmed_filt *d)
+{
+	join *j;
+	const char *list;
+
+	if (FMED_PNULL == (list = d->track->getvalstr(d->trk, "join_input"))
+		&& FMED_PNULL == (list = d->track->getvalstr(d->trk, "input")))
+		return NULL;
+
+	if (NULL == (j = ffmem_new(join)))
+		return NULL;
+	fflk_init(&j->lk);
+	j->refs = 1;
+	j->track = d->track;
+	j->trk = d->trk;
+	j->stmcopy = d->stream_copy;
+	j->end_padding = FMED_NULL;
+	fflist_init(&j->blocks);
+	fftask_set(&j->tsk, &join_start, j);
+
+	if (0 != join_names(j, list)) {
+		join_free(j);
+		return NULL;
+	}
+
+	// --seek is applied to the first input;  --until is applied by the next filters to the whole output
+	if ((int64)d->audio.seek != FMED_NULL) {
+		j->seek = d->audio.seek;
+		d->audio.seek = FMED_NULL;
+	}
+
+	dbglog(d->trk, "joining %u files", j->nnames);
+	return j;
+}
+
+/** Thread: main. */
+static void join_close(void *ctx)
+{
+	join *j = ctx;
+
+	fflk_lock(&j->lk);
+	j->closed = 1;
+	core->task(&j->tsk, FMED_TASK_DEL);
+	if (j->in_running)
+		j->track->cmd(j->in_trk, FMED_TRACK_STOP);
+	uint refs = --j->refs;
+	fflk_unlock(&j->lk);
+
+	if (refs == 0)
+		join_free(j);
+}
+
+/** Set properties of the main track from the first input. */
+static void join_info_set(join *j, fmed_filt *d)
+{
+	d->audio.fmt = j->fmt;
+	d->audio.decoder = j->decoder;
+	d->audio.bitrate = j->bitrate;
+	d->datatype = j->datatype;
+}
+
+static int join_process(void *ctx, fmed_filt *d)
+{
+	join *j = ctx;
+	fflist_item *it;
+
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RFIN;
+	}
+
+	fflk_lock(&j->lk);
+
+	if (j->state == 0) {
+		j->state = 1;
+		join_post(j);
+		j->waiting = 1;
+		fflk_unlock(&j->lk);
+		return FMED_RASYNC;
+	}
+
+	ffmem_free0(j->outblk);
+
+	if (j->err)
+		goto err;
+
+	if (!fflist_empty(&j->blocks)) {
+		it = fflist_first(&j->blocks);
+		struct joinblk *b = FF_GETPTR(struct joinblk, sib, it);
+		fflist_rm(&j->blocks, &b->sib);
+		j->queued -= b->len;
+		j->outblk = b;
+		if (j->in_waiting && j->queued <= JOIN_BUFSIZE / 2) {
+			j->in_waiting = 0;
+			j->track->cmd(j->in_trk, FMED_TRACK_WAKE);
+		}
+		uint first = !j->info_set;
+		if (first) {
+			j->info_set = 1;
+			join_info_set(j, d);
+		}
+		fflk_unlock(&j->lk);
+
+		if (first && j->stmcopy && ffsz_eq(j->datatype, "mpeg")
+			&& 0 != d->track->cmd2(d->trk, FMED_TRACK_ADDFILT, "mpeg.copy"))
+			return FMED_RERR;
+
+		d->audio.pos = b->pos;
+		d->meta_block = b->meta;
+		if (b->granpos != FMED_NULL) {
+			fmed_setval("ogg_granpos", b->granpos);
+			if (b->flush)
+				fmed_setval("ogg_flush", 1);
+		}
+		d->out = (j->fmt.ileaved || j->stmcopy) ? b->data : (void*)b->chan;
+		d->outlen = b->len;
+		return FMED_RDATA;
+	}
+
+	if (j->ndone == j->nnames) {
+		int64 padding = j->end_padding;
+		fflk_unlock(&j->lk);
+		if (padding != FMED_NULL)
+			d->track->setval(d->trk, "audio_end_padding", padding);
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	j->waiting = 1;
+	fflk_unlock(&j->lk);
+	return FMED_RASYNC;
+
+err:
+	fflk_unlock(&j->lk);
+	errlog(d->trk, "input #%u: %s: processing failed", j->cur + 1, j->names[j->cur]);
+	return FMED_RERR;
+}
+
+const fmed_filter sndmod_join = {
+	&join_open, &join_process, &join_close
+};
+
+
+//JOIN SINK
+/* The context of joinsink is the shared join object. */
+
+/** Thread: main. */
+static void* joinsink_open(fmed_filt *d)
+{
+	int64 ptr = d->track->getval(d->trk, "join_ctx");
+	if (ptr == FMED_NULL)
+		return NULL;
+	return (void*)(size_t)ptr;
+}
+
+/** Thread: main. */
+static void joinsink_close(void *ctx)
+{
+	join *j = ctx;
+
+	fflk_lock(&j->lk);
+	j->in_running = 0;
+	j->in_waiting = 0;
+	j->in_trk = NULL;
+	if (j->ndone != j->nstarted && !j->closed) {
+		j->err = 1;
+		join_wake(j);
+	}
+	uint refs = --j->refs;
+	uint start = (!j->closed && !j->err && j->nstarted != j->nnames);
+	fflk_unlock(&j->lk);
+
+	if (refs == 0)
+		join_free(j);
+	else if (start)
+		join_post(j);
+}
+
+/** Get properties of the first input, or check that the next input is compatible.
+Must be called under the lock. */
+static int joinsink_info(join *j, fmed_filt *d)
+{
+	const char *datatype = (j->stmcopy) ? d->datatype : "pcm";
+
+	if (j->stmcopy)
+		j->end_padding = d->track->getval(d->trk, "audio_end_padding");
+
+	if (!j->info) {
+		if (d->audio.fmt.channels > JOIN_MAXCHAN) {
+			errlog(d->trk, "too many channels: %u", d->audio.fmt.channels);
+			return -1;
+		}
+		j->fmt = d->audio.fmt;
+		j->sampsize = ffpcm_size1(&j->fmt);
+		j->datatype = datatype;
+		j->decoder = d->audio.decoder;
+		j->bitrate = d->audio.bitrate;
+
+		int64 val;
+		if (FMED_NULL != (val = d->track->getval(d->trk, "audio_frame_samples")))
+			j->track->setval(j->trk, "audio_frame_samples", val);
+		if (FMED_NULL != (val = d->track->getval(d->trk, "audio_enc_delay")))
+			j->track->setval(j->trk, "audio_enc_delay", val);
+		if (FMED_NULL != (val = d->track->getval(d->trk, "mpeg_delay")))
+			j->track->setval(j->trk, "mpeg_delay", val);
+
+		d->track->cmd(j->trk, FMED_TRACK_META_COPYFROM, d->trk);
+		j->info = 1;
+		return 0;
+	}
+
+	if (!ffsz_eq(datatype, j->datatype)
+		|| d->audio.fmt.sample_rate != j->fmt.sample_rate
+		|| d->audio.fmt.channels != j->fmt.channels
+		|| (!j->stmcopy
+			&& (d->audio.fmt.format != j->fmt.format || d->audio.fmt.ileaved != j->fmt.ileaved))) {
+		errlog(d->trk, "audio format %s/%u/%u is incompatible with the first input's %s/%u/%u"
+			, datatype, d->audio.fmt.sample_rate, d->audio.fmt.channels
+			, j->datatype, j->fmt.sample_rate, j->fmt.channels);
+		return -1;
+	}
+	return 0;
+}
+
+#define VORBIS_BOOK_STR  "\x05vorbis"
+
+/** Stream copy: check whether the header packet must be skipped.
+The codec configuration of the next inputs must be the same as the first input's.
+Return 1 if the packet must be skipped;  -1 on error. */
+static int joinsink_hdr(join *j, fmed_filt *d)
+{
+	ffstr data;
+	ffstr_set(&data, d->data, d->datalen);
+
+	if (!d->meta_block && !ffstr_matchz(&data, VORBIS_BOOK_STR)) {
+		j->in_hdr = 0;
+		return 0;
+	}
+
+	// MP4 codec configuration and Vorbis codebook packet must match
+	ffbool check = ffsz_eq(j->datatype, "mp4") || ffstr_matchz(&data, VORBIS_BOOK_STR);
+	if (j->cur == 0) {
+		if (check) {
+			j->conf.len = 0;
+			if (NULL == ffarr_append(&j->conf, data.ptr, data.len))
+				return -1;
+		}
+		return 0;
+	}
+
+	if (check && !ffstr_eq2(&data, &j->conf)) {
+		errlog(d->trk, "codec configuration is incompatible with the first input's");
+		return -1;
+	}
+	return 1;
+}
+
+/** Add data block to the queue.
+@hdr: stream copy: the block is a header packet */
+static int joinsink_store(join *j, fmed_filt *d, uint hdr, int64 gpos, uint flush)
+{
+	size_t len = d->datalen;
+	uint nch = j->fmt.channels;
+	struct joinblk *b;
+	if (NULL == (b = ffmem_alloc(sizeof(struct joinblk) + len)))
+		return -1;
+
+	if (j->in_first && !hdr) {
+		// positions of this input start after the end of the previous input
+		j->in_first = 0;
+		j->pos_off = (j->cur == 0) ? 0 : j->pos_end - d->audio.pos;
+		j->gran_off += j->gran_end;
+		j->gran_end = 0;
+		j->last_pos = d->audio.pos;
+		j->last_dur = 0;
+	}
+
+	b->pos = (hdr) ? j->pos_end : j->pos_off + d->audio.pos;
+	b->len = len;
+	b->meta = d->meta_block;
+	b->granpos = FMED_NULL;
+	b->flush = 0;
+
+	if (!j->stmcopy) {
+		size_t n = len / j->sampsize;
+		j->pos_end = b->pos + n;
+
+		if (j->fmt.ileaved) {
+			ffmemcpy(b->data, d->data, len);
+		} else {
+			uint ss = j->sampsize / nch;
+			for (uint c = 0;  c != nch;  c++) {
+				b->chan[c] = b->data + c * n * ss;
+				ffmemcpy(b->chan[c], d->datani[c], n * ss);
+			}
+		}
+
+	} else {
+		ffmemcpy(b->data, d->data, len);
+
+		if (!hdr) {
+			if (d->audio.pos > j->last_pos)
+				j->last_dur = d->audio.pos - j->last_pos;
+			j->last_pos = d->audio.pos;
+			j->pos_end = b->pos + j->last_dur;
+		}
+
+		if (gpos != FMED_NULL) {
+			b->granpos = -1;
+			if (gpos != -1) {
+				b->granpos = j->gran_off + gpos;
+				j->gran_end = ffmax(j->gran_end, gpos);
+			}
+			b->flush = flush;
+		}
+	}
+
+	fflist_ins(&j->blocks, &b->sib);
+	j->queued += len;
+	return 0;
+}
+
+static int joinsink_process(void *ctx, fmed_filt *d)
+{
+	join *j = ctx;
+	int r = FMED_ROK;
+
+	fflk_lock(&j->lk);
+
+	if (j->closed || (d->flags & FMED_FSTOP)) {
+		r = FMED_RFIN;
+		goto end;
+	}
+
+	if (d->datalen != 0) {
+		if (j->queued >= JOIN_BUFSIZE) {
+			j->in_waiting = 1;
+			join_wake(j);
+			fflk_unlock(&j->lk);
+			return FMED_RASYNC;
+		}
+
+		if (j->in_first && 0 != joinsink_info(j, d)) {
+			r = FMED_RERR;
+			goto end;
+		}
+
+		// Ogg page properties are set by ogg.input for each packet
+		int64 gpos = FMED_NULL;
+		uint flush = 0;
+		if (j->stmcopy && ffsz_eq(j->datatype, "OGG")) {
+			gpos = d->track->getval(d->trk, "ogg_granpos");
+			flush = (1 == d->track->getval(d->trk, "ogg_flush"));
+			d->track->setval(d->trk, "ogg_flush", 0);
+		}
+
+		int skip = 0;
+		uint hdr = 0;
+		if (j->stmcopy && j->in_hdr) {
+			if (0 > (skip = joinsink_hdr(j, d))) {
+				r = FMED_RERR;
+				goto end;
+			}
+			hdr = j->in_hdr;
+		}
+
+		if (!skip && 0 != joinsink_store(j, d, hdr, gpos, flush)) {
+			r = FMED_RERR;
+			goto end;
+		}
+		d->datalen = 0;
+	}
+
+	if (d->flags & FMED_FLAST) {
+		dbglog(d->trk, "input #%u: done", j->cur + 1);
+		j->ndone++;
+		r = FMED_RFIN;
+	}
+
+	join_wake(j);
+
+end:
+	fflk_unlock(&j->lk);
+	return r;
+}
+
+const fmed_filter sndmod_joinsink = {
+	&joinsink_open, &joinsink_process, &joinsink_close
+};
@@ -0,0 +1,612 @@
+/** Loudness analyzer: EBU R128 / ITU-R BS.1770 integrated loudness, loudness range, true peak.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+K-weighted audio is squared and summed within 100ms sub-blocks.
+Momentary loudness (400ms) and short-term loudness (3sec) are computed from the last sub-blocks
+ and are stored into histograms with 0.1 LU resolution.
+Gating is performed on the histograms, so the analyzer's state doesn't grow with track length.
+Histograms of the tracks from the same directory are merged to get album loudness.
+
+Input is processed in blocks of up to LOUD_BLOCK samples:
+ K-weighting filters run for all channels at once (one lane per channel),
+ true-peak interpolation runs per channel with the sample loop innermost.
+When all tracks are finished, fin() prints album loudness, writes the report file
+ and starts the tracks which write ReplayGain tags into the input files (tag.edit).
+*/
+
+#include <fmedia.h>
+#include <FF/list.h>
+#include <FF/path.h>
+
+
+extern const fmed_core *core;
+
+#undef dbglog
+#define dbglog(trk, ...)  fmed_dbglog(core, trk, "loudness", __VA_ARGS__)
+
+//LOUDNESS
+static void* loud_open(fmed_filt *d);
+static int loud_process(void *ctx, fmed_filt *d);
+static void loud_close(void *ctx);
+const fmed_filter sndmod_loudness = {
+	&loud_open, &loud_process, &loud_close
+};
+
+enum {
+	LOUD_HIST_MIN = -70, // LUFS
+	LOUD_HIST_MAX = 5,
+	LOUD_HIST_BINS = (LOUD_HIST_MAX - LOUD_HIST_MIN) * 10,
+	LOUD_SUBBLOCKS_M = 4, // 400ms
+	LOUD_SUBBLOCKS_S = 30, // 3sec
+	LOUD_TP_PHASES = 4, // true-peak oversampling factor
+	LOUD_TP_TAPS = 12, // FIR taps per phase
+	LOUD_LANES = 8, // max. channels
+	LOUD_BLOCK = 1024, // samples processed at once
+};
+
+#define LOUD_RG_REF  (-18.0) // ReplayGain 2.0 reference level (LUFS)
+#define LOUD_PI  3.14159265358979323846
+
+struct loud_hist {
+	uint integrated[LOUD_HIST_BINS];
+	uint shortterm[LOUD_HIST_BINS];
+	double peak; // true peak (linear)
+};
+
+/** Biquad filter state for all channels. */
+struct loud_biquad {
+	double x1[LOUD_LANES], x2[LOUD_LANES], y1[LOUD_LANES], y2[LOUD_LANES];
+};
+
+typedef struct loudness {
+	uint state;
+	uint nch;
+	uint subblock; // samples per 100ms
+	uint subblock_fill;
+	double pre_b[3], pre_a[3];
+	double rlb_b[3], rlb_a[3];
+	float tp_coef[LOUD_TP_PHASES][LOUD_TP_TAPS]; // reversed: [0] multiplies the oldest sample
+
+	struct loud_biquad pre; // pre-filter (high shelf)
+	struct loud_biquad rlb; // RLB (high pass) filter
+	double sum[LOUD_LANES]; // sums of squares within the current sub-block
+	double weight[LOUD_LANES];
+
+	double energy[LOUD_SUBBLOCKS_S]; // the last sub-blocks
+	uint64 nsubblocks;
+
+	struct loud_hist hist;
+
+	double (*xt)[LOUD_LANES]; // transposed input block: [LOUD_BLOCK][LOUD_LANES]
+	float *tp_x; // true-peak window: the last TAPS-1 samples of the previous block + the current block
+	float *tp_y; // interpolated samples of 1 phase
+	float tp_hist[LOUD_LANES][LOUD_TP_TAPS - 1];
+} loudness;
+
+/** Results of a track. */
+struct loud_track {
+	fflist_item sib;
+	double integrated, range, peak;
+	char fn[0];
+};
+
+/** Loudness data of all tracks within a directory. */
+struct loud_album {
+	fflist_item sib;
+	struct loud_hist hist;
+	uint ntracks;
+	fflist tracks; //struct loud_track[]
+	char dir[0];
+};
+
+static struct {
+	fflock lk;
+	fflist albums; //struct loud_album[]
+	uint init :1;
+} loud_albums;
+
+
+static double loud_energy2lufs(double e)
+{
+	if (e <= 0)
+		return LOUD_HIST_MIN;
+	return -0.691 + 10 * log10(e);
+}
+
+static double loud_bin2energy(uint i)
+{
+	double lufs = LOUD_HIST_MIN + (i + 0.5) / 10;
+	return pow(10, (lufs + 0.691) / 10);
+}
+
+static void loud_hist_add(uint *hist, double energy)
+{
+	if (energy <= 0)
+		return;
+	double lufs = loud_energy2lufs(energy);
+	if (lufs < LOUD_HIST_MIN)
+		return; // absolute gate
+	uint i = (uint)((lufs - LOUD_HIST_MIN) * 10);
+	hist[ffmin(i, LOUD_HIST_BINS - 1)]++;
+}
+
+/** Get mean energy of all blocks above the threshold. */
+static double loud_hist_mean(const uint *hist, double threshold_lufs, uint64 *count)
+{
+	double sum = 0;
+	uint64 n = 0;
+	uint start = 0;
+	if (threshold_lufs > LOUD_HIST_MIN)
+		start = ffmin((uint)((threshold_lufs - LOUD_HIST_MIN) * 10), LOUD_HIST_BINS);
+	for (uint i = start;  i != LOUD_HIST_BINS;  i++) {
+		sum += hist[i] * loud_bin2energy(i);
+		n += hist[i];
+	}
+	if (count != NULL)
+		*count = n;
+	return (n != 0) ? sum / n : 0;
+}
+
+/** Integrated loudness: mean of the blocks above the relative gate (-10 LU). */
+static double loud_integrated(const struct loud_hist *h)
+{
+	double e = loud_hist_mean(h->integrated, LOUD_HIST_MIN, NULL);
+	if (e == 0)
+		return LOUD_HIST_MIN;
+	e = loud_hist_mean(h->integrated, loud_energy2lufs(e) - 10, NULL);
+	return loud_energy2lufs(e);
+}
+
+/** Loudness range: the difference between the 95th and the 10th percentiles
+ of short-term loudness values above the relative gate (-20 LU). */
+static double loud_range(const struct loud_hist *h)
+{
+	uint64 n;
+	double e = loud_hist_mean(h->shortterm, LOUD_HIST_MIN, NULL);
+	if (e == 0)
+		return 0;
+	double thr = loud_energy2lufs(e) - 20;
+	loud_hist_mean(h->shortterm, thr, &n);
+	if (n == 0)
+		return 0;
+
+	uint start = 0;
+	if (thr > LOUD_HIST_MIN)
+		start = ffmin((uint)((thr - LOUD_HIST_MIN) * 10), LOUD_HIST_BINS);
+	uint64 lo_n = n * 10 / 100, hi_n = n * 95 / 100, k = 0;
+	int lo = -1, hi = -1;
+	for (uint i = start;  i != LOUD_HIST_BINS;  i++) {
+		k += h->shortterm[i];
+		if (lo < 0 && k > lo_n)
+			lo = i;
+		if (hi < 0 && k > hi_n) {
+			hi = i;
+			break;
+		}
+	}
+	if (lo < 0 || hi < 0)
+		return 0;
+	return (double)(hi - lo) / 10;
+}
+
+static void loud_hist_merge(struct loud_hist *dst, const struct loud_hist *src)
+{
+	for (uint i = 0;  i != LOUD_HIST_BINS;  i++) {
+		dst->integrated[i] += src->integrated[i];
+		dst->shortterm[i] += src->shortterm[i];
+	}
+	dst->peak = ffmax(dst->peak, src->peak);
+}
+
+/** Add track's data to the album identified by the directory of the input file. */
+static void loud_album_add(const char *fn, const struct loud_hist *h, double integrated, double range)
+{
+	ffstr dir = {};
+	ffpath_split2(fn, ffsz_len(fn), &dir, NULL);
+	struct loud_track *t;
+
+	fflk_lock(&loud_albums.lk);
+	if (!loud_albums.init) {
+		fflist_init(&loud_albums.albums);
+		loud_albums.init = 1;
+	}
+
+	struct loud_album *a;
+	FFLIST_WALK(&loud_albums.albums, a, sib) {
+		if (ffstr_eqz(&dir, a->dir))
+			goto found;
+	}
+	if (NULL == (a = ffmem_calloc(1, sizeof(struct loud_album) + dir.len + 1)))
+		goto end;
+	ffmemcpy(a->dir, dir.ptr, dir.len);
+	a->dir[dir.len] = '\0';
+	fflist_init(&a->tracks);
+	fflist_ins(&loud_albums.albums, &a->sib);
+
+found:
+	if (NULL == (t = ffmem_alloc(sizeof(struct loud_track) + ffsz_len(fn) + 1)))
+		goto end;
+	t->integrated = integrated;
+	t->range = range;
+	t->peak = h->peak;
+	ffsz_copy(t->fn, ffsz_len(fn) + 1, fn, ffsz_len(fn));
+	fflist_ins(&a->tracks, &t->sib);
+
+	loud_hist_merge(&a->hist, h);
+	a->ntracks++;
+
+end:
+	fflk_unlock(&loud_albums.lk);
+}
+
+/** Start the track which writes ReplayGain tags into the file.
+Return 0 if the track is started. */
+static int loud_tags_write(const struct loud_track *t, double album_gain, double album_peak)
+{
+	const fmed_track *track = core->getmod("#core.track");
+	void *trk;
+	char meta[256];
+
+	if (NULL == (trk = track->create(FMED_TRK_TYPE_NONE, NULL)))
+		return -1;
+	ffs_fmt(meta, meta + sizeof(meta)
+		, "replaygain_track_gain=%.2F dB;replaygain_track_peak=%.6F"
+		";replaygain_album_gain=%.2F dB;replaygain_album_peak=%.6F%Z"
+		, LOUD_RG_REF - t->integrated, t->peak, album_gain, album_peak);
+	track->setvalstr(trk, "input", t->fn);
+	track->setvalstr(trk, "meta", meta);
+	if (0 == track->cmd(trk, FMED_TRACK_FILT_ADDLAST, "tag.edit"))
+		track->setval(trk, "error", 1);
+	track->cmd(trk, FMED_TRACK_XSTART); // the track will be freed after it's finished
+	return 0;
+}
+
+/** Print album loudness for each directory, write the report file, start tag writers and free the data.
+Thread: main. */
+static uint loud_fin(const char *report, uint tags)
+{
+	struct loud_album *a;
+	struct loud_track *t;
+	fflist_item *next, *tnext;
+	ffarr buf = {};
+	uint ntrk = 0;
+
+	if (!loud_albums.init)
+		return 0;
+
+	if (report != NULL)
+		ffstr_catfmt(&buf, "# file\tintegrated LUFS\trange LU\ttrue peak dBTP\ttrack gain dB\talbum gain dB\n");
+
+	fflk_lock(&loud_albums.lk);
+	FFLIST_WALKSAFE(&loud_albums.albums, a, sib, next) {
+		double i = loud_integrated(&a->hist);
+		double album_gain = LOUD_RG_REF - i;
+		if (a->ntracks > 1) {
+			core->log(FMED_LOG_USER, NULL, NULL
+				, "Album loudness \"%s\" (%u tracks): integrated:%.1FLUFS  range:%.1FLU  true peak:%.2FdBTP  gain:%.2FdB"
+				, a->dir, a->ntracks
+				, i, loud_range(&a->hist), ffpcm_gain2db(a->hist.peak), album_gain);
+		}
+
+		FFLIST_WALKSAFE(&a->tracks, t, sib, tnext) {
+			if (report != NULL)
+				ffstr_catfmt(&buf, "%s\t%.1F\t%.1F\t%.2F\t%.2F\t%.2F\n"
+					, t->fn, t->integrated, t->range, ffpcm_gain2db(t->peak)
+					, LOUD_RG_REF - t->integrated, album_gain);
+			if (tags && 0 == loud_tags_write(t, album_gain, a->hist.peak))
+				ntrk++;
+			fflist_rm(&a->tracks, &t->sib);
+			ffmem_free(t);
+		}
+
+		fflist_rm(&loud_albums.albums, &a->sib);
+		ffmem_free(a);
+	}
+	fflk_unlock(&loud_albums.lk);
+
+	if (report != NULL) {
+		if (buf.ptr == NULL
+			|| 0 != fffile_writeall(report, buf.ptr, buf.len, 0))
+			syserrlog(core, NULL, "loudness", "can't write report: %s", report);
+		else
+			core->log(FMED_LOG_USER, NULL, NULL, "Saved loudness report to %s", report);
+	}
+	ffarr_free(&buf);
+	return ntrk;
+}
+
+const fmed_loudness_scan sndmod_loudness_scan = {
+	&loud_fin
+};
+
+/** Print album loudness for each directory and free the data. */
+void loudness_albums_print(void)
+{
+	loud_fin(NULL, 0);
+}
+
+
+/** Compute K-weighting filter coefficients for the sample rate (ITU-R BS.1770). */
+static void loud_kweight_init(loudness *l, uint rate)
+{
+	double f0 = 1681.974450955533;
+	double G = 3.999843853973347;
+	double Q = 0.7071752369554196;
+	double K = tan(LOUD_PI * f0 / rate);
+	double Vh = pow(10, G / 20);
+	double Vb = pow(Vh, 0.4996667741545416);
+	double a0 = 1 + K / Q + K * K;
+	l->pre_b[0] = (Vh + Vb * K / Q + K * K) / a0;
+	l->pre_b[1] = 2 * (K * K - Vh) / a0;
+	l->pre_b[2] = (Vh - Vb * K / Q + K * K) / a0;
+	l->pre_a[1] = 2 * (K * K - 1) / a0;
+	l->pre_a[2] = (1 - K / Q + K * K) / a0;
+
+	f0 = 38.13547087602444;
+	Q = 0.5003270373238773;
+	K = tan(LOUD_PI * f0 / rate);
+	a0 = 1 + K / Q + K * K;
+	l->rlb_b[0] = 1;
+	l->rlb_b[1] = -2;
+	l->rlb_b[2] = 1;
+	l->rlb_a[1] = 2 * (K * K - 1) / a0;
+	l->rlb_a[2] = (1 - K / Q + K * K) / a0;
+}
+
+/** Windowed-sinc interpolation filter for true-peak measurement. */
+static void loud_tp_init(loudness *l)
+{
+	const uint n = LOUD_TP_PHASES * LOUD_TP_TAPS;
+	for (uint i = 0;  i != n;  i++) {
+		double x = ((double)i - (n - 1) / 2.0) / LOUD_TP_PHASES;
+		double sinc = (x == 0) ? 1 : sin(LOUD_PI * x) / (LOUD_PI * x);
+		double win = 0.5 - 0.5 * cos(2 * LOUD_PI * (i + 0.5) / n);
+		l->tp_coef[i % LOUD_TP_PHASES][LOUD_TP_TAPS - 1 - i / LOUD_TP_PHASES] = sinc * win;
+	}
+}
+
+static void* loud_open(fmed_filt *d)
+{
+	loudness *l = ffmem_new(loudness);
+	if (l == NULL)
+		return NULL;
+	return l;
+}
+
+static void loud_close(void *ctx)
+{
+	loudness *l = ctx;
+	ffmem_free(l->xt);
+	ffmem_free(l->tp_x);
+	ffmem_free(l->tp_y);
+	ffmem_free(l);
+}
+
+static int loud_init(loudness *l, fmed_filt *d)
+{
+	const ffpcmex *fmt = &d->audio.convfmt;
+
+	l->nch = fmt->channels;
+	if (l->nch > LOUD_LANES) {
+		errlog(core, d->trk, "loudness", "%u channels aren't supported", l->nch);
+		return -1;
+	}
+
+	if (NULL == (l->xt = ffmem_alloc(LOUD_BLOCK * sizeof(*l->xt)))
+		|| NULL == (l->tp_x = ffmem_allocT(LOUD_TP_TAPS - 1 + LOUD_BLOCK, float))
+		|| NULL == (l->tp_y = ffmem_allocT(LOUD_BLOCK, float)))
+		return -1;
+	ffmem_zero(l->xt, LOUD_BLOCK * sizeof(*l->xt));
+
+	for (uint i = 0;  i != l->nch;  i++) {
+		l->weight[i] = 1.0;
+	}
+	if (l->nch == 6) {
+		// 5.1: LFE channel isn't counted, surround channels get +1.5dB
+		l->weight[3] = 0;
+		l->weight[4] = 1.41;
+		l->weight[5] = 1.41;
+	}
+
+	l->subblock = fmt->sample_rate / 10;
+	loud_kweight_init(l, fmt->sample_rate);
+	loud_tp_init(l);
+	return 0;
+}
+
+/** Apply 2nd-order IIR filter to 1 sample of each lane. */
+static FFINL void loud_biquad(struct loud_biquad *st, const double *b, const double *a, double *x)
+{
+	for (uint c = 0;  c != LOUD_LANES;  c++) {
+		double y = b[0] * x[c] + b[1] * st->x1[c] + b[2] * st->x2[c] - a[1] * st->y1[c] - a[2] * st->y2[c];
+		st->x2[c] = st->x1[c];
+		st->x1[c] = x[c];
+		st->y2[c] = st->y1[c];
+		st->y1[c] = y;
+		x[c] = y;
+	}
+}
+
+/** K-weight the samples of all channels and add their squares to the sub-block sums. */
+static void loud_kweight(loudness *l, const float **data, size_t n)
+{
+	for (uint c = 0;  c != l->nch;  c++) {
+		const float *d = data[c];
+		for (size_t i = 0;  i != n;  i++) {
+			l->xt[i][c] = d[i];
+		}
+	}
+
+	for (size_t i = 0;  i != n;  i++) {
+		double *x = l->xt[i];
+		loud_biquad(&l->pre, l->pre_b, l->pre_a, x);
+		loud_biquad(&l->rlb, l->rlb_b, l->rlb_a, x);
+		for (uint c = 0;  c != LOUD_LANES;  c++) {
+			l->sum[c] += x[c] * x[c];
+		}
+	}
+}
+
+/** Get true peak of 1 channel's samples. */
+static float loud_truepeak(loudness *l, uint ch, const float *data, size_t n)
+{
+	const uint nhist = LOUD_TP_TAPS - 1;
+	float *x = l->tp_x, *y = l->tp_y;
+	float peak = 0;
+
+	ffmemcpy(x, l->tp_hist[ch], nhist * sizeof(float));
+	ffmemcpy(x + nhist, data, n * sizeof(float));
+
+	for (uint p = 0;  p != LOUD_TP_PHASES;  p++) {
+		ffmem_zero(y, n * sizeof(float));
+		for (uint k = 0;  k != LOUD_TP_TAPS;  k++) {
+			float coef = l->tp_coef[p][k];
+			const float *xk = x + k;
+			for (size_t i = 0;  i != n;  i++) {
+				y[i] += xk[i] * coef;
+			}
+		}
+
+		for (size_t i = 0;  i != n;  i++) {
+			float v = (y[i] < 0) ? -y[i] : y[i];
+			peak = (v > peak) ? v : peak;
+		}
+	}
+
+	ffmemcpy(l->tp_hist[ch], x + n, nhist * sizeof(float));
+	return peak;
+}
+
+/** A 100ms sub-block is complete: update momentary and short-term loudness histograms. */
+static void loud_subblock(loudness *l)
+{
+	double e = 0;
+	for (uint i = 0;  i != l->nch;  i++) {
+		e += l->weight[i] * l->sum[i];
+		l->sum[i] = 0;
+	}
+	l->energy[l->nsubblocks % LOUD_SUBBLOCKS_S] = e / l->subblock;
+	l->nsubblocks++;
+
+	if (l->nsubblocks >= LOUD_SUBBLOCKS_M) {
+		double m = 0;
+		for (uint i = 1;  i <= LOUD_SUBBLOCKS_M;  i++) {
+			m += l->energy[(l->nsubblocks - i) % LOUD_SUBBLOCKS_S];
+		}
+		loud_hist_add(l->hist.integrated, m / LOUD_SUBBLOCKS_M);
+	}
+
+	if (l->nsubblocks >= LOUD_SUBBLOCKS_S) {
+		double s = 0;
+		for (uint i = 0;  i != LOUD_SUBBLOCKS_S;  i++) {
+			s += l->energy[i];
+		}
+		loud_hist_add(l->hist.shortterm, s / LOUD_SUBBLOCKS_S);
+	}
+}
+
+static void loud_result(loudness *l, fmed_filt *d)
+{
+	double i = loud_integrated(&l->hist);
+	double lra = loud_range(&l->hist);
+	double tp = ffpcm_gain2db(l->hist.peak);
+	double gain = LOUD_RG_REF - i;
+
+	core->log(FMED_LOG_USER, d->trk, NULL
+		, "Loudness: integrated:%.1FLUFS  range:%.1FLU  true peak:%.2FdBTP  gain:%.2FdB"
+		, i, lra, tp, gain);
+
+	if (l->nsubblocks < LOUD_SUBBLOCKS_M)
+		return; // too short
+
+	// attach ReplayGain values to the track
+	char buf[64];
+	ffstr name, val;
+	ffstr_setz(&name, "replaygain_track_gain");
+	val.ptr = buf;
+	val.len = ffs_fmt(buf, buf + sizeof(buf), "%.2F dB", gain);
+	d->track->meta_set(d->trk, &name, &val, FMED_QUE_OVWRITE);
+
+	ffstr_setz(&name, "replaygain_track_peak");
+	val.len = ffs_fmt(buf, buf + sizeof(buf), "%.6F", l->hist.peak);
+	d->track->meta_set(d->trk, &name, &val, FMED_QUE_OVWRITE);
+
+	const char *fn = d->track->getvalstr(d->trk, "input");
+	if (fn != FMED_PNULL)
+		loud_album_add(fn, &l->hist, i, lra);
+}
+
+static int loud_process(void *ctx, fmed_filt *d)
+{
+	loudness *l = ctx;
+
+	switch (l->state) {
+	case 0:
+		d->audio.convfmt.format = FFPCM_FLOAT;
+		d->audio.convfmt.ileaved = 0;
+		l->state = 1;
+		return FMED_RMORE;
+
+	case 1:
+		if (d->audio.convfmt.format != FFPCM_FLOAT || d->audio.convfmt.ileaved) {
+			// another filter has requested a different format from autoconv
+			struct fmed_aconv conv;
+			conv.in = d->audio.convfmt;
+			conv.out = d->audio.convfmt;
+			conv.out.format = FFPCM_FLOAT;
+			conv.out.ileaved = 0;
+			void *f = (void*)d->track->cmd(d->trk, FMED_TRACK_FILT_ADDPREV, "#soundmod.conv");
+			if (f == NULL)
+				return FMED_RERR;
+			const struct fmed_filter2 *aconv = core->getmod("#soundmod.conv");
+			void *fi = (void*)d->track->cmd(d->trk, FMED_TRACK_FILT_INSTANCE, f);
+			if (fi == NULL)
+				return FMED_RERR;
+			aconv->cmd(fi, 0, &conv);
+			d->audio.convfmt = conv.out;
+			d->out = d->data,  d->outlen = d->datalen;
+			l->state = 2;
+			return FMED_RBACK;
+		}
+		// fall through
+
+	case 2:
+		if (0 != loud_init(l, d))
+			return FMED_RERR;
+		l->state = 3;
+		break;
+	}
+
+	size_t samples = d->datalen / (sizeof(float) * l->nch);
+	size_t off = 0;
+	while (off != samples) {
+		size_t n = ffmin(samples - off, l->subblock - l->subblock_fill);
+		n = ffmin(n, LOUD_BLOCK);
+
+		const float *data[LOUD_LANES];
+		for (uint i = 0;  i != l->nch;  i++) {
+			data[i] = (float*)d->datani[i] + off;
+			float peak = loud_truepeak(l, i, data[i], n);
+			l->hist.peak = ffmax(l->hist.peak, peak);
+		}
+		loud_kweight(l, data, n);
+
+		off += n;
+		l->subblock_fill += n;
+		if (l->subblock_fill == l->subblock) {
+			loud_subblock(l);
+			l->subblock_fill = 0;
+		}
+	}
+
+	d->out = d->data;
+	d->outlen = d->datalen;
+	d->datalen = 0;
+
+	if (d->flags & FMED_FLAST) {
+		loud_result(l, d);
+		return FMED_RDONE;
+	}
+	return FMED_ROK;
+}
@@ -16,18 +16,28 @@ const fmed_filter fmed_sndmod_peaks = {
 };
 
 
+struct peaks_ch {
+	double high; // the highest absolute sample value
+	double sum; // sum of absolute sample values
+	double sum_sq; // sum of squared sample values
+	double sum_dc; // sum of signed sample values
+	uint64 clipped;
+	uint crc;
+};
+
+typedef void (*peaks_func)(struct peaks_ch *c, const char *data, size_t samples, size_t step);
+
 typedef struct sndmod_peaks {
 	uint state;
 	uint nch;
 	uint64 total;
-
-	struct {
-		uint crc;
-		uint high;
-		uint64 sum;
-		uint64 clipped;
-	} ch[8];
+	peaks_func analyze;
+	uint ssize; // bytes per 1 sample of 1 channel
+	uint ileaved :1;
 	uint do_crc :1;
+	double scale; // multiplier to get a normalized (-1.0..1.0) value
+
+	struct peaks_ch *ch;
 } sndmod_peaks;
 
 static void* sndmod_peaks_open(fmed_filt *d)
@@ -37,7 +47,7 @@ static void* sndmod_peaks_open(fmed_filt *d)
 		return NULL;
 
 	p->nch = d->audio.convfmt.channels;
-	if (p->nch > FFCNT(p->ch)) {
+	if (NULL == (p->ch = ffmem_callocT(p->nch, struct peaks_ch))) {
 		ffmem_free(p);
 		return NULL;
 	}
@@ -49,52 +59,176 @@ static void* sndmod_peaks_open(fmed_filt *d)
 static void sndmod_peaks_close(void *ctx)
 {
 	sndmod_peaks *p = ctx;
+	ffmem_free(p->ch);
 	ffmem_free(p);
 }
 
+static FFINL int peaks_int24(const char *p)
+{
+	const byte *b = (byte*)p;
+	return (int)((uint)b[0] | ((uint)b[1] << 8) | ((uint)b[2] << 16) | ((b[2] & 0x80) ? 0xff000000 : 0));
+}
+
+#define peaks_get16(p, i)  (((const short*)(p))[i])
+#define peaks_get24(p, i)  peaks_int24((p) + (i) * 3)
+#define peaks_get32(p, i)  (((const int*)(p))[i])
+
+/* The loops below don't branch on sample values,
+ so the compiler is able to vectorize them for planar data. */
+
+/** Integer samples: accumulate in integers, then add to the channel totals once per block. */
+#define PEAKS_INT_FUNC(name, get, smin, smax, sq_t) \
+static void name(struct peaks_ch *c, const char *data, size_t samples, size_t step) \
+{ \
+	uint64 hi = 0, sum = 0, clipped = 0; \
+	int64 dc = 0; \
+	sq_t sq = 0; \
+	for (size_t i = 0;  i != samples;  i++) { \
+		int64 s = get(data, i * step); \
+		uint64 a = (s < 0) ? -s : s; \
+		hi = (a > hi) ? a : hi; \
+		sum += a; \
+		dc += s; \
+		sq += (sq_t)s * s; \
+		clipped += (s == (smin) || s == (smax)); \
+	} \
+	if (c->high < hi) \
+		c->high = hi; \
+	c->sum += sum; \
+	c->sum_sq += sq; \
+	c->sum_dc += dc; \
+	c->clipped += clipped; \
+}
+
+PEAKS_INT_FUNC(peaks_int16, peaks_get16, -0x8000, 0x7fff, uint64)
+PEAKS_INT_FUNC(peaks_int24_func, peaks_get24, -0x800000, 0x7fffff, uint64)
+PEAKS_INT_FUNC(peaks_int32, peaks_get32, -0x7fffffffLL - 1, 0x7fffffff, double)
+
+#undef PEAKS_INT_FUNC
+
+static void peaks_float(struct peaks_ch *c, const char *data, size_t samples, size_t step)
+{
+	const float *f = (void*)data;
+	float hi = 0;
+	double sum = 0, sq = 0, dc = 0;
+	uint64 clipped = 0;
+	for (size_t i = 0;  i != samples;  i++) {
+		float s = f[i * step];
+		float a = (s < 0) ? -s : s;
+		hi = (a > hi) ? a : hi;
+		sum += a;
+		dc += s;
+		sq += (double)s * s;
+		clipped += (a >= 1.0f);
+	}
+	if (c->high < hi)
+		c->high = hi;
+	c->sum += sum;
+	c->sum_sq += sq;
+	c->sum_dc += dc;
+	c->clipped += clipped;
+}
+
+/** Update CRC of the channel's samples.
+Interleaved samples are gathered into a temporary buffer so that crc32() is called with large chunks. */
+static void peaks_crc(struct peaks_ch *c, const char *data, size_t samples, uint ssize, size_t stride)
+{
+	if (stride == ssize) {
+		c->crc = crc32(data, samples * ssize, c->crc);
+		return;
+	}
+
+	char buf[4 * 1024];
+	size_t n = 0;
+	for (size_t i = 0;  i != samples;  i++) {
+		ffmemcpy(&buf[n], data + i * stride, ssize);
+		n += ssize;
+		if (n + ssize > sizeof(buf)) {
+			c->crc = crc32(buf, n, c->crc);
+			n = 0;
+		}
+	}
+	if (n != 0)
+		c->crc = crc32(buf, n, c->crc);
+}
+
+/** Choose the analyzer function for the input format.
+Return 0 if the format is supported. */
+static int peaks_init(sndmod_peaks *p, const ffpcmex *fmt)
+{
+	switch (fmt->format) {
+	case FFPCM_16:
+		p->analyze = &peaks_int16;
+		p->scale = 1.0 / 0x8000;
+		break;
+	case FFPCM_24:
+		p->analyze = &peaks_int24_func;
+		p->scale = 1.0 / 0x800000;
+		break;
+	case FFPCM_32:
+		p->analyze = &peaks_int32;
+		p->scale = 1.0 / 0x80000000U;
+		break;
+	case FFPCM_FLOAT:
+		p->analyze = &peaks_float;
+		p->scale = 1.0;
+		break;
+	default:
+		return -1;
+	}
+	p->ssize = ffpcm_size(fmt->format, 1);
+	p->ileaved = fmt->ileaved;
+	return 0;
+}
+
 static int sndmod_peaks_process(void *ctx, fmed_filt *d)
 {
 	sndmod_peaks *p = ctx;
-	size_t i, ich, samples;
+	size_t ich, samples;
 
 	switch (p->state) {
 	case 0:
-		d->audio.convfmt.ileaved = 0;
-		d->audio.convfmt.format = FFPCM_16LE;
+		// analyze audio in its native format if possible
+		switch (d->audio.convfmt.format) {
+		case FFPCM_16:
+		case FFPCM_24:
+		case FFPCM_32:
+		case FFPCM_FLOAT:
+			break;
+		default:
+			d->audio.convfmt.format = FFPCM_FLOAT;
+		}
 		p->state = 1;
 		return FMED_RMORE;
 
 	case 1:
-		if (d->audio.convfmt.ileaved
-			|| d->audio.convfmt.format != FFPCM_16LE) {
-			errlog(core, d->trk, "peaks", "input must be non-interleaved 16LE PCM");
+		if (0 != peaks_init(p, &d->audio.convfmt)) {
+			errlog(core, d->trk, "peaks", "unsupported input format: %s"
+				, ffpcm_fmtstr(d->audio.convfmt.format));
 			return FMED_RERR;
 		}
 		p->state = 2;
 		break;
 	}
 
-	samples = d->datalen / (sizeof(short) * p->nch);
+	samples = d->datalen / (p->ssize * p->nch);
 	p->total += samples;
 
 	for (ich = 0;  ich != p->nch;  ich++) {
-		for (i = 0;  i != samples;  i++) {
-			int sh = ((short**)d->datani)[ich][i];
-
-			if (sh == 0x7fff || sh == -0x8000)
-				p->ch[ich].clipped++;
-
-			if (sh < 0)
-				sh = -sh;
-
-			if (p->ch[ich].high < (uint)sh)
-				p->ch[ich].high = sh;
-
-			p->ch[ich].sum += sh;
+		const char *data;
+		size_t stride;
+		if (p->ileaved) {
+			data = d->data + ich * p->ssize;
+			stride = p->ssize * p->nch;
+		} else {
+			data = d->datani[ich];
+			stride = p->ssize;
 		}
 
+		p->analyze(&p->ch[ich], data, samples, stride / p->ssize);
+
 		if (p->do_crc)
-			p->ch[ich].crc = crc32(d->datani[ich], d->datalen / p->nch, p->ch[ich].crc);
+			peaks_crc(&p->ch[ich], data, samples, p->ssize, stride);
 	}
 
 	d->out = d->data;
@@ -108,13 +242,16 @@ static int sndmod_peaks_process(void *ctx, fmed_filt *d)
 
 		if (p->total != 0) {
 			for (ich = 0;  ich != p->nch;  ich++) {
-
-				double hi = ffpcm_gain2db(_ffpcm_16le_flt(p->ch[ich].high));
-				double avg = ffpcm_gain2db(_ffpcm_16le_flt(p->ch[ich].sum / p->total));
-				ffstr_catfmt(&buf, "Channel #%L: highest peak:%.2FdB, avg peak:%.2FdB.  Clipped: %U (%.4F%%).  CRC:%08xu" FF_NEWLN
+				const struct peaks_ch *c = &p->ch[ich];
+				double hi = ffpcm_gain2db(c->high * p->scale);
+				double avg = ffpcm_gain2db(c->sum / p->total * p->scale);
+				double rms = ffpcm_gain2db(sqrt(c->sum_sq / p->total) * p->scale);
+				double dc = c->sum_dc / p->total * p->scale * 100;
+				ffstr_catfmt(&buf, "Channel #%L: highest peak:%.2FdB, avg peak:%.2FdB.  Clipped: %U (%.4F%%).  CRC:%08xu  RMS:%.2FdB  DC offset:%.4F%%" FF_NEWLN
 					, ich + 1, hi, avg
-					, p->ch[ich].clipped, ((double)p->ch[ich].clipped * 100 / p->total)
-					, p->ch[ich].crc);
+					, c->clipped, ((double)c->clipped * 100 / p->total)
+					, c->crc
+					, rms, dc);
 			}
 		}
 
@@ -0,0 +1,566 @@
+/** Built-in sample rate converter: polyphase FIR resampler.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+Output sample is a dot product of the last input samples and one phase of the filter bank.
+Filter bank is a Kaiser-windowed sinc function sampled at 'nphases' fractional offsets.
+Phase and input position are tracked with integer arithmetic (in_rate/out_rate reduced by GCD),
+ so there's no drift;  if the reduced output rate is larger than RS_MAXPHASES, the nearest phase is used.
+Filter banks are shared by all tracks with the same rate ratio and quality.
+All buffers are allocated when the filter is initialized.
+*/
+
+#include <fmedia.h>
+#include <FF/list.h>
+
+
+extern const fmed_core *core;
+
+#undef dbglog
+#undef errlog
+#define dbglog(trk, ...)  fmed_dbglog(core, trk, "resample", __VA_ARGS__)
+#define errlog(trk, ...)  fmed_errlog(core, trk, "resample", __VA_ARGS__)
+
+//RESAMPLER
+static void* rs_open(fmed_filt *d);
+static int rs_process(void *ctx, fmed_filt *d);
+static void rs_close(void *ctx);
+static ssize_t rs_cmd(void *ctx, uint cmd, ...);
+const struct fmed_filter2 sndmod_resample = {
+	&rs_open, &rs_process, &rs_close, &rs_cmd
+};
+
+enum {
+	RS_MAXPHASES = 1024,
+	RS_BLOCK = 4096, // max. input samples processed at once
+	RS_MAXCHAN = 8,
+};
+
+#define RS_PI  3.14159265358979323846
+
+struct rs_quality {
+	const char *name;
+	uint zc; // zero crossings on each side
+	double cutoff; // passband edge relative to Nyquist frequency
+	double beta; // Kaiser window parameter
+};
+
+enum RS_Q {
+	RS_Q_QUICK,
+	RS_Q_MEDIUM,
+	RS_Q_HIGH,
+};
+
+static const struct rs_quality rs_qualities[] = {
+	{ "quick", 8, 0.85, 6 },
+	{ "medium", 16, 0.91, 8 },
+	{ "high", 32, 0.95, 10 },
+};
+
+struct rs_conf_t {
+	uint quality; // enum RS_Q
+};
+static struct rs_conf_t rs_conf = {
+	RS_Q_MEDIUM, // mod_conf may be absent
+};
+
+static int rs_conf_quality(ffparser_schem *p, void *obj, ffstr *val)
+{
+	for (uint i = 0;  i != FFCNT(rs_qualities);  i++) {
+		if (ffstr_eqz(val, rs_qualities[i].name)) {
+			rs_conf.quality = i;
+			return 0;
+		}
+	}
+	return FFPARS_EBADVAL;
+}
+
+static const ffpars_arg rs_conf_args[] = {
+	{ "quality",	FFPARS_TSTR | FFPARS_FNOTEMPTY, FFPARS_DST(&rs_conf_quality) },
+};
+
+int sndmod_resample_conf(ffpars_ctx *ctx)
+{
+	rs_conf.quality = RS_Q_MEDIUM;
+	ffpars_setargs(ctx, &rs_conf, rs_conf_args, FFCNT(rs_conf_args));
+	return 0;
+}
+
+
+/** Filter bank for a rate ratio. */
+struct rs_bank {
+	fflist_item sib;
+	uint L, M; // output and input rates reduced by GCD
+	uint quality;
+	uint nphases;
+	uint taps; // per phase;  multiple of 8
+	float *coeffs; // float[nphases][taps]
+};
+
+static struct {
+	fflock lk;
+	fflist banks; //struct rs_bank[]
+	uint init :1;
+} rs_cache;
+
+static uint rs_gcd(uint a, uint b)
+{
+	while (b != 0) {
+		uint t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/** Modified Bessel function of the first kind, order 0. */
+static double rs_bessel_i0(double x)
+{
+	double sum = 1, term = 1, x2 = x * x / 4;
+	for (uint k = 1;  k != 50;  k++) {
+		term *= x2 / ((double)k * k);
+		sum += term;
+		if (term < sum * 1e-12)
+			break;
+	}
+	return sum;
+}
+
+/** Compute filter coefficients.
+Phase 'p' corresponds to output position 'p/nphases' between input samples [taps/2-1] and [taps/2]. */
+static int rs_bank_init(struct rs_bank *b)
+{
+	const struct rs_quality *q = &rs_qualities[b->quality];
+	double scale = ffmin(1.0, (double)b->L / b->M); // cutoff is lowered when downsampling
+	double fc = 0.5 * q->cutoff * scale; // cycles per input sample
+	uint half = (uint)ceil(q->zc / scale);
+	b->taps = (half * 2 + 7) & ~7U;
+	half = b->taps / 2;
+	b->nphases = ffmin(b->L, RS_MAXPHASES);
+
+	if (NULL == (b->coeffs = ffmem_allocT(b->nphases * b->taps, float)))
+		return -1;
+
+	double i0beta = rs_bessel_i0(q->beta);
+	for (uint p = 0;  p != b->nphases;  p++) {
+		float *h = &b->coeffs[p * b->taps];
+		double sum = 0;
+		for (uint k = 0;  k != b->taps;  k++) {
+			double x = (double)p / b->nphases + half - 1 - k; // distance from the output position
+			double r = x / half;
+			double v = 0;
+			if (r > -1 && r < 1) {
+				double w = rs_bessel_i0(q->beta * sqrt(1 - r * r)) / i0beta;
+				double t = 2 * fc * x;
+				v = 2 * fc * w * ((t == 0) ? 1 : sin(RS_PI * t) / (RS_PI * t));
+			}
+			h[k] = v;
+			sum += v;
+		}
+
+		// unity gain for DC
+		for (uint k = 0;  k != b->taps;  k++) {
+			h[k] /= sum;
+		}
+	}
+	return 0;
+}
+
+/** Get a cached filter bank or create a new one. */
+static const struct rs_bank* rs_bank_get(uint L, uint M, uint quality)
+{
+	struct rs_bank *b;
+	fflk_lock(&rs_cache.lk);
+	if (!rs_cache.init) {
+		fflist_init(&rs_cache.banks);
+		rs_cache.init = 1;
+	}
+
+	FFLIST_WALK(&rs_cache.banks, b, sib) {
+		if (b->L == L && b->M == M && b->quality == quality)
+			goto end;
+	}
+
+	if (NULL == (b = ffmem_new(struct rs_bank)))
+		goto end;
+	b->L = L;
+	b->M = M;
+	b->quality = quality;
+	if (0 != rs_bank_init(b)) {
+		ffmem_free0(b);
+		goto end;
+	}
+	fflist_ins(&rs_cache.banks, &b->sib);
+
+end:
+	fflk_unlock(&rs_cache.lk);
+	return b;
+}
+
+/** Free all filter banks.  Called when the module is destroyed, after all tracks are closed. */
+void resample_cache_free(void)
+{
+	struct rs_bank *b;
+	fflist_item *next;
+	fflk_lock(&rs_cache.lk);
+	if (rs_cache.init) {
+		FFLIST_WALKSAFE(&rs_cache.banks, b, sib, next) {
+			ffmem_free(b->coeffs);
+			ffmem_free(b);
+		}
+		fflist_init(&rs_cache.banks);
+	}
+	fflk_unlock(&rs_cache.lk);
+}
+
+
+/* Sample loaders and storers convert between the native format and float.
+They are simple loops that the compiler is able to vectorize. */
+
+typedef void (*rs_load_t)(float *dst, const char *src, size_t n, size_t step);
+typedef void (*rs_store_t)(char *dst, const float *src, size_t n, size_t step);
+
+static FFINL int rs_int24(const char *p)
+{
+	const byte *b = (byte*)p;
+	return (int)((uint)b[0] | ((uint)b[1] << 8) | ((uint)b[2] << 16) | ((b[2] & 0x80) ? 0xff000000 : 0));
+}
+
+static void rs_load16(float *dst, const char *src, size_t n, size_t step)
+{
+	const short *s = (void*)src;
+	for (size_t i = 0;  i != n;  i++) {
+		dst[i] = s[i * step] * (1.0f / 0x8000);
+	}
+}
+
+static void rs_load24(float *dst, const char *src, size_t n, size_t step)
+{
+	for (size_t i = 0;  i != n;  i++) {
+		dst[i] = rs_int24(src + i * step * 3) * (1.0f / 0x800000);
+	}
+}
+
+static void rs_load32(float *dst, const char *src, size_t n, size_t step)
+{
+	const int *s = (void*)src;
+	for (size_t i = 0;  i != n;  i++) {
+		dst[i] = s[i * step] * (1.0f / 0x80000000U);
+	}
+}
+
+static void rs_loadf(float *dst, const char *src, size_t n, size_t step)
+{
+	const float *s = (void*)src;
+	for (size_t i = 0;  i != n;  i++) {
+		dst[i] = s[i * step];
+	}
+}
+
+static FFINL float rs_clip(float f, float lo, float hi)
+{
+	f = (f < lo) ? lo : f;
+	return (f > hi) ? hi : f;
+}
+
+static void rs_store16(char *dst, const float *src, size_t n, size_t step)
+{
+	short *d = (void*)dst;
+	for (size_t i = 0;  i != n;  i++) {
+		d[i * step] = (short)lrintf(rs_clip(src[i] * 0x8000, -0x8000, 0x7fff));
+	}
+}
+
+static void rs_store24(char *dst, const float *src, size_t n, size_t step)
+{
+	for (size_t i = 0;  i != n;  i++) {
+		int v = (int)lrintf(rs_clip(src[i] * 0x800000, -0x800000, 0x7fffff));
+		byte *d = (byte*)dst + i * step * 3;
+		d[0] = (byte)v;
+		d[1] = (byte)(v >> 8);
+		d[2] = (byte)(v >> 16);
+	}
+}
+
+static void rs_store32(char *dst, const float *src, size_t n, size_t step)
+{
+	int *d = (void*)dst;
+	for (size_t i = 0;  i != n;  i++) {
+		double v = (double)src[i] * 0x80000000U;
+		v = (v < -2147483648.0) ? -2147483648.0 : v;
+		v = (v > 2147483647.0) ? 2147483647.0 : v;
+		d[i * step] = (int)lrint(v);
+	}
+}
+
+static void rs_storef(char *dst, const float *src, size_t n, size_t step)
+{
+	float *d = (void*)dst;
+	for (size_t i = 0;  i != n;  i++) {
+		d[i * step] = src[i];
+	}
+}
+
+/** Get the functions for a sample format. */
+static int rs_fmt_funcs(uint format, rs_load_t *load, rs_store_t *store)
+{
+	switch (format) {
+	case FFPCM_16:
+		*load = &rs_load16,  *store = &rs_store16;  break;
+	case FFPCM_24:
+		*load = &rs_load24,  *store = &rs_store24;  break;
+	case FFPCM_32:
+		*load = &rs_load32,  *store = &rs_store32;  break;
+	case FFPCM_FLOAT:
+		*load = &rs_loadf,  *store = &rs_storef;  break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+/** Dot product.
+8 independent sums let the compiler use SIMD registers without reordering float additions.
+'n' is a multiple of 8. */
+static FFINL float rs_dot(const float *h, const float *x, uint n)
+{
+	float s[8] = {};
+	for (uint i = 0;  i != n;  i += 8) {
+		for (uint k = 0;  k != 8;  k++) {
+			s[k] += h[i + k] * x[i + k];
+		}
+	}
+	return ((s[0] + s[4]) + (s[1] + s[5])) + ((s[2] + s[6]) + (s[3] + s[7]));
+}
+
+
+typedef struct resample {
+	uint state;
+	ffpcmex inpcm, outpcm;
+	const struct rs_bank *bank;
+	rs_load_t load;
+	rs_store_t store;
+	uint in_ssize, out_ssize; // bytes per 1 sample of 1 channel
+
+	// input history: float[nch][hist_cap]
+	float *hist;
+	uint hist_cap;
+	uint avail; // samples in history
+	uint ipos; // history index of the current input sample
+	uint frac; // position between input samples: [0..L)
+	uint end; // history index after the last input sample (when flushing)
+
+	float *fout; // float[out_cap]
+	ffarr buf; // output data
+	uint out_cap; // samples
+	uint off; // input offset (bytes per channel)
+	uint flushing :1;
+} resample;
+
+static void* rs_open(fmed_filt *d)
+{
+	resample *c = ffmem_new(resample);
+	if (c == NULL)
+		return NULL;
+	return c;
+}
+
+static void rs_close(void *ctx)
+{
+	resample *c = ctx;
+	ffmem_free(c->hist);
+	ffmem_free(c->fout);
+	ffarr_free(&c->buf);
+	ffmem_free(c);
+}
+
+static ssize_t rs_cmd(void *ctx, uint cmd, ...)
+{
+	resample *c = ctx;
+	va_list va;
+	va_start(va, cmd);
+	ssize_t r = -1;
+
+	switch (cmd) {
+	case 0: {
+		const struct fmed_aconv *conf = va_arg(va, void*);
+		c->inpcm = conf->in;
+		c->outpcm = conf->out;
+		c->state = 1;
+		r = 0;
+		break;
+	}
+	}
+
+	va_end(va);
+	return r;
+}
+
+static int rs_init(resample *c, fmed_filt *d)
+{
+	rs_store_t st;
+	rs_load_t ld;
+	uint nch = c->inpcm.channels;
+
+	if (nch != (c->outpcm.channels & FFPCM_CHMASK) || nch > RS_MAXCHAN
+		|| 0 != rs_fmt_funcs(c->inpcm.format, &c->load, &st)
+		|| 0 != rs_fmt_funcs(c->outpcm.format, &ld, &c->store)) {
+		errlog(d->trk, "unsupported PCM conversion: %s/%u/%u -> %s/%u/%u"
+			, ffpcm_fmtstr(c->inpcm.format), c->inpcm.channels, c->inpcm.sample_rate
+			, ffpcm_fmtstr(c->outpcm.format), c->outpcm.channels & FFPCM_CHMASK, c->outpcm.sample_rate);
+		return FMED_RERR;
+	}
+
+	uint g = rs_gcd(c->outpcm.sample_rate, c->inpcm.sample_rate);
+	if (NULL == (c->bank = rs_bank_get(c->outpcm.sample_rate / g, c->inpcm.sample_rate / g, rs_conf.quality)))
+		return FMED_RSYSERR;
+
+	const struct rs_bank *b = c->bank;
+	c->in_ssize = ffpcm_size(c->inpcm.format, 1);
+	c->out_ssize = ffpcm_size(c->outpcm.format, 1);
+	c->hist_cap = RS_BLOCK + b->taps;
+	c->out_cap = (uint)(((uint64)(RS_BLOCK + b->taps) * b->L + b->M - 1) / b->M) + 1;
+
+	if (NULL == (c->hist = ffmem_callocT(nch * c->hist_cap, float))
+		|| NULL == (c->fout = ffmem_allocT(c->out_cap, float)))
+		return FMED_RSYSERR;
+
+	size_t cap = c->out_cap * c->out_ssize * nch;
+	if (!c->outpcm.ileaved) {
+		if (NULL == ffarr_alloc(&c->buf, sizeof(void*) * nch + cap))
+			return FMED_RSYSERR;
+		ffarrp_setbuf((void**)c->buf.ptr, nch, c->buf.ptr + sizeof(void*) * nch, cap / nch);
+	} else {
+		if (NULL == ffarr_alloc(&c->buf, cap))
+			return FMED_RSYSERR;
+	}
+
+	// the first output sample is aligned to the first input sample
+	c->ipos = b->taps / 2 - 1;
+	c->avail = c->ipos;
+
+	dbglog(d->trk, "%s/%u/%u/%s -> %s/%u/%u/%s  ratio:%u/%u  phases:%u  taps:%u  quality:%s"
+		, ffpcm_fmtstr(c->inpcm.format), nch, c->inpcm.sample_rate, (c->inpcm.ileaved) ? "i" : "ni"
+		, ffpcm_fmtstr(c->outpcm.format), nch, c->outpcm.sample_rate, (c->outpcm.ileaved) ? "i" : "ni"
+		, b->L, b->M, b->nphases, b->taps, rs_qualities[b->quality].name);
+	return 0;
+}
+
+/** Compute output samples for 1 channel.
+Return the number of output samples. */
+static uint rs_filter(resample *c, const float *x, float *out, uint *ipos, uint *frac)
+{
+	const struct rs_bank *b = c->bank;
+	uint half = b->taps / 2;
+	uint i = *ipos, f = *frac, n = 0;
+	uint lim = (c->flushing) ? c->end : c->avail - half;
+
+	while (i < lim && n != c->out_cap) {
+		uint p = (b->nphases == b->L) ? f : (uint)((uint64)f * b->nphases / b->L);
+		out[n++] = rs_dot(&b->coeffs[p * b->taps], &x[i + 1 - half], b->taps);
+		f += b->M;
+		i += f / b->L;
+		f %= b->L;
+	}
+
+	*ipos = i;
+	*frac = f;
+	return n;
+}
+
+static int rs_process(void *ctx, fmed_filt *d)
+{
+	resample *c = ctx;
+	uint nch = c->inpcm.channels, i, n = 0;
+	int r;
+
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	switch (c->state) {
+	case 0:
+		return FMED_RERR; // settings are empty
+	case 1:
+		if (0 != (r = rs_init(c, d)))
+			return r;
+		c->state = 2;
+		break;
+	case 2:
+		break;
+	}
+
+	if (d->flags & FMED_FFWD)
+		c->off = 0;
+
+	uint half = c->bank->taps / 2;
+
+	// copy input samples to history
+	size_t samples = d->datalen / (c->in_ssize * nch);
+	samples = ffmin(samples, c->hist_cap - c->avail);
+	for (i = 0;  i != nch;  i++) {
+		const char *src;
+		size_t step = 1;
+		if (c->inpcm.ileaved) {
+			src = d->data + c->off * nch + i * c->in_ssize;
+			step = nch;
+		} else {
+			src = (char*)d->datani[i] + c->off;
+		}
+		c->load(&c->hist[i * c->hist_cap + c->avail], src, samples, step);
+	}
+	c->off += samples * c->in_ssize;
+	c->avail += samples;
+	d->datalen -= samples * c->in_ssize * nch;
+
+	if (d->datalen == 0 && (d->flags & FMED_FLAST) && !c->flushing
+		&& c->hist_cap - c->avail >= half) {
+		// pad with silence to get the last samples
+		c->end = c->avail;
+		for (i = 0;  i != nch;  i++) {
+			ffmem_zero(&c->hist[i * c->hist_cap + c->avail], half * sizeof(float));
+		}
+		c->avail += half;
+		c->flushing = 1;
+	}
+
+	if (c->avail >= c->bank->taps || c->flushing) {
+		uint ipos, frac;
+		for (i = 0;  i != nch;  i++) {
+			ipos = c->ipos,  frac = c->frac;
+			n = rs_filter(c, &c->hist[i * c->hist_cap], c->fout, &ipos, &frac);
+			if (c->outpcm.ileaved)
+				c->store(c->buf.ptr + i * c->out_ssize, c->fout, n, nch);
+			else
+				c->store(((char**)c->buf.ptr)[i], c->fout, n, 1);
+		}
+		c->frac = frac;
+
+		// keep the samples needed for the next output
+		uint keep = ffmin(ipos + 1 - half, c->avail);
+		for (i = 0;  i != nch;  i++) {
+			float *h = &c->hist[i * c->hist_cap];
+			ffmem_move(h, h + keep, (c->avail - keep) * sizeof(float));
+		}
+		c->ipos = ipos - keep;
+		c->avail -= keep;
+		if (c->flushing)
+			c->end -= ffmin(keep, c->end);
+	}
+
+	if (n == 0) {
+		if (c->flushing && c->ipos >= c->end) {
+			d->outlen = 0;
+			return FMED_RDONE;
+		}
+		if (d->datalen == 0 && !(d->flags & FMED_FLAST))
+			return FMED_RMORE;
+		d->outlen = 0;
+		return FMED_RDATA;
+	}
+
+	d->out = c->buf.ptr;
+	d->outlen = n * c->out_ssize * nch;
+	return FMED_RDATA;
+}
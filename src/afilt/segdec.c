@@ -0,0 +1,558 @@
+/** Segmented decoding: decode parts of one file on several workers in parallel.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+main track:      #queue.track -> segdec -> ... -> OUTPUT
+                                   ^
+segment tracks:  #file.in -> INPUT -> DECODER -> segsink   (segments #cur..#cur+N-1)
+
+The main track starts the track for the first segment.
+When the first segment's data arrives, the file length and audio format are known:
+ segdec gets the audio properties and meta data, and the tracks for the next segments are started.
+Each segment track seeks to (segment start - pre-roll), decodes the data and stores it
+ within the segment's boundaries.
+segdec returns the data of the current segment in order;
+ when the whole segment is returned, its slot is used for the next segment.
+Segment tracks are created and closed on the main thread;  the data is exchanged under the lock.
+
+Memory: the decoded data stored in all slots is limited by 'max_buffer'.
+When the limit is reached, a segment track is suspended (segsink returns FMED_RASYNC with its input kept)
+ until segdec returns some data to the next filter.
+The track of the current segment is suspended only while its slot has data for segdec to return,
+ so the total is max_buffer plus one data block at most.
+
+If the decoder doesn't know the total length (e.g. a file without an index, or a stream),
+ the segments' boundaries can't be computed: the whole file is decoded by one segment track,
+ i.e. there's no parallel decoding.
+*/
+
+#include <fmedia.h>
+#include <FF/audio/pcm.h>
+#include <FF/list.h>
+
+
+extern const fmed_core *core;
+
+#undef dbglog
+#undef errlog
+#define dbglog(trk, ...)  fmed_dbglog(core, trk, "segdec", __VA_ARGS__)
+#define errlog(trk, ...)  fmed_errlog(core, trk, "segdec", __VA_ARGS__)
+
+enum {
+	SEG_PREROLL_MSEC = 500,
+	SEG_MAXCHAN = 8,
+};
+
+struct segdec_conf_t {
+	byte threads;
+	uint segment; // seconds
+	size_t max_buffer;
+};
+static struct segdec_conf_t segdec_conf = { 0, 60, 64 * 1024 * 1024 };
+
+static const ffpars_arg segdec_conf_args[] = {
+	{ "threads",	FFPARS_TINT | FFPARS_F8BIT,  FFPARS_DSTOFF(struct segdec_conf_t, threads) },
+	{ "segment",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct segdec_conf_t, segment) },
+	{ "max_buffer",	FFPARS_TSIZE | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct segdec_conf_t, max_buffer) },
+};
+
+int sndmod_segdec_conf(ffpars_ctx *ctx)
+{
+	ffpars_setargs(ctx, &segdec_conf, segdec_conf_args, FFCNT(segdec_conf_args));
+	return 0;
+}
+
+
+struct segblk {
+	fflist_item sib;
+	uint64 pos; // samples
+	size_t len; // bytes (all channels)
+	void *chan[SEG_MAXCHAN]; // non-interleaved data
+	char data[0];
+};
+
+struct seg {
+	struct segdec *sd;
+	uint64 index;
+	uint64 start, end; // samples
+	uint64 pos; // the next sample to store
+	void *trk;
+	fflist blocks; // struct segblk[]
+	uint used :1; // assigned to a segment which isn't returned yet
+	uint running :1; // segment track exists
+	uint done :1; // all data is stored
+	uint err :1;
+	uint paused :1; // segment track waits until the stored data is returned
+};
+
+typedef struct segdec {
+	fflock lk;
+	uint refs; // main track + segment tracks
+	const fmed_track *track;
+	void *trk;
+	char *fn;
+	fftask tsk;
+	uint tsk_posted :1;
+	uint closed :1; // main track is closed
+	uint waiting :1; // main track waits for data
+	uint info :1; // audio properties are received from the first segment
+	uint info_set :1;
+	uint state;
+
+	ffpcmex fmt;
+	uint sampsize;
+	uint64 total; // samples;  0: unknown
+	uint64 seg_samples;
+	const char *decoder;
+	uint bitrate;
+
+	uint64 nseg;
+	uint64 cur; // segment being returned
+	uint64 next; // the next segment to start
+	struct seg *slots;
+	uint nslots;
+	struct segblk *outblk;
+	size_t buffered; // bytes stored in all slots
+} segdec;
+
+static void segdec_free(segdec *sd)
+{
+	for (uint i = 0;  i != sd->nslots;  i++) {
+		struct segblk *b;
+		fflist_item *next;
+		FFLIST_WALKSAFE(&sd->slots[i].blocks, b, sib, next) {
+			ffmem_free(b);
+		}
+	}
+	ffmem_safefree(sd->outblk);
+	ffmem_safefree(sd->slots);
+	ffmem_safefree(sd->fn);
+	ffmem_free(sd);
+}
+
+/** Wake the main track if it waits for the current segment.  Must be called under the lock. */
+static void segdec_wake(segdec *sd, struct seg *s)
+{
+	if (sd->waiting && !sd->closed && (s == NULL || s->index == sd->cur)) {
+		sd->waiting = 0;
+		sd->track->cmd(sd->trk, FMED_TRACK_WAKE);
+	}
+}
+
+/** Wake the suspended segment tracks if the stored data is below the limit.
+Must be called under the lock. */
+static void segdec_resume(segdec *sd)
+{
+	if (sd->buffered >= segdec_conf.max_buffer)
+		return;
+	for (uint i = 0;  i != sd->nslots;  i++) {
+		struct seg *s = &sd->slots[i];
+		if (s->paused) {
+			s->paused = 0;
+			sd->track->cmd(s->trk, FMED_TRACK_WAKE);
+		}
+	}
+}
+
+static void seg_start(void *param);
+
+/** Schedule starting of the next segments on the main thread.  Must be called under the lock. */
+static void segdec_post(segdec *sd)
+{
+	if (sd->tsk_posted || sd->closed)
+		return;
+	sd->tsk_posted = 1;
+	core->task(&sd->tsk, FMED_TASK_POST);
+}
+
+/** Create and start the track for a segment.  Thread: main. */
+static int seg_trk_start(segdec *sd, struct seg *s)
+{
+	void *trk;
+	fmed_trk *conf;
+	ssize_t f;
+
+	trk = sd->track->create(FMED_TRK_TYPE_SEGMENT, sd->fn);
+	if (trk == NULL || trk == FMED_TRK_EFMT)
+		return -1;
+	conf = sd->track->conf(trk);
+
+	uint64 start_ms = s->index * segdec_conf.segment * 1000;
+	if (start_ms > SEG_PREROLL_MSEC)
+		conf->audio.seek = start_ms - SEG_PREROLL_MSEC;
+
+	sd->track->setval(trk, "segdec_slot", (size_t)s);
+	s->trk = trk;
+
+	// segsink instance is created now so that its close() is called even if the track fails to start
+	if (0 == (f = sd->track->cmd(trk, FMED_TRACK_FILT_ADDLAST, "#soundmod.segsink"))) {
+		sd->track->cmd(trk, FMED_TRACK_XSTART); // the track will be freed after it's finished
+		return -1;
+	}
+	sd->track->cmd(trk, FMED_TRACK_FILT_INSTANCE, (void*)f);
+
+	dbglog(sd->trk, "segment #%U: starting track at %Ums", s->index, start_ms);
+	sd->track->cmd(trk, FMED_TRACK_XSTART);
+	return 0;
+}
+
+/** Start tracks for the next segments while there are free slots.  Thread: main. */
+static void seg_start(void *param)
+{
+	segdec *sd = param;
+
+	fflk_lock(&sd->lk);
+	sd->tsk_posted = 0;
+
+	while (!sd->closed
+		&& sd->next < sd->nseg
+		&& sd->next < sd->cur + sd->nslots
+		&& (sd->info || sd->next == 0)) {
+
+		struct seg *s = &sd->slots[sd->next % sd->nslots];
+		if (s->used || s->running)
+			break;
+
+		s->index = sd->next++;
+		s->start = s->index * sd->seg_samples;
+		s->end = (sd->info) ? ffmin(s->start + sd->seg_samples, sd->total) : (uint64)-1;
+		s->pos = s->start;
+		s->used = 1;
+		s->running = 1;
+		s->done = 0;
+		s->err = 0;
+		s->paused = 0;
+		sd->refs++;
+		fflk_unlock(&sd->lk);
+
+		int r = seg_trk_start(sd, s);
+
+		fflk_lock(&sd->lk);
+		if (r != 0) {
+			// segsink instance wasn't created
+			s->running = 0;
+			s->trk = NULL;
+			s->err = 1;
+			sd->refs--;
+			segdec_wake(sd, s);
+			break;
+		}
+	}
+
+	fflk_unlock(&sd->lk);
+}
+
+
+//SEGMENTED DECODER
+static void* segdec_open(fmed_filt *d)
+{
+	segdec *sd;
+	const char *fn;
+
+	if (FMED_PNULL == (fn = d->track->getvalstr(d->trk, "input")))
+		return NULL;
+
+	if (NULL == (sd = ffmem_new(segdec)))
+		return NULL;
+	fflk_init(&sd->lk);
+	sd->refs = 1;
+	sd->track = d->track;
+	sd->trk = d->trk;
+	sd->nseg = (uint64)-1;
+	fftask_set(&sd->tsk, &seg_start, sd);
+
+	sd->nslots = segdec_conf.threads;
+	if (sd->nslots == 0) {
+		ffsysconf sc;
+		ffsc_init(&sc);
+		sd->nslots = ffsc_get(&sc, FFSYSCONF_NPROCESSORS_ONLN);
+	}
+	sd->nslots = ffmax(sd->nslots, 1);
+
+	if (NULL == (sd->fn = ffsz_alcopyz(fn))
+		|| NULL == (sd->slots = ffmem_callocT(sd->nslots, struct seg))) {
+		segdec_free(sd);
+		return NULL;
+	}
+	for (uint i = 0;  i != sd->nslots;  i++) {
+		sd->slots[i].sd = sd;
+		fflist_init(&sd->slots[i].blocks);
+	}
+
+	d->datatype = "pcm";
+	dbglog(d->trk, "decoding in %u-sec segments, %u tracks"
+		, segdec_conf.segment, sd->nslots);
+	return sd;
+}
+
+/** Thread: main. */
+static void segdec_close(void *ctx)
+{
+	segdec *sd = ctx;
+
+	fflk_lock(&sd->lk);
+	sd->closed = 1;
+	core->task(&sd->tsk, FMED_TASK_DEL);
+	for (uint i = 0;  i != sd->nslots;  i++) {
+		struct seg *s = &sd->slots[i];
+		if (s->running)
+			sd->track->cmd(s->trk, FMED_TRACK_STOP);
+	}
+	uint refs = --sd->refs;
+	fflk_unlock(&sd->lk);
+
+	if (refs == 0)
+		segdec_free(sd);
+}
+
+static int segdec_process(void *ctx, fmed_filt *d)
+{
+	segdec *sd = ctx;
+	struct seg *s;
+	fflist_item *it;
+
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RFIN;
+	}
+
+	fflk_lock(&sd->lk);
+
+	if (sd->state == 0) {
+		sd->state = 1;
+		segdec_post(sd);
+		sd->waiting = 1;
+		fflk_unlock(&sd->lk);
+		return FMED_RASYNC;
+	}
+
+	if (sd->outblk != NULL) {
+		sd->buffered -= sd->outblk->len;
+		ffmem_free0(sd->outblk);
+		segdec_resume(sd);
+	}
+
+	if (!sd->info) {
+		s = &sd->slots[0];
+		if (s->err)
+			goto err;
+		sd->waiting = 1;
+		fflk_unlock(&sd->lk);
+		return FMED_RASYNC;
+	}
+
+	if (!sd->info_set) {
+		sd->info_set = 1;
+		d->audio.fmt = sd->fmt;
+		if (sd->total != 0)
+			d->audio.total = sd->total;
+		d->audio.decoder = sd->decoder;
+		d->audio.bitrate = sd->bitrate;
+	}
+
+	for (;;) {
+		s = &sd->slots[sd->cur % sd->nslots];
+		if (s->err)
+			goto err;
+
+		if (!fflist_empty(&s->blocks)) {
+			it = fflist_first(&s->blocks);
+			struct segblk *b = FF_GETPTR(struct segblk, sib, it);
+			fflist_rm(&s->blocks, &b->sib);
+			sd->outblk = b;
+			fflk_unlock(&sd->lk);
+
+			d->audio.pos = b->pos;
+			d->out = (sd->fmt.ileaved) ? b->data : (void*)b->chan;
+			d->outlen = b->len;
+			return FMED_RDATA;
+		}
+
+		if (!s->done) {
+			sd->waiting = 1;
+			fflk_unlock(&sd->lk);
+			return FMED_RASYNC;
+		}
+
+		dbglog(d->trk, "segment #%U: done", s->index);
+		s->used = 0;
+		sd->cur++;
+		if (sd->cur == sd->nseg) {
+			fflk_unlock(&sd->lk);
+			d->outlen = 0;
+			return FMED_RDONE;
+		}
+		if (!s->running)
+			segdec_post(sd);
+		segdec_resume(sd); // the next segment may wait for its data to be returned
+	}
+
+err:
+	fflk_unlock(&sd->lk);
+	errlog(d->trk, "segment #%U: decoding failed", s->index);
+	return FMED_RERR;
+}
+
+const fmed_filter sndmod_segdec = {
+	&segdec_open, &segdec_process, &segdec_close
+};
+
+
+//SEGMENT SINK
+/* The context of segsink is the segment's slot. */
+
+/** Thread: main. */
+static void* segsink_open(fmed_filt *d)
+{
+	int64 ptr = d->track->getval(d->trk, "segdec_slot");
+	if (ptr == FMED_NULL)
+		return NULL;
+	return (void*)(size_t)ptr;
+}
+
+/** Thread: main. */
+static void segsink_close(void *ctx)
+{
+	struct seg *s = ctx;
+	segdec *sd = s->sd;
+
+	fflk_lock(&sd->lk);
+	s->running = 0;
+	s->paused = 0;
+	s->trk = NULL;
+	if (!s->done && !sd->closed) {
+		s->err = 1;
+		segdec_wake(sd, NULL);
+	}
+	uint refs = --sd->refs;
+	uint start = (!sd->closed && !s->used);
+	fflk_unlock(&sd->lk);
+
+	if (refs == 0)
+		segdec_free(sd);
+	else if (start)
+		seg_start(sd);
+}
+
+/** Get audio properties from the first segment and compute segments' boundaries.
+Must be called under the lock. */
+static void segsink_info(struct seg *s, fmed_filt *d)
+{
+	segdec *sd = s->sd;
+	sd->fmt = d->audio.fmt;
+	sd->sampsize = ffpcm_size1(&sd->fmt);
+	sd->total = ((int64)d->audio.total != FMED_NULL) ? d->audio.total : 0;
+	sd->decoder = d->audio.decoder;
+	sd->bitrate = d->audio.bitrate;
+	sd->seg_samples = (uint64)segdec_conf.segment * sd->fmt.sample_rate;
+
+	// the length is unknown: decode the whole file within this segment
+	sd->nseg = 1;
+	if (sd->total != 0)
+		sd->nseg = (sd->total + sd->seg_samples - 1) / sd->seg_samples;
+	else
+		dbglog(sd->trk, "total length is unknown: decoding in one track");
+	if (sd->nseg > 1)
+		s->end = ffmin(sd->seg_samples, sd->total);
+
+	d->track->cmd(sd->trk, FMED_TRACK_META_COPYFROM, d->trk);
+	sd->info = 1;
+	dbglog(sd->trk, "total: %U samples, %U segments", sd->total, sd->nseg);
+	segdec_post(sd);
+}
+
+/** Store audio data within segment boundaries. */
+static int segsink_store(struct seg *s, fmed_filt *d)
+{
+	segdec *sd = s->sd;
+	uint64 pos = d->audio.pos;
+	size_t n = d->datalen / sd->sampsize;
+
+	if (pos > s->pos) {
+		errlog(d->trk, "segment #%U: sample #%U is expected, got #%U"
+			, s->index, s->pos, pos);
+		return -1;
+	}
+
+	uint64 end = ffmin(pos + n, s->end);
+	if (end <= s->pos)
+		return 0;
+	size_t skip = s->pos - pos;
+	n = end - s->pos;
+
+	uint nch = sd->fmt.channels;
+	size_t len = n * sd->sampsize;
+	struct segblk *b;
+	if (NULL == (b = ffmem_alloc(sizeof(struct segblk) + len)))
+		return -1;
+	b->pos = s->pos;
+	b->len = len;
+
+	if (sd->fmt.ileaved) {
+		ffmemcpy(b->data, d->data + skip * sd->sampsize, len);
+	} else {
+		uint ss = sd->sampsize / nch;
+		for (uint c = 0;  c != nch;  c++) {
+			b->chan[c] = b->data + c * n * ss;
+			ffmemcpy(b->chan[c], (char*)d->datani[c] + skip * ss, n * ss);
+		}
+	}
+
+	fflist_ins(&s->blocks, &b->sib);
+	s->pos = end;
+	sd->buffered += len;
+	return 0;
+}
+
+static int segsink_process(void *ctx, fmed_filt *d)
+{
+	struct seg *s = ctx;
+	segdec *sd = s->sd;
+	int r = FMED_ROK;
+
+	fflk_lock(&sd->lk);
+
+	if (sd->closed || (d->flags & FMED_FSTOP)) {
+		r = FMED_RFIN;
+		goto end;
+	}
+
+	if (!sd->info) {
+		if (d->audio.fmt.channels > SEG_MAXCHAN) {
+			errlog(d->trk, "too many channels: %u", d->audio.fmt.channels);
+			r = FMED_RERR;
+			goto end;
+		}
+		segsink_info(s, d);
+	}
+
+	if (sd->buffered >= segdec_conf.max_buffer
+		&& !(s->index == sd->cur && fflist_empty(&s->blocks))) {
+		s->paused = 1;
+		r = FMED_RASYNC; // the input data is kept until we're woken up
+		goto end;
+	}
+
+	if (0 != segsink_store(s, d)) {
+		r = FMED_RERR;
+		goto end;
+	}
+	d->datalen = 0;
+
+	if (s->pos == s->end || (d->flags & FMED_FLAST)) {
+		if (s->pos != s->end && s->end != (uint64)-1)
+			dbglog(d->trk, "segment #%U: stream ended at sample #%U", s->index, s->pos);
+		s->done = 1;
+		r = FMED_RFIN;
+	}
+
+	segdec_wake(sd, s);
+
+end:
+	fflk_unlock(&sd->lk);
+	return r;
+}
+
+const fmed_filter sndmod_segsink = {
+	&segsink_open, &segsink_process, &segsink_close
+};
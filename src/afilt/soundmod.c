@@ -22,9 +22,10 @@ enum {
 static const void* sndmod_iface(const char *name);
 static int sndmod_sig(uint signo);
 static void sndmod_destroy(void);
+static int sndmod_conf(const char *name, ffpars_ctx *ctx);
 static const fmed_mod fmed_sndmod_mod = {
 	.ver = FMED_VER_FULL, .ver_core = FMED_VER_CORE,
-	&sndmod_iface, &sndmod_sig, &sndmod_destroy
+	&sndmod_iface, &sndmod_sig, &sndmod_destroy, &sndmod_conf
 };
 
 //GAIN
@@ -80,23 +81,43 @@ struct submod {
 
 extern const struct fmed_filter2 fmed_sndmod_conv;
 extern const fmed_filter fmed_sndmod_autoconv;
+extern const struct fmed_filter2 sndmod_resample;
+extern const struct fmed_filter2 sndmod_dither;
 extern const fmed_filter fmed_sndmod_split;
 extern const fmed_filter fmed_sndmod_peaks;
+extern const fmed_filter sndmod_loudness;
+extern const fmed_loudness_scan sndmod_loudness_scan;
 extern const fmed_filter sndmod_startlev;
 extern const fmed_filter sndmod_stoplev;
+extern const fmed_filter sndmod_segdec;
+extern const fmed_filter sndmod_segsink;
+extern const fmed_filter sndmod_join;
+extern const fmed_filter sndmod_joinsink;
+extern const fmed_filter sndmod_tee;
+extern const fmed_filter sndmod_teesrc;
 
 static const struct submod submods[] = {
 	{ "conv", (fmed_filter*)&fmed_sndmod_conv },
 	{ "autoconv", &fmed_sndmod_autoconv },
+	{ "resample", (fmed_filter*)&sndmod_resample },
+	{ "dither", (fmed_filter*)&sndmod_dither },
 	{ "gain", &fmed_sndmod_gain },
 	{ "until", &fmed_sndmod_until },
 	{ "split", &fmed_sndmod_split },
 	{ "peaks", &fmed_sndmod_peaks },
+	{ "loudness", &sndmod_loudness },
+	{ "loudness-scan", (fmed_filter*)&sndmod_loudness_scan },
 	{ "rtpeak", &fmed_sndmod_rtpeak },
 	{ "silgen", &sndmod_silgen },
 	{ "startlevel", &sndmod_startlev },
 	{ "stoplevel", &sndmod_stoplev },
 	{ "membuf", &sndmod_membuf },
+	{ "segdec", &sndmod_segdec },
+	{ "segsink", &sndmod_segsink },
+	{ "join", &sndmod_join },
+	{ "joinsink", &sndmod_joinsink },
+	{ "tee", &sndmod_tee },
+	{ "teesrc", &sndmod_teesrc },
 };
 
 static const void* sndmod_iface(const char *name)
@@ -109,13 +130,40 @@ static const void* sndmod_iface(const char *name)
 	return NULL;
 }
 
+extern void loudness_albums_print(void);
+extern void resample_cache_free(void);
+
 static int sndmod_sig(uint signo)
 {
+	switch (signo) {
+	case FMED_STOP:
+		loudness_albums_print();
+		break;
+	}
 	return 0;
 }
 
 static void sndmod_destroy(void)
 {
+	resample_cache_free();
+}
+
+extern int sndmod_conv_conf(ffpars_ctx *ctx);
+extern int sndmod_resample_conf(ffpars_ctx *ctx);
+extern int sndmod_dither_conf(ffpars_ctx *ctx);
+extern int sndmod_segdec_conf(ffpars_ctx *ctx);
+
+static int sndmod_conf(const char *name, ffpars_ctx *ctx)
+{
+	if (ffsz_eq(name, "conv"))
+		return sndmod_conv_conf(ctx);
+	else if (ffsz_eq(name, "resample"))
+		return sndmod_resample_conf(ctx);
+	else if (ffsz_eq(name, "dither"))
+		return sndmod_dither_conf(ctx);
+	else if (ffsz_eq(name, "segdec"))
+		return sndmod_segdec_conf(ctx);
+	return 0;
 }
 
 
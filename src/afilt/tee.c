@@ -0,0 +1,491 @@
+/** Write the audio data to several outputs.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+main track:    ... -> DECODER -> ... -> #soundmod.gain -> tee -> (#soundmod.autoconv) -> ENCODER -> OUTPUT
+                                                           v
+branch tracks: teesrc -> #soundmod.autoconv -> ENCODER -> OUTPUT   (one track per additional --out)
+
+The main track writes the first output as usual.
+tee passes the data through and also copies each block into the queue shared with the branch tracks;
+ every branch track converts, encodes and writes the data for its output on any worker.
+A block is freed after all branches have returned it.
+When the queue is full (the slowest branch is behind), the main track waits until the branches take the data.
+After the last block is queued, the main track waits until all branches have returned the data,
+ so the branch tracks are still active when the main track is closed.
+A branch that fails doesn't stop the main track and the other branches.
+Branch tracks are created and closed on the main thread;  the data is exchanged under the lock.
+*/
+
+#include <fmedia.h>
+#include <FF/audio/pcm.h>
+#include <FF/path.h>
+
+
+extern const fmed_core *core;
+
+#undef dbglog
+#undef errlog
+#define dbglog(trk, ...)  fmed_dbglog(core, trk, "tee", __VA_ARGS__)
+#define errlog(trk, ...)  fmed_errlog(core, trk, "tee", __VA_ARGS__)
+
+enum {
+	TEE_MAXCHAN = 8,
+	TEE_BUFSIZE = 2 * 1024 * 1024, // max. amount of data queued for the slowest branch
+};
+
+struct teeblk {
+	uint64 pos; // samples
+	size_t len;
+	void *chan[TEE_MAXCHAN]; // non-interleaved data
+	char data[0];
+};
+
+struct teebr {
+	struct tee *t;
+	char *out; // output file name
+	const fmed_modinfo *mi; // encoder
+	void *trk;
+	uint64 next; // the next block to return
+	uint64 done; // blocks returned and not used anymore
+	uint active :1; // the branch track is being started or is running
+	uint running :1; // branch track exists
+	uint waiting :1; // branch track waits for data
+	uint fin :1; // all data is returned
+};
+
+typedef struct tee {
+	fflock lk;
+	uint refs; // main track + branch tracks
+	const fmed_track *track;
+	void *trk;
+	fftask tsk;
+	uint closed :1; // main track is closed
+	uint waiting :1; // main track waits until the branches take the data
+	uint eos :1; // the last block is queued
+	uint stored :1; // the current input data is queued
+
+	fmed_trk props; // properties for the branch tracks
+	char *input;
+	ffpcmex fmt;
+	uint sampsize;
+
+	ffarr blocks; // struct teeblk*[]
+	uint64 first; // index of blocks[0]
+	size_t queued; // bytes
+	struct teebr *br;
+	uint nbr;
+} tee;
+
+static void tee_free(tee *t)
+{
+	struct teeblk **pb;
+	FFARR_WALKT(&t->blocks, pb, struct teeblk*) {
+		ffmem_free(*pb);
+	}
+	ffarr_free(&t->blocks);
+	for (uint i = 0;  i != t->nbr;  i++) {
+		ffmem_free(t->br[i].out);
+	}
+	ffmem_safefree(t->br);
+	ffmem_safefree(t->input);
+	ffmem_free(t);
+}
+
+/** Free the blocks returned by all active branches.  Must be called under the lock. */
+static void tee_trim(tee *t)
+{
+	uint64 min = t->first + t->blocks.len;
+	for (uint i = 0;  i != t->nbr;  i++) {
+		if (t->br[i].active)
+			min = ffmin(min, t->br[i].done);
+	}
+
+	size_t n = min - t->first;
+	if (n == 0)
+		return;
+	for (size_t i = 0;  i != n;  i++) {
+		struct teeblk *b = *ffarr_itemT(&t->blocks, i, struct teeblk*);
+		t->queued -= b->len;
+		ffmem_free(b);
+	}
+	_ffarr_rmleft(&t->blocks, n, sizeof(struct teeblk*));
+	t->first = min;
+}
+
+/** Wake the main track if the branches have taken enough data.  Must be called under the lock. */
+static void tee_wake(tee *t)
+{
+	if (!t->waiting || t->closed)
+		return;
+	if ((t->eos) ? t->blocks.len != 0 : t->queued > TEE_BUFSIZE / 2)
+		return;
+	t->waiting = 0;
+	t->track->cmd(t->trk, FMED_TRACK_WAKE);
+}
+
+/** Wake the branch tracks waiting for data.  Must be called under the lock. */
+static void tee_wake_branches(tee *t)
+{
+	for (uint i = 0;  i != t->nbr;  i++) {
+		struct teebr *br = &t->br[i];
+		if (br->waiting) {
+			br->waiting = 0;
+			t->track->cmd(br->trk, FMED_TRACK_WAKE);
+		}
+	}
+}
+
+/** Get the output filter for the file name.
+@conf: output properties are set */
+static const char* tee_outfilter(const char *ofn, fmed_trk *conf)
+{
+	ffstr name, ext;
+	ffbool have_path = (NULL != ffpath_split2(ofn, ffsz_len(ofn), NULL, &name));
+	ffstr_rsplitby(&name, '.', &name, &ext);
+
+	conf->out_seekable = 0;
+	conf->out_stream = 0;
+	if (!have_path && ffstr_eqcz(&name, "@stdout"))
+		return "#file.stdout";
+	if (!have_path && ffstr_eqcz(&name, "@http")) {
+		conf->out_stream = 1;
+		return "net.httpsrv";
+	}
+	conf->out_seekable = 1;
+	return "#file.out";
+}
+
+/** Create and start the track for a branch.  Thread: main. */
+static int tee_trk_start(tee *t, struct teebr *br)
+{
+	void *trk;
+	fmed_trk *conf;
+	ssize_t f;
+
+	if (NULL == (trk = t->track->create(FMED_TRK_TYPE_NONE, NULL)))
+		return -1;
+	conf = t->track->conf(trk);
+	t->track->copy_info(conf, &t->props);
+	// the data is already trimmed by the main track
+	conf->audio.seek = FMED_NULL;
+	conf->audio.until = FMED_NULL;
+	conf->audio.split = FMED_NULL;
+	conf->audio.abs_seek = 0;
+	const char *ofilt = tee_outfilter(br->out, conf);
+
+	t->track->setvalstr(trk, "output", br->out);
+	if (t->input != NULL)
+		t->track->setvalstr(trk, "input", t->input);
+	t->track->setval(trk, "tee_branch", (size_t)br);
+	t->track->cmd(trk, FMED_TRACK_META_COPYFROM, t->trk);
+	br->trk = trk;
+
+	// teesrc instance is created now so that its close() is called even if the track fails to start
+	if (0 == (f = t->track->cmd(trk, FMED_TRACK_FILT_ADDLAST, "#soundmod.teesrc"))) {
+		t->track->cmd(trk, FMED_TRACK_XSTART); // the track will be freed after it's finished
+		return -1;
+	}
+	t->track->cmd(trk, FMED_TRACK_FILT_INSTANCE, (void*)f);
+
+	if (0 == t->track->cmd(trk, FMED_TRACK_FILT_ADDLAST, "#soundmod.autoconv")
+		|| 0 == t->track->cmd(trk, FMED_TRACK_FILT_ADDLAST, br->mi->name)
+		|| 0 == t->track->cmd(trk, FMED_TRACK_FILT_ADDLAST, ofilt))
+		t->track->setval(trk, "error", 1);
+
+	dbglog(t->trk, "output #%u: %s", (uint)(br - t->br) + 2, br->out);
+	t->track->cmd(trk, FMED_TRACK_XSTART);
+	return 0;
+}
+
+/** Start the branch tracks.  Thread: main. */
+static void tee_start(void *param)
+{
+	tee *t = param;
+
+	fflk_lock(&t->lk);
+	for (uint i = 0;  i != t->nbr && !t->closed;  i++) {
+		struct teebr *br = &t->br[i];
+		br->running = 1;
+		t->refs++;
+		fflk_unlock(&t->lk);
+
+		int r = tee_trk_start(t, br);
+
+		fflk_lock(&t->lk);
+		if (r != 0) {
+			// teesrc instance wasn't created
+			errlog(t->trk, "output #%u: %s: can't start the track", i + 2, br->out);
+			br->running = 0;
+			br->active = 0;
+			br->trk = NULL;
+			t->refs--;
+		}
+	}
+	tee_trim(t);
+	tee_wake(t);
+	fflk_unlock(&t->lk);
+}
+
+/** Split the list of output file names and find the encoder for each file. */
+static int tee_outputs(tee *t, const char *list)
+{
+	ffstr s, name, ext;
+	ffstr_setz(&s, list);
+	uint n = 1;
+	for (size_t i = 0;  i != s.len;  i++) {
+		if (s.ptr[i] == '\n')
+			n++;
+	}
+	if (NULL == (t->br = ffmem_callocT(n, struct teebr)))
+		return -1;
+
+	while (s.len != 0) {
+		ffstr_nextval3(&s, &name, '\n');
+		if (name.len == 0)
+			continue;
+
+		struct teebr *br = &t->br[t->nbr];
+		ffpath_splitname(name.ptr, name.len, NULL, &ext);
+		if (NULL == (br->mi = core->getmod2(FMED_MOD_OUTEXT, ext.ptr, ext.len))) {
+			errlog(t->trk, "no module can write to this file format: %S", &ext);
+			return -1;
+		}
+		if (NULL == (br->out = ffsz_alcopystr(&name)))
+			return -1;
+		br->t = t;
+		br->active = 1;
+		t->nbr++;
+	}
+	return (t->nbr != 0) ? 0 : -1;
+}
+
+
+//TEE
+static void* tee_open(fmed_filt *d)
+{
+	tee *t;
+	const char *list, *input;
+
+	if (FMED_PNULL == (list = d->track->getvalstr(d->trk, "output_tee")))
+		return FMED_FILT_SKIP;
+
+	if (d->stream_copy || !ffsz_eq(d->datatype, "pcm")) {
+		errlog(d->trk, "several outputs are supported for PCM input only");
+		return NULL;
+	}
+	if ((int64)d->audio.split != FMED_NULL) {
+		errlog(d->trk, "--split isn't supported with several outputs");
+		return NULL;
+	}
+	if (d->audio.fmt.channels > TEE_MAXCHAN) {
+		errlog(d->trk, "too many channels: %u", d->audio.fmt.channels);
+		return NULL;
+	}
+
+	if (NULL == (t = ffmem_new(tee)))
+		return NULL;
+	fflk_init(&t->lk);
+	t->refs = 1;
+	t->track = d->track;
+	t->trk = d->trk;
+	fftask_set(&t->tsk, &tee_start, t);
+
+	if (0 != tee_outputs(t, list))
+		goto err;
+	if (FMED_PNULL != (input = d->track->getvalstr(d->trk, "input"))
+		&& NULL == (t->input = ffsz_alcopyz(input)))
+		goto err;
+
+	t->fmt = d->audio.fmt;
+	t->sampsize = ffpcm_size1(&t->fmt);
+	d->track->copy_info(&t->props, d);
+
+	core->task(&t->tsk, FMED_TASK_POST);
+	dbglog(d->trk, "writing to %u additional outputs", t->nbr);
+	return t;
+
+err:
+	tee_free(t);
+	return NULL;
+}
+
+/** Thread: main. */
+static void tee_close(void *ctx)
+{
+	tee *t = ctx;
+
+	fflk_lock(&t->lk);
+	t->closed = 1;
+	core->task(&t->tsk, FMED_TASK_DEL);
+	for (uint i = 0;  i != t->nbr;  i++) {
+		struct teebr *br = &t->br[i];
+		if (br->running && !t->eos)
+			t->track->cmd(br->trk, FMED_TRACK_STOP);
+	}
+	uint refs = --t->refs;
+	fflk_unlock(&t->lk);
+
+	if (refs == 0)
+		tee_free(t);
+}
+
+/** Add a copy of the input data to the queue.  Must be called under the lock. */
+static int tee_store(tee *t, fmed_filt *d)
+{
+	size_t len = d->datalen;
+	uint nch = t->fmt.channels;
+	struct teeblk *b, **pb;
+	if (NULL == (pb = ffarr_pushgrowT(&t->blocks, 16, struct teeblk*))
+		|| NULL == (b = ffmem_alloc(sizeof(struct teeblk) + len))) {
+		if (pb != NULL)
+			t->blocks.len--;
+		return -1;
+	}
+	*pb = b;
+	b->pos = d->audio.pos;
+	b->len = len;
+
+	if (t->fmt.ileaved) {
+		ffmemcpy(b->data, d->data, len);
+	} else {
+		size_t n = len / t->sampsize;
+		uint ss = t->sampsize / nch;
+		for (uint c = 0;  c != nch;  c++) {
+			b->chan[c] = b->data + c * n * ss;
+			ffmemcpy(b->chan[c], d->datani[c], n * ss);
+		}
+	}
+
+	t->queued += len;
+	return 0;
+}
+
+static int tee_process(void *ctx, fmed_filt *d)
+{
+	tee *t = ctx;
+
+	fflk_lock(&t->lk);
+
+	if (!t->stored) {
+		if (!t->eos && t->queued > TEE_BUFSIZE) {
+			t->waiting = 1;
+			fflk_unlock(&t->lk);
+			return FMED_RASYNC;
+		}
+
+		if (d->datalen != 0 && 0 != tee_store(t, d)) {
+			fflk_unlock(&t->lk);
+			syserrlog(core, d->trk, "tee", "%s", ffmem_alloc_S);
+			return FMED_RERR;
+		}
+		if (d->flags & FMED_FLAST)
+			t->eos = 1;
+		t->stored = 1;
+		tee_trim(t); // free the data immediately if no branches are active
+		tee_wake_branches(t);
+	}
+
+	if (t->eos && t->blocks.len != 0) {
+		t->waiting = 1;
+		fflk_unlock(&t->lk);
+		return FMED_RASYNC;
+	}
+
+	t->stored = 0;
+	fflk_unlock(&t->lk);
+
+	d->out = d->data;
+	d->outlen = d->datalen;
+	d->datalen = 0;
+	if (d->flags & FMED_FLAST)
+		return FMED_RDONE;
+	return FMED_ROK;
+}
+
+const fmed_filter sndmod_tee = {
+	&tee_open, &tee_process, &tee_close
+};
+
+
+//TEE SOURCE
+/* The context of teesrc is the branch object. */
+
+/** Thread: main. */
+static void* teesrc_open(fmed_filt *d)
+{
+	int64 ptr = d->track->getval(d->trk, "tee_branch");
+	if (ptr == FMED_NULL)
+		return NULL;
+	d->datatype = "pcm";
+	return (void*)(size_t)ptr;
+}
+
+/** Thread: main. */
+static void teesrc_close(void *ctx)
+{
+	struct teebr *br = ctx;
+	tee *t = br->t;
+
+	fflk_lock(&t->lk);
+	if (!br->fin && (t->eos || !t->closed))
+		errlog(t->trk, "output #%u: %s: processing failed", (uint)(br - t->br) + 2, br->out);
+	br->running = 0;
+	br->active = 0;
+	br->waiting = 0;
+	br->trk = NULL;
+	tee_trim(t);
+	tee_wake(t);
+	uint refs = --t->refs;
+	fflk_unlock(&t->lk);
+
+	if (refs == 0)
+		tee_free(t);
+}
+
+static int teesrc_process(void *ctx, fmed_filt *d)
+{
+	struct teebr *br = ctx;
+	tee *t = br->t;
+
+	fflk_lock(&t->lk);
+
+	if ((d->flags & FMED_FSTOP) || (t->closed && !t->eos)) {
+		fflk_unlock(&t->lk);
+		d->outlen = 0;
+		return FMED_RFIN;
+	}
+
+	// the block returned previously isn't used anymore
+	if (br->done != br->next) {
+		br->done = br->next;
+		tee_trim(t);
+		tee_wake(t);
+	}
+
+	if (br->next != t->first + t->blocks.len) {
+		struct teeblk *b = *ffarr_itemT(&t->blocks, br->next - t->first, struct teeblk*);
+		br->next++;
+		fflk_unlock(&t->lk);
+
+		d->audio.pos = b->pos;
+		d->out = (t->fmt.ileaved) ? b->data : (void*)b->chan;
+		d->outlen = b->len;
+		return FMED_RDATA;
+	}
+
+	if (t->eos) {
+		br->fin = 1;
+		fflk_unlock(&t->lk);
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	br->waiting = 1;
+	fflk_unlock(&t->lk);
+	return FMED_RASYNC;
+}
+
+const fmed_filter sndmod_teesrc = {
+	&teesrc_open, &teesrc_process, &teesrc_close
+};
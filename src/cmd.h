@@ -45,6 +45,9 @@ typedef struct fmed_cmd {
 	byte volume;
 	byte pcm_peaks;
 	byte pcm_crc;
+	byte loudness;
+	byte loudness_tags;
+	char *loudness_report;
 	byte dynanorm;
 
 	float vorbis_qual;
@@ -66,10 +69,14 @@ typedef struct fmed_cmd {
 	byte cue_gaps;
 
 	ffstr outfn;
+	ffarr out_tee; // additional outputs: "OUT1\nOUT2..."
 	byte overwrite;
 	byte out_copy;
 	byte preserve_date;
 	byte parallel;
+	byte parallel_decode;
+	byte join;
+	byte edit_tags;
 
 	ffstr dummy;
 
@@ -96,11 +103,13 @@ static inline void cmd_destroy(fmed_cmd *cmd)
 
 	FFARR_FREE_ALL_PTR(&cmd->in_files, ffmem_free, char*);
 	ffstr_free(&cmd->outfn);
+	ffarr_free(&cmd->out_tee);
 
 	ffstr_free(&cmd->meta);
 	ffmem_safefree(cmd->aac_profile);
 	ffmem_safefree(cmd->trackno);
 	ffmem_safefree(cmd->conf_fn);
+	ffmem_safefree(cmd->loudness_report);
 
 	ffmem_safefree(cmd->globcmd_pipename);
 	ffstr_free(&cmd->globcmd);
@@ -42,6 +42,7 @@ static const ffpars_arg conf_args[] = {
 	{ "codepage",	FFPARS_TSTR, FFPARS_DST(&conf_codepage) },
 	{ "instance_mode",	FFPARS_TENUM | FFPARS_F8BIT, FFPARS_DST(&im_enum) },
 	{ "prevent_sleep",	FFPARS_TBOOL8, FFPARS_DSTOFF(fmed_config, prevent_sleep) },
+	{ "seek_index",	FFPARS_TBOOL8, FFPARS_DSTOFF(fmed_config, seek_index) },
 	{ "include",	FFPARS_TSTR | FFPARS_FNOTEMPTY, FFPARS_DST(&conf_include) },
 	{ "include_user",	FFPARS_TSTR | FFPARS_FNOTEMPTY, FFPARS_DST(&conf_include) },
 	{ "portable_conf",	FFPARS_TBOOL8, FFPARS_DST(&conf_portable) },
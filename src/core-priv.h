@@ -10,6 +10,7 @@ typedef struct fmed_config {
 	byte codepage;
 	byte instance_mode;
 	byte prevent_sleep;
+	byte seek_index;
 	byte workers;
 	ffpcm inp_pcm;
 	const fmed_modinfo *output;
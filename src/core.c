@@ -188,6 +188,7 @@ static int fmed_conf(const char *filename)
 	fmed->props.record_format = fmed->conf.inp_pcm;
 	fmed->props.record_format = fmed->conf.inp_pcm;
 	fmed->props.prevent_sleep = fmed->conf.prevent_sleep;
+	fmed->props.seek_index = fmed->conf.seek_index;
 
 	if (fn != filename)
 		ffmem_free0(fn);
@@ -1153,9 +1154,21 @@ static int xtask(int signo, fftask *task, uint wid)
 	return 0;
 }
 
+/** Get the worker running in the current thread (the main worker for other threads). */
+static struct worker* work_cur(void)
+{
+	struct worker *w;
+	ffthd_id id = ffthd_curid();
+	FFARR_WALKT(&fmed->workers, w, struct worker) {
+		if (w->init && w->id == id)
+			return w;
+	}
+	return (void*)fmed->workers.ptr;
+}
+
 static int core_timer(fftmrq_entry *tmr, int64 _interval, uint flags)
 {
-	struct worker *w = (void*)fmed->workers.ptr;
+	struct worker *w = work_cur();
 	int interval = _interval;
 	uint period = ffmin((uint)ffabs(interval), TMR_INT);
 	dbglog(core, NULL, "core", "timer:%p  interval:%d  handler:%p  param:%p"
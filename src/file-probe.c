@@ -0,0 +1,301 @@
+/** Detect the format of input data.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+#file.probe is placed after the input filter.
+The first block of input data is checked against the table of signatures,
+ then MPEG and ADTS frame headers are searched for;
+ the input module for the detected format is found via fmedia.conf::input_ext
+ and is added after #file.probe.  All data is passed through unchanged.
+
+A signature at a fixed offset, or a frame header followed by another frame header of the same stream
+ gives a sure result, which is preferred over the file extension.
+Otherwise the module is chosen by the file extension,
+ and the data is used only if there's no extension (weak result: ID3v2 tag or a single frame header).
+Files with an extension not listed in fmedia.conf::input_ext aren't opened at all.
+*/
+
+#include <fmedia.h>
+#include <FF/path.h>
+
+
+extern const fmed_core *core;
+
+#undef dbglog
+#undef warnlog
+#undef errlog
+#define dbglog(trk, ...)  fmed_dbglog(core, trk, "file", __VA_ARGS__)
+#define warnlog(trk, ...)  fmed_warnlog(core, trk, "file", __VA_ARGS__)
+#define errlog(trk, ...)  fmed_errlog(core, trk, "file", __VA_ARGS__)
+
+enum PROBE_R {
+	PROBE_NONE,
+	PROBE_WEAK,
+	PROBE_SURE,
+};
+
+/** Search for frame headers within this amount of data (bytes). */
+#define PROBE_SYNC_SEARCH  (16 * 1024)
+
+struct probe_sig {
+	const char *ext; // fmedia.conf::input_ext
+	uint off;
+	const char *sig;
+	uint off2; // the second signature (optional)
+	const char *sig2;
+};
+
+static const struct probe_sig probe_sigs[] = {
+	{ "flac", 0, "fLaC", 0, NULL },
+	{ "ogg", 0, "OggS", 0, NULL },
+	{ "mp4", 4, "ftyp", 0, NULL },
+	{ "wav", 0, "RIFF", 8, "WAVE" },
+	{ "avi", 0, "RIFF", 8, "AVI " },
+	{ "caf", 0, "caff", 0, NULL },
+	{ "mkv", 0, "\x1a\x45\xdf\xa3", 0, NULL }, // EBML
+	{ "ape", 0, "MAC ", 0, NULL },
+	{ "wv", 0, "wvpk", 0, NULL },
+	{ "mpc", 0, "MPCK", 0, NULL },
+	{ "ts", 0, "\x47", 188, "\x47" },
+};
+
+static int probe_match(const ffstr *data, uint off, const char *sig)
+{
+	size_t n = ffsz_len(sig);
+	return (off + n <= data->len
+		&& !ffmemcmp(data->ptr + off, sig, n));
+}
+
+/** Get MPEG audio frame length from its header.  Return 0 if the header is invalid. */
+static uint mpeg_framelen(const byte *h)
+{
+	static const ushort kbps[2][3][15] = {
+		{ // MPEG-1
+			{ 0,32,64,96,128,160,192,224,256,288,320,352,384,416,448 },
+			{ 0,32,48,56,64,80,96,112,128,160,192,224,256,320,384 },
+			{ 0,32,40,48,56,64,80,96,112,128,160,192,224,256,320 },
+		},
+		{ // MPEG-2, MPEG-2.5
+			{ 0,32,48,56,64,80,96,112,128,144,160,176,192,224,256 },
+			{ 0,8,16,24,32,40,48,56,64,80,96,112,128,144,160 },
+			{ 0,8,16,24,32,40,48,56,64,80,96,112,128,144,160 },
+		},
+	};
+	static const ushort rates[] = { 44100, 48000, 32000 };
+
+	if (h[0] != 0xff || (h[1] & 0xe0) != 0xe0)
+		return 0;
+	uint ver = (h[1] >> 3) & 3; // 0:MPEG-2.5  1:reserved  2:MPEG-2  3:MPEG-1
+	uint layer = (h[1] >> 1) & 3; // 1:III  2:II  3:I
+	uint ibr = h[2] >> 4, irate = (h[2] >> 2) & 3, pad = (h[2] >> 1) & 1;
+	if (ver == 1 || layer == 0 || ibr == 0 || ibr == 15 || irate == 3)
+		return 0;
+
+	uint lsf = (ver != 3);
+	uint l = 3 - layer; // 0:I  1:II  2:III
+	uint br = kbps[lsf][l][ibr] * 1000;
+	uint rate = rates[irate] >> ((ver == 3) ? 0 : (ver == 2) ? 1 : 2);
+	switch (l) {
+	case 0:
+		return (12 * br / rate + pad) * 4;
+	case 2:
+		if (lsf)
+			return 72 * br / rate + pad;
+		break;
+	}
+	return 144 * br / rate + pad;
+}
+
+/** Get AAC ADTS frame length from its header.  Return 0 if the header is invalid. */
+static uint adts_framelen(const byte *h)
+{
+	if (h[0] != 0xff || (h[1] & 0xf6) != 0xf0 // sync, layer
+		|| ((h[2] >> 2) & 0x0f) >= 13) // sample rate
+		return 0;
+	uint n = ((h[3] & 3) << 11) | (h[4] << 3) | (h[5] >> 5);
+	return (n >= 7) ? n : 0;
+}
+
+struct probe_sync {
+	const char *ext;
+	uint hdrlen;
+	byte mask2; // byte #2 bits which must be the same in all headers
+	uint (*framelen)(const byte *h);
+};
+
+static const struct probe_sync probe_syncs[] = {
+	{ "mp3", 4, 0x0c, &mpeg_framelen }, // sample rate
+	{ "aac", 7, 0xfc, &adts_framelen }, // profile, sample rate
+};
+
+/** Find a frame header followed by the header of the next frame. */
+static int probe_sync(const struct probe_sync *ps, const ffstr *data)
+{
+	const byte *d = (void*)data->ptr;
+	size_t lim = ffmin(data->len, PROBE_SYNC_SEARCH);
+	int r = PROBE_NONE;
+
+	for (size_t i = 0;  i + ps->hdrlen <= lim;  i++) {
+		const byte *h = ffmemchr(d + i, 0xff, lim - ps->hdrlen + 1 - i);
+		if (h == NULL)
+			break;
+		i = h - d;
+
+		uint n = ps->framelen(h);
+		if (n == 0)
+			continue;
+		if (i + n + ps->hdrlen > data->len) {
+			r = PROBE_WEAK;
+			continue;
+		}
+		const byte *h2 = h + n;
+		if (0 != ps->framelen(h2)
+			&& h[1] == h2[1]
+			&& (h[2] & ps->mask2) == (h2[2] & ps->mask2))
+			return PROBE_SURE;
+	}
+	return r;
+}
+
+/** Skip ID3v2 tag.
+Return 1 if the tag is skipped;  -1 if the tag is larger than data. */
+static int probe_id3v2(ffstr *data)
+{
+	const byte *h = (void*)data->ptr;
+	if (!(data->len >= 10 && !ffmemcmp(h, "ID3", 3)))
+		return 0;
+	uint n = ((h[6] & 0x7f) << 21) | ((h[7] & 0x7f) << 14) | ((h[8] & 0x7f) << 7) | (h[9] & 0x7f);
+	n += 10;
+	if (h[5] & 0x10)
+		n += 10; // footer
+	if (n >= data->len)
+		return -1;
+	ffstr_shift(data, n);
+	return 1;
+}
+
+/** Detect the format of input data.
+Return file extension;  NULL if unknown. */
+static const char* probe_fmt(const ffstr *input, int *score)
+{
+	ffstr data = *input;
+	const struct probe_sig *sig;
+	const struct probe_sync *ps;
+	const char *ext = NULL;
+	int r;
+
+	*score = PROBE_NONE;
+	if (probe_id3v2(&data) < 0) {
+		*score = PROBE_WEAK;
+		return "mp3";
+	}
+
+	FFARRS_FOREACH(probe_sigs, sig) {
+		if (probe_match(&data, sig->off, sig->sig)
+			&& (sig->sig2 == NULL || probe_match(&data, sig->off2, sig->sig2))) {
+			*score = PROBE_SURE;
+			return sig->ext;
+		}
+	}
+
+	FFARRS_FOREACH(probe_syncs, ps) {
+		r = probe_sync(ps, &data);
+		if (r > *score) {
+			*score = r;
+			ext = ps->ext;
+			if (r == PROBE_SURE)
+				break;
+		}
+	}
+	return ext;
+}
+
+
+struct probe {
+	uint state;
+};
+
+static void* probe_open(fmed_filt *d)
+{
+	struct probe *p;
+	if (NULL == (p = ffmem_new(struct probe)))
+		return NULL;
+	return p;
+}
+
+static void probe_close(void *ctx)
+{
+	ffmem_free(ctx);
+}
+
+/** Choose the input module by the data and the file extension. */
+static const fmed_modinfo* probe_mod(fmed_filt *d, const ffstr *data)
+{
+	const char *fn;
+	ffstr name, fext = {};
+	const fmed_modinfo *mi_ext = NULL, *mi;
+
+	if (FMED_PNULL != (fn = d->track->getvalstr(d->trk, "input"))) {
+		ffpath_split2(fn, ffsz_len(fn), NULL, &name);
+		ffpath_splitname(name.ptr, name.len, NULL, &fext);
+		if (fext.len != 0)
+			mi_ext = core->getmod2(FMED_MOD_INEXT, fext.ptr, fext.len);
+	}
+
+	int score;
+	const char *ext = probe_fmt(data, &score);
+	if (ext == NULL) {
+		dbglog(d->trk, "format isn't detected");
+		return mi_ext;
+	}
+	dbglog(d->trk, "detected format: %s (%s)", ext, (score == PROBE_SURE) ? "sure" : "weak");
+
+	if (mi_ext != NULL && score != PROBE_SURE)
+		return mi_ext;
+
+	mi = core->getmod2(FMED_MOD_INEXT, ext, -1);
+	if (mi == NULL) {
+		dbglog(d->trk, "no module configured to open .%s", ext);
+		return mi_ext;
+	}
+
+	if (mi_ext != NULL && mi_ext != mi)
+		warnlog(d->trk, "data format doesn't match file extension .%S: opening as .%s"
+			, &fext, ext);
+	return mi;
+}
+
+static int probe_process(void *ctx, fmed_filt *d)
+{
+	struct probe *p = ctx;
+
+	switch (p->state) {
+	case 0: {
+		if (d->datalen == 0 && !(d->flags & FMED_FLAST))
+			return FMED_RMORE;
+
+		ffstr data;
+		ffstr_set(&data, d->data, d->datalen);
+		const fmed_modinfo *mi = probe_mod(d, &data);
+		if (mi == NULL) {
+			errlog(d->trk, "can't detect the format of input data");
+			return FMED_RERR;
+		}
+		if (0 == d->track->cmd(d->trk, FMED_TRACK_FILT_ADD, mi->name))
+			return FMED_RERR;
+		p->state = 1;
+		break;
+	}
+	}
+
+	d->out = d->data;
+	d->outlen = d->datalen;
+	d->datalen = 0;
+	if (d->flags & FMED_FLAST)
+		return FMED_RDONE;
+	return FMED_ROK;
+}
+
+const fmed_filter file_probe = {
+	&probe_open, &probe_process, &probe_close
+};
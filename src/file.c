@@ -100,6 +100,7 @@ extern int fileout_config(ffpars_ctx *ctx);
 extern int stdout_config(ffpars_ctx *ctx);
 extern const fmed_filter file_stdin;
 extern const fmed_filter file_stdout;
+extern const fmed_filter file_probe;
 
 static const void* file_iface(const char *name)
 {
@@ -111,6 +112,8 @@ static const void* file_iface(const char *name)
 		return &file_stdin;
 	else if (!ffsz_cmp(name, "stdout"))
 		return &file_stdout;
+	else if (ffsz_eq(name, "probe"))
+		return &file_probe;
 	return NULL;
 }
 
@@ -196,7 +196,8 @@ struct fmed_core {
 	@cmd: enum FMED_TASK. */
 	void (*task)(fftask *task, uint cmd);
 
-	/** Set timer on the main worker.
+	/** Set timer on the worker running in the current thread (the main worker for other threads).
+	The timer must be disabled within the same worker.
 	@interval:  >0: periodic;  <0: one-shot;  0: disable.
 	Return 0 on success. */
 	int (*timer)(fftmrq_entry *tmr, int64 interval, uint flags);
@@ -218,6 +219,7 @@ struct fmed_props {
 	uint prevent_sleep :1;
 	uint gui :1; // GUI is enabled
 	uint tui :1; // TUI is enabled
+	uint seek_index :1; // use persistent seek index for inputs without seek tables
 	char *version_str; // "X.XX[.XX]"
 
 	/** Path to user configuration directory (with the trailing slash).
@@ -305,11 +307,21 @@ enum FMED_TRACK_CMD {
 	FMED_TRACK_MONITOR,
 
 	/** Get kernel queue associated with this track.
+	The track's filters will be closed within its worker, because their I/O objects are attached to this queue.
 	Return fffd. */
 	FMED_TRACK_KQ,
 
 	/** Start a track in any worker. */
 	FMED_TRACK_XSTART,
+
+	/** Get status of all active tracks: one line per track.
+	@trk: (void*)-1
+	@param: ffarr *buf */
+	FMED_TRACK_STATUS,
+
+	/** Get ID of the worker associated with this track (for FMED_TASK_XPOST).
+	Return uint. */
+	FMED_TRACK_WORKER,
 };
 
 enum FMED_TRK_TYPE {
@@ -321,6 +333,7 @@ enum FMED_TRK_TYPE {
 	FMED_TRK_TYPE_NETIN,
 	FMED_TRK_TYPE_EXPAND, // get file meta info
 	FMED_TRK_TYPE_PLIST, // write playlist file from queue
+	FMED_TRK_TYPE_SEGMENT, // decode a part of file (#soundmod.segdec) or read a joined input (#soundmod.join)
 	_FMED_TRK_TYPE_END,
 
 	//obsolete:
@@ -464,6 +477,15 @@ struct fmed_trk {
 	uint a_stop_level_mintime; //msec
 	ushort a_in_buf_time; // buffer size for audio input (msec)  0:default
 
+	struct fmed_netbuf {
+		uint level; // buffered data (msec)
+		uint target; // target buffer depth (msec);  0: no network buffer
+		uint stalls; // times the buffer has run out of data
+		uint reconnects;
+		uint64 received; // bytes
+		uint prebuffer :1; // waiting until the buffer is filled
+	} net_buf; // status of network input buffer (net.http)
+
 	byte _bar_start;
 	struct {
 		ffstr profile;
@@ -524,10 +546,16 @@ struct fmed_trk {
 		uint show_tags :1;
 		uint print_time :1;
 		uint duration_accurate :1;
+		uint loudness :1; // analyze loudness (EBU R128)
+		uint parallel_decode :1; // decode segments of the input on several workers
+		uint join :1; // concatenate all inputs into one output (#soundmod.join)
+		uint edit_tags :1; // write --meta tags into the input file (tag.edit)
+		uint out_stream :1; // output is a live stream (net.httpsrv): the metadata is sent separately
 	};
 	};
 
 //fmed_filt only:
+	uint64 paused_time; // total time the track has been paused (msec)
 	size_t datalen;
 	union {
 	const char *data;
@@ -602,6 +630,16 @@ struct fmed_aconv {
 	ffpcmex in, out;
 };
 
+/** Loudness analyzer's results for all tracks: "#soundmod.loudness-scan". */
+typedef struct fmed_loudness_scan {
+	/** Print album loudness, write the report file, start the tracks which write ReplayGain tags.
+	@report: report file name or NULL
+	@tags: write tags into the input files
+	Return the number of started tracks.
+	Thread: main. */
+	uint (*fin)(const char *report, uint tags);
+} fmed_loudness_scan;
+
 static FFINL int64 fmed_popval_def(fmed_filt *d, const char *name, int64 def)
 {
 	int64 n;
@@ -613,6 +651,7 @@ static FFINL int64 fmed_popval_def(fmed_filt *d, const char *name, int64 def)
 enum FMED_OUTCP {
 	FMED_OUTCP_ALL = 1,
 	FMED_OUTCP_CMD,
+	FMED_OUTCP_REC, // save without playing
 };
 
 
@@ -954,6 +993,10 @@ typedef struct fmed_globcmd_iface {
 	@cmd: enum FMED_GLOBCMD. */
 	int (*ctl)(uint cmd, ...);
 	int (*write)(const void *data, size_t len);
+
+	/** Read response from another instance.
+	Return the number of bytes read;  0 if the connection is closed;  <0 on error. */
+	ssize_t (*read)(void *buf, size_t cap);
 } fmed_globcmd_iface;
 
 
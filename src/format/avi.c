@@ -12,9 +12,58 @@ Copyright (c) 2016 Simon Zolin */
 
 static const fmed_core *core;
 
+/* Seeking by index:
+On the first seek request the file header (everything before the data of the first 'movi' list)
+ is read again to get the audio stream's parameters and its OpenDML super index ('indx').
+If there's a super index, the standard index chunk ('ix##') covering the target is read,
+ otherwise the whole legacy index ('idx1') is read once.
+The reader is restarted with the header (RIFF and 'movi' sizes are reduced by the number of skipped bytes),
+ and then it continues from the audio chunk before the target.
+If the chunk is within an OpenDML extension ('RIFF AVIX'), the RIFF headers are walked to find it,
+ and the reader gets the header of the first RIFF with empty 'movi' list
+ followed by the header of the extension RIFF. */
+struct avi_idxpt {
+	uint64 units; // stream units before this chunk
+	uint64 off; // chunk offset
+};
+
+struct avi_sidx {
+	uint64 off; // offset of 'ix##' chunk
+	uint size;
+	uint64 units; // stream units before this index chunk
+};
+
+struct avi_idx {
+	uint state;
+	ffarr buf;
+	ffarr hdr; // header to replay
+	uint64 riff_size;
+	uint64 movi_off; // offset of 'movi' LIST
+	uint64 movi_size;
+	uint64 idx1_off;
+	uint astm; // audio stream index
+	uint scale, rate, sample_size, sample_rate;
+	ffarr sidx; // struct avi_sidx[]
+	ffarr pts; // struct avi_idxpt[]
+	uint64 seek_units;
+	uint64 ix_units; // stream units before the index chunk being read
+	uint64 chunk_off;
+	uint64 riffx_off; // extension RIFF offset
+	uint hdr_loaded :1;
+	uint idx1_loaded :1;
+	uint moved :1; // the input is read from another offset
+	uint failed :1;
+};
+
 typedef struct fmed_avi {
 	ffavi avi;
 	uint state;
+	uint64 seek_ms;
+	uint64 pos_base; // position of the chunk the reader was restarted from
+	uint seeking :1;
+	uint seek_hdr :1; // seek request is received along with the header
+	uint restarted :1; // the reader was restarted from a chunk
+	struct avi_idx idx;
 } fmed_avi;
 
 
@@ -80,6 +129,10 @@ static void* avi_open(fmed_filt *d)
 static void avi_close(void *ctx)
 {
 	fmed_avi *a = ctx;
+	ffarr_free(&a->idx.buf);
+	ffarr_free(&a->idx.hdr);
+	ffarr_free(&a->idx.sidx);
+	ffarr_free(&a->idx.pts);
 	ffavi_close(&a->avi);
 	ffmem_free(a);
 }
@@ -94,6 +147,455 @@ static void avi_meta(fmed_avi *a, fmed_filt *d)
 	d->track->meta_set(d->trk, &name, &val, FMED_QUE_TMETA);
 }
 
+
+enum {
+	AVI_HDR_MAX = 4 * 1024 * 1024,
+	AVI_IDX_MAX = 64 * 1024 * 1024,
+};
+
+static uint le32(const byte *d)
+{
+	return d[0] | (d[1] << 8) | (d[2] << 16) | ((uint)d[3] << 24);
+}
+
+static uint64 le64(const byte *d)
+{
+	return le32(d) | ((uint64)le32(d + 4) << 32);
+}
+
+static void le32_set(byte *d, uint n)
+{
+	for (uint i = 0;  i != 4;  i++) {
+		d[i] = (byte)(n >> (i * 8));
+	}
+}
+
+/** Get the number of stream units in the chunk. */
+static uint avix_units(struct avi_idx *x, uint chunk_size)
+{
+	return (x->sample_size != 0) ? chunk_size / x->sample_size : 1;
+}
+
+/** Parse OpenDML super index. */
+static int avix_indx(struct avi_idx *x, const byte *d, size_t len)
+{
+	if (len < 24 || d[3] != 0 /*AVI_INDEX_OF_INDEXES*/ || d[0] != 4)
+		return 0;
+	uint n = le32(d + 4);
+	if (n > (len - 24) / 16)
+		return -1;
+	uint64 units = 0;
+	d += 24;
+	for (uint i = 0;  i != n;  i++, d += 16) {
+		struct avi_sidx *e;
+		if (NULL == (e = ffarr_pushT(&x->sidx, struct avi_sidx)))
+			return -1;
+		e->off = le64(d);
+		e->size = le32(d + 8);
+		e->units = units;
+		units += le32(d + 12);
+	}
+	return 0;
+}
+
+/** Parse 'strl' list. */
+static int avix_strl(struct avi_idx *x, const byte *d, size_t len, uint stm)
+{
+	uint audio = 0;
+	while (len >= 8) {
+		uint size = le32(d + 4);
+		if (size > len - 8)
+			return -1;
+		const byte *data = d + 8;
+
+		if (!ffmemcmp(d, "strh", 4) && size >= 48) {
+			if (ffmemcmp(data, "auds", 4))
+				return 0;
+			audio = 1;
+			x->astm = stm;
+			x->scale = le32(data + 20);
+			x->rate = le32(data + 24);
+			x->sample_size = le32(data + 44);
+
+		} else if (!ffmemcmp(d, "strf", 4) && audio && size >= 8) {
+			x->sample_rate = le32(data + 4);
+
+		} else if (!ffmemcmp(d, "indx", 4) && audio) {
+			if (0 != avix_indx(x, data, size))
+				return -1;
+		}
+
+		size += size & 1;
+		if (size > len - 8)
+			break;
+		d += 8 + size;
+		len -= 8 + size;
+	}
+	return 0;
+}
+
+/** Parse file header.
+Return 0 if 'movi' list is reached;  1 if more data is needed;  -1 on error. */
+static int avix_hdr(struct avi_idx *x)
+{
+	const byte *d = (byte*)x->buf.ptr;
+	size_t len = x->buf.len, i = 12;
+	uint stm = 0;
+
+	if (len < 12)
+		return 1;
+	if (ffmemcmp(d, "RIFF", 4) || ffmemcmp(d + 8, "AVI ", 4))
+		return -1;
+	x->riff_size = le32(d + 4);
+	x->astm = (uint)-1;
+	x->sidx.len = 0;
+
+	for (;;) {
+		if (i + 12 > len)
+			return (i < AVI_HDR_MAX) ? 1 : -1;
+		uint size = le32(d + i + 4);
+
+		if (!ffmemcmp(d + i, "LIST", 4)) {
+			const byte *type = d + i + 8;
+
+			if (!ffmemcmp(type, "movi", 4)) {
+				x->movi_off = i;
+				x->movi_size = size;
+				x->idx1_off = i + 8 + size + (size & 1);
+				return (x->astm != (uint)-1 && x->scale != 0 && x->rate != 0 && x->sample_rate != 0) ? 0 : -1;
+			}
+
+			if (!ffmemcmp(type, "hdrl", 4)) {
+				if (size < 4 || i + 8 + size > AVI_HDR_MAX)
+					return -1;
+				if (i + 8 + size > len)
+					return 1;
+				const byte *h = d + i + 12;
+				size_t hlen = size - 4;
+				while (hlen >= 12) {
+					uint n = le32(h + 4);
+					if (n > hlen - 8)
+						return -1;
+					if (!ffmemcmp(h, "LIST", 4) && !ffmemcmp(h + 8, "strl", 4)) {
+						if (x->astm == (uint)-1
+							&& 0 != avix_strl(x, h + 12, n - 4, stm))
+							return -1;
+						stm++;
+					}
+					n += n & 1;
+					if (n > hlen - 8)
+						break;
+					h += 8 + n;
+					hlen -= 8 + n;
+				}
+			}
+		}
+
+		i += 8 + size + (size & 1);
+	}
+}
+
+/** Add audio chunks from legacy index. */
+static int avix_idx1(struct avi_idx *x, const byte *d, size_t len)
+{
+	char ckid[4];
+	uint64 base = 0, units = 0;
+	ckid[0] = '0' + (x->astm / 10) % 10;
+	ckid[1] = '0' + x->astm % 10;
+	ckid[2] = 'w',  ckid[3] = 'b';
+
+	x->pts.len = 0;
+	for (size_t i = 0;  i + 16 <= len;  i += 16) {
+		const byte *e = d + i;
+		uint off = le32(e + 8);
+		if (i == 0 && off < x->movi_off)
+			base = x->movi_off + 8; // offsets are relative to 'movi'
+		if (ffmemcmp(e, ckid, 4))
+			continue;
+		struct avi_idxpt *pt;
+		if (NULL == (pt = ffarr_pushT(&x->pts, struct avi_idxpt)))
+			return -1;
+		pt->units = units;
+		pt->off = base + off;
+		units += avix_units(x, le32(e + 12));
+	}
+	return 0;
+}
+
+/** Add audio chunks from OpenDML standard index chunk. */
+static int avix_ix(struct avi_idx *x, const byte *d, size_t len, uint64 units)
+{
+	if (len < 8 + 24)
+		return -1;
+	d += 8,  len -= 8;
+	if (d[3] != 1 /*AVI_INDEX_OF_CHUNKS*/ || d[0] != 2)
+		return -1;
+	uint n = le32(d + 4);
+	uint64 base = le64(d + 12);
+	if (n > (len - 24) / 8)
+		return -1;
+
+	x->pts.len = 0;
+	d += 24;
+	for (uint i = 0;  i != n;  i++, d += 8) {
+		struct avi_idxpt *pt;
+		if (NULL == (pt = ffarr_pushT(&x->pts, struct avi_idxpt)))
+			return -1;
+		pt->units = units;
+		pt->off = base + le32(d) - 8; // offset points to chunk data
+		units += avix_units(x, le32(d + 4) & 0x7fffffff);
+	}
+	return 0;
+}
+
+/** Find the last audio chunk before the target. */
+static const struct avi_idxpt* avix_find(struct avi_idx *x, uint64 units)
+{
+	const struct avi_idxpt *pt = (void*)x->pts.ptr;
+	size_t lo = 0, hi = x->pts.len;
+	if (hi == 0)
+		return NULL;
+	while (hi - lo > 1) {
+		size_t m = lo + (hi - lo) / 2;
+		if (pt[m].units <= units)
+			lo = m;
+		else
+			hi = m;
+	}
+	return &pt[lo];
+}
+
+/** Prepare the header for the reader restarted from the chunk.
+@riffx: extension RIFF header or NULL */
+static int avix_replay_hdr(struct avi_idx *x, const byte *riffx)
+{
+	uint64 movi_data = x->movi_off + 12;
+	x->hdr.len = movi_data;
+	if (NULL == ffarr_grow(&x->hdr, 24, 0))
+		return -1;
+	byte *d = (byte*)x->hdr.ptr;
+
+	if (riffx == NULL) {
+		uint64 skip = x->chunk_off - movi_data;
+		le32_set(d + 4, x->riff_size - skip);
+		le32_set(d + x->movi_off + 4, x->movi_size - skip);
+		return 0;
+	}
+
+	le32_set(d + 4, movi_data - 8);
+	le32_set(d + x->movi_off + 4, 4);
+	uint64 skip = x->chunk_off - (x->riffx_off + 24);
+	ffmemcpy(d + x->hdr.len, riffx, 24);
+	le32_set(d + x->hdr.len + 4, le32(riffx + 4) - skip);
+	le32_set(d + x->hdr.len + 16, le32(riffx + 16) - skip);
+	x->hdr.len += 24;
+	return 0;
+}
+
+/** Restart the reader from the chunk. */
+static int avi_restart(fmed_avi *a, fmed_filt *d, uint64 units)
+{
+	struct avi_idx *x = &a->idx;
+	ffavi_close(&a->avi);
+	ffmem_tzero(&a->avi);
+	ffavi_init(&a->avi);
+	ffstr_set2(&a->avi.data, &x->hdr);
+
+	for (;;) {
+		int r = ffavi_read(&a->avi);
+		switch (r) {
+		case FFAVI_RHDR:
+		case FFAVI_RTAG:
+		case FFAVI_RWARN:
+			continue;
+
+		case FFAVI_RMORE:
+			break;
+
+		default:
+			errlog(core, d->trk, NULL, "seek: restarting reader: ffavi_read(): %s"
+				, ffavi_errstr(&a->avi));
+			return FMED_RERR;
+		}
+		break;
+	}
+
+	a->pos_base = units * x->scale * x->sample_rate / x->rate;
+	dbglog(core, d->trk, NULL, "seek: chunk offset:%xU  sample:%U", x->chunk_off, a->pos_base);
+	a->restarted = 1;
+	d->audio.seek = a->seek_ms; // decoder skips the data before the target
+	d->input.seek = x->chunk_off;
+	return FMED_RMORE;
+}
+
+/** Seek by index.
+Return enum FMED_R;  -1 if there's no index. */
+static int avi_idx_seek(fmed_avi *a, fmed_filt *d)
+{
+	enum { IX_NONE, IX_HDR, IX_IDX1, IX_IX, IX_FIND, IX_RIFF };
+	struct avi_idx *x = &a->idx;
+	const struct avi_idxpt *pt;
+	uint64 target;
+	int r;
+
+	if (x->failed)
+		return -1;
+
+	if (x->state != IX_NONE) {
+		if (NULL == ffarr_append(&x->buf, a->avi.data.ptr, a->avi.data.len))
+			return FMED_RSYSERR;
+		a->avi.data.len = 0;
+	} else
+		x->moved = 0;
+
+	for (;;) {
+		switch (x->state) {
+		case IX_NONE:
+			x->buf.len = 0;
+			if (!x->hdr_loaded) {
+				x->state = IX_HDR;
+				x->moved = 1;
+				d->input.seek = 0;
+				return FMED_RMORE;
+			}
+
+			target = a->seek_ms * x->rate / ((uint64)x->scale * 1000);
+			x->seek_units = target;
+			if (x->sidx.len != 0) {
+				const struct avi_sidx *e = (void*)x->sidx.ptr;
+				size_t i;
+				for (i = 1;  i != x->sidx.len;  i++) {
+					if (e[i].units > target)
+						break;
+				}
+				e = &e[i - 1];
+				if (e->size > AVI_IDX_MAX)
+					goto fail;
+				x->state = IX_IX;
+				x->ix_units = e->units;
+				x->moved = 1;
+				d->input.seek = e->off;
+				return FMED_RMORE;
+			}
+
+			if (x->idx1_loaded) {
+				x->state = IX_FIND;
+				continue;
+			}
+			x->state = IX_IDX1;
+			x->moved = 1;
+			d->input.seek = x->idx1_off;
+			return FMED_RMORE;
+
+		case IX_HDR:
+			r = avix_hdr(x);
+			if (r == 1 && !(d->flags & FMED_FLAST))
+				return FMED_RMORE;
+			if (r != 0)
+				goto fail;
+			x->hdr.len = 0;
+			if (NULL == ffarr_append(&x->hdr, x->buf.ptr, x->movi_off + 12))
+				return FMED_RSYSERR;
+			x->hdr_loaded = 1;
+			x->state = IX_NONE;
+			continue;
+
+		case IX_IDX1:
+		case IX_IX: {
+			if (x->buf.len < 8
+				|| x->buf.len < 8 + (uint64)le32((byte*)x->buf.ptr + 4)) {
+				if (x->buf.len >= 8 && le32((byte*)x->buf.ptr + 4) > AVI_IDX_MAX)
+					goto fail;
+				if (d->flags & FMED_FLAST)
+					goto fail;
+				return FMED_RMORE;
+			}
+			const byte *data = (byte*)x->buf.ptr;
+			uint size = le32(data + 4);
+
+			if (x->state == IX_IDX1) {
+				if (ffmemcmp(data, "idx1", 4)
+					|| 0 != avix_idx1(x, data + 8, size))
+					goto fail;
+				x->idx1_loaded = 1;
+				dbglog(core, d->trk, NULL, "seek: loaded %L index entries", x->pts.len);
+
+			} else {
+				if (ffmemcmp(data, "ix", 2)
+					|| 0 != avix_ix(x, data, 8 + size, x->ix_units))
+					goto fail;
+			}
+			x->buf.len = 0;
+			x->state = IX_FIND;
+			continue;
+		}
+
+		case IX_FIND:
+			if (NULL == (pt = avix_find(x, x->seek_units)))
+				goto fail;
+			x->chunk_off = pt->off;
+			x->seek_units = pt->units;
+			if (x->chunk_off < 8 + x->riff_size) {
+				x->state = IX_NONE;
+				if (0 != avix_replay_hdr(x, NULL))
+					return FMED_RSYSERR;
+				return avi_restart(a, d, x->seek_units);
+			}
+			// the chunk is within an extension RIFF
+			x->riffx_off = 8 + x->riff_size + (x->riff_size & 1);
+			x->buf.len = 0;
+			x->state = IX_RIFF;
+			x->moved = 1;
+			d->input.seek = x->riffx_off;
+			return FMED_RMORE;
+
+		case IX_RIFF: {
+			if (x->buf.len < 24) {
+				if (d->flags & FMED_FLAST)
+					goto fail;
+				return FMED_RMORE;
+			}
+			const byte *h = (byte*)x->buf.ptr;
+			uint size = le32(h + 4);
+			if (ffmemcmp(h, "RIFF", 4) || ffmemcmp(h + 8, "AVIX", 4)
+				|| ffmemcmp(h + 12, "LIST", 4) || ffmemcmp(h + 20, "movi", 4))
+				goto fail;
+			if (x->chunk_off >= x->riffx_off + 8 + size) {
+				x->riffx_off += 8 + size + (size & 1);
+				x->buf.len = 0;
+				d->input.seek = x->riffx_off;
+				return FMED_RMORE;
+			}
+			if (x->chunk_off < x->riffx_off + 24)
+				goto fail;
+			x->state = IX_NONE;
+			if (0 != avix_replay_hdr(x, h))
+				return FMED_RSYSERR;
+			return avi_restart(a, d, x->seek_units);
+		}
+		}
+	}
+
+fail:
+	dbglog(core, d->trk, NULL, "seek: no index");
+	x->failed = 1;
+	ffarr_free(&x->buf);
+	ffarr_free(&x->hdr);
+	ffarr_free(&x->sidx);
+	ffarr_free(&x->pts);
+	x->state = IX_NONE;
+	if (!x->moved)
+		return -1;
+	// restart the reader from the beginning
+	ffavi_close(&a->avi);
+	ffmem_tzero(&a->avi);
+	ffavi_init(&a->avi);
+	a->pos_base = 0;
+	a->restarted = 1;
+	d->input.seek = 0;
+	return FMED_RMORE;
+}
+
 static const ushort avi_codecs[] = {
 	FFAVI_AUDIO_AAC, FFAVI_AUDIO_MP3,
 };
@@ -103,7 +605,7 @@ static const char* const avi_codecs_str[] = {
 
 static int avi_process(void *ctx, fmed_filt *d)
 {
-	enum { I_HDR, I_DATA };
+	enum { I_HDR, I_DATA, I_SEEK };
 	fmed_avi *a = ctx;
 	int r;
 
@@ -117,12 +619,30 @@ static int avi_process(void *ctx, fmed_filt *d)
 		d->datalen = 0;
 	}
 
+again:
 	switch (a->state) {
 	case I_HDR:
 		break;
 
 	case I_DATA:
+		if (((int64)d->audio.seek != FMED_NULL && !a->seeking) || a->seek_hdr) {
+			if (!a->seek_hdr)
+				a->seek_ms = d->audio.seek;
+			a->seek_hdr = 0;
+			a->seeking = 1;
+			a->state = I_SEEK;
+			goto again;
+		}
 		break;
+
+	case I_SEEK:
+		r = avi_idx_seek(a, d);
+		if (a->idx.state != 0)
+			return r; // reading index
+		a->state = I_DATA;
+		if (r != -1)
+			return r;
+		break; // the decoder skips the data until the target
 	}
 
 	if (d->flags & FMED_FLAST)
@@ -147,6 +667,9 @@ static int avi_process(void *ctx, fmed_filt *d)
 			goto data;
 
 		case FFAVI_RHDR: {
+			if (a->restarted)
+				break;
+
 			int i = ffint_find2(avi_codecs, FFCNT(avi_codecs), a->avi.info.format);
 			if (i == -1) {
 				errlog(core, d->trk, NULL, "unsupported codec: %xu", a->avi.info.format);
@@ -162,12 +685,20 @@ static int avi_process(void *ctx, fmed_filt *d)
 			d->audio.total = a->avi.info.total_samples;
 			d->audio.bitrate = a->avi.info.bitrate;
 
+			if ((int64)d->audio.seek != FMED_NULL) {
+				// seek after the header data is passed to decoder
+				a->seek_hdr = 1;
+				a->seek_ms = d->audio.seek;
+			}
+
 			d->out = a->avi.info.asc.ptr,  d->outlen = a->avi.info.asc.len;
 			a->state = I_DATA;
 			return FMED_RDATA;
 		}
 
 		case FFAVI_RTAG:
+			if (a->restarted)
+				break;
 			avi_meta(a, d);
 			break;
 
@@ -187,7 +718,8 @@ static int avi_process(void *ctx, fmed_filt *d)
 	}
 
 data:
-	d->audio.pos = ffavi_cursample(&a->avi);
+	d->audio.pos = a->pos_base + ffavi_cursample(&a->avi);
+	a->seeking = 0;
 	d->out = a->avi.out.ptr,  d->outlen = a->avi.out.len;
 	return FMED_RDATA;
 }
@@ -2,6 +2,7 @@
 Copyright (c) 2018 Simon Zolin */
 
 #include <fmedia.h>
+#include <format/seekidx.h>
 
 #include <FF/aformat/flac.h>
 #include <FF/audio/flac.h>
@@ -44,6 +45,8 @@ const fmed_filter fmed_flac_output = {
 struct flac {
 	ffflac fl;
 	uint64 abs_seek;
+	seekidx idx;
+	uint64 idx_off; // offset of the next frame
 	uint seek_ready :1;
 };
 
@@ -88,6 +91,7 @@ static void flac_in_free(void *ctx)
 {
 	struct flac *f = ctx;
 	ffflac_close(&f->fl);
+	seekidx_close(&f->idx);
 	ffmem_free(f);
 }
 
@@ -104,6 +108,41 @@ static void flac_meta(struct flac *f, fmed_filt *d)
 	d->track->meta_set(d->trk, &name, &vtag->val, FMED_QUE_TMETA);
 }
 
+/** Use persistent seek index for a file without SEEKTABLE block.
+If the index is in cache, replace the reader's seek table with the indexed frames positions,
+ so the reader finds the target frame with 1 read.
+Otherwise, record the frames positions while the file is being read from the beginning. */
+static void flac_idx_open(struct flac *f, fmed_filt *d)
+{
+	const char *fn;
+	if (f->fl.sktab.len > 2
+		|| (int64)d->input.size == FMED_NULL
+		|| f->fl.info.total_samples == 0
+		|| FMED_PNULL == (fn = d->track->getvalstr(d->trk, "input")))
+		return;
+
+	f->idx_off = f->fl.framesoff;
+	if (0 != seekidx_open(&f->idx, fn, f->fl.fmt.sample_rate / 4))
+		return;
+
+	const struct seekidx_pt *pt = (void*)f->idx.pts.ptr;
+	size_t n = f->idx.pts.len;
+	ffpcm_seekpt *sk;
+	if (NULL == (sk = ffmem_allocT(n + 1, ffpcm_seekpt)))
+		return;
+	for (size_t i = 0;  i != n;  i++) {
+		sk[i].sample = pt[i].sample;
+		sk[i].off = pt[i].off - f->fl.framesoff;
+	}
+	sk[n].sample = f->fl.info.total_samples;
+	sk[n].off = d->input.size - f->fl.framesoff;
+
+	ffmem_safefree(f->fl.sktab.ptr);
+	f->fl.sktab.ptr = sk;
+	f->fl.sktab.len = n + 1;
+	dbglog(d->trk, "using seek index: %L points", n);
+}
+
 static int flac_in_read(void *ctx, fmed_filt *d)
 {
 	struct flac *f = ctx;
@@ -122,6 +161,7 @@ static int flac_in_read(void *ctx, fmed_filt *d)
 
 	if (f->seek_ready) {
 		if ((int64)d->audio.seek != FMED_NULL) {
+			seekidx_stop(&f->idx);
 			ffflac_seek(&f->fl, f->abs_seek + ffpcm_samples(d->audio.seek, f->fl.fmt.sample_rate));
 			d->audio.seek = FMED_NULL;
 		}
@@ -170,9 +210,13 @@ static int flac_in_read(void *ctx, fmed_filt *d)
 				return FMED_RERR;
 
 			f->seek_ready = 1;
-			if (f->abs_seek != 0)
+			flac_idx_open(f, d);
+			if (f->abs_seek != 0) {
+				seekidx_stop(&f->idx);
 				ffflac_seek(&f->fl, f->abs_seek);
+			}
 			if ((int64)d->audio.seek != FMED_NULL) {
+				seekidx_stop(&f->idx);
 				ffflac_seek(&f->fl, f->abs_seek + ffpcm_samples(d->audio.seek, f->fl.fmt.sample_rate));
 				d->audio.seek = FMED_NULL;
 			}
@@ -186,12 +230,14 @@ static int flac_in_read(void *ctx, fmed_filt *d)
 			return FMED_RMORE;
 
 		case FFFLAC_RDONE:
+			seekidx_save(&f->idx, f->fl.info.total_samples);
 			d->outlen = 0;
 			return FMED_RDONE;
 
 		case FFFLAC_RWARN:
 			warnlog(d->trk, "ffflac_decode(): at offset 0x%xU: %s"
 				, f->fl.off, ffflac_errstr(&f->fl));
+			seekidx_stop(&f->idx); // frames aren't contiguous
 			break;
 
 		case FFFLAC_RERR:
@@ -214,6 +260,10 @@ data:
 	ffstr out = ffflac_output(&f->fl);
 	d->out = out.ptr;
 	d->outlen = out.len;
+
+	// frames follow each other, so the offset of each frame is known while reading sequentially
+	seekidx_add(&f->idx, ffflac_cursample(&f->fl), f->idx_off);
+	f->idx_off += out.len;
 	return FMED_RDATA;
 }
 
@@ -12,11 +12,44 @@ Copyright (c) 2016 Simon Zolin */
 
 static const fmed_core *core;
 
+/* Seeking by Cues:
+On the first seek request the file header (everything before the first Cluster) is read again
+ to get Segment offset, TimecodeScale and Cues offset (from SeekHead),
+ then Cues element is read.
+For each seek request the cluster with the largest CueTime <= target is found,
+ the reader is restarted with the header (Segment size is reduced by the number of skipped bytes),
+ and then it continues from the cluster's offset.
+If there are no Cues, ffmkv_seek() is used. */
+struct mkv_cuept {
+	uint64 time; // in TimecodeScale units
+	uint64 off; // cluster offset
+};
+
+struct mkv_idx {
+	uint state;
+	ffarr buf;
+	ffarr hdr; // header to replay
+	uint64 seg_off; // Segment data offset
+	uint64 seg_size; // -1: unknown
+	uint seg_sizeoff, seg_sizelen;
+	uint64 hdr_end; // first Cluster offset
+	uint64 cues_off; // 0: unknown
+	uint64 tscale;
+	ffarr pts; // struct mkv_cuept[]
+	uint cues_loaded :1;
+	uint moved :1; // the input is read from another offset
+	uint failed :1;
+};
+
 typedef struct fmed_mkv {
 	ffmkv mkv;
 	ffmkv_vorbis mkv_vorbis;
 	uint state;
+	uint64 seek_ms;
 	uint seeking :1;
+	uint seek_hdr :1; // seek request is received along with the header
+	uint restarted :1; // the reader was restarted from a cluster
+	struct mkv_idx idx;
 } fmed_mkv;
 
 
@@ -82,6 +115,9 @@ static void* mkv_open(fmed_filt *d)
 static void mkv_close(void *ctx)
 {
 	fmed_mkv *m = ctx;
+	ffarr_free(&m->idx.buf);
+	ffarr_free(&m->idx.hdr);
+	ffarr_free(&m->idx.pts);
 	ffmkv_close(&m->mkv);
 	ffmem_free(m);
 }
@@ -96,6 +132,409 @@ static void mkv_meta(fmed_mkv *m, fmed_filt *d)
 	d->track->meta_set(d->trk, &name, &val, FMED_QUE_TMETA);
 }
 
+
+enum {
+	EBML_HEADER = 0x1A45DFA3,
+	MKV_SEGMENT = 0x18538067,
+	MKV_SEEKHEAD = 0x114D9B74,
+	MKV_SEEK = 0x4DBB,
+	MKV_SEEKID = 0x53AB,
+	MKV_SEEKPOS = 0x53AC,
+	MKV_INFO = 0x1549A966,
+	MKV_TSCALE = 0x2AD7B1,
+	MKV_CUES = 0x1C53BB6B,
+	MKV_CUEPOINT = 0xBB,
+	MKV_CUETIME = 0xB3,
+	MKV_CUETRKPOS = 0xB7,
+	MKV_CUECLUSTERPOS = 0xF1,
+	MKV_CLUSTER = 0x1F43B675,
+
+	MKV_HDR_MAX = 4 * 1024 * 1024,
+	MKV_CUES_MAX = 64 * 1024 * 1024,
+};
+
+/** Get the length of EBML variable-width integer by its first byte. */
+static uint ebml_vlen(byte b)
+{
+	uint n = 1;
+	for (uint mask = 0x80;  mask != 0 && !(b & mask);  mask >>= 1) {
+		n++;
+	}
+	return n;
+}
+
+/** Parse EBML element header.
+@size: (output) data size;  -1: unknown
+Return header length;  0 if more data is needed;  -1 on error. */
+static int ebml_el(const byte *d, size_t len, uint *id, uint64 *size)
+{
+	uint n, i, k;
+	if (len == 0)
+		return 0;
+
+	n = ebml_vlen(d[0]);
+	if (n > 4)
+		return -1;
+	if (len < n + 1)
+		return 0;
+	*id = 0;
+	for (i = 0;  i != n;  i++) {
+		*id = (*id << 8) | d[i];
+	}
+
+	k = ebml_vlen(d[n]);
+	if (k > 8)
+		return -1;
+	if (len < n + k)
+		return 0;
+	uint64 sz = d[n] & (0xff >> k);
+	uint ones = (sz == (0xffU >> k));
+	for (i = 1;  i != k;  i++) {
+		sz = (sz << 8) | d[n + i];
+		ones &= (d[n + i] == 0xff);
+	}
+	*size = (ones) ? (uint64)-1 : sz;
+	return n + k;
+}
+
+static uint64 ebml_uint(const byte *d, size_t len)
+{
+	uint64 r = 0;
+	for (size_t i = 0;  i != ffmin(len, 8);  i++) {
+		r = (r << 8) | d[i];
+	}
+	return r;
+}
+
+/** Call func() for each child element.
+Return 0 on success;  -1 on error. */
+static int ebml_children(struct mkv_idx *x, const byte *d, size_t len
+	, int (*func)(struct mkv_idx *x, uint id, const byte *d, size_t len, void *udata), void *udata)
+{
+	uint id;
+	uint64 size;
+	while (len != 0) {
+		int n = ebml_el(d, len, &id, &size);
+		if (n <= 0 || size > len - n)
+			return -1;
+		if (0 != func(x, id, d + n, size, udata))
+			return -1;
+		d += n + size;
+		len -= n + size;
+	}
+	return 0;
+}
+
+static int mkvx_seek(struct mkv_idx *x, uint id, const byte *d, size_t len, void *udata)
+{
+	struct { uint64 pos; uint cues; } *seek = udata;
+	switch (id) {
+	case MKV_SEEKID:
+		seek->cues = (len == 4 && MKV_CUES == ebml_uint(d, len));
+		break;
+	case MKV_SEEKPOS:
+		seek->pos = ebml_uint(d, len);
+		break;
+	}
+	return 0;
+}
+
+static int mkvx_seekhead(struct mkv_idx *x, uint id, const byte *d, size_t len, void *udata)
+{
+	struct { uint64 pos; uint cues; } seek = {};
+	if (id != MKV_SEEK)
+		return 0;
+	if (0 != ebml_children(x, d, len, &mkvx_seek, &seek))
+		return -1;
+	if (seek.cues)
+		x->cues_off = x->seg_off + seek.pos;
+	return 0;
+}
+
+static int mkvx_info(struct mkv_idx *x, uint id, const byte *d, size_t len, void *udata)
+{
+	if (id == MKV_TSCALE && ebml_uint(d, len) != 0)
+		x->tscale = ebml_uint(d, len);
+	return 0;
+}
+
+static int mkvx_cuetrkpos(struct mkv_idx *x, uint id, const byte *d, size_t len, void *udata)
+{
+	struct mkv_cuept *pt = udata;
+	if (id == MKV_CUECLUSTERPOS)
+		pt->off = x->seg_off + ebml_uint(d, len);
+	return 0;
+}
+
+static int mkvx_cuepoint(struct mkv_idx *x, uint id, const byte *d, size_t len, void *udata)
+{
+	struct mkv_cuept *pt = udata;
+	switch (id) {
+	case MKV_CUETIME:
+		pt->time = ebml_uint(d, len);
+		break;
+	case MKV_CUETRKPOS:
+		// all tracks are interleaved within a cluster:  any track's position will do
+		if (pt->off == 0)
+			return ebml_children(x, d, len, &mkvx_cuetrkpos, pt);
+		break;
+	}
+	return 0;
+}
+
+static int mkvx_cues(struct mkv_idx *x, uint id, const byte *d, size_t len, void *udata)
+{
+	struct mkv_cuept pt = {}, *p;
+	if (id != MKV_CUEPOINT)
+		return 0;
+	if (0 != ebml_children(x, d, len, &mkvx_cuepoint, &pt))
+		return -1;
+	if (pt.off == 0)
+		return 0;
+	if (x->pts.len != 0) {
+		const struct mkv_cuept *last = (void*)(x->pts.ptr + (x->pts.len - 1) * sizeof(struct mkv_cuept));
+		if (pt.time <= last->time)
+			return 0; // not sorted
+	}
+	if (NULL == (p = ffarr_pushT(&x->pts, struct mkv_cuept)))
+		return -1;
+	*p = pt;
+	return 0;
+}
+
+/** Parse file header.
+Return 0 if the first cluster is reached;  1 if more data is needed;  -1 on error. */
+static int mkvx_hdr(struct mkv_idx *x)
+{
+	const byte *d = (byte*)x->buf.ptr;
+	size_t len = x->buf.len, i;
+	uint id;
+	uint64 size;
+	int n;
+
+	n = ebml_el(d, len, &id, &size);
+	if (n <= 0 || id != EBML_HEADER || size == (uint64)-1)
+		return (n == 0) ? 1 : -1;
+	i = n + size;
+	if (i >= len)
+		return (i < MKV_HDR_MAX) ? 1 : -1;
+
+	n = ebml_el(d + i, len - i, &id, &size);
+	if (n <= 0 || id != MKV_SEGMENT)
+		return (n == 0) ? 1 : -1;
+	x->seg_sizeoff = i + 4;
+	x->seg_sizelen = n - 4;
+	x->seg_size = size;
+	i += n;
+	x->seg_off = i;
+	x->tscale = 1000000;
+
+	for (;;) {
+		n = (i < len) ? ebml_el(d + i, len - i, &id, &size) : 0;
+		if (n == 0)
+			return (len < MKV_HDR_MAX) ? 1 : -1;
+		if (n < 0)
+			return -1;
+
+		if (id == MKV_CLUSTER) {
+			x->hdr_end = i;
+			return 0;
+		}
+
+		if (size == (uint64)-1 || i + n + size > MKV_HDR_MAX)
+			return -1;
+
+		int (*func)(struct mkv_idx *x, uint id, const byte *d, size_t len, void *udata) = NULL;
+		switch (id) {
+		case MKV_SEEKHEAD:
+			func = &mkvx_seekhead;  break;
+		case MKV_INFO:
+			func = &mkvx_info;  break;
+		case MKV_CUES:
+			if (x->cues_loaded)
+				break;
+			func = &mkvx_cues;
+			break;
+		}
+		if (func != NULL) {
+			if (len - i - n < size)
+				return 1; // the element isn't buffered yet: parse the header again with more data
+			if (0 != ebml_children(x, d + i + n, size, func, NULL))
+				return -1;
+			if (id == MKV_CUES)
+				x->cues_loaded = 1;
+		}
+		i += n + size;
+	}
+}
+
+/** Prepare the header for the reader restarted from the cluster at 'off'. */
+static int mkvx_replay_hdr(struct mkv_idx *x, uint64 off)
+{
+	if (x->seg_size == (uint64)-1)
+		return 0;
+	uint64 size = x->seg_size - (off - x->hdr_end);
+	byte *d = (byte*)x->hdr.ptr + x->seg_sizeoff;
+	uint k = x->seg_sizelen;
+	for (uint i = 0;  i != k;  i++) {
+		d[k - 1 - i] = (byte)(size >> (i * 8));
+	}
+	d[0] |= 0x80 >> (k - 1);
+	return 0;
+}
+
+/** Find the cluster for the target time (msec). */
+static uint64 mkvx_find(struct mkv_idx *x, uint64 target)
+{
+	const struct mkv_cuept *pt = (void*)x->pts.ptr;
+	uint64 t = target * 1000000 / x->tscale;
+	size_t lo = 0, hi = x->pts.len;
+	if (hi == 0 || t < pt[0].time)
+		return x->hdr_end;
+	while (hi - lo > 1) {
+		size_t m = lo + (hi - lo) / 2;
+		if (pt[m].time <= t)
+			lo = m;
+		else
+			hi = m;
+	}
+	return pt[lo].off;
+}
+
+/** Restart the reader from the cluster at 'off'. */
+static int mkv_restart(fmed_mkv *m, fmed_filt *d, uint64 off)
+{
+	struct mkv_idx *x = &m->idx;
+	mkvx_replay_hdr(x, off);
+	ffmkv_close(&m->mkv);
+	ffmem_tzero(&m->mkv);
+	ffmkv_open(&m->mkv);
+	ffstr_set2(&m->mkv.data, &x->hdr);
+
+	for (;;) {
+		int r = ffmkv_read(&m->mkv);
+		switch (r) {
+		case FFMKV_RHDR:
+		case FFMKV_RTAG:
+		case FFMKV_RWARN:
+			continue;
+
+		case FFMKV_RMORE:
+			break;
+
+		default:
+			errlog(core, d->trk, NULL, "seek: restarting reader: ffmkv_read(): %s"
+				, ffmkv_errstr(&m->mkv));
+			return FMED_RERR;
+		}
+		break;
+	}
+
+	dbglog(core, d->trk, NULL, "seek: cluster offset:%xU", off);
+	m->restarted = 1;
+	d->audio.seek = m->seek_ms; // decoder skips the data before the target
+	d->input.seek = off;
+	return FMED_RMORE;
+}
+
+/** Seek by Cues.
+Return enum FMED_R;  -1 if Cues can't be used. */
+static int mkv_idx_seek(fmed_mkv *m, fmed_filt *d)
+{
+	enum { IX_NONE, IX_HDR, IX_CUES, IX_FIND };
+	struct mkv_idx *x = &m->idx;
+	int r;
+
+	if (x->failed)
+		return -1;
+
+	if (x->state != IX_NONE) {
+		if (NULL == ffarr_append(&x->buf, m->mkv.data.ptr, m->mkv.data.len))
+			return FMED_RSYSERR;
+		m->mkv.data.len = 0;
+	} else
+		x->moved = 0;
+
+	for (;;) {
+		switch (x->state) {
+		case IX_NONE:
+			if (x->cues_loaded) {
+				x->state = IX_FIND;
+				continue;
+			}
+			x->buf.len = 0;
+			x->state = IX_HDR;
+			x->moved = 1;
+			d->input.seek = 0;
+			return FMED_RMORE;
+
+		case IX_HDR:
+			r = mkvx_hdr(x);
+			if (r == 1 && !(d->flags & FMED_FLAST))
+				return FMED_RMORE;
+			if (r != 0)
+				goto fail;
+			x->hdr.len = 0;
+			if (NULL == ffarr_append(&x->hdr, x->buf.ptr, x->hdr_end))
+				return FMED_RSYSERR;
+			if (!x->cues_loaded) {
+				if (x->cues_off == 0)
+					goto fail;
+				x->buf.len = 0;
+				x->state = IX_CUES;
+				d->input.seek = x->cues_off;
+				return FMED_RMORE;
+			}
+			x->state = IX_FIND;
+			continue;
+
+		case IX_CUES: {
+			uint id;
+			uint64 size;
+			r = ebml_el((byte*)x->buf.ptr, x->buf.len, &id, &size);
+			if (r < 0 || (r > 0 && (id != MKV_CUES || size > MKV_CUES_MAX)))
+				goto fail;
+			if (r == 0 || x->buf.len - r < size) {
+				if (d->flags & FMED_FLAST)
+					goto fail;
+				return FMED_RMORE;
+			}
+			if (0 != ebml_children(x, (byte*)x->buf.ptr + r, size, &mkvx_cues, NULL))
+				goto fail;
+			x->cues_loaded = 1;
+			ffarr_free(&x->buf);
+			dbglog(core, d->trk, NULL, "seek: loaded %L cue points", x->pts.len);
+			x->state = IX_FIND;
+			continue;
+		}
+
+		case IX_FIND:
+			x->state = IX_NONE;
+			if (x->pts.len == 0)
+				goto fail;
+			return mkv_restart(m, d, mkvx_find(x, m->seek_ms));
+		}
+	}
+
+fail:
+	dbglog(core, d->trk, NULL, "seek: no cues");
+	x->failed = 1;
+	ffarr_free(&x->buf);
+	ffarr_free(&x->hdr);
+	ffarr_free(&x->pts);
+	x->state = IX_NONE;
+	if (!x->moved)
+		return -1;
+	// we've read from another offset:  restart the reader from the beginning,
+	//  ffmkv_seek() is called after it has read the header
+	ffmkv_close(&m->mkv);
+	ffmem_tzero(&m->mkv);
+	ffmkv_open(&m->mkv);
+	m->restarted = 1;
+	d->input.seek = 0;
+	return FMED_RMORE;
+}
+
 static const ushort mkv_codecs[] = {
 	FFMKV_AUDIO_AAC, FFMKV_AUDIO_ALAC, FFMKV_AUDIO_MPEG, FFMKV_AUDIO_VORBIS,
 };
@@ -111,7 +550,7 @@ static const char* const mkv_vcodecs_str[] = {
 
 static int mkv_process(void *ctx, fmed_filt *d)
 {
-	enum { I_HDR, I_VORBIS_HDR, I_DATA, };
+	enum { I_HDR, I_VORBIS_HDR, I_DATA, I_SEEK, };
 	fmed_mkv *m = ctx;
 	int r;
 
@@ -144,12 +583,25 @@ again:
 		break;
 
 	case I_DATA:
-		if ((int64)d->audio.seek != FMED_NULL && !m->seeking) {
+		if (((int64)d->audio.seek != FMED_NULL && !m->seeking) || m->seek_hdr) {
+			if (!m->seek_hdr)
+				m->seek_ms = d->audio.seek;
+			m->seek_hdr = 0;
 			m->seeking = 1;
-			uint64 seek = ffpcm_samples(d->audio.seek, m->mkv.info.sample_rate);
-			ffmkv_seek(&m->mkv, seek);
+			m->state = I_SEEK;
+			goto again;
 		}
 		break;
+
+	case I_SEEK:
+		r = mkv_idx_seek(m, d);
+		if (m->idx.state != 0)
+			return r; // reading index
+		m->state = I_DATA;
+		if (r != -1)
+			return r;
+		ffmkv_seek(&m->mkv, ffpcm_samples(m->seek_ms, m->mkv.info.sample_rate));
+		break;
 	}
 
 	for (;;) {
@@ -171,6 +623,12 @@ again:
 			goto data;
 
 		case FFMKV_RHDR: {
+			if (m->restarted) {
+				if (m->idx.failed && m->seeking)
+					ffmkv_seek(&m->mkv, ffpcm_samples(m->seek_ms, m->mkv.info.sample_rate));
+				break;
+			}
+
 			int i = ffint_find2(mkv_codecs, FFCNT(mkv_codecs), m->mkv.info.format);
 			if (i == -1) {
 				errlog(core, d->trk, NULL, "unsupported codec: %xu", m->mkv.info.format);
@@ -187,9 +645,9 @@ again:
 			d->audio.bitrate = m->mkv.info.bitrate;
 
 			if ((int64)d->audio.seek != FMED_NULL) {
-				m->seeking = 1;
-				uint64 seek = ffpcm_samples(d->audio.seek, m->mkv.info.sample_rate);
-				ffmkv_seek(&m->mkv, seek);
+				// seek after the header data is passed to decoder
+				m->seek_hdr = 1;
+				m->seek_ms = d->audio.seek;
 			}
 
 			if (m->mkv.info.format == FFMKV_AUDIO_VORBIS) {
@@ -211,6 +669,8 @@ again:
 		}
 
 		case FFMKV_RTAG:
+			if (m->restarted)
+				break;
 			mkv_meta(m, d);
 			break;
 
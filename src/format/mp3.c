@@ -2,6 +2,8 @@
 Copyright (c) 2017 Simon Zolin */
 
 #include <fmedia.h>
+#include <format/seekidx.h>
+#include <acodec/mpeg-tag.h>
 
 #include <FF/aformat/mp3.h>
 #include <FF/audio/pcm.h>
@@ -23,12 +25,19 @@ const fmed_filter fmed_mpeg_input = {
 typedef struct mpeg_in {
 	ffmpgfile mpg;
 	uint state;
+	seekidx idx;
+	uint64 idx_sample, idx_off; // position of the frame the reader was restarted from
+	uint64 copy_target; // stream copy: sample position (including encoder delay) where the output starts
 	uint have_id32tag :1
 		, seeking :1
+		, restarted :1 // the reader is restarted from an indexed frame
+		, copy_hold :1 // stream copy: skip the frames before the output start
 		;
 } mpeg_in;
 
 static void mpeg_meta(mpeg_in *m, fmed_filt *d, uint type);
+static void mpeg_copy_info(mpeg_in *m, fmed_filt *d);
+static int mpeg_copy_first(mpeg_in *m, fmed_filt *d);
 
 //OUTPUT
 static void* mpeg_out_open(fmed_filt *d);
@@ -64,20 +73,27 @@ const fmed_filter fmed_mpeg_copy = {
 };
 
 typedef struct mpeg_copy {
-	ffmpgcopy mpgcpy;
-	uint64 until;
+	uint state;
+	uint64 until; // input sample position (including encoder delay) where the output ends;  (uint64)-1: unset
+	uint64 end; // end position of the last returned frame
+	uint delay; // encoder delay of the output
+	uint br_idx; // bitrate index of the first frame
+	uint vbr :1;
+	uint until_reached :1;
+
+	ffarr tag; // Xing frame
+	uint64 nframes;
+	uint64 nbytes; // including Xing frame
+	ffarr offsets; // uint[]: offsets of audio frames
+	uint crc; // CRC-16 of audio frames
+	ushort crctab[256];
 } mpeg_copy;
 
+static int mpeg_copy_fin(mpeg_copy *m, fmed_filt *d);
+
 
 static void* mpeg_open(fmed_filt *d)
 {
-	if (d->stream_copy && !d->track->cmd(d->trk, FMED_TRACK_META_HAVEUSER)) {
-
-		if (0 != d->track->cmd2(d->trk, FMED_TRACK_ADDFILT, "mpeg.copy"))
-			return NULL;
-		return FMED_FILT_SKIP;
-	}
-
 	mpeg_in *m = ffmem_new(mpeg_in);
 	if (m == NULL)
 		return NULL;
@@ -96,9 +112,99 @@ static void mpeg_close(void *ctx)
 {
 	mpeg_in *m = ctx;
 	ffmpg_fclose(&m->mpg);
+	seekidx_close(&m->idx);
 	ffmem_free(m);
 }
 
+/** Prepare seek index for a file without Xing header:
+ the reader can't find the exact position of a frame in VBR stream without TOC. */
+static void mpeg_idx_open(mpeg_in *m, fmed_filt *d)
+{
+	const char *fn;
+	if (d->stream_copy
+		|| (int64)d->input.size == FMED_NULL
+		|| m->mpg.rdr.xing.frames != 0
+		|| FMED_PNULL == (fn = d->track->getvalstr(d->trk, "input")))
+		return;
+	seekidx_open(&m->idx, fn, ffmpg_fmt(&m->mpg.rdr).sample_rate / 4);
+}
+
+/** Seek to the target sample.
+If the file is indexed, restart the reader from the exact frame position
+ (a frame with enough data for the bit-reservoir is chosen);
+ the decoder then skips the samples before the target.
+After a restart the reader counts samples and offsets from the restart point:
+ a target before that point restarts the reader from the file beginning.
+Stream copy: the reader is moved back by the preroll distance.
+Return 1 if the new input data must be requested. */
+static int mpeg_seek(mpeg_in *m, fmed_filt *d, uint64 sample)
+{
+	const struct seekidx_pt *pt = NULL;
+	static const struct seekidx_pt start = {};
+	uint preroll = 2 * m->mpg.rdr.frsamps;
+
+	seekidx_stop(&m->idx);
+	if (d->stream_copy) {
+		// the frames before the output start are skipped by mpeg_copy_first()
+		m->copy_target = sample + m->mpg.rdr.delay;
+		m->copy_hold = 1;
+		sample = (sample > preroll) ? sample - preroll : 0;
+	} else {
+		pt = seekidx_find(&m->idx, (sample > preroll) ? sample - preroll : 0);
+	}
+	if (pt == NULL && m->restarted && sample < m->idx_sample)
+		pt = &start;
+	if (pt == NULL) {
+		ffmpg_rseek(&m->mpg.rdr, sample - m->idx_sample);
+		return 0;
+	}
+
+	dbglog(core, d->trk, NULL, "seek index: sample %U -> frame at %U (offset %xU)"
+		, sample, pt->sample, pt->off);
+	uint opts = m->mpg.options;
+	if (pt->off != 0)
+		opts &= ~FFMPG_O_ID3V2;
+	ffmpg_fclose(&m->mpg);
+	ffmpg_fopen(&m->mpg);
+	m->mpg.codepage = core->getval("codepage");
+	ffmpg_setsize(&m->mpg.rdr, d->input.size - pt->off);
+	m->mpg.options = opts;
+	m->idx_sample = pt->sample;
+	m->idx_off = pt->off;
+	m->restarted = 1;
+	d->input.seek = pt->off;
+	return 1;
+}
+
+/** Stream copy: pass encoder delay and padding of the input to mpeg.copy. */
+static void mpeg_copy_info(mpeg_in *m, fmed_filt *d)
+{
+	fmed_setval("audio_enc_delay", m->mpg.rdr.delay);
+	if (m->mpg.rdr.xing.frames != 0) {
+		int64 padding = (int64)m->mpg.rdr.xing.frames * m->mpg.rdr.frsamps - m->mpg.rdr.delay - (int64)d->audio.total;
+		fmed_setval("audio_end_padding", ffmax(padding, 0));
+	}
+}
+
+/** Stream copy after seeking: skip the frames before the output start.
+The output starts 2 frames before the target frame:
+ the decoder needs their data for the bit-reservoir and for overlapping with the target frame.
+Encoder delay of the output is set so that the decoder discards the samples before the target.
+Return 1 if the frame must be skipped. */
+static int mpeg_copy_first(mpeg_in *m, fmed_filt *d)
+{
+	uint64 pos = m->idx_sample + ffmpg_cursample(&m->mpg.rdr);
+	if (pos + 3 * m->mpg.rdr.frsamps <= m->copy_target)
+		return 1;
+
+	uint64 delay = (m->copy_target > pos) ? m->copy_target - pos : 0;
+	dbglog(core, d->trk, NULL, "stream copy: first frame at sample %U, encoder delay: %U"
+		, pos, delay);
+	fmed_setval("audio_enc_delay", delay);
+	m->copy_hold = 0;
+	return 0;
+}
+
 static void mpeg_meta(mpeg_in *m, fmed_filt *d, uint type)
 {
 	ffstr name, val;
@@ -152,9 +258,11 @@ again:
 	case I_DATA:
 		if ((int64)d->audio.seek != FMED_NULL && !m->seeking) {
 			m->seeking = 1;
-			ffmpg_rseek(&m->mpg.rdr, ffpcm_samples(d->audio.seek, ffmpg_fmt(&m->mpg.rdr).sample_rate));
+			r = mpeg_seek(m, d, ffpcm_samples(d->audio.seek, ffmpg_fmt(&m->mpg.rdr).sample_rate));
 			if (d->stream_copy)
 				d->audio.seek = FMED_NULL;
+			if (r != 0)
+				return FMED_RMORE;
 		}
 		break;
 	}
@@ -164,6 +272,8 @@ again:
 
 		switch (r) {
 		case FFMPG_RFRAME:
+			if (m->copy_hold && 0 != mpeg_copy_first(m, d))
+				continue;
 			goto data;
 
 		case FFMPG_RMORE:
@@ -178,6 +288,7 @@ again:
 			return FMED_RMORE;
 
 		case FFMPG_RDONE:
+			seekidx_save(&m->idx, ffmpg_cursample(&m->mpg.rdr));
 			d->outlen = 0;
 			return FMED_RLASTOUT;
 
@@ -185,6 +296,8 @@ again:
 			continue;
 
 		case FFMPG_RHDR:
+			if (m->restarted)
+				continue;
 			dbglog(core, d->trk, NULL, "preset:%s  tool:%s  xing-frames:%u"
 				, ffmpg_isvbr(&m->mpg.rdr) ? "VBR" : "CBR", m->mpg.rdr.lame.id, m->mpg.rdr.xing.frames);
 			ffpcm_fmtcopy(&d->audio.fmt, &ffmpg_fmt(&m->mpg.rdr));
@@ -211,9 +324,23 @@ again:
 				&& 0 != d->track->cmd2(d->trk, FMED_TRACK_ADDFILT, "mpeg.decode"))
 				return FMED_RERR;
 
+			if (d->stream_copy) {
+				mpeg_copy_info(m, d);
+				// for joined inputs mpeg.copy is added to the main track by #soundmod.join
+				if (!d->join
+					&& 0 != d->track->cmd2(d->trk, FMED_TRACK_ADDFILT, "mpeg.copy"))
+					return FMED_RERR;
+			}
+
+			mpeg_idx_open(m, d);
+
 			if ((int64)d->audio.seek != FMED_NULL && !m->seeking) {
 				m->seeking = 1;
-				ffmpg_rseek(&m->mpg.rdr, ffpcm_samples(d->audio.seek, ffmpg_fmt(&m->mpg.rdr).sample_rate));
+				r = mpeg_seek(m, d, ffpcm_samples(d->audio.seek, ffmpg_fmt(&m->mpg.rdr).sample_rate));
+				if (d->stream_copy)
+					d->audio.seek = FMED_NULL;
+				if (r != 0)
+					return FMED_RMORE;
 			}
 
 			goto again;
@@ -221,11 +348,12 @@ again:
 		case FFMPG_RID31:
 		case FFMPG_RID32:
 		case FFMPG_RAPETAG:
-			mpeg_meta(m, d, r);
+			if (!m->restarted)
+				mpeg_meta(m, d, r);
 			break;
 
 		case FFMPG_RSEEK:
-			d->input.seek = ffmpg_seekoff(&m->mpg);
+			d->input.seek = m->idx_off + ffmpg_seekoff(&m->mpg);
 			return FMED_RMORE;
 
 		case FFMPG_RWARN:
@@ -254,7 +382,8 @@ data:
 		m->seeking = 0;
 	d->out = m->mpg.frame.ptr;
 	d->outlen = m->mpg.frame.len;
-	d->audio.pos = ffmpg_cursample(&m->mpg.rdr);
+	d->audio.pos = m->idx_sample + ffmpg_cursample(&m->mpg.rdr);
+	seekidx_add(&m->idx, d->audio.pos, m->mpg.rdr.off - m->mpg.frame.len);
 	dbglog(core, d->trk, NULL, "passing frame #%u  samples:%u[%U]  size:%u  br:%u  off:%xU"
 		, m->mpg.rdr.frno, (uint)m->mpg.rdr.frsamps, d->audio.pos, (uint)m->mpg.frame.len
 		, ffmpg_hdr_bitrate((void*)m->mpg.frame.ptr), m->mpg.rdr.off - m->mpg.frame.len);
@@ -262,19 +391,30 @@ data:
 }
 
 
+/*
+INPUT -> mpeg.copy -> ... -> mpeg.out
+mpeg.copy cuts the stream at frame boundaries and passes the frames as is.
+It writes Xing frame with LAME extension before the first frame;
+ the final tag is passed to mpeg.out after the last frame, the same way as from the encoder.
+Encoder delay and padding in LAME tag make the decoder discard the samples
+ before --seek and after --until positions.
+*/
+
 static void* mpeg_copy_open(fmed_filt *d)
 {
 	mpeg_copy *m = ffmem_new(mpeg_copy);
 	if (m == NULL)
 		return NULL;
+	mpeg_crc_init(m->crctab);
 
-	m->mpgcpy.options = FFMPG_WRITE_ID3V2 | FFMPG_WRITE_ID3V1 | FFMPG_WRITE_XING;
-	if ((int64)d->input.size != FMED_NULL)
-		ffmpg_setsize(&m->mpgcpy.rdr, d->input.size);
+	int64 val;
+	m->delay = (FMED_NULL != (val = fmed_getval("audio_enc_delay"))) ? val : 0;
 
 	m->until = (uint64)-1;
-	if (d->audio.until != FMED_NULL) {
-		m->until = d->audio.until;
+	if (d->audio.until != FMED_NULL && d->audio.until > 0) {
+		// the input position of a frame includes encoder delay of the input
+		uint delay = (FMED_NULL != (val = fmed_getval("mpeg_delay"))) ? val : 0;
+		m->until = ffpcm_samples(d->audio.until, d->audio.fmt.sample_rate) + delay;
 		d->audio.until = FMED_NULL;
 	}
 
@@ -285,101 +425,106 @@ static void* mpeg_copy_open(fmed_filt *d)
 static void mpeg_copy_close(void *ctx)
 {
 	mpeg_copy *m = ctx;
-	ffmpg_copy_close(&m->mpgcpy);
+	ffarr_free(&m->tag);
+	ffarr_free(&m->offsets);
 	ffmem_free(m);
 }
 
 static int mpeg_copy_process(void *ctx, fmed_filt *d)
 {
+	enum { C_TAG, C_DATA };
 	mpeg_copy *m = ctx;
-	int r;
-	ffstr out;
+	struct mpeg_frame fr;
 
 	if (d->flags & FMED_FSTOP) {
 		d->outlen = 0;
 		return FMED_RLASTOUT;
 	}
 
-	if (d->datalen != 0) {
-		ffmpg_input(&m->mpgcpy, d->data, d->datalen);
-		d->datalen = 0;
+	if (d->datalen == 0) {
+		if (d->flags & FMED_FLAST)
+			return mpeg_copy_fin(m, d);
+		return FMED_RMORE;
 	}
 
-	for (;;) {
-
-	r = ffmpg_copy(&m->mpgcpy, &out);
+	if (0 == mpeg_frame_parse(d->data, d->datalen, &fr)) {
+		errlog(core, d->trk, "mpeg", "bad MPEG frame at sample %U", d->audio.pos);
+		return FMED_RERR;
+	}
 
-	switch (r) {
-	case FFMPG_RMORE:
-		if (d->flags & FMED_FLAST) {
-			ffmpg_copy_fin(&m->mpgcpy);
-			continue;
+	switch (m->state) {
+	case C_TAG:
+		m->state = C_DATA;
+		m->br_idx = (byte)d->data[2] >> 4;
+		if (d->out_stream)
+			break; // the tag can't be updated in the output stream
+
+		if (0 == mpeg_tag_create(&m->tag, d->data)) {
+			errlog(core, d->trk, "mpeg", "can't create Xing frame");
+			return FMED_RERR;
 		}
-		return FMED_RMORE;
+		m->nbytes = m->tag.len;
+		d->out = m->tag.ptr,  d->outlen = m->tag.len;
+		return FMED_RDATA;
 
-	case FFMPG_RXING:
-		continue;
-
-	case FFMPG_RHDR:
-		ffpcm_fmtcopy(&d->audio.fmt, &ffmpg_copy_fmt(&m->mpgcpy));
-		d->audio.fmt.format = FFPCM_16;
-		d->audio.bitrate = ffmpg_bitrate(&m->mpgcpy.rdr);
-		d->audio.total = ffmpg_length(&m->mpgcpy.rdr);
-		d->audio.decoder = "MPEG";
-		d->meta_block = 0;
-
-		if ((int64)d->audio.seek != FMED_NULL) {
-			int64 samples = ffpcm_samples(d->audio.seek, ffmpg_fmt(&m->mpgcpy.rdr).sample_rate);
-			ffmpg_copy_seek(&m->mpgcpy, samples);
-			d->audio.seek = FMED_NULL;
-			continue;
-		}
-		continue;
-
-	case FFMPG_RID32:
-	case FFMPG_RID31:
-		d->meta_block = 1;
-		goto data;
-
-	case FFMPG_RFRAME:
-		d->audio.pos = ffmpg_cursample(&m->mpgcpy.rdr);
-		if (ffpcm_time(d->audio.pos, ffmpg_copy_fmt(&m->mpgcpy).sample_rate) >= m->until) {
-			dbglog(core, d->trk, NULL, "reached time %Ums", d->audio.until);
-			ffmpg_copy_fin(&m->mpgcpy);
-			m->until = (uint64)-1;
-			continue;
-		}
-		goto data;
+	case C_DATA:
+		break;
+	}
 
-	case FFMPG_RSEEK:
-		d->input.seek = ffmpg_copy_seekoff(&m->mpgcpy);
-		return FMED_RMORE;
+	if (d->audio.pos >= m->until) {
+		dbglog(core, d->trk, "mpeg", "reached sample #%U", m->until);
+		m->until_reached = 1;
+		d->datalen = 0;
+		return mpeg_copy_fin(m, d);
+	}
+
+	uint *off;
+	if (NULL == (off = ffarr_pushT(&m->offsets, uint)))
+		return FMED_RERR;
+	*off = m->nbytes;
+	m->nbytes += d->datalen;
+	m->nframes++;
+	m->crc = mpeg_crc16(m->crctab, m->crc, d->data, d->datalen);
+	m->end = d->audio.pos + fr.samples;
+	if (((byte)d->data[2] >> 4) != m->br_idx)
+		m->vbr = 1;
+
+	d->out = d->data,  d->outlen = d->datalen;
+	d->datalen = 0;
+	return FMED_RDATA;
+}
+
+/** Pass the final Xing frame to mpeg.out. */
+static int mpeg_copy_fin(mpeg_copy *m, fmed_filt *d)
+{
+	uint64 padding = 0;
+	int64 val;
+	if (m->until_reached)
+		padding = (m->end > m->until) ? m->end - m->until : 0;
+	else if (FMED_NULL != (val = fmed_getval("audio_end_padding")))
+		padding = val;
 
-	case FFMPG_ROUTSEEK:
-		d->output.seek = ffmpg_copy_seekoff(&m->mpgcpy);
-		continue;
+	core->log(FMED_LOG_INFO, d->trk, NULL, "MPEG: frames:%U  encoder delay:%u  padding:%U"
+		, m->nframes, m->delay, padding);
 
-	case FFMPG_RDONE:
-		core->log(FMED_LOG_INFO, d->trk, NULL, "MPEG: frames:%u", ffmpg_wframes(&m->mpgcpy.writer));
+	if (m->tag.len == 0) {
 		d->outlen = 0;
 		return FMED_RLASTOUT;
-
-	case FFMPG_RWARN:
-		warnlog(core, d->trk, NULL, "near sample %U: ffmpg_copy(): %s"
-			, ffmpg_cursample(&m->mpgcpy.rdr), ffmpg_copy_errstr(&m->mpgcpy));
-		continue;
-
-	default:
-		errlog(core, d->trk, "mpeg", "ffmpg_copy() failed: %s", ffmpg_copy_errstr(&m->mpgcpy));
-		return FMED_RERR;
-	}
 	}
 
-data:
-	d->out = out.ptr,  d->outlen = out.len;
-	dbglog(core, d->trk, "mpeg", "output: %L bytes"
-		, out.len);
-	return FMED_RDATA;
+	struct mpeg_tag_info info = {};
+	info.frames = m->nframes;
+	info.bytes = m->nbytes;
+	info.offsets = (void*)m->offsets.ptr;
+	info.delay = m->delay;
+	info.padding = padding;
+	info.crc = m->crc;
+	info.id = (m->vbr) ? "Xing" : "Info";
+	mpeg_tag_update(m->tag.ptr, m->tag.len, &info, m->crctab);
+
+	d->mpg_lametag = 1;
+	d->out = m->tag.ptr,  d->outlen = m->tag.len;
+	return FMED_RLASTOUT;
 }
 
 
@@ -390,25 +535,15 @@ int mpeg_out_config(ffpars_ctx *ctx)
 	return 0;
 }
 
-static int mpeg_have_trkmeta(fmed_filt *d)
-{
-	fmed_trk_meta meta;
-	ffmem_tzero(&meta);
-	if (0 == d->track->cmd2(d->trk, FMED_TRACK_META_ENUM, &meta))
-		return 1;
-	return 0;
-}
-
 static void* mpeg_out_open(fmed_filt *d)
 {
-	if (ffsz_eq(d->datatype, "mpeg") && !mpeg_have_trkmeta(d))
-		return FMED_FILT_SKIP; // mpeg.copy is used in this case
-
 	mpeg_out *m = ffmem_new(mpeg_out);
 	if (m == NULL)
 		return NULL;
 	ffmpg_winit(&m->mpgw);
 	m->mpgw.options = FFMPG_WRITE_ID3V1 | FFMPG_WRITE_ID3V2;
+	if (d->out_stream)
+		m->mpgw.options = 0; // tags in the middle of a stream confuse the players
 	return m;
 }
 
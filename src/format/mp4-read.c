@@ -0,0 +1,1139 @@
+/** MP4 reader with compact sample tables;  fragmented MP4.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+Sample tables of the audio track are kept in their original form (stts, stsc, stsz, stco/co64)
+ and are decoded lazily by a cursor that moves from one sample to the next.
+A copy of the cursor is saved every MP4RD_SKIP samples (skip index),
+ so seeking starts from the nearest saved cursor.
+For a 10-hour AAC file this takes about 7MB (tables) + 100KB (skip index)
+ instead of the arrays of per-sample offsets, sizes and positions.
+
+Fragmented MP4 (moov/mvex, moof/traf/trun):
+Only the current fragment's samples are stored.
+Seeking uses the segment index (sidx) if there's one at the beginning,
+ otherwise it starts from the nearest known fragment and walks the top-level boxes,
+ skipping 'mdat' data.  Offsets and times of the fragments seen so far are saved.
+
+The reader is used only for fragmented files and files with a large 'moov' (MP4RD_MOOV_MIN),
+ otherwise the caller uses the default reader.
+This is decided before 'moov' is parsed:
+ by its size, or by the presence of 'mvex' box among its children.
+*/
+
+#include <format/mp4-read.h>
+#include <FF/array.h>
+
+
+enum {
+	MP4RD_MOOV_MIN = 1024 * 1024, // ~256K samples with per-sample sizes in 'stsz'
+	MP4RD_SKIP = 1024,
+	MP4RD_MOOV_MAX = 64 * 1024 * 1024,
+	MP4RD_MOOF_MAX = 16 * 1024 * 1024,
+	MP4RD_FRAME_MAX = 1024 * 1024,
+	MP4RD_MOOFS_MAX = 64 * 1024,
+};
+
+struct cursor {
+	uint64 sample;
+	uint64 pos; // decode time (in timescale units)
+	uint64 off; // file offset of the sample
+	uint stts_i, stts_left;
+	uint stsc_i;
+	uint chunk;
+	uint chunk_left;
+};
+
+struct fsample {
+	uint64 off;
+	uint size;
+	uint dur;
+};
+
+struct moofpos {
+	uint64 off;
+	uint64 time;
+};
+
+enum ST {
+	ST_BOX,
+	ST_MOOV,
+	ST_SIDX,
+	ST_MOOF,
+	ST_HDR,
+	ST_TAGS,
+	ST_DATA,
+	ST_FDATA,
+	ST_DONE,
+};
+
+struct mp4rd {
+	uint st;
+	uint64 total_size;
+	const char *err;
+
+	ffarr buf; // input data
+	uint64 off; // file offset of buf[0]
+	uint64 seekoff;
+	uint64 box_off; // the next top-level box
+	uint64 box_size;
+	uint box_hlen;
+	uint64 moov_end;
+
+	struct mp4rd_info info;
+	ffarr conf;
+	uint track_id;
+	uint timescale;
+	uint def_dur, def_size; // trex
+
+	// tags
+	ffarr moov;
+	size_t ilst_off, ilst_len; // within 'moov'
+	ffstr tagname, tagval;
+	char tagbuf[32];
+
+	// sample tables (copied from 'moov')
+	ffarr tabs;
+	const byte *stts, *stsc, *stsz, *stco;
+	uint stts_n, stsc_n, stco_n;
+	uint stsz_const;
+	uint co64 :1;
+	uint64 nsamples;
+	uint64 table_dur;
+	struct cursor cur;
+	ffarr skip; // struct cursor[]
+
+	// fragments
+	ffarr fsamples; // struct fsample[]
+	size_t fi;
+	uint64 fpos; // decode time of fsamples[fi]
+	uint64 frag_time; // decode time of the next fragment
+	ffarr moofs; // struct moofpos[]
+	uint64 first_moof;
+	ffarr sidx; // struct moofpos[]:  segment offset and start time
+	uint64 fseek; // target decode time;  -1: not seeking
+
+	ffstr frame;
+	uint64 frame_pos;
+	uint mvex :1;
+	uint hdr_done :1;
+};
+
+
+static uint be16(const byte *d)
+{
+	return (d[0] << 8) | d[1];
+}
+
+static uint be32(const byte *d)
+{
+	return ((uint)d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3];
+}
+
+static uint64 be64(const byte *d)
+{
+	return ((uint64)be32(d) << 32) | be32(d + 4);
+}
+
+/** Parse box header.
+Return header length;  0 if more data is needed;  -1 on error. */
+static int box_hdr(const byte *d, size_t len, char *type, uint64 *size)
+{
+	if (len < 8)
+		return 0;
+	ffmemcpy(type, d + 4, 4);
+	*size = be32(d);
+	if (*size == 1) {
+		if (len < 16)
+			return 0;
+		*size = be64(d + 8);
+		return (*size >= 16) ? 16 : -1;
+	}
+	if (*size == 0)
+		*size = (uint64)-1; // up to the end of file
+	else if (*size < 8)
+		return -1;
+	return 8;
+}
+
+/** Find child box.
+Return box data;  NULL if not found. */
+static const byte* box_find(const byte *d, size_t len, const char *type, size_t *size)
+{
+	char t[4];
+	uint64 sz;
+	while (len >= 8) {
+		int n = box_hdr(d, len, t, &sz);
+		if (n <= 0 || sz > len)
+			return NULL;
+		if (!ffmemcmp(t, type, 4)) {
+			*size = sz - n;
+			return d + n;
+		}
+		d += sz;
+		len -= sz;
+	}
+	return NULL;
+}
+
+/** Find box by path, e.g. "mdia" "minf" "stbl". */
+static const byte* box_path(const byte *d, size_t len, const char *const *path, uint n, size_t *size)
+{
+	for (uint i = 0;  i != n;  i++) {
+		if (NULL == (d = box_find(d, len, path[i], &len)))
+			return NULL;
+	}
+	*size = len;
+	return d;
+}
+
+
+/** Make data at [off..off+n) available.
+Return 0 on success;  -1: need more data;  MP4RD_RSEEK. */
+static int need(mp4rd *r, uint64 off, size_t n, const byte **p)
+{
+	if (off >= r->off && off <= r->off + r->buf.len) {
+		_ffarr_rmleft(&r->buf, off - r->off, sizeof(char));
+		r->off = off;
+		if (r->buf.len >= n) {
+			*p = (byte*)r->buf.ptr;
+			return 0;
+		}
+		return -1;
+	}
+	r->buf.len = 0;
+	r->off = off;
+	r->seekoff = off;
+	return MP4RD_RSEEK;
+}
+
+
+static uint sample_size(mp4rd *r, uint64 i)
+{
+	return (r->stsz_const != 0) ? r->stsz_const : be32(r->stsz + i * 4);
+}
+
+static uint64 chunk_off(mp4rd *r, uint i)
+{
+	return (r->co64) ? be64(r->stco + i * 8) : be32(r->stco + i * 4);
+}
+
+/** Set samples per chunk for the current chunk. */
+static int cur_chunk(mp4rd *r, struct cursor *c)
+{
+	if (c->stsc_i + 1 < r->stsc_n
+		&& be32(r->stsc + (c->stsc_i + 1) * 12) - 1 == c->chunk)
+		c->stsc_i++;
+	if (c->chunk >= r->stco_n)
+		return -1;
+	c->chunk_left = be32(r->stsc + c->stsc_i * 12 + 4);
+	c->off = chunk_off(r, c->chunk);
+	return 0;
+}
+
+static void cur_stts(mp4rd *r, struct cursor *c)
+{
+	while (c->stts_left == 0 && c->stts_i + 1 < r->stts_n) {
+		c->stts_i++;
+		c->stts_left = be32(r->stts + c->stts_i * 8);
+	}
+}
+
+static uint cur_delta(mp4rd *r, const struct cursor *c)
+{
+	return be32(r->stts + c->stts_i * 8 + 4);
+}
+
+static int cur_init(mp4rd *r, struct cursor *c)
+{
+	ffmem_tzero(c);
+	c->stts_left = be32(r->stts);
+	cur_stts(r, c);
+	c->stsc_i = 0;
+	c->chunk = 0;
+	if (0 != cur_chunk(r, c))
+		return -1;
+	while (c->chunk_left == 0) {
+		c->chunk++;
+		if (0 != cur_chunk(r, c))
+			return -1;
+	}
+	return 0;
+}
+
+/** Move the cursor to the next sample. */
+static int cur_next(mp4rd *r, struct cursor *c)
+{
+	c->off += sample_size(r, c->sample);
+	c->pos += cur_delta(r, c);
+	c->sample++;
+	if (c->stts_left != 0)
+		c->stts_left--;
+	cur_stts(r, c);
+
+	if (--c->chunk_left == 0 && c->sample != r->nsamples) {
+		do {
+			c->chunk++;
+			if (0 != cur_chunk(r, c))
+				return -1;
+		} while (c->chunk_left == 0);
+	}
+	return 0;
+}
+
+/** Walk through all samples and build skip index. */
+static int tab_index(mp4rd *r)
+{
+	struct cursor c, *p;
+	if (0 != cur_init(r, &c))
+		return -1;
+	r->cur = c;
+	while (c.sample != r->nsamples) {
+		if (c.sample % MP4RD_SKIP == 0) {
+			if (NULL == (p = ffarr_pushT(&r->skip, struct cursor)))
+				return -1;
+			*p = c;
+		}
+		if (0 != cur_next(r, &c))
+			return -1;
+	}
+	r->table_dur = c.pos;
+	return 0;
+}
+
+/** Set cursor to the sample containing the target decode time. */
+static void tab_seek(mp4rd *r, uint64 t)
+{
+	const struct cursor *sk = (void*)r->skip.ptr;
+	size_t lo = 0, hi = r->skip.len;
+	if (hi == 0)
+		return;
+	while (hi - lo > 1) {
+		size_t m = lo + (hi - lo) / 2;
+		if (sk[m].pos <= t)
+			lo = m;
+		else
+			hi = m;
+	}
+	struct cursor c = sk[lo];
+	while (c.sample + 1 < r->nsamples && c.pos + cur_delta(r, &c) <= t) {
+		if (0 != cur_next(r, &c))
+			break;
+	}
+	r->cur = c;
+}
+
+
+/** Parse audio sample entry within 'stsd'. */
+static int stsd_parse(mp4rd *r, const byte *d, size_t len)
+{
+	char type[4];
+	uint64 size;
+	if (len < 8)
+		return -1;
+	d += 8,  len -= 8; // version, flags, entry count
+	int n = box_hdr(d, len, type, &size);
+	if (n <= 0 || size > len || size < (uint)n + 28)
+		return -1;
+	const byte *e = d + n;
+	size_t elen = size - n;
+
+	uint ver = be16(e + 8);
+	r->info.channels = be16(e + 16);
+	r->info.bits = be16(e + 18);
+	r->info.sample_rate = be32(e + 24) >> 16;
+	uint skip = 28 + ((ver == 1) ? 16 : (ver == 2) ? 36 : 0);
+	if (elen < skip)
+		return -1;
+	const byte *ch = e + skip;
+	size_t chlen = elen - skip;
+	size_t sz;
+
+	if (!ffmemcmp(type, "alac", 4)) {
+		const byte *a = box_find(ch, chlen, "alac", &sz);
+		if (a == NULL || sz < 4 + 24)
+			return -1;
+		r->info.codec = MP4RD_ALAC;
+		// magic cookie follows version and flags
+		if (NULL == ffarr_append(&r->conf, a + 4, sz - 4))
+			return -1;
+		r->info.frame_samples = be32(a + 4);
+		r->info.bits = a[4 + 5];
+		r->info.channels = a[4 + 9];
+		r->info.bitrate = be32(a + 4 + 16);
+		r->info.sample_rate = be32(a + 4 + 20);
+		return 0;
+	}
+
+	if (ffmemcmp(type, "mp4a", 4))
+		return -1;
+	const byte *es = box_find(ch, chlen, "esds", &sz);
+	if (es == NULL || sz < 4)
+		return -1;
+	es += 4,  sz -= 4;
+
+	// descriptors: TAG(1) SIZE(1..4) DATA
+	while (sz >= 2) {
+		uint tag = es[0], dlen = 0, i;
+		for (i = 1;  i != ffmin(sz, 5);  i++) {
+			dlen = (dlen << 7) | (es[i] & 0x7f);
+			if (!(es[i] & 0x80))
+				break;
+		}
+		if (i == ffmin(sz, 5))
+			return -1;
+		i++;
+		const byte *dd = es + i;
+		size_t dsz = sz - i;
+
+		switch (tag) {
+		case 3: { // ES_Descriptor:  descriptors follow the header
+			if (dsz < 3)
+				return -1;
+			uint fl = dd[2], hl = 3;
+			if (fl & 0x80)
+				hl += 2;
+			if (fl & 0x40)
+				hl += 1 + ((dsz > hl) ? dd[hl] : 0);
+			if (fl & 0x20)
+				hl += 2;
+			if (hl > dsz)
+				return -1;
+			es = dd + hl;
+			sz = dsz - hl;
+			continue;
+		}
+
+		case 4: // DecoderConfigDescriptor:  DecSpecificInfo follows the header
+			if (dsz < 13)
+				return -1;
+			switch (dd[0]) {
+			case 0x40:
+			case 0x66: case 0x67: case 0x68:
+				r->info.codec = MP4RD_AAC;
+				r->info.frame_samples = 1024;
+				break;
+			case 0x69: case 0x6b:
+				r->info.codec = MP4RD_MPEG1;
+				r->info.frame_samples = 1152;
+				break;
+			default:
+				return -1;
+			}
+			r->info.bitrate = be32(dd + 9);
+			es = dd + 13;
+			sz = dsz - 13;
+			continue;
+
+		case 5: // DecSpecificInfo
+			if (dlen > dsz)
+				return -1;
+			if (NULL == ffarr_append(&r->conf, dd, dlen))
+				return -1;
+			return 0;
+		}
+
+		if (dlen > dsz)
+			break;
+		es = dd + dlen;
+		sz = dsz - dlen;
+	}
+	return (r->info.codec != 0) ? 0 : -1;
+}
+
+/** Get encoder delay and padding from iTunes item "----" (name: "iTunSMPB").
+Data: " 00000000 DELAY PADDING SAMPLES ..." (hex). */
+static void ilst_smpb(mp4rd *r, const byte *d, size_t len)
+{
+	char type[4];
+	uint64 size;
+	size_t sz;
+
+	while (len >= 8) {
+		int n = box_hdr(d, len, type, &size);
+		if (n <= 0 || size > len)
+			break;
+		const byte *item = d + n, *b;
+		size_t itemlen = size - n;
+		d += size;
+		len -= size;
+
+		if (ffmemcmp(type, "----", 4)
+			|| NULL == (b = box_find(item, itemlen, "name", &sz))
+			|| !(sz == 4 + 8 && !ffmemcmp(b + 4, "iTunSMPB", 8))
+			|| NULL == (b = box_find(item, itemlen, "data", &sz))
+			|| sz < 8)
+			continue;
+
+		ffstr s, v;
+		uint64 val[3];
+		ffstr_set(&s, b + 8, sz - 8);
+		for (uint i = 0;  i != 3;  i++) {
+			const char *p = ffs_skipof(s.ptr, s.len, " ", 1);
+			ffstr_shift(&s, p - s.ptr);
+			ffs_split2by(s.ptr, s.len, ' ', &v, &s);
+			if (v.len == 0
+				|| v.len != ffs_toint(v.ptr, v.len, &val[i], FFS_INT64 | FFS_INTHEX))
+				return;
+		}
+		r->info.enc_delay = val[1];
+		r->info.end_padding = val[2];
+		return;
+	}
+}
+
+/** Find the first audio track and get its sample tables. */
+static int moov_parse(mp4rd *r, const byte *d, size_t len)
+{
+	static const char *const p_hdlr[] = { "mdia", "hdlr" };
+	static const char *const p_mdhd[] = { "mdia", "mdhd" };
+	static const char *const p_stbl[] = { "mdia", "minf", "stbl" };
+	static const char *const p_ilst[] = { "udta", "meta" };
+	char type[4];
+	uint64 size;
+	const byte *trak = NULL, *stbl, *b;
+	size_t traklen = 0, stbllen, sz;
+
+	for (const byte *p = d;  p + 8 <= d + len; ) {
+		int n = box_hdr(p, d + len - p, type, &size);
+		if (n <= 0 || size > (size_t)(d + len - p))
+			break;
+		if (!ffmemcmp(type, "trak", 4)) {
+			b = box_path(p + n, size - n, p_hdlr, FFCNT(p_hdlr), &sz);
+			if (b != NULL && sz >= 12 && !ffmemcmp(b + 8, "soun", 4)) {
+				trak = p + n;
+				traklen = size - n;
+				break;
+			}
+		}
+		p += size;
+	}
+	if (trak == NULL) {
+		r->err = "no audio track";
+		return -1;
+	}
+
+	if (NULL != (b = box_find(trak, traklen, "tkhd", &sz)) && sz >= 24)
+		r->track_id = be32(b + ((b[0] == 1) ? 20 : 12));
+
+	if (NULL == (b = box_path(trak, traklen, p_mdhd, FFCNT(p_mdhd), &sz)) || sz < 24) {
+		r->err = "bad mdhd";
+		return -1;
+	}
+	r->timescale = be32(b + ((b[0] == 1) ? 20 : 12));
+	if (r->timescale == 0) {
+		r->err = "bad mdhd";
+		return -1;
+	}
+
+	if (NULL == (stbl = box_path(trak, traklen, p_stbl, FFCNT(p_stbl), &stbllen))
+		|| NULL == (b = box_find(stbl, stbllen, "stsd", &sz))
+		|| 0 != stsd_parse(r, b, sz)) {
+		r->err = "unsupported codec";
+		return -1;
+	}
+	if (r->info.sample_rate == 0)
+		r->info.sample_rate = r->timescale;
+	ffstr_set2(&r->info.conf, &r->conf);
+
+	// copy sample tables
+	const byte *stts, *stsc, *stsz, *stco;
+	size_t stts_sz, stsc_sz, stsz_sz, stco_sz;
+	stts = box_find(stbl, stbllen, "stts", &stts_sz);
+	stsc = box_find(stbl, stbllen, "stsc", &stsc_sz);
+	stsz = box_find(stbl, stbllen, "stsz", &stsz_sz);
+	if (NULL == (stco = box_find(stbl, stbllen, "stco", &stco_sz))) {
+		stco = box_find(stbl, stbllen, "co64", &stco_sz);
+		r->co64 = 1;
+	}
+	if (stts == NULL || stsc == NULL || stsz == NULL || stco == NULL
+		|| stts_sz < 8 || stsc_sz < 8 || stsz_sz < 12 || stco_sz < 8) {
+		r->err = "bad sample table";
+		return -1;
+	}
+	r->stts_n = be32(stts + 4);
+	r->stsc_n = be32(stsc + 4);
+	r->stsz_const = be32(stsz + 4);
+	r->nsamples = be32(stsz + 8);
+	r->stco_n = be32(stco + 4);
+	if (r->stts_n > (stts_sz - 8) / 8
+		|| r->stsc_n > (stsc_sz - 8) / 12
+		|| (r->stsz_const == 0 && r->nsamples > (stsz_sz - 12) / 4)
+		|| r->stco_n > (stco_sz - 8) / ((r->co64) ? 8 : 4)) {
+		r->err = "bad sample table";
+		return -1;
+	}
+
+	size_t n_stts = r->stts_n * 8, n_stsc = r->stsc_n * 12
+		, n_stsz = (r->stsz_const == 0) ? r->nsamples * 4 : 0
+		, n_stco = r->stco_n * ((r->co64) ? 8 : 4);
+	if (NULL == ffarr_alloc(&r->tabs, n_stts + n_stsc + n_stsz + n_stco + 1))
+		return -1;
+	byte *t = (byte*)r->tabs.ptr;
+	ffmemcpy(t, stts + 8, n_stts);
+	r->stts = t,  t += n_stts;
+	ffmemcpy(t, stsc + 8, n_stsc);
+	r->stsc = t,  t += n_stsc;
+	ffmemcpy(t, stsz + 12, n_stsz);
+	r->stsz = t,  t += n_stsz;
+	ffmemcpy(t, stco + 8, n_stco);
+	r->stco = t;
+
+	if (r->nsamples != 0
+		&& (r->stts_n == 0 || r->stsc_n == 0 || r->stco_n == 0
+			|| 0 != tab_index(r))) {
+		r->err = "bad sample table";
+		return -1;
+	}
+
+	// fragments
+	if (NULL != (b = box_find(d, len, "mvex", &sz))) {
+		r->mvex = 1;
+		r->info.fragmented = 1;
+		const byte *trex = b;
+		size_t trexlen = sz;
+		while (NULL != (b = box_find(trex, trexlen, "trex", &sz))) {
+			if (sz >= 24 && be32(b + 4) == r->track_id) {
+				r->def_dur = be32(b + 12);
+				r->def_size = be32(b + 16);
+				break;
+			}
+			trexlen -= (b + sz) - trex;
+			trex = b + sz;
+		}
+	}
+
+	r->info.total_samples = r->table_dur * r->info.sample_rate / r->timescale;
+	if (r->info.total_samples == 0 && NULL != (b = box_find(d, len, "mvhd", &sz)) && sz >= 20) {
+		// fragmented: duration from mvhd
+		uint64 dur = (b[0] == 1) ? be64(b + 24) : be32(b + 16);
+		uint ts = be32(b + ((b[0] == 1) ? 20 : 12));
+		if (ts != 0)
+			r->info.total_samples = dur * r->info.sample_rate / ts;
+	}
+
+	if (NULL != (b = box_path(d, len, p_ilst, FFCNT(p_ilst), &sz)) && sz >= 4) {
+		const byte *ilst = box_find(b + 4, sz - 4, "ilst", &sz);
+		if (ilst != NULL) {
+			r->ilst_off = ilst - d;
+			r->ilst_len = sz;
+			ilst_smpb(r, ilst, sz);
+		}
+	}
+	return 0;
+}
+
+static const char tag_ids[][4] = {
+	"\xa9""ART", "\xa9""alb", "\xa9""cmt", "\xa9""day", "\xa9""gen", "\xa9""nam", "\xa9""wrt",
+	"aART", "trkn",
+};
+static const char *const tag_names[] = {
+	"artist", "album", "comment", "date", "genre", "title", "composer",
+	"albumartist", "tracknumber",
+};
+
+/** Get the next tag from 'ilst'.
+Return 0 if there are no more tags. */
+static int tag_next(mp4rd *r)
+{
+	const byte *d = (byte*)r->moov.ptr + r->ilst_off;
+	char type[4];
+	uint64 size;
+	size_t sz;
+
+	while (r->ilst_len >= 8) {
+		int n = box_hdr(d, r->ilst_len, type, &size);
+		if (n <= 0 || size > r->ilst_len)
+			break;
+		const byte *item = d + n;
+		size_t itemlen = size - n;
+		r->ilst_off += size;
+		r->ilst_len -= size;
+		d += size;
+
+		uint i;
+		for (i = 0;  i != FFCNT(tag_ids);  i++) {
+			if (!ffmemcmp(type, tag_ids[i], 4))
+				break;
+		}
+		const byte *data;
+		if (i == FFCNT(tag_ids)
+			|| NULL == (data = box_find(item, itemlen, "data", &sz))
+			|| sz < 8)
+			continue;
+
+		ffstr_setz(&r->tagname, tag_names[i]);
+		if (!ffmemcmp(type, "trkn", 4)) {
+			if (sz < 8 + 4)
+				continue;
+			uint k = ffs_fromint(be16(data + 8 + 2), r->tagbuf, sizeof(r->tagbuf), 0);
+			ffstr_set(&r->tagval, r->tagbuf, k);
+		} else {
+			ffstr_set(&r->tagval, data + 8, sz - 8);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+
+/** Parse 'moof' and get the samples of the audio track. */
+static int moof_parse(mp4rd *r, const byte *d, size_t len, uint64 moof_off)
+{
+	char type[4];
+	uint64 size;
+	size_t sz;
+	const byte *b;
+	uint64 time = r->frag_time;
+
+	r->fsamples.len = 0;
+	r->fi = 0;
+
+	for (const byte *p = d;  p + 8 <= d + len; ) {
+		int n = box_hdr(p, d + len - p, type, &size);
+		if (n <= 0 || size > (size_t)(d + len - p))
+			return -1;
+		const byte *traf = p + n;
+		size_t traflen = size - n;
+		p += size;
+		if (ffmemcmp(type, "traf", 4))
+			continue;
+
+		if (NULL == (b = box_find(traf, traflen, "tfhd", &sz)) || sz < 8)
+			return -1;
+		uint fl = be32(b) & 0xffffff;
+		if (be32(b + 4) != r->track_id)
+			continue;
+		uint64 base = moof_off;
+		uint dur = r->def_dur, fsize = r->def_size;
+		const byte *f = b + 8, *end = b + sz;
+		if (fl & 0x01) {
+			if (f + 8 > end)
+				return -1;
+			base = be64(f);
+			f += 8;
+		}
+		if (fl & 0x02)
+			f += 4;
+		if (fl & 0x08) {
+			if (f + 4 > end)
+				return -1;
+			dur = be32(f);
+			f += 4;
+		}
+		if (fl & 0x10) {
+			if (f + 4 > end)
+				return -1;
+			fsize = be32(f);
+			f += 4;
+		}
+
+		if (NULL != (b = box_find(traf, traflen, "tfdt", &sz)) && sz >= 8)
+			time = (b[0] == 1 && sz >= 12) ? be64(b + 4) : be32(b + 4);
+
+		// all 'trun' boxes
+		uint64 data_off = base;
+		const byte *t = traf;
+		size_t tlen = traflen;
+		while (NULL != (b = box_find(t, tlen, "trun", &sz))) {
+			tlen -= (b + sz) - t;
+			t = b + sz;
+			if (sz < 8)
+				return -1;
+			uint tfl = be32(b) & 0xffffff;
+			uint cnt = be32(b + 4);
+			const byte *e = b + 8, *eend = b + sz;
+			if (tfl & 0x01) {
+				if (e + 4 > eend)
+					return -1;
+				data_off = base + (int)be32(e);
+				e += 4;
+			}
+			if (tfl & 0x04)
+				e += 4;
+			uint esz = ((tfl & 0x100) ? 4 : 0) + ((tfl & 0x200) ? 4 : 0)
+				+ ((tfl & 0x400) ? 4 : 0) + ((tfl & 0x800) ? 4 : 0);
+			if (e > eend || (esz != 0 && cnt > (size_t)(eend - e) / esz))
+				return -1;
+
+			for (uint i = 0;  i != cnt;  i++) {
+				struct fsample *s;
+				if (NULL == (s = ffarr_pushT(&r->fsamples, struct fsample)))
+					return -1;
+				s->dur = dur;
+				s->size = fsize;
+				if (tfl & 0x100) {
+					s->dur = be32(e);
+					e += 4;
+				}
+				if (tfl & 0x200) {
+					s->size = be32(e);
+					e += 4;
+				}
+				e += ((tfl & 0x400) ? 4 : 0) + ((tfl & 0x800) ? 4 : 0);
+				s->off = data_off;
+				data_off += s->size;
+			}
+		}
+		break;
+	}
+
+	r->fpos = time;
+	const struct fsample *s = (void*)r->fsamples.ptr;
+	for (size_t i = 0;  i != r->fsamples.len;  i++) {
+		time += s[i].dur;
+	}
+	r->frag_time = time;
+
+	// save fragment position
+	const struct moofpos *mps = (void*)r->moofs.ptr;
+	if (r->moofs.len < MP4RD_MOOFS_MAX
+		&& (r->moofs.len == 0 || moof_off > mps[r->moofs.len - 1].off)) {
+		struct moofpos *mp;
+		if (NULL != (mp = ffarr_pushT(&r->moofs, struct moofpos))) {
+			mp->off = moof_off;
+			mp->time = r->fpos;
+		}
+	}
+	return 0;
+}
+
+/** Parse 'sidx' that references media segments. */
+static int sidx_parse(mp4rd *r, const byte *d, size_t len, uint64 sidx_end)
+{
+	if (len < 24)
+		return -1;
+	uint ts = be32(d + 8);
+	uint64 t, off;
+	const byte *e;
+	if (d[0] == 0) {
+		t = be32(d + 12);
+		off = be32(d + 16);
+		e = d + 20;
+	} else {
+		if (len < 32)
+			return -1;
+		t = be64(d + 12);
+		off = be64(d + 20);
+		e = d + 28;
+	}
+	uint n = be16(e + 2);
+	e += 4;
+	if (ts == 0 || n > (size_t)(d + len - e) / 12)
+		return -1;
+
+	off += sidx_end;
+	for (uint i = 0;  i != n;  i++, e += 12) {
+		if (e[0] & 0x80) {
+			r->sidx.len = 0; // hierarchical index isn't supported
+			return 0;
+		}
+		struct moofpos *p;
+		if (NULL == (p = ffarr_pushT(&r->sidx, struct moofpos)))
+			return -1;
+		p->off = off;
+		p->time = t * r->timescale / ts;
+		off += be32(e) & 0x7fffffff;
+		t += be32(e + 4);
+	}
+	return 0;
+}
+
+
+mp4rd* mp4rd_create(uint64 total_size)
+{
+	mp4rd *r;
+	if (NULL == (r = ffmem_new(mp4rd)))
+		return NULL;
+	r->total_size = total_size;
+	r->fseek = (uint64)-1;
+	return r;
+}
+
+void mp4rd_free(mp4rd *r)
+{
+	ffarr_free(&r->buf);
+	ffarr_free(&r->conf);
+	ffarr_free(&r->moov);
+	ffarr_free(&r->tabs);
+	ffarr_free(&r->skip);
+	ffarr_free(&r->fsamples);
+	ffarr_free(&r->moofs);
+	ffarr_free(&r->sidx);
+	ffmem_free(r);
+}
+
+const struct mp4rd_info* mp4rd_info(mp4rd *r)
+{
+	return &r->info;
+}
+
+void mp4rd_tag(mp4rd *r, ffstr *name, ffstr *val)
+{
+	*name = r->tagname;
+	*val = r->tagval;
+}
+
+uint64 mp4rd_frame(mp4rd *r, ffstr *frame)
+{
+	*frame = r->frame;
+	return r->frame_pos;
+}
+
+const char* mp4rd_errstr(mp4rd *r)
+{
+	return r->err;
+}
+
+static uint64 to_samples(mp4rd *r, uint64 t)
+{
+	return t * r->info.sample_rate / r->timescale;
+}
+
+void mp4rd_seek(mp4rd *r, uint64 sample)
+{
+	uint64 t = sample * r->timescale / r->info.sample_rate;
+
+	if (!r->mvex || t < r->table_dur) {
+		tab_seek(r, t);
+		r->st = ST_DATA;
+		return;
+	}
+
+	// fragments: start from the nearest known fragment
+	const struct moofpos *p = (void*)r->sidx.ptr;
+	size_t n = r->sidx.len;
+	if (n == 0 || (r->moofs.len != 0 && ((struct moofpos*)r->moofs.ptr)[r->moofs.len - 1].time > p[n - 1].time)) {
+		p = (void*)r->moofs.ptr;
+		n = r->moofs.len;
+	}
+	r->box_off = r->moov_end;
+	r->frag_time = r->table_dur;
+	for (size_t i = 0;  i != n;  i++) {
+		if (p[i].time > t)
+			break;
+		r->box_off = p[i].off;
+		r->frag_time = p[i].time;
+	}
+	r->fseek = t;
+	r->fsamples.len = 0;
+	r->st = ST_BOX;
+}
+
+int mp4rd_read(mp4rd *r, ffstr *in, uint fin, uint64 *seekoff)
+{
+	const byte *d;
+	char type[4];
+	uint64 size;
+	size_t sz;
+	int n, rc;
+
+	if (in->len != 0) {
+		if (NULL == ffarr_append(&r->buf, in->ptr, in->len)) {
+			r->err = "no memory";
+			return MP4RD_RERR;
+		}
+		ffstr_shift(in, in->len);
+	}
+
+	for (;;) {
+		switch (r->st) {
+
+		case ST_BOX:
+			if (r->total_size != 0 && r->box_off >= r->total_size)
+				goto eof;
+			if (0 != (rc = need(r, r->box_off, 16, &d))) {
+				if (rc < 0 && fin) {
+					if (r->buf.len < 8)
+						goto eof;
+					d = (byte*)r->buf.ptr;
+				} else {
+					*seekoff = r->seekoff;
+					return (rc < 0) ? MP4RD_RMORE : rc;
+				}
+			}
+			n = box_hdr(d, r->buf.len, type, &size);
+			if (n <= 0) {
+				r->err = "bad box";
+				return MP4RD_RERR;
+			}
+			r->box_size = size;
+			r->box_hlen = n;
+
+			if (!ffmemcmp(type, "moov", 4)) {
+				if (size > MP4RD_MOOV_MAX) {
+					r->err = "moov is too large";
+					return MP4RD_RERR;
+				}
+				r->st = ST_MOOV;
+				continue;
+			}
+
+			if (r->hdr_done && !ffmemcmp(type, "moof", 4)) {
+				if (size > MP4RD_MOOF_MAX) {
+					r->err = "moof is too large";
+					return MP4RD_RERR;
+				}
+				if (r->first_moof == 0)
+					r->first_moof = r->box_off;
+				r->st = ST_MOOF;
+				continue;
+			}
+
+			if (!ffmemcmp(type, "sidx", 4) && r->first_moof == 0 && r->sidx.len == 0
+				&& size <= MP4RD_MOOF_MAX) {
+				r->st = ST_SIDX;
+				continue;
+			}
+
+			if (size == (uint64)-1)
+				goto eof;
+			r->box_off += size;
+			continue;
+
+		case ST_MOOV:
+		case ST_SIDX:
+		case ST_MOOF:
+			size = r->box_size;
+			n = r->box_hlen;
+			if (0 != (rc = need(r, r->box_off, size, &d))) {
+				if (rc < 0 && fin) {
+					r->err = "incomplete box";
+					return MP4RD_RERR;
+				}
+				*seekoff = r->seekoff;
+				return (rc < 0) ? MP4RD_RMORE : rc;
+			}
+
+			if (r->st == ST_MOOV) {
+				if (r->hdr_done) {
+					r->box_off += size;
+					r->st = ST_BOX;
+					continue;
+				}
+				if (size < MP4RD_MOOV_MIN
+					&& NULL == box_find(d + n, size - n, "mvex", &sz))
+					return MP4RD_RFALLBACK; // small and not fragmented
+				if (0 != moov_parse(r, d + n, size - n))
+					return MP4RD_RERR;
+				r->moov_end = r->box_off + size;
+				if (r->ilst_len != 0
+					&& NULL == ffarr_append(&r->moov, d + n, size - n)) {
+					r->err = "no memory";
+					return MP4RD_RERR;
+				}
+				r->box_off += size;
+				r->hdr_done = 1;
+				r->st = ST_HDR;
+				return MP4RD_RHDR;
+			}
+
+			if (r->st == ST_SIDX) {
+				if (0 != sidx_parse(r, d + n, size - n, r->box_off + size))
+					r->sidx.len = 0;
+				r->box_off += size;
+				r->st = ST_BOX;
+				continue;
+			}
+
+			if (0 != moof_parse(r, d + n, size - n, r->box_off)) {
+				r->err = "bad moof";
+				return MP4RD_RERR;
+			}
+			r->box_off += size;
+			r->st = ST_FDATA;
+			continue;
+
+		case ST_HDR:
+			r->st = ST_TAGS;
+			// fallthrough
+
+		case ST_TAGS:
+			if (r->moov.len != 0 && tag_next(r))
+				return MP4RD_RTAG;
+			ffarr_free(&r->moov);
+			r->st = ST_DATA;
+			continue;
+
+		case ST_DATA: {
+			struct cursor *c = &r->cur;
+			if (c->sample == r->nsamples) {
+				if (r->mvex) {
+					r->box_off = r->moov_end;
+					r->frag_time = r->table_dur;
+					r->st = ST_BOX;
+					continue;
+				}
+				r->st = ST_DONE;
+				continue;
+			}
+			uint sz = sample_size(r, c->sample);
+			if (sz > MP4RD_FRAME_MAX) {
+				r->err = "frame is too large";
+				return MP4RD_RERR;
+			}
+			if (0 != (rc = need(r, c->off, sz, &d))) {
+				if (rc < 0 && fin) {
+					r->err = "incomplete frame";
+					return MP4RD_RERR;
+				}
+				*seekoff = r->seekoff;
+				return (rc < 0) ? MP4RD_RMORE : rc;
+			}
+			ffstr_set(&r->frame, d, sz);
+			r->frame_pos = to_samples(r, c->pos);
+			if (0 != cur_next(r, c)) {
+				r->err = "bad sample table";
+				return MP4RD_RERR;
+			}
+			return MP4RD_RDATA;
+		}
+
+		case ST_FDATA: {
+			const struct fsample *s = (void*)r->fsamples.ptr;
+			if (r->fseek != (uint64)-1) {
+				// skip the samples before the target
+				while (r->fi != r->fsamples.len && r->fpos + s[r->fi].dur <= r->fseek) {
+					r->fpos += s[r->fi].dur;
+					r->fi++;
+				}
+				if (r->fi != r->fsamples.len)
+					r->fseek = (uint64)-1;
+			}
+			if (r->fi == r->fsamples.len) {
+				r->st = ST_BOX;
+				continue;
+			}
+			s = &s[r->fi];
+			if (s->size > MP4RD_FRAME_MAX) {
+				r->err = "frame is too large";
+				return MP4RD_RERR;
+			}
+			if (0 != (rc = need(r, s->off, s->size, &d))) {
+				if (rc < 0 && fin) {
+					r->err = "incomplete frame";
+					return MP4RD_RERR;
+				}
+				*seekoff = r->seekoff;
+				return (rc < 0) ? MP4RD_RMORE : rc;
+			}
+			ffstr_set(&r->frame, d, s->size);
+			r->frame_pos = to_samples(r, r->fpos);
+			r->fpos += s->dur;
+			r->fi++;
+			return MP4RD_RDATA;
+		}
+
+		case ST_DONE:
+			return MP4RD_RDONE;
+		}
+	}
+
+eof:
+	if (!r->hdr_done) {
+		r->err = "no moov box";
+		return MP4RD_RERR;
+	}
+	r->st = ST_DONE;
+	return MP4RD_RDONE;
+}
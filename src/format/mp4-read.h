@@ -0,0 +1,66 @@
+/** MP4 reader with compact sample tables;  fragmented MP4.
+Copyright (c) 2020 Simon Zolin */
+
+#pragma once
+#include <fmedia.h>
+
+
+typedef struct mp4rd mp4rd;
+
+enum MP4RD_R {
+	MP4RD_RMORE,
+	MP4RD_RSEEK, // read data at 'seekoff'
+	MP4RD_RHDR, // mp4rd_info() is ready
+	MP4RD_RTAG, // mp4rd_tag()
+	MP4RD_RDATA, // mp4rd_frame()
+	MP4RD_RDONE,
+	MP4RD_RFALLBACK, // 'moov' is small and the file isn't fragmented:  use the default reader from the beginning
+	MP4RD_RERR,
+};
+
+enum MP4RD_CODEC {
+	MP4RD_AAC = 1,
+	MP4RD_ALAC,
+	MP4RD_MPEG1,
+};
+
+struct mp4rd_info {
+	uint codec; // enum MP4RD_CODEC
+	uint sample_rate;
+	uint channels;
+	uint bits;
+	uint bitrate;
+	uint frame_samples; // 0: variable
+	uint64 total_samples;
+	uint enc_delay, end_padding; // iTunSMPB
+	ffstr conf; // codec configuration data (AAC: AudioSpecificConfig;  ALAC: magic cookie)
+	uint fragmented :1;
+};
+
+/**
+@total_size: file size;  0: unknown */
+extern mp4rd* mp4rd_create(uint64 total_size);
+
+extern void mp4rd_free(mp4rd *r);
+
+/**
+@in: input data;  all data is consumed
+@fin: the end of file is reached
+@seekoff: (output) offset to read the next data from
+Return enum MP4RD_R. */
+extern int mp4rd_read(mp4rd *r, ffstr *in, uint fin, uint64 *seekoff);
+
+extern const struct mp4rd_info* mp4rd_info(mp4rd *r);
+
+/** Get the next tag (after MP4RD_RTAG). */
+extern void mp4rd_tag(mp4rd *r, ffstr *name, ffstr *val);
+
+/** Get the frame data (after MP4RD_RDATA);  valid until the next call.
+Return the audio position of the frame. */
+extern uint64 mp4rd_frame(mp4rd *r, ffstr *frame);
+
+/** Seek to the frame containing the target sample.
+Must be called after the header is read. */
+extern void mp4rd_seek(mp4rd *r, uint64 sample);
+
+extern const char* mp4rd_errstr(mp4rd *r);
@@ -2,6 +2,7 @@
 Copyright (c) 2016 Simon Zolin */
 
 #include <fmedia.h>
+#include <format/mp4-read.h>
 
 #include <FF/mformat/mp4.h>
 #include <FF/mtags/mmtag.h>
@@ -16,8 +17,17 @@ static const fmed_queue *qu;
 
 typedef struct mp4 {
 	ffmp4 mp;
+	mp4rd *rd; // fragmented or very large file
 	uint state;
 	uint seeking :1;
+
+	// stream copy with --seek
+	uint hold :1; // hold codec configuration data until the first frame is read
+	uint pending :1; // the first frame is passed on the next call
+	ffarr conf;
+	uint64 copy_target; // sample position where the output starts
+	ffstr pend;
+	uint64 pend_pos;
 } mp4;
 
 typedef struct mp4_out {
@@ -53,6 +63,9 @@ static const fmed_filter mp4_output = {
 };
 
 static void mp4_meta(mp4 *m, fmed_filt *d);
+static int mp4_rd_decode(mp4 *m, fmed_filt *d);
+static uint64 mp4_copy_seek(mp4 *m, uint64 seek, uint delay, uint frame_samples);
+static int mp4_copy_first(mp4 *m, fmed_filt *d, uint64 pos, const ffstr *frame);
 static int mp4_out_addmeta(mp4_out *m, fmed_filt *d);
 
 
@@ -91,6 +104,8 @@ static void mp4_destroy(void)
 }
 
 
+enum { I_HDR, I_DATA1, I_DATA, };
+
 static void* mp4_in_create(fmed_filt *d)
 {
 	mp4 *m = ffmem_tcalloc1(mp4);
@@ -99,8 +114,10 @@ static void* mp4_in_create(fmed_filt *d)
 
 	ffmp4_init(&m->mp);
 
-	if ((int64)d->input.size != FMED_NULL)
+	if ((int64)d->input.size != FMED_NULL) {
 		m->mp.total_size = d->input.size;
+		m->rd = mp4rd_create(d->input.size);
+	}
 
 	d->datatype = "mp4";
 	return m;
@@ -109,6 +126,9 @@ static void* mp4_in_create(fmed_filt *d)
 static void mp4_in_free(void *ctx)
 {
 	mp4 *m = ctx;
+	if (m->rd != NULL)
+		mp4rd_free(m->rd);
+	ffarr_free(&m->conf);
 	ffmp4_close(&m->mp);
 	ffmem_free(m);
 }
@@ -135,7 +155,6 @@ static void mp4_meta(mp4 *m, fmed_filt *d)
 */
 static int mp4_in_decode(void *ctx, fmed_filt *d)
 {
-	enum { I_HDR, I_DATA1, I_DATA, };
 	mp4 *m = ctx;
 	int r;
 
@@ -144,6 +163,26 @@ static int mp4_in_decode(void *ctx, fmed_filt *d)
 		return FMED_RLASTOUT;
 	}
 
+	if (m->pending) {
+		m->pending = 0;
+		d->audio.pos = m->pend_pos;
+		d->out = m->pend.ptr,  d->outlen = m->pend.len;
+		d->meta_block = 0;
+		return FMED_RDATA;
+	}
+
+	if (m->rd != NULL) {
+		if (-1 != (r = mp4_rd_decode(m, d)))
+			return r;
+		// the file is handled by ffmp4 from the beginning
+		mp4rd_free(m->rd);
+		m->rd = NULL;
+		m->state = 0;
+		d->datalen = 0;
+		d->input.seek = 0;
+		return FMED_RMORE;
+	}
+
 	m->mp.data = d->data;
 	m->mp.datalen = d->datalen;
 
@@ -156,12 +195,20 @@ static int mp4_in_decode(void *ctx, fmed_filt *d)
 		if ((int64)d->audio.seek != FMED_NULL && !m->seeking) {
 			m->seeking = 1;
 			uint64 seek = ffpcm_samples(d->audio.seek, m->mp.fmt.sample_rate);
+			if (d->stream_copy && m->state == I_DATA1) {
+				if (NULL == ffarr_copy(&m->conf, d->out, d->outlen))
+					return FMED_RERR;
+				seek = mp4_copy_seek(m, seek, m->mp.enc_delay, m->mp.frame_samples);
+				m->state = I_DATA;
+			}
 			ffmp4_seek(&m->mp, seek);
 			if (d->stream_copy)
 				d->audio.seek = FMED_NULL;
 		}
 		if (m->state == I_DATA1) {
 			m->state = I_DATA;
+			if (d->stream_copy)
+				d->meta_block = 1;
 			return FMED_RDATA;
 		}
 		//fallthrough
@@ -194,8 +241,8 @@ static int mp4_in_decode(void *ctx, fmed_filt *d)
 
 			} else if (m->mp.codec == FFMP4_AAC) {
 				filt = "aac.decode";
+				fmed_setval("audio_enc_delay", m->mp.enc_delay);
 				if (!d->stream_copy) {
-					fmed_setval("audio_enc_delay", m->mp.enc_delay);
 					fmed_setval("audio_end_padding", m->mp.end_padding);
 					d->audio.bitrate = (m->mp.aac_brate != 0) ? m->mp.aac_brate : ffmp4_bitrate(&m->mp);
 				}
@@ -242,8 +289,14 @@ static int mp4_in_decode(void *ctx, fmed_filt *d)
 			dbglog(core, d->trk, NULL, "passing %L bytes at position #%U"
 				, m->mp.outlen, d->audio.pos);
 			d->data = m->mp.data,  d->datalen = m->mp.datalen;
-			d->out = m->mp.out,  d->outlen = m->mp.outlen;
 			m->seeking = 0;
+			if (m->hold) {
+				ffstr fr;
+				ffstr_set(&fr, m->mp.out, m->mp.outlen);
+				return mp4_copy_first(m, d, d->audio.pos, &fr);
+			}
+			d->out = m->mp.out,  d->outlen = m->mp.outlen;
+			d->meta_block = 0;
 			return FMED_RDATA;
 
 		case FFMP4_RDONE:
@@ -271,6 +324,166 @@ static int mp4_in_decode(void *ctx, fmed_filt *d)
 	//unreachable
 }
 
+/** Read fragmented or very large file.
+Return -1 if ffmp4 must be used instead. */
+static int mp4_rd_decode(mp4 *m, fmed_filt *d)
+{
+	const struct mp4rd_info *info;
+	ffstr in, name, val;
+	uint64 off;
+	int r;
+
+	for (;;) {
+
+		if (m->state != I_HDR
+			&& (int64)d->audio.seek != FMED_NULL && !m->seeking) {
+			m->seeking = 1;
+			mp4rd_seek(m->rd, ffpcm_samples(d->audio.seek, d->audio.fmt.sample_rate));
+			if (d->stream_copy)
+				d->audio.seek = FMED_NULL;
+			m->state = I_DATA; // skip the pending frame
+		}
+
+		if (m->state == I_DATA1) {
+			m->state = I_DATA;
+			d->audio.pos = mp4rd_frame(m->rd, &val);
+			d->out = val.ptr,  d->outlen = val.len;
+			return FMED_RDATA;
+		}
+
+		ffstr_set(&in, d->data, d->datalen);
+		d->datalen = 0;
+		r = mp4rd_read(m->rd, &in, !!(d->flags & FMED_FLAST), &off);
+		switch (r) {
+		case MP4RD_RMORE:
+			if (d->flags & FMED_FLAST) {
+				warnlog(core, d->trk, "mp4", "file is incomplete");
+				d->outlen = 0;
+				return FMED_RDONE;
+			}
+			return FMED_RMORE;
+
+		case MP4RD_RSEEK:
+			d->input.seek = off;
+			return FMED_RMORE;
+
+		case MP4RD_RFALLBACK:
+			return -1;
+
+		case MP4RD_RHDR: {
+			info = mp4rd_info(m->rd);
+			dbglog1(d->trk, "codec:%u  magic:%*xb  total_samples:%U  format:%u/%u  fragmented:%u"
+				, info->codec, info->conf.len, info->conf.ptr, info->total_samples
+				, info->sample_rate, info->channels, info->fragmented);
+			d->audio.fmt.format = FFPCM_16;
+			if (info->codec == MP4RD_ALAC && (info->bits == 24 || info->bits == 32))
+				d->audio.fmt.format = (info->bits == 24) ? FFPCM_24 : FFPCM_32;
+			d->audio.fmt.sample_rate = info->sample_rate;
+			d->audio.fmt.channels = info->channels;
+			d->audio.total = info->total_samples;
+			d->audio.bitrate = info->bitrate;
+
+			const char *filt = "aac.decode";
+			if (info->codec == MP4RD_ALAC) {
+				filt = "alac.decode";
+			} else if (info->codec == MP4RD_MPEG1) {
+				filt = "mpeg.decode";
+			} else {
+				fmed_setval("audio_enc_delay", info->enc_delay);
+				if (!d->stream_copy)
+					fmed_setval("audio_end_padding", info->end_padding);
+			}
+
+			if (info->frame_samples != 0)
+				fmed_setval("audio_frame_samples", info->frame_samples);
+
+			if (!d->stream_copy
+				&& 0 != d->track->cmd2(d->trk, FMED_TRACK_ADDFILT, (void*)filt))
+				return FMED_RERR;
+			break;
+		}
+
+		case MP4RD_RTAG:
+			mp4rd_tag(m->rd, &name, &val);
+			dbglog(core, d->trk, "mp4", "tag: %S: %S", &name, &val);
+			d->track->meta_set(d->trk, &name, &val, FMED_QUE_TMETA);
+			break;
+
+		case MP4RD_RDATA:
+			if (m->state == I_HDR) {
+				// all tags are read:  pass codec configuration data, then the pending frame
+				if (d->input_info)
+					return FMED_ROK;
+				info = mp4rd_info(m->rd);
+				d->out = info->conf.ptr,  d->outlen = info->conf.len;
+				m->state = I_DATA1;
+				if ((int64)d->audio.seek != FMED_NULL) {
+					m->seeking = 1;
+					uint64 seek = ffpcm_samples(d->audio.seek, d->audio.fmt.sample_rate);
+					if (d->stream_copy) {
+						if (NULL == ffarr_copy(&m->conf, info->conf.ptr, info->conf.len))
+							return FMED_RERR;
+						seek = mp4_copy_seek(m, seek, info->enc_delay, info->frame_samples);
+						d->audio.seek = FMED_NULL;
+						m->state = I_DATA;
+						mp4rd_seek(m->rd, seek);
+						continue;
+					}
+					mp4rd_seek(m->rd, seek);
+					m->state = I_DATA;
+				}
+				if (d->stream_copy)
+					d->meta_block = 1;
+				return FMED_RDATA;
+			}
+			d->audio.pos = mp4rd_frame(m->rd, &val);
+			dbglog(core, d->trk, NULL, "passing %L bytes at position #%U"
+				, val.len, d->audio.pos);
+			m->seeking = 0;
+			if (m->hold)
+				return mp4_copy_first(m, d, d->audio.pos, &val);
+			d->out = val.ptr,  d->outlen = val.len;
+			d->meta_block = 0;
+			return FMED_RDATA;
+
+		case MP4RD_RDONE:
+			d->outlen = 0;
+			return FMED_RLASTOUT;
+
+		case MP4RD_RERR:
+			errlog(core, d->trk, "mp4", "mp4rd_read(): %s", mp4rd_errstr(m->rd));
+			return FMED_RERR;
+		}
+	}
+}
+
+/** Stream copy: prepare seeking to the target sample.
+The output starts from the frame preceding the target one, so the decoder has the data to overlap with;
+ the encoder delay of the output is set after the first frame is read.
+@delay: encoder delay of the input
+Return the sample to seek to. */
+static uint64 mp4_copy_seek(mp4 *m, uint64 seek, uint delay, uint frame_samples)
+{
+	m->hold = 1;
+	m->copy_target = seek + delay;
+	return (m->copy_target > frame_samples) ? m->copy_target - frame_samples : 0;
+}
+
+/** Stream copy after seeking: pass the codec configuration data, then the first frame on the next call. */
+static int mp4_copy_first(mp4 *m, fmed_filt *d, uint64 pos, const ffstr *frame)
+{
+	uint64 delay = (m->copy_target > pos) ? m->copy_target - pos : 0;
+	dbglog1(d->trk, "stream copy: first frame at sample %U, encoder delay: %U"
+		, pos, delay);
+	fmed_setval("audio_enc_delay", delay);
+	m->hold = 0;
+	m->pending = 1;
+	m->pend = *frame;
+	m->pend_pos = pos;
+	d->out = m->conf.ptr,  d->outlen = m->conf.len;
+	d->meta_block = 1;
+	return FMED_RDATA;
+}
 
 static void* mp4_out_create(fmed_filt *d)
 {
@@ -0,0 +1,427 @@
+/** OGG seeking: bisection on page granule positions;  page reader.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+Seeking:
+The target page (the last page with granule < target) is within [lo_end..hi.off):
+ lo: the page with granule < target (lo_end: the end of this page),
+ hi: granule >= target;  initially it's the end of file.
+1. Guess the offset by interpolating granule positions within the range,
+   request the data at this offset and find the next page there.
+2. If the page's granule < target, it's the new 'lo';  otherwise the range ends at the guessed offset
+   (there's no page between the guessed offset and this page).
+   If there's no page after the guessed offset at all (it's after the last page), the range ends there too.
+3. When the range is small enough or the reads limit is reached, the pages are read sequentially from 'lo'.
+Every page found during bisection is stored in cache, so the next seek requests start with a narrower range.
+
+Reading:
+The packets of a page are returned with the position equal to the granule of the previous page.
+The packets completed on 'lo' page are skipped, but the packet continued on the next page is returned:
+ this way the first returned packet starts exactly at 'lo' granule.
+A packet continued from the page we didn't read is skipped.
+Only the pages of the active logical stream (the serial number of the stream being decoded) are used.
+Page headers are validated with ogg_checksum() from FF's OGG reader.
+*/
+
+#include <format/ogg-seek.h>
+#include <FF/mformat/ogg.h>
+#include <FF/array.h>
+
+
+enum {
+	OGGSK_WINDOW = 64 * 1024, // read sequentially if the range is smaller than this
+	OGGSK_MARGIN = 16 * 1024, // guess a bit before the interpolated offset
+	OGGSK_MAXREADS = 12,
+	OGGSK_SCAN = 2 * OGG_MAXPAGE, // max. data to scan for a page after the guessed offset
+	OGGSK_CACHE_MAX = 4096,
+};
+
+struct pgpos {
+	uint64 granule;
+	uint64 off;
+};
+
+struct page {
+	uint64 granule;
+	uint serial;
+	uint flags;
+	uint nsegs;
+	uint hdrlen, size;
+};
+
+enum ST {
+	ST_NONE,
+	ST_FIND, // bisection: find the first page after the guessed offset
+	ST_READ, // read pages sequentially
+	ST_PAGE, // return packets from the current page
+	ST_DONE,
+};
+
+struct ogg_seek {
+	uint st;
+	uint serial; // the active logical stream
+	uint64 total_samples, total_size;
+
+	ffarr buf; // input data
+	uint64 off; // file offset of buf[0]
+
+	// bisection
+	uint64 target;
+	struct pgpos lo, hi;
+	uint64 lo_end;
+	uint64 guess, prev_guess;
+	uint nreads;
+	ffarr cache; // struct pgpos[] sorted by offset
+
+	// reading
+	struct page page;
+	uint iseg; // the next segment in the current page
+	uint dataoff; // offset of the next segment's data within the page
+	uint64 pos; // position of the current page's packets
+	ffarr pkt; // packet continued on the next page
+	uint first_page :1; // skip the packets completed on 'lo' page
+	uint pkt_cont :1; // 'pkt' contains a part of the packet
+	const char *err;
+};
+
+
+/** Parse page at the beginning of data.
+Return 1 if the page is valid;  0 if more data is needed;  -1 if it's not a page. */
+static int page_parse(ogg_seek *s, const byte *d, size_t len, struct page *pg)
+{
+	const ogg_hdr *h = (void*)d;
+
+	if (0 != ffmemcmp(d, "OggS", ffmin(len, 4)))
+		return -1;
+	if (len < sizeof(ogg_hdr))
+		return 0;
+	if (h->version != 0 || (h->flags & ~(OGG_FCONTINUED | OGG_FFIRST | OGG_FLAST)))
+		return -1;
+
+	pg->nsegs = h->nsegments;
+	pg->hdrlen = sizeof(ogg_hdr) + pg->nsegs;
+	if (len < pg->hdrlen)
+		return 0;
+
+	pg->size = pg->hdrlen;
+	for (uint i = 0;  i != pg->nsegs;  i++) {
+		pg->size += h->segments[i];
+	}
+	if (len < pg->size)
+		return 0;
+
+	if (ffint_ltoh32(h->crc) != ogg_checksum((void*)d, pg->size))
+		return -1;
+
+	pg->flags = h->flags;
+	pg->granule = ffint_ltoh64(h->granulepos);
+	pg->serial = ffint_ltoh32(h->serial);
+	return 1;
+}
+
+/** Find a valid page within data.
+Return offset of the page;  -1 if more data is needed;  -2 if there's no page. */
+static ssize_t page_find(ogg_seek *s, const byte *d, size_t len, uint fin, struct page *pg)
+{
+	for (size_t i = 0;  i != len;  i++) {
+		if (d[i] != 'O')
+			continue;
+		int r = page_parse(s, d + i, len - i, pg);
+		if (r == 1)
+			return i;
+		if (r == 0 && !fin)
+			return -1;
+	}
+	return (fin || len >= OGGSK_SCAN) ? -2 : -1;
+}
+
+static void cache_add(ogg_seek *s, uint64 granule, uint64 off)
+{
+	struct pgpos *p = (void*)s->cache.ptr;
+	size_t i;
+	for (i = 0;  i != s->cache.len;  i++) {
+		if (p[i].off == off)
+			return;
+		if (p[i].off > off)
+			break;
+	}
+	if (s->cache.len == OGGSK_CACHE_MAX
+		|| NULL == ffarr_pushT(&s->cache, struct pgpos))
+		return;
+	p = (void*)s->cache.ptr;
+	memmove(&p[i + 1], &p[i], (s->cache.len - 1 - i) * sizeof(struct pgpos));
+	p[i].granule = granule;
+	p[i].off = off;
+}
+
+/** Set the initial range from cache. */
+static void range_init(ogg_seek *s)
+{
+	const struct pgpos *p = (void*)s->cache.ptr;
+	s->lo.granule = 0,  s->lo.off = 0,  s->lo_end = 0;
+	s->hi.granule = s->total_samples,  s->hi.off = s->total_size;
+	for (size_t i = 0;  i != s->cache.len;  i++) {
+		if (p[i].granule < s->target) {
+			s->lo = p[i];
+			s->lo_end = p[i].off + 1; // page size isn't cached:  the next page is after this offset
+		} else {
+			s->hi = p[i];
+			break;
+		}
+	}
+}
+
+ogg_seek* oggsk_create(uint64 total_samples, uint64 total_size, uint serial)
+{
+	ogg_seek *s;
+	if (NULL == (s = ffmem_new(ogg_seek)))
+		return NULL;
+	s->serial = serial;
+	s->total_samples = total_samples;
+	s->total_size = total_size;
+	return s;
+}
+
+void oggsk_free(ogg_seek *s)
+{
+	ffarr_free(&s->buf);
+	ffarr_free(&s->cache);
+	ffarr_free(&s->pkt);
+	ffmem_free(s);
+}
+
+void oggsk_start(ogg_seek *s, uint64 target)
+{
+	s->target = target;
+	s->nreads = 0;
+	s->prev_guess = (uint64)-1;
+	s->buf.len = 0; // the caller's read position is unknown:  the first request is always RSEEK
+	range_init(s);
+	s->st = ST_NONE;
+}
+
+const char* oggsk_errstr(ogg_seek *s)
+{
+	return s->err;
+}
+
+/** Remove data from the beginning of buffer. */
+static void buf_shift(ogg_seek *s, size_t n)
+{
+	_ffarr_rmleft(&s->buf, n, sizeof(char));
+	s->off += n;
+}
+
+/** Get the next offset to read. */
+static uint64 next_guess(ogg_seek *s)
+{
+	uint64 g;
+	if (s->hi.granule > s->lo.granule) {
+		double k = (double)(s->target - s->lo.granule) / (s->hi.granule - s->lo.granule);
+		g = s->lo_end + (uint64)(k * (s->hi.off - s->lo_end));
+		g = (g > s->lo_end + OGGSK_MARGIN) ? g - OGGSK_MARGIN : s->lo_end;
+	} else {
+		g = s->lo_end + (s->hi.off - s->lo_end) / 2;
+	}
+	// bisect on every other read, so a bad interpolation (e.g. VBR) doesn't make us crawl
+	if (g == s->prev_guess || (s->nreads & 1))
+		g = s->lo_end + (s->hi.off - s->lo_end) / 2;
+	return g;
+}
+
+/** Request data at the specified offset. */
+static void seek_to(ogg_seek *s, uint64 off)
+{
+	if (off >= s->off && off <= s->off + s->buf.len) {
+		// the data is already here
+		buf_shift(s, off - s->off);
+		return;
+	}
+	s->buf.len = 0;
+	s->off = off;
+}
+
+static void read_start(ogg_seek *s)
+{
+	s->pos = s->lo.granule;
+	s->first_page = 1;
+	s->pkt_cont = 0;
+	s->pkt.len = 0;
+	s->st = ST_READ;
+}
+
+int oggsk_read(ogg_seek *s, ffstr *in, uint fin, uint64 *seekoff, ffstr *pkt, uint64 *pos)
+{
+	struct page pg;
+	ssize_t r;
+
+	if (in->len != 0) {
+		if (NULL == ffarr_append(&s->buf, in->ptr, in->len)) {
+			s->err = "no memory";
+			return OGGSK_RERR;
+		}
+		ffstr_shift(in, in->len);
+	}
+
+	for (;;) {
+		switch (s->st) {
+
+		case ST_NONE:
+			if ((s->lo.granule != 0 && s->hi.off <= s->lo_end + OGGSK_WINDOW)
+				|| s->hi.off <= s->lo_end
+				|| s->nreads == OGGSK_MAXREADS) {
+
+				if (s->lo.granule == 0)
+					return OGGSK_RFALLBACK;
+				seek_to(s, s->lo.off);
+				read_start(s);
+				if (s->buf.len == 0) {
+					*seekoff = s->lo.off;
+					return OGGSK_RSEEK;
+				}
+				continue;
+			}
+
+			s->guess = next_guess(s);
+			s->prev_guess = s->guess;
+			s->nreads++;
+			s->st = ST_FIND;
+			seek_to(s, s->guess);
+			if (s->buf.len == 0) {
+				*seekoff = s->guess;
+				return OGGSK_RSEEK;
+			}
+			continue;
+
+		case ST_FIND: {
+			r = page_find(s, (byte*)s->buf.ptr, s->buf.len, fin, &pg);
+			if (r == -1) {
+				if (fin)
+					r = -2;
+				else
+					return OGGSK_RMORE;
+			}
+
+			if (r == -2) {
+				// no page after this offset
+				s->hi.off = s->guess;
+				s->st = ST_NONE;
+				s->buf.len = 0;
+				continue;
+			}
+
+			uint64 off = s->off + r;
+			if (pg.serial != s->serial
+				|| pg.granule == (uint64)-1 || (pg.flags & OGG_FFIRST)) {
+				// a page of another logical stream or no packet ends on this page: check the next one
+				buf_shift(s, r + pg.size);
+				continue;
+			}
+			cache_add(s, pg.granule, off);
+
+			if (off >= s->hi.off) {
+				s->hi.off = s->guess;
+			} else if (pg.granule < s->target) {
+				s->lo.granule = pg.granule;
+				s->lo.off = off;
+				s->lo_end = off + pg.size;
+			} else {
+				s->hi.granule = pg.granule;
+				s->hi.off = s->guess;
+			}
+			s->st = ST_NONE;
+			continue;
+		}
+
+		case ST_READ:
+			r = page_find(s, (byte*)s->buf.ptr, s->buf.len, fin, &pg);
+			if (r == -1)
+				return OGGSK_RMORE;
+			if (r == -2) {
+				if (fin)
+					return OGGSK_RDONE;
+				buf_shift(s, s->buf.len); // garbage
+				return OGGSK_RMORE;
+			}
+			buf_shift(s, r);
+			if (pg.serial != s->serial) {
+				buf_shift(s, pg.size);
+				continue;
+			}
+
+			s->page = pg;
+			s->iseg = 0;
+			s->dataoff = pg.hdrlen;
+			s->st = ST_PAGE;
+			// fallthrough
+
+		case ST_PAGE: {
+			const byte *d = (byte*)s->buf.ptr;
+			uint n = 0, i;
+
+			if (s->iseg == s->page.nsegs) {
+				// the page is processed
+				if (s->page.granule != (uint64)-1)
+					s->pos = s->page.granule;
+				buf_shift(s, s->page.size);
+				s->first_page = 0;
+				if (s->page.flags & OGG_FLAST) {
+					s->st = ST_DONE;
+					return OGGSK_RDONE;
+				}
+				s->st = ST_READ;
+				continue;
+			}
+
+			// get the segments of the next packet
+			for (i = s->iseg;  i != s->page.nsegs;  i++) {
+				n += d[sizeof(ogg_hdr) + i];
+				if (d[sizeof(ogg_hdr) + i] != 255)
+					break;
+			}
+			uint complete = (i != s->page.nsegs);
+			if (complete)
+				i++;
+			ffstr data;
+			ffstr_set(&data, d + s->dataoff, n);
+			uint first = (s->iseg == 0);
+			s->iseg = i;
+			s->dataoff += n;
+
+			if (first && (s->page.flags & OGG_FCONTINUED)) {
+				if (!s->pkt_cont)
+					continue; // the beginning of this packet is on the page we didn't read
+			} else if (s->pkt_cont) {
+				// the previous packet wasn't completed on the previous page
+				s->pkt_cont = 0;
+				s->pkt.len = 0;
+			}
+
+			if (complete && s->first_page) {
+				s->pkt_cont = 0;
+				s->pkt.len = 0;
+				continue;
+			}
+
+			if (!complete || s->pkt_cont) {
+				if (NULL == ffarr_append(&s->pkt, data.ptr, data.len)) {
+					s->err = "no memory";
+					return OGGSK_RERR;
+				}
+				s->pkt_cont = !complete;
+				if (!complete)
+					continue;
+				ffstr_set2(&data, &s->pkt);
+				s->pkt.len = 0;
+			}
+
+			*pkt = data;
+			*pos = s->pos;
+			return OGGSK_RPKT;
+		}
+
+		case ST_DONE:
+			return OGGSK_RDONE;
+		}
+	}
+}
@@ -0,0 +1,40 @@
+/** OGG seeking: bisection on page granule positions;  page reader.
+Copyright (c) 2020 Simon Zolin */
+
+#pragma once
+#include <fmedia.h>
+
+
+typedef struct ogg_seek ogg_seek;
+
+enum OGGSK_R {
+	OGGSK_RMORE,
+	OGGSK_RSEEK, // read data at 'seekoff'
+	OGGSK_RPKT,
+	OGGSK_RDONE,
+	OGGSK_RFALLBACK, // the target is within the first audio page:  use the default seek method
+	OGGSK_RERR,
+};
+
+/**
+@total_samples: the granule of the last page
+@total_size: file size
+@serial: serial number of the logical stream being decoded;  pages of other streams are skipped */
+extern ogg_seek* oggsk_create(uint64 total_samples, uint64 total_size, uint serial);
+
+extern void oggsk_free(ogg_seek *s);
+
+/** Start seeking to the target sample.
+The pages found by the previous seek requests are used to narrow the range. */
+extern void oggsk_start(ogg_seek *s, uint64 target);
+
+/** Find the target page and read packets starting from it.
+@in: input data;  all data is consumed
+@fin: the end of file is reached
+@seekoff: (output) offset to read the next data from
+@pkt: (output) packet data;  valid until the next call
+@pos: (output) position of the packet's page
+Return enum OGGSK_R. */
+extern int oggsk_read(ogg_seek *s, ffstr *in, uint fin, uint64 *seekoff, ffstr *pkt, uint64 *pos);
+
+extern const char* oggsk_errstr(ogg_seek *s);
@@ -2,6 +2,7 @@
 Copyright (c) 2015 Simon Zolin */
 
 #include <fmedia.h>
+#include <format/ogg-seek.h>
 
 #include <FF/mformat/ogg.h>
 #include <FF/audio/opus.h>
@@ -17,11 +18,17 @@ static const fmed_core *core;
 
 typedef struct fmed_ogg {
 	ffogg og;
+	ogg_seek *sk;
+	uint64 seek_target;
 	uint sample_rate;
+	uint preskip; // Opus:  granule positions include the encoder delay
+	uint64 copy_base; // stream copy:  granule positions are shifted so that the output starts at this sample
+	uint64 copy_gpos; // stream copy:  the last granule position passed
 	uint hdr :1;
 	uint seek_ready :1;
 	uint seek_done :1;
 	uint stmcopy :1;
+	uint sk_active :1; // reading via 'sk' after a seek request
 } fmed_ogg;
 
 typedef struct ogg_out {
@@ -155,6 +162,8 @@ static void* ogg_open(fmed_filt *d)
 static void ogg_close(void *ctx)
 {
 	fmed_ogg *o = ctx;
+	if (o->sk != NULL)
+		oggsk_free(o->sk);
 	ffogg_close(&o->og);
 	ffmem_free(o);
 }
@@ -169,6 +178,61 @@ static const char* ogg_enc_mod(const char *fn)
 	return "vorbis.encode";
 }
 
+/** Read packets via seek engine.
+Return -1 if the default seek method should be used. */
+static int ogg_sk_read(fmed_ogg *o, fmed_filt *d)
+{
+	ffstr in, pkt;
+	uint64 off, pos;
+	ffstr_set(&in, o->og.data, o->og.datalen);
+	o->og.datalen = 0;
+
+	int r = oggsk_read(o->sk, &in, !!(d->flags & FMED_FLAST), &off, &pkt, &pos);
+	switch (r) {
+	case OGGSK_RMORE:
+		if (d->flags & FMED_FLAST) {
+			dbglog(core, d->trk, "ogg", "no eos page");
+			d->outlen = 0;
+			return FMED_RLASTOUT;
+		}
+		return FMED_RMORE;
+
+	case OGGSK_RSEEK:
+		d->input.seek = off;
+		return FMED_RMORE;
+
+	case OGGSK_RPKT:
+		dbglog(core, d->trk, "ogg", "packet: %L bytes, pos: %U", pkt.len, pos);
+		d->audio.pos = pos;
+		o->seek_done = 0;
+		d->out = pkt.ptr,  d->outlen = pkt.len;
+		return FMED_RDATA;
+
+	case OGGSK_RDONE:
+		d->outlen = 0;
+		return FMED_RLASTOUT;
+
+	case OGGSK_RFALLBACK:
+		o->sk_active = 0;
+		return -1;
+	}
+
+	errlog(core, d->trk, "ogg", "oggsk_read(): %s", oggsk_errstr(o->sk));
+	return FMED_RERR;
+}
+
+/** Stream copy: get granule position for the output.
+After seeking, positions start from the target sample;  the first page's granule position is less than
+ the number of samples in it, so the decoder discards the samples before the target. */
+static uint64 ogg_copy_gpos(fmed_ogg *o, uint64 gpos)
+{
+	if (gpos == 0 || gpos == (uint64)-1)
+		return gpos;
+	gpos = (gpos > o->copy_base) ? gpos - o->copy_base : 0;
+	o->copy_gpos = gpos;
+	return gpos;
+}
+
 #define VORBIS_HEAD_STR  "\x01vorbis"
 #define FLAC_HEAD_STR  "\x7f""FLAC"
 
@@ -192,9 +256,23 @@ static int ogg_decode(void *ctx, fmed_filt *d)
 
 		if (o->seek_ready && (int64)d->audio.seek != FMED_NULL && !o->seek_done) {
 			o->seek_done = 1;
-			ffogg_seek(&o->og, ffpcm_samples(d->audio.seek, o->sample_rate));
-			if (o->stmcopy)
+			o->seek_target = ffpcm_samples(d->audio.seek, o->sample_rate);
+			if (o->sk != NULL) {
+				oggsk_start(o->sk, o->seek_target);
+				o->sk_active = 1;
+			} else
+				ffogg_seek(&o->og, o->seek_target);
+			if (o->stmcopy) {
+				o->copy_base = o->seek_target;
 				d->audio.seek = FMED_NULL;
+			}
+		}
+
+		if (o->sk_active) {
+			if (-1 != (r = ogg_sk_read(o, d)))
+				return r;
+			dbglog(core, d->trk, "ogg", "seek: target is within the first page");
+			ffogg_seek(&o->og, o->seek_target);
 		}
 
 		r = ffogg_read(&o->og);
@@ -213,8 +291,11 @@ static int ogg_decode(void *ctx, fmed_filt *d)
 			const char *dec;
 			if (ffs_matchz(o->og.out.ptr, o->og.out.len, VORBIS_HEAD_STR))
 				dec = "vorbis.decode";
-			else if (ffs_matchz(o->og.out.ptr, o->og.out.len, FFOPUS_HEAD_STR))
+			else if (ffs_matchz(o->og.out.ptr, o->og.out.len, FFOPUS_HEAD_STR)) {
 				dec = "opus.decode";
+				if (o->og.out.len >= 12)
+					o->preskip = (byte)o->og.out.ptr[10] | ((uint)(byte)o->og.out.ptr[11] << 8);
+			}
 			else if (ffs_matchz(o->og.out.ptr, o->og.out.len, FLAC_HEAD_STR)) {
 				dec = "flac.ogg-in";
 			} else {
@@ -242,6 +323,9 @@ static int ogg_decode(void *ctx, fmed_filt *d)
 			d->audio.total = o->og.total_samples;
 			o->sample_rate = d->audio.fmt.sample_rate;
 			o->seek_ready = 1;
+			if (!o->stmcopy && o->og.seekable
+				&& o->og.total_samples != 0 && o->og.total_size != 0)
+				o->sk = oggsk_create(o->og.total_samples, o->og.total_size, o->og.serial);
 			d->audio.bitrate = ffogg_bitrate(&o->og, d->audio.fmt.sample_rate);
 			break;
 
@@ -269,7 +353,7 @@ data:
 		uint64 set_gpos = (uint64)-1;
 		if (ffogg_page_last_pkt(&o->og)) {
 			fmed_setval("ogg_flush", 1);
-			set_gpos = ffogg_granulepos(&o->og);
+			set_gpos = ogg_copy_gpos(o, ffogg_granulepos(&o->og));
 		}
 		fmed_setval("ogg_granpos", set_gpos);
 	}
@@ -283,6 +367,10 @@ data:
 			&& ffpcm_time(d->audio.pos, o->sample_rate) >= (uint64)d->audio.until) {
 			dbglog(core, d->trk, NULL, "reached time %Ums", d->audio.until);
 			r = FMED_RLASTOUT;
+			// the last page ends exactly at the target sample:  the decoder discards the rest
+			uint64 gpos = ogg_copy_gpos(o, ffpcm_samples(d->audio.until, o->sample_rate) + o->preskip);
+			fmed_setval("ogg_flush", 1);
+			fmed_setval("ogg_granpos", ffmax(gpos, o->copy_gpos));
 			d->audio.until = FMED_NULL;
 		}
 	}
@@ -0,0 +1,252 @@
+/** Persistent seek index.
+Copyright (c) 2020 Simon Zolin */
+
+#include <format/seekidx.h>
+#include <FF/path.h>
+#include <FFOS/error.h>
+#include <ffbase/murmurhash3.h>
+
+
+extern const fmed_core *core;
+
+#undef dbglog
+#undef syswarnlog
+#define dbglog(...)  fmed_dbglog(core, NULL, "seekidx", __VA_ARGS__)
+#define syswarnlog(...)  fmed_syswarnlog(core, NULL, "seekidx", __VA_ARGS__)
+
+#define SI_SIGN  "FMSI"
+enum {
+	SI_VER = 1,
+	SI_MAXPTS = 4 * 1024 * 1024,
+};
+
+
+static size_t varint_write(byte *d, uint64 n)
+{
+	size_t i = 0;
+	while (n >= 0x80) {
+		d[i++] = (byte)(n | 0x80);
+		n >>= 7;
+	}
+	d[i++] = (byte)n;
+	return i;
+}
+
+/** Return the number of bytes read;  0 on error. */
+static size_t varint_read(const byte *d, size_t len, uint64 *n)
+{
+	uint64 r = 0;
+	for (size_t i = 0;  i != ffmin(len, 10);  i++) {
+		r |= (uint64)(d[i] & 0x7f) << (i * 7);
+		if (!(d[i] & 0x80)) {
+			*n = r;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+/** Parse cache file data.  Return 0 if it matches the input file. */
+static int si_parse(seekidx *si, ffstr data)
+{
+	uint64 v[5], n;
+	size_t r;
+
+	if (!ffstr_match(&data, SI_SIGN, 4) || data.len < 5 || (byte)data.ptr[4] != SI_VER)
+		return -1;
+	ffstr_shift(&data, 5);
+
+	// size, mtime, total, path length, number of points
+	for (uint i = 0;  i != 4;  i++) {
+		if (0 == (r = varint_read((byte*)data.ptr, data.len, &v[i])))
+			return -1;
+		ffstr_shift(&data, r);
+	}
+	if (v[3] > data.len)
+		return -1;
+	ffstr path;
+	ffstr_set(&path, data.ptr, v[3]);
+	if (v[0] != si->size || v[1] != si->mtime
+		|| !ffstr_eqz(&path, si->path))
+		return -1;
+	ffstr_shift(&data, v[3]);
+	if (0 == (r = varint_read((byte*)data.ptr, data.len, &v[4]))
+		|| v[4] > SI_MAXPTS)
+		return -1;
+	ffstr_shift(&data, r);
+
+	if (NULL == ffarr_allocT(&si->pts, v[4], struct seekidx_pt))
+		return -1;
+	struct seekidx_pt *pt = (void*)si->pts.ptr, prev = {};
+	for (n = 0;  n != v[4];  n++) {
+		uint64 ds, doff;
+		if (0 == (r = varint_read((byte*)data.ptr, data.len, &ds)))
+			return -1;
+		ffstr_shift(&data, r);
+		if (0 == (r = varint_read((byte*)data.ptr, data.len, &doff)))
+			return -1;
+		ffstr_shift(&data, r);
+		pt[n].sample = prev.sample + ds;
+		pt[n].off = prev.off + doff;
+		prev = pt[n];
+	}
+	si->pts.len = n;
+	si->total = v[2];
+	return 0;
+}
+
+int seekidx_open(seekidx *si, const char *fn, uint step)
+{
+	fffileinfo fi;
+	ffarr buf = {};
+	int rc = -1;
+
+	if (!core->props->seek_index)
+		return -1;
+
+	if (0 != fffile_infofn(fn, &fi) || fffile_isdir(fffile_infoattr(&fi)))
+		return -1;
+	si->size = fffile_infosize(&fi);
+	fftime t = fffile_infomtime(&fi);
+	si->mtime = (uint64)fftime_sec(&t) * 1000000 + fftime_usec(&t);
+	si->step = ffmax(step, 1);
+
+	if (NULL == (si->path = ffsz_alcopyz(fn)))
+		return -1;
+	uint h1 = murmurhash3(fn, ffsz_len(fn), 0x12345678);
+	uint h2 = murmurhash3(fn, ffsz_len(fn), 0x87654321);
+	if (NULL == (si->cache_fn = ffsz_alfmt("%sseekidx/%08xu%08xu.idx"
+		, core->props->user_path, h1, h2)))
+		return -1;
+
+	if (0 == fffile_readall(&buf, si->cache_fn, 64 * 1024 * 1024)) {
+		ffstr d;
+		ffstr_set2(&d, &buf);
+		if (0 == si_parse(si, d)) {
+			si->loaded = 1;
+			dbglog("%s: loaded %L points", si->cache_fn, si->pts.len);
+			rc = 0;
+			goto end;
+		}
+		dbglog("%s: cache entry is stale", si->cache_fn);
+		ffarr_free(&si->pts);
+	}
+
+	si->recording = 1;
+	rc = 1;
+
+end:
+	ffarr_free(&buf);
+	return rc;
+}
+
+void seekidx_close(seekidx *si)
+{
+	ffarr_free(&si->pts);
+	ffmem_safefree0(si->cache_fn);
+	ffmem_safefree0(si->path);
+}
+
+void seekidx_add(seekidx *si, uint64 sample, uint64 off)
+{
+	if (!si->recording)
+		return;
+
+	if (si->pts.len != 0) {
+		const struct seekidx_pt *last = (void*)(si->pts.ptr + (si->pts.len - 1) * sizeof(struct seekidx_pt));
+		if (sample < last->sample + si->step)
+			return;
+		if (off <= last->off || si->pts.len == SI_MAXPTS) {
+			si->recording = 0; // samples or offsets go backwards: don't trust this data
+			ffarr_free(&si->pts);
+			return;
+		}
+	}
+
+	struct seekidx_pt *pt;
+	if (NULL == (pt = ffarr_pushT(&si->pts, struct seekidx_pt))) {
+		si->recording = 0;
+		return;
+	}
+	pt->sample = sample;
+	pt->off = off;
+}
+
+int seekidx_save(seekidx *si, uint64 total)
+{
+	ffarr buf = {}, fname = {};
+	fffd f = FF_BADFD;
+	int rc = -1;
+
+	if (!si->recording || si->pts.len == 0)
+		return 0;
+	si->recording = 0;
+
+	size_t pathlen = ffsz_len(si->path);
+	if (NULL == ffarr_alloc(&buf, 5 + 5 * 10 + pathlen + si->pts.len * 2 * 10))
+		goto end;
+	byte *d = (byte*)buf.ptr;
+	size_t i = 0;
+	ffmemcpy(d, SI_SIGN, 4);
+	d[4] = SI_VER;
+	i = 5;
+	i += varint_write(&d[i], si->size);
+	i += varint_write(&d[i], si->mtime);
+	i += varint_write(&d[i], total);
+	i += varint_write(&d[i], pathlen);
+	ffmemcpy(&d[i], si->path, pathlen);
+	i += pathlen;
+	i += varint_write(&d[i], si->pts.len);
+
+	const struct seekidx_pt *pt = (void*)si->pts.ptr;
+	struct seekidx_pt prev = {};
+	for (size_t n = 0;  n != si->pts.len;  n++) {
+		i += varint_write(&d[i], pt[n].sample - prev.sample);
+		i += varint_write(&d[i], pt[n].off - prev.off);
+		prev = pt[n];
+	}
+	buf.len = i;
+
+	// write to a temporary file and then rename, so parallel readers never see partial data
+	if (0 == ffstr_catfmt(&fname, "%s.tmp%Z", si->cache_fn))
+		goto end;
+	if (FF_BADFD == (f = fffile_open(fname.ptr, FFO_CREATE | FFO_TRUNC | FFO_WRONLY))) {
+		if (0 != ffdir_make_path(fname.ptr, 0) && fferr_last() != EEXIST)
+			goto end;
+		if (FF_BADFD == (f = fffile_open(fname.ptr, FFO_CREATE | FFO_TRUNC | FFO_WRONLY)))
+			goto end;
+	}
+	if (buf.len != (size_t)fffile_write(f, buf.ptr, buf.len))
+		goto end;
+	fffile_safeclose(f);
+	if (0 != fffile_rename(fname.ptr, si->cache_fn))
+		goto end;
+
+	dbglog("%s: saved %L points (%L bytes)", si->cache_fn, si->pts.len, buf.len);
+	rc = 0;
+
+end:
+	if (rc != 0)
+		syswarnlog("saving seek index to %s", si->cache_fn);
+	FF_SAFECLOSE(f, FF_BADFD, fffile_close);
+	ffarr_free(&fname);
+	ffarr_free(&buf);
+	return rc;
+}
+
+const struct seekidx_pt* seekidx_find(seekidx *si, uint64 sample)
+{
+	const struct seekidx_pt *pt = (void*)si->pts.ptr;
+	size_t lo = 0, hi = si->pts.len;
+	if (!si->loaded || hi == 0 || sample < pt[0].sample)
+		return NULL;
+
+	while (hi - lo > 1) {
+		size_t m = lo + (hi - lo) / 2;
+		if (pt[m].sample <= sample)
+			lo = m;
+		else
+			hi = m;
+	}
+	return &pt[lo];
+}
@@ -0,0 +1,62 @@
+/** Persistent seek index: exact (sample, file offset) pairs of an input file.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+The index is built while the file is decoded from the beginning without seeking:
+ each audio frame's position is passed to seekidx_add().
+When the end of file is reached, the index is written to the cache directory
+ ("{user_path}/seekidx/"), and the next time the file is opened
+ the reader finds the exact position of the target frame with seekidx_find().
+
+Cache file format:
+ "FMSI" VER(1)
+ VARINT(FILE_SIZE) VARINT(FILE_MTIME) VARINT(TOTAL_SAMPLES) VARINT(PATH_LEN) PATH
+ VARINT(N) {VARINT(sample - prev_sample) VARINT(off - prev_off)}[N]
+VARINT: unsigned LEB128 (7 bits per byte, the lowest bits first, bit 7 is set if more bytes follow).
+The cache entry is valid only if file path, size and modification time match.
+*/
+
+#pragma once
+#include <fmedia.h>
+
+
+struct seekidx_pt {
+	uint64 sample;
+	uint64 off;
+};
+
+typedef struct seekidx {
+	ffarr pts; // struct seekidx_pt[]
+	char *cache_fn;
+	char *path;
+	uint64 size;
+	uint64 mtime;
+	uint64 total;
+	uint step; // min. distance between points (samples)
+	uint loaded :1; // the index is read from cache
+	uint recording :1; // the points are being added sequentially from the file beginning
+} seekidx;
+
+/** Prepare the index for the input file and load it from cache.
+@step: min. distance between points (samples)
+Return 0 if the index is loaded;  1 if the index should be built;  -1 if disabled or on error. */
+extern int seekidx_open(seekidx *si, const char *fn, uint step);
+
+extern void seekidx_close(seekidx *si);
+
+/** Add the position of the next frame (while recording).
+The point is stored only if it's at least 'step' samples after the previous one. */
+extern void seekidx_add(seekidx *si, uint64 sample, uint64 off);
+
+/** Stop recording because the reader has seeked. */
+static FFINL void seekidx_stop(seekidx *si)
+{
+	si->recording = 0;
+}
+
+/** Write the index to cache after the whole file has been read. */
+extern int seekidx_save(seekidx *si, uint64 total);
+
+/** Find the last point at or before the target sample.
+Return NULL if there's no such point. */
+extern const struct seekidx_pt* seekidx_find(seekidx *si, uint64 sample);
@@ -0,0 +1,643 @@
+/** MPEG-TS input.
+Copyright (c) 2020 Simon Zolin */
+
+#include <fmedia.h>
+
+#include <FF/audio/pcm.h>
+#include <FF/array.h>
+
+
+static const fmed_core *core;
+
+/*
+TS packet (188 bytes):
+ sync(0x47)  TEI(1) PUSI(1) priority(1) PID(13)  scrambling(2) adaptation(2) counter(4)
+ [adaptation field: length(8) ...]
+ [payload]
+
+PID 0 carries PAT which refers to PMT;  PMT lists elementary streams of the program.
+The payload of the audio PID is a sequence of PES packets:
+ prefix(0x000001) stream_id(8) length(16)  flags(16) header_length(8) [PTS(40)] ...  ES data
+
+ES data of all PES packets is collected into one buffer (the only copy of audio data)
+ from which ADTS or MPEG frames are returned without copying.
+A PES packet's PTS is applied to the frame starting at the beginning of its payload.
+A sequence of files (HLS segments) is processed as one stream:
+ discontinuities in continuity counter and PTS are tolerated,
+ the audio position is monotonic. */
+
+enum {
+	TS_PKT = 188,
+	TS_SYNC = 0x47,
+	TS_PID_PAT = 0,
+	TS_PTS_HZ = 90000,
+
+	// PMT stream types
+	TS_MPEG1_AUDIO = 0x03,
+	TS_MPEG2_AUDIO = 0x04,
+	TS_AAC_ADTS = 0x0f,
+};
+
+enum TS_CODEC {
+	TS_NONE,
+	TS_AAC,
+	TS_MPEG,
+};
+
+struct ts_frame {
+	uint len; // frame length (with header)
+	uint hdrlen;
+	uint samples;
+	uint sample_rate;
+	uint channels;
+	byte asc[2]; // AAC: AudioSpecificConfig
+};
+
+typedef struct fmed_ts {
+	uint state;
+	ffstr in; // input data
+	byte pkt[TS_PKT]; // incomplete packet from the previous input chunk
+	uint pktlen;
+	uint synced :1;
+	uint pes_hdr :1; // PES header isn't parsed yet
+	uint have_pts :1;
+	uint sync_warn :1;
+	uint cc_valid :1;
+
+	uint pmt_pid;
+	uint pid; // audio PID
+	uint codec; // enum TS_CODEC
+	uint cc; // continuity counter of the audio PID
+
+	ffarr es; // ES data
+	size_t es_off; // offset of the current frame within 'es'
+	uint64 es_total; // total ES bytes removed from 'es'
+	uint64 pts_esoff; // ES offset where the PES packet with PTS begins
+	uint64 pts;
+	int64 pts_last; // unwrapped PTS of the last packet
+	ffarr peshdr; // incomplete PES header
+
+	struct ts_frame fr;
+	uint sample_rate;
+	uint64 pos; // position of the next frame (samples)
+	int64 pts_base; // unwrapped PTS (in samples) at position 0
+	int64 seek; // target position (msec)
+	uint64 pkts;
+} fmed_ts;
+
+
+//FMEDIA MODULE
+static const void* ts_iface(const char *name);
+static int ts_sig(uint signo);
+static void ts_destroy(void);
+static const fmed_mod fmed_ts_mod = {
+	.ver = FMED_VER_FULL, .ver_core = FMED_VER_CORE,
+	&ts_iface, &ts_sig, &ts_destroy
+};
+
+//INPUT
+static void* ts_open(fmed_filt *d);
+static void ts_close(void *ctx);
+static int ts_process(void *ctx, fmed_filt *d);
+static const fmed_filter fmed_ts_input = {
+	&ts_open, &ts_process, &ts_close
+};
+
+
+FF_EXP const fmed_mod* fmed_getmod(const fmed_core *_core)
+{
+	core = _core;
+	return &fmed_ts_mod;
+}
+
+static const void* ts_iface(const char *name)
+{
+	if (!ffsz_cmp(name, "in"))
+		return &fmed_ts_input;
+	return NULL;
+}
+
+static int ts_sig(uint signo)
+{
+	switch (signo) {
+	case FMED_SIG_INIT:
+		ffmem_init();
+		return 0;
+	}
+	return 0;
+}
+
+static void ts_destroy(void)
+{
+}
+
+
+static void* ts_open(fmed_filt *d)
+{
+	fmed_ts *t;
+	if (NULL == (t = ffmem_new(fmed_ts)))
+		return NULL;
+	t->pmt_pid = (uint)-1;
+	t->pid = (uint)-1;
+	t->pts_last = -1;
+	t->seek = -1;
+	return t;
+}
+
+static void ts_close(void *ctx)
+{
+	fmed_ts *t = ctx;
+	ffarr_free(&t->es);
+	ffarr_free(&t->peshdr);
+	ffmem_free(t);
+}
+
+
+static const uint adts_rates[] = {
+	96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+
+/** Parse ADTS frame header.
+Return 0 on success. */
+static int adts_hdr(const byte *h, struct ts_frame *f)
+{
+	if (!(h[0] == 0xff && (h[1] & 0xf6) == 0xf0))
+		return -1;
+	uint profile = h[2] >> 6;
+	uint rate = (h[2] >> 2) & 0x0f;
+	uint chan = ((h[2] & 1) << 2) | (h[3] >> 6);
+	f->len = ((uint)(h[3] & 3) << 11) | ((uint)h[4] << 3) | (h[5] >> 5);
+	f->hdrlen = (h[1] & 1) ? 7 : 9;
+	if (rate >= FFCNT(adts_rates) || chan == 0 || f->len <= f->hdrlen)
+		return -1;
+	f->samples = ((h[6] & 3) + 1) * 1024;
+	f->sample_rate = adts_rates[rate];
+	f->channels = (chan == 7) ? 8 : chan;
+
+	// AudioSpecificConfig: object type(5) rate index(4) channels(4) ...
+	uint asc = ((profile + 1) << 11) | (rate << 7) | (chan << 3);
+	f->asc[0] = (byte)(asc >> 8),  f->asc[1] = (byte)asc;
+	return 0;
+}
+
+static const ushort mpeg_kbps[2][3][15] = {
+	{ // MPEG-1
+		{ 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 }, // L1
+		{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 }, // L2
+		{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 }, // L3
+	},
+	{ // MPEG-2, MPEG-2.5
+		{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+		{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+		{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+	},
+};
+static const ushort mpeg_rates[] = { 44100, 48000, 32000 };
+
+/** Parse MPEG audio frame header.
+Return 0 on success. */
+static int mpeg_hdr(const byte *h, struct ts_frame *f)
+{
+	if (!(h[0] == 0xff && (h[1] & 0xe0) == 0xe0))
+		return -1;
+	uint ver = (h[1] >> 3) & 3; // 0:2.5, 2:2, 3:1
+	uint layer = 4 - ((h[1] >> 1) & 3); // 1..3
+	uint br = h[2] >> 4;
+	uint rate = (h[2] >> 2) & 3;
+	uint pad = (h[2] >> 1) & 1;
+	if (ver == 1 || layer == 4 || br == 0 || br == 15 || rate == 3)
+		return -1;
+
+	uint v2 = (ver != 3);
+	f->sample_rate = mpeg_rates[rate] >> ((ver == 3) ? 0 : (ver == 2) ? 1 : 2);
+	uint bps = mpeg_kbps[v2][layer - 1][br] * 1000;
+	if (layer == 1) {
+		f->samples = 384;
+		f->len = (12 * bps / f->sample_rate + pad) * 4;
+	} else {
+		f->samples = (layer == 3 && v2) ? 576 : 1152;
+		f->len = f->samples / 8 * bps / f->sample_rate + pad;
+	}
+	f->hdrlen = 4;
+	f->channels = ((h[3] >> 6) == 3) ? 1 : 2;
+	return 0;
+}
+
+/** Parse PAT or PMT section.
+Return 0 on success. */
+static int ts_psi(fmed_ts *t, fmed_filt *d, uint pid, ffstr data, uint start)
+{
+	if (!start)
+		return 0; // a section never spans packets in practice
+
+	// pointer_field
+	uint ptr = (byte)data.ptr[0];
+	if (1 + ptr + 3 > data.len)
+		return -1;
+	ffstr_shift(&data, 1 + ptr);
+
+	const byte *s = (void*)data.ptr;
+	uint len = ((uint)(s[1] & 0x0f) << 8) | s[2];
+	if (3 + len > data.len || len < 9)
+		return -1;
+	// table_id(8) length(16) id(16) version(8) section(8) last_section(8) ... CRC(32)
+	const byte *e = s + 3 + len - 4;
+
+	if (pid == TS_PID_PAT) {
+		if (s[0] != 0x00)
+			return -1;
+		for (const byte *p = s + 8;  p + 4 <= e;  p += 4) {
+			uint prog = ((uint)p[0] << 8) | p[1];
+			uint ppid = ((uint)(p[2] & 0x1f) << 8) | p[3];
+			if (prog != 0) {
+				if (t->pmt_pid != ppid)
+					dbglog(core, d->trk, NULL, "PAT: program #%u  PMT PID:%xu", prog, ppid);
+				t->pmt_pid = ppid;
+				break;
+			}
+		}
+		return 0;
+	}
+
+	// PMT:  ... PCR_PID(16) program_info_length(16) [descriptors] {stream_type(8) PID(16) ES_info_length(16) [descriptors]}...
+	if (s[0] != 0x02 || s + 12 > e)
+		return -1;
+	const byte *p = s + 12 + (((uint)(s[10] & 0x0f) << 8) | s[11]);
+	for (;  p + 5 <= e;  p += 5 + (((uint)(p[3] & 0x0f) << 8) | p[4])) {
+		uint type = p[0];
+		uint spid = ((uint)(p[1] & 0x1f) << 8) | p[2];
+		uint codec = TS_NONE;
+		switch (type) {
+		case TS_AAC_ADTS:
+			codec = TS_AAC; break;
+		case TS_MPEG1_AUDIO:
+		case TS_MPEG2_AUDIO:
+			codec = TS_MPEG; break;
+		}
+		dbglog(core, d->trk, NULL, "PMT: stream type:%xu  PID:%xu", type, spid);
+		if (codec == TS_NONE)
+			continue;
+
+		if (t->pid == spid)
+			return 0;
+		if (t->codec != TS_NONE && t->codec != codec) {
+			errlog(core, d->trk, NULL, "audio codec has changed");
+			return -2;
+		}
+		if (t->pid != (uint)-1)
+			dbglog(core, d->trk, NULL, "audio PID has changed: %xu -> %xu", t->pid, spid);
+		t->pid = spid;
+		t->codec = codec;
+		t->pes_hdr = 0;
+		t->cc_valid = 0;
+		return 0;
+	}
+
+	if (t->pid == (uint)-1) {
+		errlog(core, d->trk, NULL, "no supported audio stream in PMT");
+		return -2;
+	}
+	return 0;
+}
+
+/** Parse PES header.
+Return the header length;  0 if more data is needed;  -1 on error. */
+static int ts_pes_hdr(fmed_ts *t, const byte *h, size_t len)
+{
+	if (len < 9)
+		return 0;
+	if (!(h[0] == 0 && h[1] == 0 && h[2] == 1))
+		return -1;
+	uint n = 9 + h[8];
+	if (len < n)
+		return 0;
+
+	if ((h[7] & 0x80) && h[8] >= 5) {
+		// '001x' PTS[32..30] 1  PTS[29..15] 1  PTS[14..0] 1
+		const byte *p = h + 9;
+		uint64 pts = ((uint64)((p[0] >> 1) & 7) << 30)
+			| ((uint64)p[1] << 22) | ((uint64)(p[2] >> 1) << 15)
+			| ((uint64)p[3] << 7) | (p[4] >> 1);
+		t->pts = pts;
+		t->pts_esoff = t->es_total + t->es.len;
+		t->have_pts = 1;
+	}
+	return n;
+}
+
+/** Process the payload of the audio PID. */
+static int ts_pes(fmed_ts *t, fmed_filt *d, ffstr data, uint start)
+{
+	if (start) {
+		t->pes_hdr = 1;
+		t->peshdr.len = 0;
+	}
+
+	if (t->pes_hdr) {
+		const byte *h = (void*)data.ptr;
+		size_t n = data.len;
+		if (t->peshdr.len != 0) {
+			if (NULL == ffarr_append(&t->peshdr, data.ptr, data.len))
+				return -1;
+			h = (void*)t->peshdr.ptr;
+			n = t->peshdr.len;
+		}
+
+		int r = ts_pes_hdr(t, h, n);
+		if (r < 0) {
+			warnlog(core, d->trk, NULL, "bad PES header (packet #%U)", t->pkts);
+			t->pes_hdr = 0;
+			return 0;
+		} else if (r == 0) {
+			if (t->peshdr.len == 0
+				&& NULL == ffarr_append(&t->peshdr, data.ptr, data.len))
+				return -1;
+			return 0;
+		}
+
+		// skip PES header
+		t->pes_hdr = 0;
+		if (t->peshdr.len != 0) {
+			ffstr_set(&data, t->peshdr.ptr + r, t->peshdr.len - r);
+			t->peshdr.len = 0;
+		} else {
+			ffstr_shift(&data, r);
+		}
+	}
+
+	if (NULL == ffarr_append(&t->es, data.ptr, data.len))
+		return -1;
+	return 0;
+}
+
+/** Process TS packet. */
+static int ts_pkt(fmed_ts *t, fmed_filt *d, const byte *p)
+{
+	t->pkts++;
+	uint start = !!(p[1] & 0x40);
+	uint pid = ((uint)(p[1] & 0x1f) << 8) | p[2];
+	uint adapt = (p[3] >> 4) & 3;
+	uint cc = p[3] & 0x0f;
+
+	if (p[1] & 0x80)
+		return 0; // transport error
+	if (!(adapt & 1))
+		return 0; // no payload
+
+	ffstr data;
+	ffstr_set(&data, p + 4, TS_PKT - 4);
+	if (adapt & 2) {
+		uint n = 1 + p[4];
+		if (n > data.len)
+			return 0;
+		ffstr_shift(&data, n);
+	}
+
+	if (pid == TS_PID_PAT || pid == t->pmt_pid) {
+		int r = ts_psi(t, d, pid, data, start);
+		if (r == -2)
+			return -1;
+		else if (r != 0)
+			warnlog(core, d->trk, NULL, "bad PSI section (packet #%U)", t->pkts);
+		return 0;
+	}
+
+	if (pid != t->pid)
+		return 0;
+
+	if (t->cc_valid) {
+		if (cc == t->cc)
+			return 0; // duplicate packet
+		if (cc != ((t->cc + 1) & 0x0f))
+			dbglog(core, d->trk, NULL, "discontinuity (packet #%U)", t->pkts);
+	}
+	t->cc = cc;
+	t->cc_valid = 1;
+
+	return ts_pes(t, d, data, start);
+}
+
+/** Get the next TS packet from input.
+Return NULL if more data is needed. */
+static const byte* ts_next(fmed_ts *t, fmed_filt *d)
+{
+	if (t->pktlen != 0) {
+		uint n = ffmin(TS_PKT - t->pktlen, t->in.len);
+		ffmemcpy(t->pkt + t->pktlen, t->in.ptr, n);
+		ffstr_shift(&t->in, n);
+		t->pktlen += n;
+		if (t->pktlen != TS_PKT)
+			return NULL;
+		t->pktlen = 0;
+		if (t->pkt[0] == TS_SYNC)
+			return t->pkt;
+		t->synced = 0;
+	}
+
+	while (t->in.len != 0) {
+		if (!t->synced) {
+			// find 2 consecutive packets
+			const char *s = ffs_find(t->in.ptr, t->in.len, TS_SYNC);
+			size_t skip = s - t->in.ptr;
+			if (skip == t->in.len) {
+				t->in.len = 0;
+				break;
+			}
+			if (skip + TS_PKT < t->in.len && (byte)s[TS_PKT] != TS_SYNC) {
+				ffstr_shift(&t->in, skip + 1);
+				continue;
+			}
+			if (skip != 0 || t->pkts != 0) {
+				if (!t->sync_warn)
+					warnlog(core, d->trk, NULL, "lost synchronization, skipped %L bytes", skip);
+				t->sync_warn = 1;
+			}
+			ffstr_shift(&t->in, skip);
+			t->synced = 1;
+		}
+
+		if (t->in.len < TS_PKT) {
+			ffmemcpy(t->pkt, t->in.ptr, t->in.len);
+			t->pktlen = t->in.len;
+			t->in.len = 0;
+			break;
+		}
+
+		const byte *p = (void*)t->in.ptr;
+		if (p[0] != TS_SYNC) {
+			t->synced = 0;
+			continue;
+		}
+		ffstr_shift(&t->in, TS_PKT);
+		return p;
+	}
+	return NULL;
+}
+
+/** Get the next audio frame from ES buffer.
+Return 0 on success;  1 if more data is needed. */
+static int ts_frame(fmed_ts *t, fmed_filt *d, ffstr *frame)
+{
+	struct ts_frame f;
+	for (;;) {
+		if (t->es.len - t->es_off < ((t->codec == TS_AAC) ? 7 : 4))
+			return 1;
+		const byte *h = (byte*)t->es.ptr + t->es_off;
+		int r = (t->codec == TS_AAC) ? adts_hdr(h, &f) : mpeg_hdr(h, &f);
+		if (r != 0
+			|| (t->fr.len != 0
+				&& (f.sample_rate != t->fr.sample_rate || f.channels != t->fr.channels))) {
+			// find the next frame header
+			if (!t->sync_warn)
+				warnlog(core, d->trk, NULL, "bad %s frame header at ES offset %U"
+					, (t->codec == TS_AAC) ? "ADTS" : "MPEG", t->es_total + t->es_off);
+			t->sync_warn = 1;
+			t->es_off = ffs_find(t->es.ptr + t->es_off + 1, t->es.len - t->es_off - 1, 0xff) - t->es.ptr;
+			continue;
+		}
+		if (f.len > t->es.len - t->es_off)
+			return 1;
+		break;
+	}
+
+	// position:  PTS of the PES packet which starts with this frame, or the next position after the previous frame
+	uint64 off = t->es_total + t->es_off;
+	if (t->have_pts && t->pts_esoff <= off) {
+		t->have_pts = 0;
+		int64 pts = t->pts;
+		if (t->pts_last >= 0) {
+			// PTS is 33-bit
+			while (pts < t->pts_last - (1LL << 32))
+				pts += 1LL << 33;
+		}
+		t->pts_last = pts;
+
+		int64 spts = pts * f.sample_rate / TS_PTS_HZ;
+		if (t->pts_esoff == off) {
+			if (t->fr.len == 0) {
+				t->pts_base = spts;
+			} else if (ffabs(spts - t->pts_base - (int64)t->pos) > f.sample_rate) {
+				dbglog(core, d->trk, NULL, "PTS discontinuity: %D -> %D"
+					, (int64)t->pos, spts - t->pts_base);
+				t->pts_base = spts - t->pos;
+			} else {
+				t->pos = ffmax(spts - t->pts_base, 0);
+			}
+		}
+	}
+
+	t->fr = f;
+	const char *h = t->es.ptr + t->es_off;
+	if (!d->stream_copy)
+		ffstr_set(frame, h + f.hdrlen, f.len - f.hdrlen);
+	else
+		ffstr_set(frame, h, f.len);
+	t->es_off += f.len;
+	return 0;
+}
+
+static int ts_process(void *ctx, fmed_filt *d)
+{
+	enum { I_HDR, I_DATA };
+	fmed_ts *t = ctx;
+	ffstr frame;
+	const byte *p;
+
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RLASTOUT;
+	}
+
+	if (d->flags & FMED_FFWD) {
+		ffstr_set(&t->in, d->data, d->datalen);
+		d->datalen = 0;
+	}
+
+	if ((int64)d->audio.seek != FMED_NULL) {
+		t->seek = d->audio.seek;
+		d->audio.seek = FMED_NULL;
+	}
+
+	// the frame returned last time isn't needed anymore
+	_ffarr_rmleft(&t->es, t->es_off, sizeof(char));
+	t->es_total += t->es_off;
+	t->es_off = 0;
+
+	for (;;) {
+		if (t->codec != TS_NONE && 0 == ts_frame(t, d, &frame)) {
+			if (t->state == I_HDR)
+				break;
+			if (t->seek >= 0) {
+				if (t->pos + t->fr.samples <= (uint64)ffpcm_samples(t->seek, t->sample_rate)) {
+					t->pos += t->fr.samples;
+					continue;
+				}
+				t->seek = -1;
+			}
+			goto data;
+		}
+
+		if (NULL == (p = ts_next(t, d))) {
+			if (!(d->flags & FMED_FLAST))
+				return FMED_RMORE;
+			if (t->state == I_HDR) {
+				errlog(core, d->trk, NULL, "no audio data");
+				return FMED_RERR;
+			}
+			d->outlen = 0;
+			return FMED_RDONE;
+		}
+
+		if (0 != ts_pkt(t, d, p))
+			return FMED_RERR;
+	}
+
+	// the first frame:  set audio format, add decoder, pass AAC ASC
+	t->state = I_DATA;
+	t->sample_rate = t->fr.sample_rate;
+	d->audio.fmt.format = FFPCM_16;
+	d->audio.fmt.sample_rate = t->fr.sample_rate;
+	d->audio.fmt.channels = t->fr.channels;
+	d->audio.total = 0;
+	fmed_setval("audio_frame_samples", t->fr.samples);
+	if (t->codec == TS_AAC) {
+		d->audio.decoder = "AAC";
+		d->datatype = "aac";
+	} else {
+		d->audio.decoder = "MPEG";
+		d->datatype = "mpeg";
+	}
+	dbglog(core, d->trk, NULL, "audio PID:%xu  %s  %u Hz, %u channels"
+		, t->pid, d->audio.decoder, t->fr.sample_rate, t->fr.channels);
+
+	if (d->input_info)
+		return FMED_RDONE;
+
+	if (d->stream_copy) {
+		d->audio.convfmt = d->audio.fmt;
+	} else {
+		const char *codec = (t->codec == TS_AAC) ? "aac.decode" : "mpeg.decode";
+		if (0 != d->track->cmd2(d->trk, FMED_TRACK_ADDFILT, (void*)codec))
+			return FMED_RERR;
+	}
+
+	// the frame will be returned again
+	t->es_off -= t->fr.len;
+	if (t->codec == TS_AAC) {
+		d->out = (void*)t->fr.asc,  d->outlen = sizeof(t->fr.asc);
+	} else {
+		d->outlen = 0;
+	}
+	t->fr.len = 0;
+	t->have_pts = (t->pts_esoff == t->es_total + t->es_off);
+	t->pts_last = -1;
+	return FMED_RDATA;
+
+data:
+	d->audio.pos = t->pos;
+	t->pos += t->fr.samples;
+	dbglog(core, d->trk, NULL, "frame: samples:%u[%U]  size:%L"
+		, t->fr.samples, d->audio.pos, frame.len);
+	d->out = frame.ptr,  d->outlen = frame.len;
+	return FMED_RDATA;
+}
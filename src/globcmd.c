@@ -4,6 +4,7 @@ Copyright (c) 2016 Simon Zolin */
 #include <fmedia.h>
 #include <FF/data/conf.h>
 #include <FFOS/asyncio.h>
+#include <FFOS/thread.h>
 
 
 static const fmed_core *core;
@@ -24,8 +25,9 @@ static const fmed_mod fmed_globcmd_mod = {
 // GLOBCMD IFACE
 static int globcmd_ctl(uint cmd, ...);
 static int globcmd_write(const void *data, size_t len);
+static ssize_t globcmd_read(void *buf, size_t cap);
 static const fmed_globcmd_iface fmed_globcmd = {
-	&globcmd_ctl, &globcmd_write
+	&globcmd_ctl, &globcmd_write, &globcmd_read
 };
 
 enum {
@@ -52,17 +54,28 @@ static void globcmd_free(void);
 static int globcmd_listen(void);
 static void globcmd_accept(void *udata);
 static int globcmd_accept1(void);
-static void globcmd_onaccept(fffd peer);
+static int globcmd_onaccept(fffd peer);
 
 typedef struct cmd_parser {
 	ffconf conf;
+	fffd peer;
 	uint cmd;
 	const fmed_queue *qu;
 	const fmed_que_entry *first;
+	uint peer_own :1; // the peer is closed by the response writer
 } cmd_parser;
 
 static int globcmd_parse(cmd_parser *c, const ffstr *in);
 
+/** Response to the client.
+It's written by a separate thread, so a client that doesn't read it can't block the main thread. */
+struct gcmd_resp {
+	fffd peer;
+	ffarr buf;
+};
+
+static int gcmd_resp_send(fffd peer, ffarr *buf);
+
 
 const fmed_mod* fmed_getmod_globcmd(const fmed_core *_core)
 {
@@ -150,6 +163,14 @@ static int globcmd_write(const void *data, size_t len)
 	return 0;
 }
 
+static ssize_t globcmd_read(void *buf, size_t cap)
+{
+	ssize_t r = ffpipe_read(g->opened_fd, buf, cap);
+	if (r < 0)
+		syserrlog(core, NULL, "globcmd", "%s", fffile_read_S);
+	return r;
+}
+
 
 static int globcmd_init(void)
 {
@@ -233,12 +254,13 @@ static int globcmd_accept1(void)
 		dbglog(core, NULL, "globcmd", "listening");
 		return -1;
 	}
-	globcmd_onaccept(peer);
-	ffpipe_peer_close(peer);
+	if (0 == globcmd_onaccept(peer))
+		ffpipe_peer_close(peer);
 	return 0;
 }
 
-static void globcmd_onaccept(fffd peer)
+/** Return 1 if the peer is owned by the response writer. */
+static int globcmd_onaccept(fffd peer)
 {
 	ffarr buf = {0};
 	ffstr in;
@@ -248,6 +270,7 @@ static void globcmd_onaccept(fffd peer)
 	dbglog(core, NULL, "globcmd", "accepted client");
 
 	ffmem_tzero(&c);
+	c.peer = peer;
 	c.qu = core->getmod("#queue.queue");
 	ffmem_tzero(&c.conf);
 	ffconf_parseinit(&c.conf);
@@ -281,6 +304,38 @@ done:
 	ffarr_free(&buf);
 	ffconf_parseclose(&c.conf);
 	dbglog(core, NULL, "globcmd", "done with client");
+	return c.peer_own;
+}
+
+static int FFTHDCALL gcmd_resp_write(void *param)
+{
+	struct gcmd_resp *r = param;
+	if (r->buf.len != (size_t)fffile_write(r->peer, r->buf.ptr, r->buf.len))
+		syserrlog(core, NULL, "globcmd", "%s", "pipe write");
+	ffpipe_peer_close(r->peer);
+	ffarr_free(&r->buf);
+	ffmem_free(r);
+	return 0;
+}
+
+/** Write the data to the client and close the connection in background.
+Return 0 if the writer owns the peer and the data. */
+static int gcmd_resp_send(fffd peer, ffarr *buf)
+{
+	struct gcmd_resp *r;
+	ffthd th;
+	if (NULL == (r = ffmem_new(struct gcmd_resp)))
+		return -1;
+	r->peer = peer;
+	r->buf = *buf;
+	if (FFTHD_INV == (th = ffthd_create(&gcmd_resp_write, r, 0))) {
+		syserrlog(core, NULL, "globcmd", "%s", ffthd_create_S);
+		ffmem_free(r);
+		return -1;
+	}
+	ffthd_detach(th);
+	ffarr_null(buf);
+	return 0;
 }
 
 enum CMDS {
@@ -288,6 +343,7 @@ enum CMDS {
 	CMD_CLEAR,
 	CMD_PLAY,
 	CMD_QUIT,
+	CMD_STATUS,
 	CMD_STOP,
 };
 
@@ -296,6 +352,7 @@ static const char* const cmds_str[] = {
 	"clear",
 	"play", // "play INPUT..."
 	"quit",
+	"status", // print status of all tracks and close connection
 	"stop",
 };
 
@@ -346,6 +403,15 @@ static int globcmd_parse(cmd_parser *c, const ffstr *in)
 			case CMD_QUIT:
 				g->track->cmd((void*)-1, FMED_TRACK_STOPALL_EXIT);
 				break;
+
+			case CMD_STATUS: {
+				ffarr buf = {0};
+				g->track->cmd((void*)-1, FMED_TRACK_STATUS, &buf);
+				if (0 == gcmd_resp_send(c->peer, &buf))
+					c->peer_own = 1;
+				ffarr_free(&buf);
+				return -1; // the client reads the response until the connection is closed
+			}
 			}
 			break;
 
@@ -1044,6 +1044,12 @@ static int gtrk_process(void *ctx, fmed_filt *d)
 	t->time_cur = playtime;
 	wmain_update(playtime, t->time_total);
 
+	if (d->net_buf.target != 0)
+		wmain_status("Buffer: %u.%us / %u.%us  Stalls: %u"
+			, d->net_buf.level / 1000, d->net_buf.level % 1000 / 100
+			, d->net_buf.target / 1000, d->net_buf.target % 1000 / 100
+			, d->net_buf.stalls);
+
 done:
 	d->out = d->data;
 	d->outlen = d->datalen;
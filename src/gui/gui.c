@@ -1486,6 +1486,15 @@ static int gtrk_process(void *ctx, fmed_filt *d)
 
 	wmain_update(playtime, g->total_time_sec);
 
+	if (d->net_buf.target != 0) {
+		char buf[64];
+		size_t n = ffs_fmt(buf, buf + sizeof(buf), "Buffer: %u.%us / %u.%us  Stalls: %u"
+			, d->net_buf.level / 1000, d->net_buf.level % 1000 / 100
+			, d->net_buf.target / 1000, d->net_buf.target % 1000 / 100
+			, d->net_buf.stalls);
+		gui_status(buf, n);
+	}
+
 done:
 	d->out = d->data;
 	d->outlen = d->datalen;
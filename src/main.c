@@ -28,6 +28,8 @@ struct gctx {
 	const fmed_track *track;
 	const fmed_queue *qu;
 	uint psexit; //process exit code
+	fftask tsk_loudness;
+	uint loudness_fin :1; // loudness results are processed
 
 	ffdl core_dl;
 	fmed_core* (*core_init)(char **argv, char **env);
@@ -53,7 +55,10 @@ static int fmed_arg_format(ffparser_schem *p, void *obj, ffstr *val);
 static int fmed_arg_out_copy(ffparser_schem *p, void *obj, const ffstr *val);
 static int fmed_arg_input_chk(ffparser_schem *p, void *obj, const ffstr *val);
 static int fmed_arg_out_chk(ffparser_schem *p, void *obj, const ffstr *val);
+static int fmed_arg_out(ffparser_schem *p, void *obj, const ffstr *val);
 static int arg_debug(ffparser_schem *p, void *obj, const int64 *val);
+static int arg_loudness_report(ffparser_schem *p, void *obj, const ffstr *val);
+static int arg_loudness_tags(ffparser_schem *p, void *obj, const int64 *val);
 
 static void open_input(void *udata);
 static void fmed_onsig(void *udata);
@@ -63,6 +68,7 @@ static void rec_lpback_new_track(fmed_cmd *cmd);
 // TRACK MONITOR
 static void mon_onsig(fmed_trk *trk, uint sig);
 static const struct fmed_trk_mon mon_iface = { &mon_onsig };
+static void loudness_fin(void *param);
 
 //LOG
 static void std_log(uint flags, fmed_logdata *ld);
@@ -116,6 +122,9 @@ static const ffpars_arg fmed_cmdline_args[] = {
 	{ "dynanorm",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(dynanorm) },
 	{ "pcm-peaks",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(pcm_peaks) },
 	{ "pcm-crc",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(pcm_crc) },
+	{ "loudness",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(loudness) },
+	{ "loudness-report",	FFPARS_TSTR | FFPARS_FNOTEMPTY,  FFPARS_DST(&arg_loudness_report) },
+	{ "loudness-tags",	FFPARS_TBOOL8 | FFPARS_FALONE,  FFPARS_DST(&arg_loudness_tags) },
 
 	//ENCODING
 	{ "vorbis.quality",	FFPARS_TFLOAT | FFPARS_FSIGN,  OFF(vorbis_qual) },
@@ -127,7 +136,7 @@ static const ffpars_arg fmed_cmdline_args[] = {
 	{ "stream-copy",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(stream_copy) },
 
 	//OUTPUT
-	{ "out",	FFPARS_SETVAL('o') | FFPARS_TSTR | FFPARS_FCOPY | FFPARS_FNOTEMPTY | FFPARS_FSTRZ,  OFF(outfn) },
+	{ "out",	FFPARS_SETVAL('o') | FFPARS_TSTR | FFPARS_FNOTEMPTY | FFPARS_FMULTI,  FFPARS_DST(&fmed_arg_out) },
 	{ "overwrite",	FFPARS_SETVAL('y') | FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(overwrite) },
 	{ "out-copy",	FFPARS_TSTR | FFPARS_FALONE,  FFPARS_DST(&fmed_arg_out_copy) },
 	{ "preserve-date",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(preserve_date) },
@@ -147,6 +156,9 @@ static const ffpars_arg fmed_cmdline_args[] = {
 	{ "help",	FFPARS_SETVAL('h') | FFPARS_TBOOL | FFPARS_FALONE,  FFPARS_DST(&fmed_arg_usage) },
 	{ "cue-gaps",	FFPARS_TINT8,  OFF(cue_gaps) },
 	{ "parallel",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(parallel) },
+	{ "parallel-decode",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(parallel_decode) },
+	{ "join",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(join) },
+	{ "edit-tags",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(edit_tags) },
 
 	//INSTALL
 	{ "install",	FFPARS_TBOOL | FFPARS_FALONE,  FFPARS_DST(&fmed_arg_install) },
@@ -156,7 +168,7 @@ static const ffpars_arg fmed_cmdline_args[] = {
 static const ffpars_arg fmed_cmdline_main_args[] = {
 	{ "",	FFPARS_TSTR | FFPARS_FMULTI,  FFPARS_DST(&fmed_arg_input_chk) },
 	{ "*",	FFPARS_TSTR | FFPARS_FMULTI,  FFPARS_DST(&fmed_arg_skip) },
-	{ "out",	FFPARS_SETVAL('o') | FFPARS_TSTR,  FFPARS_DST(&fmed_arg_out_chk) },
+	{ "out",	FFPARS_SETVAL('o') | FFPARS_TSTR | FFPARS_FMULTI,  FFPARS_DST(&fmed_arg_out_chk) },
 	{ "conf",	FFPARS_TCHARPTR | FFPARS_FSTRZ | FFPARS_FCOPY | FFPARS_FNOTEMPTY,  OFF(conf_fn) },
 	{ "notui",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(notui) },
 	{ "gui",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(gui) },
@@ -314,7 +326,7 @@ static int fmed_arg_channels(ffparser_schem *p, void *obj, ffstr *val)
 	return 0;
 }
 
-static const char* const outcp_str[] = { "all", "cmd" };
+static const char* const outcp_str[] = { "all", "cmd", "rec" };
 
 static int fmed_arg_out_copy(ffparser_schem *p, void *obj, const ffstr *val)
 {
@@ -330,6 +342,26 @@ static int fmed_arg_out_copy(ffparser_schem *p, void *obj, const ffstr *val)
 	return 0;
 }
 
+/** The first --out value is the main output;
+ the next values are the additional outputs written by #soundmod.tee ('\n'-separated list). */
+static int fmed_arg_out(ffparser_schem *p, void *obj, const ffstr *val)
+{
+	fmed_cmd *cmd = obj;
+	if (cmd->outfn.len == 0) {
+		char *s;
+		if (NULL == (s = ffsz_alcopystr(val)))
+			return FFPARS_ESYS;
+		ffstr_set(&cmd->outfn, s, val->len);
+		return 0;
+	}
+
+	if (0 == ffstr_catfmt(&cmd->out_tee, "%s%S%Z"
+		, (cmd->out_tee.len != 0) ? "\n" : "", val))
+		return FFPARS_ESYS;
+	cmd->out_tee.len--;
+	return 0;
+}
+
 /** Read file line by line and add filenames as input arguments. */
 static int arg_flist(ffparser_schem *p, void *obj, const char *fn)
 {
@@ -524,6 +556,24 @@ static int arg_debug(ffparser_schem *p, void *obj, const int64 *val)
 	return 0;
 }
 
+static int arg_loudness_report(ffparser_schem *p, void *obj, const ffstr *val)
+{
+	fmed_cmd *cmd = obj;
+	ffmem_safefree(cmd->loudness_report);
+	if (NULL == (cmd->loudness_report = ffsz_alcopystr(val)))
+		return FFPARS_ESYS;
+	cmd->loudness = 1;
+	return 0;
+}
+
+static int arg_loudness_tags(ffparser_schem *p, void *obj, const int64 *val)
+{
+	fmed_cmd *cmd = obj;
+	cmd->loudness_tags = 1;
+	cmd->loudness = 1;
+	return 0;
+}
+
 static int fmed_cmdline(int argc, char **argv, uint main_only)
 {
 	ffparser_schem ps;
@@ -648,11 +698,29 @@ static void mon_onsig(fmed_trk *trk, uint sig)
 				g->track->cmd(g->rec_trk, FMED_TRACK_STOP);
 			break;
 		}
+		if (g->cmd->loudness && !g->loudness_fin) {
+			// write loudness report and tags on main thread;  ONLAST is signalled again after the tag writers finish
+			g->loudness_fin = 1;
+			fftask_set(&g->tsk_loudness, &loudness_fin, NULL);
+			core->task(&g->tsk_loudness, FMED_TASK_POST);
+			break;
+		}
 		core->sig(FMED_STOP);
 		break;
 	}
 }
 
+/** Process the results of loudness analyzer.
+Thread: main. */
+static void loudness_fin(void *param)
+{
+	const fmed_loudness_scan *ls = core->getmod("#soundmod.loudness-scan");
+	if (ls != NULL
+		&& 0 != ls->fin(g->cmd->loudness_report, g->cmd->loudness_tags))
+		return;
+	core->sig(FMED_STOP);
+}
+
 
 static const int sigs[] = { SIGINT };
 static const int sigs_block[] = { SIGINT, SIGIO };
@@ -726,6 +794,8 @@ static void qu_setprops(fmed_cmd *fmed, const fmed_queue *qu, fmed_que_entry *qe
 	} else {
 		if (fmed->outfn.len != 0 && !fmed->rec)
 			qu->meta_set(qe, FFSTR("output"), fmed->outfn.ptr, fmed->outfn.len, FMED_QUE_TRKDICT);
+		if (fmed->out_tee.len != 0 && !fmed->rec)
+			qu->meta_set(qe, FFSTR("output_tee"), fmed->out_tee.ptr, fmed->out_tee.len, FMED_QUE_TRKDICT);
 	}
 
 	if (fmed->rec)
@@ -764,6 +834,10 @@ static void trk_prep(fmed_cmd *fmed, fmed_trk *trk)
 
 	trk->pcm_peaks = fmed->pcm_peaks;
 	trk->pcm_peaks_crc = fmed->pcm_crc;
+	trk->loudness = fmed->loudness;
+	trk->parallel_decode = fmed->parallel_decode;
+	trk->join = fmed->join;
+	trk->edit_tags = fmed->edit_tags;
 	trk->use_dynanorm = fmed->dynanorm;
 	trk->a_start_level = ffabs(fmed->start_level);
 	trk->a_stop_level = ffabs(fmed->stop_level);
@@ -816,10 +890,22 @@ static void open_input(void *udata)
 	track->copy_info(&trkinfo, NULL);
 	trk_prep(fmed, &trkinfo);
 
+	ffarr joined = {};
+
 	FFARR_WALKT(&fmed->in_files, pfn, char*) {
 
+		if (fmed->join) {
+			// all inputs are opened by the track of the first one
+			if (joined.len != 0)
+				ffarr_append(&joined, "\n", 1);
+			ffarr_append(&joined, *pfn, ffsz_len(*pfn));
+			if (first != NULL)
+				continue;
+		}
+
 #ifdef FF_WIN
-		if (NULL != (qe = open_input_wcard(qu, *pfn, track, &trkinfo))) {
+		if (!fmed->join
+			&& NULL != (qe = open_input_wcard(qu, *pfn, track, &trkinfo))) {
 			if (first == NULL)
 				first = qe;
 			continue;
@@ -837,6 +923,10 @@ static void open_input(void *udata)
 	}
 	FFARR_FREE_ALL_PTR(&fmed->in_files, ffmem_free, char*);
 
+	if (first != NULL && fmed->join)
+		qu->meta_set(first, FFSTR("join_input"), joined.ptr, joined.len, FMED_QUE_TRKDICT);
+	ffarr_free(&joined);
+
 	ffstr ext;
 	ffpath_split3(fmed->outfn.ptr, fmed->outfn.len, NULL, NULL, &ext);
 	if (ffstr_eqz(&ext, "m3u8") || ffstr_eqz(&ext, "m3u")) {
@@ -855,7 +945,7 @@ static void open_input(void *udata)
 	if (first != NULL) {
 		if (fmed->mix)
 			qu->cmd(FMED_QUE_MIX, NULL);
-		else if (fmed->outfn.len != 0 && fmed->parallel) {
+		else if ((fmed->outfn.len != 0 || fmed->pcm_peaks || fmed->loudness || fmed->edit_tags) && fmed->parallel) {
 			core->props->parallel = 1;
 			qu->cmdv(FMED_QUE_XPLAY, first);
 		} else
@@ -897,6 +987,8 @@ static int rec_track_start(fmed_cmd *cmd, fmed_trk *trkinfo)
 
 	if (cmd->outfn.len != 0)
 		track->setvalstr(trk, "output", cmd->outfn.ptr);
+	if (cmd->out_tee.len != 0)
+		track->setvalstr(trk, "output_tee", cmd->out_tee.ptr);
 
 	track->setval(trk, "low_latency", 1);
 	ti->a_in_buf_time = cmd->capture_buf_len;
@@ -940,6 +1032,18 @@ static int gcmd_send(const fmed_globcmd_iface *globcmd)
 		return -1;
 	}
 
+	if (ffstr_eqcz(&g->cmd->globcmd, "status")) {
+		// terminate the command: the connection is closed only after the response is read
+		if (0 != globcmd->write("\n", 1))
+			return -1;
+
+		char buf[4096];
+		ssize_t r;
+		while (0 < (r = globcmd->read(buf, sizeof(buf)))) {
+			ffstd_write(ffstdout, buf, r);
+		}
+	}
+
 	return 0;
 }
 
@@ -17,12 +17,41 @@ netmod *net;
 const fmed_core *core;
 
 typedef struct icy icy;
+struct httpclient;
+
+/** Reference-counted block of received data.
+net.httpcli fills it and passes its data to the next filter;
+ net.in holds references to the parts of it which belong to the audio stream.
+net.in track may run in another worker, so the counter is atomic. */
+typedef struct netbuf {
+	ffatomic refs;
+	uint len;
+	uint cap;
+	uint recon :1; // the data is from a new connection
+	uint64 off; // file offset of the data (seekable HTTP input)
+	char data[0];
+} netbuf;
+
+struct netin_chunk {
+	netbuf *b;
+	ffstr data;
+};
+
+/** Max. memory size of the blocks referenced by net.in. */
+#define NETIN_MAXBUF  (4 * 1024 * 1024)
 
+/** Data queue from net.icy to net.in track.
+The tracks may run in different workers: the object is protected by the lock
+ and is freed when both net.icy and net.in have released it. */
 typedef struct netin {
+	fflock lk;
+	uint refs;
 	uint state;
-	void *trk;
-	ffarr d[2];
-	uint idx;
+	void *trk; // NULL: net.in is closed
+	ffarr chunks; // struct netin_chunk[]
+	size_t size; // memory size of the referenced blocks
+	uint64 dropped;
+	uint out :1; // the first chunk is passed to the next filter
 	uint fin :1;
 	uint fn_dyn :1;
 	icy *c;
@@ -33,6 +62,8 @@ struct icy {
 	fficy icy;
 	ffstr data;
 	ffstr next_filt_ext;
+	struct httpclient *hc;
+	netbuf *blk; // the block containing 'data'
 
 	netin *netin;
 	ffstr artist;
@@ -40,6 +71,15 @@ struct icy {
 
 	uint out_copy :1;
 	uint save_oncmd :1;
+	uint rec_only :1; // don't pass data to the next filter (--out-copy=rec)
+};
+
+/** ICY meta for the queue item. */
+struct icy_qmeta {
+	fftask tsk;
+	fmed_que_entry *qent;
+	ffstr artist;
+	ffstr title;
 };
 
 //FMEDIA MODULE
@@ -88,6 +128,7 @@ static const fmed_filter fmed_icy = {
 
 static int icy_reset(icy *c, fmed_filt *d);
 static int icy_setmeta(icy *c, const ffstr *_data);
+static void icy_qmeta_set(void *param);
 
 //PASS-THROUGH
 static void* netin_open(fmed_filt *d);
@@ -98,7 +139,11 @@ static const fmed_filter fmed_netin = {
 };
 
 static void* netin_create(icy *c, fmed_filt *d);
-static void netin_write(netin *n, const ffstr *data);
+static int netin_write(netin *n, netbuf *b, const ffstr *data);
+static void netin_release(netin *n);
+static void netin_rmchunk(netin *n);
+
+static netbuf* httpcli_outblk(struct httpclient *c);
 
 
 enum {
@@ -120,11 +165,18 @@ static const ffpars_arg net_conf_args[] = {
 	{ "bufsize",	FFPARS_TSIZE | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, bufsize) },
 	{ "buffers",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, nbufs) },
 	{ "buffer_lowat",	FFPARS_TSIZE,  FFPARS_DSTOFF(net_conf, buf_lowat) },
+	{ "buffer_min",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, buf_min) },
+	{ "buffer_max",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, buf_max) },
 	{ "connect_timeout",	FFPARS_TINT,  FFPARS_DSTOFF(net_conf, conn_tmout) },
 	{ "timeout",	FFPARS_TINT,  FFPARS_DSTOFF(net_conf, tmout) },
 	{ "user_agent",	FFPARS_TENUM | FFPARS_F8BIT,  FFPARS_DST(&ua_enum) },
 	{ "max_redirect",	FFPARS_TINT | FFPARS_F8BIT,  FFPARS_DSTOFF(net_conf, max_redirect) },
 	{ "max_reconnect",	FFPARS_TINT8,  FFPARS_DSTOFF(net_conf, max_reconnect) },
+	{ "keepalive",	FFPARS_TBOOL | FFPARS_F8BIT,  FFPARS_DSTOFF(net_conf, keepalive) },
+	{ "keepalive_timeout",	FFPARS_TINT,  FFPARS_DSTOFF(net_conf, keepalive_tmout) },
+	{ "max_host_connections",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, max_host_conns) },
+	{ "dns_cache_ttl",	FFPARS_TINT,  FFPARS_DSTOFF(net_conf, dns_cache_ttl) },
+	{ "range_cache",	FFPARS_TSIZE | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, range_cache) },
 	{ "proxy",	FFPARS_TSTR,  FFPARS_DST(&http_conf_proxy) },
 	{ NULL,	FFPARS_TCLOSE,	FFPARS_DST(&http_conf_done) },
 };
@@ -149,6 +201,8 @@ static const void* net_iface(const char *name)
 		return &http_iface;
 	else if (!ffsz_cmp(name, "hls"))
 		return &nethls;
+	else if (!ffsz_cmp(name, "httpsrv"))
+		return &nethttpsrv;
 	return NULL;
 }
 
@@ -158,6 +212,10 @@ static int net_mod_conf(const char *name, ffpars_ctx *ctx)
 		return icy_config(ctx);
 	else if (!ffsz_cmp(name, "http"))
 		return http_config(ctx);
+	else if (!ffsz_cmp(name, "hls"))
+		return hls_config(ctx);
+	else if (!ffsz_cmp(name, "httpsrv"))
+		return httpsrv_config(ctx);
 	return -1;
 }
 
@@ -170,6 +228,8 @@ static int net_sig(uint signo)
 			return -1;
 		if (NULL == (net = ffmem_tcalloc1(netmod)))
 			return -1;
+		net->conf.hls_prefetch = 3;
+		net->conf.hls_max_buffer = 4 * 1024 * 1024;
 		ffhttp_initheaders();
 		return 0;
 
@@ -177,6 +237,9 @@ static int net_sig(uint signo)
 		if (NULL == (net->qu = core->getmod("#queue.queue")))
 			return 1;
 		net->track = core->getmod("#core.track");
+		if (0 != dns_init())
+			return 1;
+		httppool_init();
 		break;
 	}
 	return 0;
@@ -186,8 +249,12 @@ static void net_destroy(void)
 {
 	if (net == NULL)
 		return;
+	httpsrv_destroy();
+	httppool_destroy();
+	dns_destroy();
 	ffhttpcl_deinit();
 	ffmem_free(net->conf.proxy.host);
+	ffmem_free(net->conf.srv.host);
 	ffmem_free0(net);
 	ffhttp_freeheaders();
 }
@@ -197,12 +264,18 @@ static int http_config(ffpars_ctx *ctx)
 {
 	net->conf.bufsize = 16 * 1024;
 	net->conf.nbufs = 2;
-	net->conf.buf_lowat = 8 * 1024;
+	net->conf.buf_min = 500;
+	net->conf.buf_max = 10000;
 	net->conf.conn_tmout = 1500;
 	net->conf.tmout = 5000;
 	net->conf.user_agent = UA_OFF;
 	net->conf.max_redirect = 10;
 	net->conf.max_reconnect = 3;
+	net->conf.keepalive = 1;
+	net->conf.keepalive_tmout = 15000;
+	net->conf.max_host_conns = 6;
+	net->conf.dns_cache_ttl = 60;
+	net->conf.range_cache = 8 * 1024 * 1024;
 	ffpars_setargs(ctx, &net->conf, net_conf_args, FFCNT(net_conf_args));
 	return 0;
 }
@@ -231,7 +304,8 @@ static int http_conf_proxy(ffparser_schem *p, void *obj, ffstr *val)
 
 static int http_conf_done(ffparser_schem *p, void *obj)
 {
-	net->conf.buf_lowat = ffmin(net->conf.buf_lowat, net->conf.bufsize);
+	net->conf.buf_max = ffmax(net->conf.buf_max, net->conf.buf_min);
+	net->conf.range_cache = ffmax(net->conf.range_cache, 4 * net->conf.bufsize);
 	return 0;
 }
 
@@ -337,10 +411,15 @@ static void* icy_open(fmed_filt *d)
 	int v = net->track->getval(d->trk, "out-copy");
 	c->out_copy = (v != FMED_NULL);
 	c->save_oncmd = (v == FMED_OUTCP_CMD);
+	c->rec_only = (v == FMED_OUTCP_REC);
 
 	const char *s = net->track->getvalstr(d->trk, "icy_format");
 	ffstr_setz(&c->next_filt_ext, s);
 
+	int64 hc = net->track->getval(d->trk, "httpcli_ptr");
+	if (hc != FMED_NULL)
+		c->hc = (void*)(size_t)hc;
+
 	return c;
 }
 
@@ -351,7 +430,7 @@ static void icy_close(void *ctx)
 	ffstr_free(&c->title);
 
 	if (c->netin != NULL) {
-		netin_write(c->netin, NULL);
+		netin_write(c->netin, NULL, NULL);
 		c->netin = NULL;
 	}
 
@@ -377,7 +456,7 @@ static int icy_process(void *ctx, fmed_filt *d)
 
 	if (d->flags & FMED_FSTOP) {
 		d->outlen = 0;
-		return FMED_RLASTOUT;
+		return (c->rec_only) ? FMED_RFIN : FMED_RLASTOUT;
 	}
 
 	if (d->flags & FMED_FFWD) {
@@ -388,20 +467,30 @@ static int icy_process(void *ctx, fmed_filt *d)
 		}
 		ffstr_set(&c->data, d->data, d->datalen);
 		d->datalen = 0;
+		if (c->hc != NULL)
+			c->blk = httpcli_outblk(c->hc);
 	}
 
 	for (;;) {
-		if (c->data.len == 0)
+		if (c->data.len == 0) {
+			if (c->rec_only && (d->flags & FMED_FLAST))
+				return FMED_RFIN;
 			return FMED_RMORE;
+		}
 
 		size_t n = c->data.len;
 		r = fficy_parse(&c->icy, c->data.ptr, &n, &s);
 		ffstr_shift(&c->data, n);
 		switch (r) {
 		case FFICY_RDATA:
-			if (c->netin != NULL) {
-				netin_write(c->netin, &s);
+			if (c->netin != NULL
+				&& 0 != netin_write(c->netin, c->blk, &s)) {
+				// net.in track is closed
+				netin_write(c->netin, NULL, NULL);
+				c->netin = NULL;
 			}
+			if (c->rec_only)
+				break;
 
 			d->out = s.ptr;
 			d->outlen = s.len;
@@ -416,10 +505,29 @@ static int icy_process(void *ctx, fmed_filt *d)
 	}
 }
 
+/** Set meta of the queue item.  Thread: main. */
+static void icy_qmeta_set(void *param)
+{
+	struct icy_qmeta *m = param;
+	ffstr pair[2];
+
+	ffstr_setcz(&pair[0], "artist");
+	ffstr_set2(&pair[1], &m->artist);
+	net->qu->cmd2(FMED_QUE_METASET | ((FMED_QUE_TMETA | FMED_QUE_OVWRITE) << 16), m->qent, (size_t)pair);
+
+	ffstr_setcz(&pair[0], "title");
+	ffstr_set2(&pair[1], &m->title);
+	net->qu->cmd2(FMED_QUE_METASET | ((FMED_QUE_TMETA | FMED_QUE_OVWRITE) << 16), m->qent, (size_t)pair);
+
+	ffstr_free(&m->artist);
+	ffstr_free(&m->title);
+	ffmem_free(m);
+}
+
 static int icy_setmeta(icy *c, const ffstr *_data)
 {
 	fficymeta icymeta;
-	ffstr artist = {0}, title = {0}, data = *_data, pair[2];
+	ffstr artist = {0}, title = {0}, data = *_data;
 	fmed_que_entry *qent;
 	int r;
 	ffbool istitle = 0;
@@ -470,18 +578,20 @@ static int icy_setmeta(icy *c, const ffstr *_data)
 	ffstr_free(&c->title);
 	ffstr_acqstr3(&c->title, &utf);
 
-	ffstr_setcz(&pair[0], "artist");
-	ffstr_set2(&pair[1], &c->artist);
-	net->qu->cmd2(FMED_QUE_METASET | ((FMED_QUE_TMETA | FMED_QUE_OVWRITE) << 16), qent, (size_t)pair);
-
-	ffstr_setcz(&pair[0], "title");
-	ffstr_set2(&pair[1], &c->title);
-	net->qu->cmd2(FMED_QUE_METASET | ((FMED_QUE_TMETA | FMED_QUE_OVWRITE) << 16), qent, (size_t)pair);
+	// the track may run in another worker: the queue is modified within the main thread
+	struct icy_qmeta *m;
+	if (NULL != (m = ffmem_new(struct icy_qmeta))) {
+		m->qent = qent;
+		ffstr_alcopystr(&m->artist, &c->artist);
+		ffstr_alcopystr(&m->title, &c->title);
+		fftask_set(&m->tsk, &icy_qmeta_set, m);
+		core->task(&m->tsk, FMED_TASK_POST);
+	}
 
 	c->d->meta_changed = 1;
 
 	if (c->netin != NULL && c->netin->fn_dyn) {
-		netin_write(c->netin, NULL);
+		netin_write(c->netin, NULL, NULL);
 		c->netin = NULL;
 	}
 
@@ -502,6 +612,8 @@ static void* netin_create(icy *c, fmed_filt *d)
 	fmed_trk *trkconf;
 	if (NULL == (n = ffmem_tcalloc1(netin)))
 		goto fail;
+	fflk_init(&n->lk);
+	n->refs = 2; // net.icy, net.in
 
 	if (NULL == (trk = net->track->create(FMED_TRK_TYPE_NETIN, "")))
 		goto fail;
@@ -509,10 +621,14 @@ static void* netin_create(icy *c, fmed_filt *d)
 	if (0 == net->track->cmd(trk, FMED_TRACK_FILT_ADDLAST, "net.in"))
 		goto fail;
 
-	const fmed_modinfo *mi = core->getmod2(FMED_MOD_INEXT, c->next_filt_ext.ptr, c->next_filt_ext.len);
-	if (mi == NULL)
-		goto fail;
-	if (0 == net->track->cmd(trk, FMED_TRACK_FILT_ADDLAST, mi->name))
+	const char *filt = "#file.probe";
+	if (c->next_filt_ext.len != 0) {
+		const fmed_modinfo *mi = core->getmod2(FMED_MOD_INEXT, c->next_filt_ext.ptr, c->next_filt_ext.len);
+		if (mi == NULL)
+			goto fail;
+		filt = mi->name;
+	}
+	if (0 == net->track->cmd(trk, FMED_TRACK_FILT_ADDLAST, filt))
 		goto fail;
 
 	trkconf = net->track->conf(trk);
@@ -524,6 +640,7 @@ static void* netin_create(icy *c, fmed_filt *d)
 	net->track->setvalstr(trk, "output", output);
 
 	net->track->setval(trk, "netin_ptr", (size_t)n);
+	n->trk = trk;
 	n->c = c;
 
 	if (c->save_oncmd) {
@@ -539,7 +656,10 @@ static void* netin_create(icy *c, fmed_filt *d)
 
 	d->track->cmd2(trk, FMED_TRACK_META_COPYFROM, d->trk);
 
-	net->track->cmd(trk, FMED_TRACK_START);
+	if (0 != net->track->cmd(trk, FMED_TRACK_START)) {
+		ffmem_free(n); // the track is freed
+		return NULL;
+	}
 	return n;
 
 fail:
@@ -547,79 +667,375 @@ fail:
 	return NULL;
 }
 
-static void netin_write(netin *n, const ffstr *data)
+static netbuf* netbuf_alloc(size_t cap)
 {
+	netbuf *b;
+	if (NULL == (b = ffmem_alloc(sizeof(netbuf) + cap)))
+		return NULL;
+	ffmem_zero(b, sizeof(netbuf));
+	ffatom_inc(&b->refs);
+	b->cap = cap;
+	return b;
+}
+
+static void netbuf_release(netbuf *b)
+{
+	if (0 == ffatom_decret(&b->refs))
+		ffmem_free(b);
+}
+
+/** Add a reference to the data from block 'b' (or a copy of the data if 'b' is NULL).
+data: NULL: no more data;  net.icy releases the object
+Return -1 if net.in track is closed. */
+static int netin_write(netin *n, netbuf *b, const ffstr *data)
+{
+	int r = 0;
+	fflk_lock(&n->lk);
+
+	if (n->trk == NULL) {
+		r = -1;
+		if (data == NULL)
+			goto rel;
+		goto end;
+	}
+
+	struct netin_chunk *ch = NULL;
+	if (n->chunks.len != 0)
+		ch = ffarr_itemT(&n->chunks, n->chunks.len - 1, struct netin_chunk);
+	ffbool same_blk = (ch != NULL && b != NULL && ch->b == b);
+
 	if (data == NULL) {
 		n->fin = 1;
 		n->c = NULL;
-	} else
-		ffarr_append(&n->d[n->idx], data->ptr, data->len);
+
+	} else if (same_blk
+		&& ch->data.ptr + ch->data.len == data->ptr
+		&& !(n->out && n->chunks.len == 1)) {
+		// continuation of the last chunk
+		ch->data.len += data->len;
+
+	} else {
+		size_t cap = (b != NULL) ? b->cap : data->len;
+		if (!same_blk && n->size + cap > NETIN_MAXBUF) {
+			if (n->dropped == 0)
+				warnlog(n->trk, "recording can't keep up with the input stream, dropping data");
+			n->dropped += data->len;
+			goto end;
+		}
+
+		if (NULL == (ch = ffarr_pushgrowT(&n->chunks, 8, struct netin_chunk)))
+			goto end;
+
+		if (b != NULL) {
+			ffatom_inc(&b->refs);
+			ffstr_set2(&ch->data, data);
+		} else {
+			if (NULL == (b = netbuf_alloc(data->len))) {
+				n->chunks.len--;
+				goto end;
+			}
+			ffmemcpy(b->data, data->ptr, data->len);
+			b->len = data->len;
+			ffstr_set(&ch->data, b->data, b->len);
+		}
+		ch->b = b;
+		if (!same_blk)
+			n->size += cap;
+	}
+
 	if (n->state == IN_WAIT)
 		net->track->cmd(n->trk, FMED_TRACK_WAKE);
+
+	if (data == NULL)
+		goto rel;
+
+end:
+	fflk_unlock(&n->lk);
+	return r;
+
+rel:
+	fflk_unlock(&n->lk);
+	netin_release(n);
+	return r;
+}
+
+static void netin_release(netin *n)
+{
+	fflk_lock(&n->lk);
+	uint refs = --n->refs;
+	fflk_unlock(&n->lk);
+	if (refs != 0)
+		return;
+
+	while (n->chunks.len != 0) {
+		netin_rmchunk(n);
+	}
+	ffarr_free(&n->chunks);
+	ffmem_free(n);
+}
+
+/** Release the chunk that the next filter has processed. */
+static void netin_rmchunk(netin *n)
+{
+	struct netin_chunk *ch = ffarr_itemT(&n->chunks, 0, struct netin_chunk);
+	if (!(n->chunks.len >= 2 && (ch + 1)->b == ch->b))
+		n->size -= ch->b->cap;
+	netbuf_release(ch->b);
+	_ffarr_rmleft(&n->chunks, 1, sizeof(struct netin_chunk));
 }
 
 static void* netin_open(fmed_filt *d)
 {
 	netin *n;
 	n = (void*)fmed_getval("netin_ptr");
+	fflk_lock(&n->lk);
 	n->trk = d->trk;
 	n->state = IN_DATANEXT;
+	fflk_unlock(&n->lk);
 	return n;
 }
 
 static void netin_close(void *ctx)
 {
 	netin *n = ctx;
-	ffarr_free(&n->d[0]);
-	ffarr_free(&n->d[1]);
-	if (n->c != NULL && n->c->netin == n)
-		n->c->netin = NULL;
-	ffmem_free(n);
+	fflk_lock(&n->lk);
+	if (n->dropped != 0)
+		warnlog(n->trk, "dropped %U bytes", n->dropped);
+	n->trk = NULL;
+	fflk_unlock(&n->lk);
+	netin_release(n);
 }
 
+/** Pass the data blocks shared with net.icy to the next filter. */
 static int netin_process(void *ctx, fmed_filt *d)
 {
 	netin *n = ctx;
-	switch (n->state) {
-	case IN_DATANEXT:
-		if (n->d[n->idx].len == 0 && !n->fin) {
-			n->state = IN_WAIT;
-			return FMED_RASYNC;
-		}
-		break;
+	int r = FMED_RDATA;
+	fflk_lock(&n->lk);
 
-	case IN_WAIT:
-		break;
+	if (n->out) {
+		n->out = 0;
+		netin_rmchunk(n);
 	}
+
+	if (n->chunks.len == 0) {
+		if (n->fin) {
+			d->outlen = 0;
+			r = FMED_RDONE;
+			goto end;
+		}
+		n->state = IN_WAIT;
+		r = FMED_RASYNC;
+		goto end;
+	}
+
 	n->state = IN_DATANEXT;
-	d->out = n->d[n->idx].ptr,  d->outlen = n->d[n->idx].len;
-	n->d[n->idx].len = 0;
-	n->idx = ffint_cycleinc(n->idx, 2);
-	if (n->fin)
-		return FMED_RDONE;
+	const struct netin_chunk *ch = ffarr_itemT(&n->chunks, 0, struct netin_chunk);
+	d->out = ch->data.ptr,  d->outlen = ch->data.len;
+	n->out = 1;
 
 	// get cmd from master track
-	if (n->c->save_oncmd && n->c->d->save_trk) {
+	if (n->c != NULL && n->c->save_oncmd && n->c->d->save_trk) {
 		n->c->d->save_trk = 0;
 		d->out_file_del = 0;
 	}
 
-	return FMED_RDATA;
+end:
+	fflk_unlock(&n->lk);
+	return r;
 }
 
 
 #define FILT_NAME  "net.httpcli"
 
+/*
+Adaptive buffer:
+Data is received from network in background and is stored in 'bufs' until the next filter requests it.
+The blocks are reference-counted: net.in (recording of ICY stream) uses the same data without copying.
+The next filters hold some data too, so the buffer level is the buffered data
+ plus the data passed to the next filters minus the time passed since playback has started.
+. Playback starts (or continues after a stall) when the buffered data reaches the target depth
+. Stall: the buffer level has dropped to 0, i.e. the next filters have run out of data
+. The target depth is the sum of:
+  'floor' which is doubled after each stall and is slowly decreased while there are no stalls;
+  4 * jitter:  average delay of data arrival relative to the stream's bitrate (RFC 3550 estimator)
+. Receiving is suspended while the buffer level is above 2 * target depth
+
+Seekable input:
+If the server responds with "Accept-Ranges: bytes" and Content-Length (a file rather than a live stream),
+ the next filters may seek (d->input.seek).
+'bufs' is then a cache of file ranges sorted by offset, and the data is passed to the next filter from 'pos'.
+. The buffer level is the size of contiguous data from 'pos'
+. Seek to the cached data or to the data that will be received soon doesn't need a new request
+. Otherwise the current request is closed and the data is requested from 'pos' ("Range: bytes=pos-")
+. The data that is already cached is skipped when received again
+. When the cache size reaches 'range_cache', the block that is the farthest from 'pos' is freed
+. If the server responds to a range request with the whole file (200 instead of 206),
+   the next requests are sent without "Range" header: the data before 'pos' is received and dropped.
+   A new request is made only if the data before the current receiving offset is needed.
+*/
+
+/** Stream byte rate while the bitrate is unknown. */
+#define HTTP_DEF_RATE  (128 * 1000 / 8)
+
+/** Decrease 'floor' after this period without stalls (msec). */
+#define HTTP_FLOOR_STABLE  30000
+
+/** Wait for the data that is being received rather than making a new range request
+ if it's closer than this (bytes). */
+#define HTTP_RANGE_GAP  (64 * 1024)
+
 struct httpclient {
-	void *con;
+	httppool *pool;
+	httpreq *req;
 	void *trk;
 	uint st;
-	uint status;
-	ffstr data;
+	int status;
+	ffstr data; // received data that isn't yet stored in 'buf'
 	ffstr next_filt_ext;
 	fmed_filt *d;
+
+	ffarr bufs; // netbuf*[]: received data
+	size_t off; // offset of unread data in the first block
+	size_t unread; // bytes
+	size_t size; // memory size of 'bufs'
+	netbuf *outblk; // the block passed to the next filter
+
+	uint target; // target depth (msec)
+	uint floor; // msec
+	uint jitter; // msec*16
+	int transit; // msec
+	uint64 media_time; // usec
+	uint64 total; // received bytes
+	uint64 start_time, prebuf_time, stable_time, play_time; // msec
+	uint64 out_bytes; // data passed to the next filter since 'play_time'
+	uint64 play_paused; // the track's paused time at 'play_time' (msec)
+	uint br_rate; // byte rate from "icy-br" HTTP header
+	uint stalls;
+	uint refills;
+	uint reconnects;
+	uint reconnect_tries; // failed connections in a row
+
+	// seekable input:
+	uint64 fsize; // file size
+	uint64 pos; // file offset of the data for the next filter
+	uint64 recv_off; // file offset of the data being received
+	netbuf *wblk; // the block being filled
+	uint nranges; // range requests
+	uint nseek;
+
+	uint async :1; // the track is waiting for data
+	uint prebuffer :1; // waiting until the buffer is filled
+	uint recv_paused :1; // the buffer is full
+	uint resumed :1; // receiving is resumed: don't update jitter
+	uint recon :1; // the next block will contain the data from a new connection
+	uint filt_added :1; // the input module (or #file.probe) is added after us
+	uint fin :1; // no more data from network
+	uint seekable :1; // the server supports range requests
+	uint range_req :1; // the current request is a range request
+	uint range_ignored :1; // the server responds to range requests with the whole file
 };
 
+static void httpcli_target(struct httpclient *c);
+
+static uint64 httpcli_now(void)
+{
+	fftime t;
+	fftime_now(&t);
+	return fftime_ms(&t);
+}
+
+/** Get stream byte rate. */
+static uint httpcli_rate(struct httpclient *c)
+{
+	if (c->d->audio.bitrate >= 8 * 1000)
+		return c->d->audio.bitrate / 8;
+	if (c->br_rate != 0)
+		return c->br_rate;
+	return HTTP_DEF_RATE;
+}
+
+/** Convert bytes to msec. */
+static uint httpcli_ms(struct httpclient *c, uint64 bytes)
+{
+	return bytes * 1000 / httpcli_rate(c);
+}
+
+/** Find the block containing data at file offset.
+Return index in 'bufs' or -1. */
+static ssize_t httpcli_find(struct httpclient *c, uint64 off)
+{
+	netbuf **pb;
+	FFARR_WALKT(&c->bufs, pb, netbuf*) {
+		if ((*pb)->off <= off && off < (*pb)->off + (*pb)->len)
+			return pb - (netbuf**)c->bufs.ptr;
+	}
+	return -1;
+}
+
+/** Get the size of contiguous cached data from file offset. */
+static uint64 httpcli_avail(struct httpclient *c, uint64 off)
+{
+	ssize_t i = httpcli_find(c, off);
+	if (i == -1)
+		return 0;
+	netbuf *b = *ffarr_itemT(&c->bufs, i, netbuf*);
+	uint64 end = b->off + b->len;
+	for (i++;  (size_t)i != c->bufs.len;  i++) {
+		b = *ffarr_itemT(&c->bufs, i, netbuf*);
+		if (b->off != end)
+			break;
+		end += b->len;
+	}
+	return end - off;
+}
+
+/** Get the amount of buffered data (bytes). */
+static uint64 httpcli_unread(struct httpclient *c)
+{
+	if (c->seekable)
+		return httpcli_avail(c, c->pos);
+	return c->unread;
+}
+
+/** Return 1 if the received data is appended to the buffered data. */
+static int httpcli_filling(struct httpclient *c)
+{
+	if (c->seekable)
+		return c->req != NULL && !c->fin
+			&& c->pos + httpcli_avail(c, c->pos) == c->recv_off;
+	return !c->fin;
+}
+
+/** Get the amount of buffered data (msec). */
+static uint httpcli_level(struct httpclient *c)
+{
+	return httpcli_ms(c, httpcli_unread(c));
+}
+
+/** Get the amount of data that the next filters haven't played yet (msec).
+The time while the track is paused isn't counted as playback. */
+static int httpcli_lead(struct httpclient *c)
+{
+	if (c->prebuffer)
+		return 0;
+	int64 played = (int64)(httpcli_now() - c->play_time) - (int64)(c->d->paused_time - c->play_paused);
+	return (int)((int64)httpcli_ms(c, c->out_bytes) - ffmax(played, 0));
+}
+
+/** The next filters have run out of data: refill the buffer. */
+static void httpcli_stall(struct httpclient *c)
+{
+	c->stalls++;
+	c->floor = ffmin(c->floor * 2, net->conf.buf_max);
+	c->stable_time = httpcli_now();
+	c->prebuf_time = c->stable_time;
+	c->prebuffer = 1;
+	httpcli_target(c);
+	warnlog(c->trk, "buffer is empty (stalls: %u), refilling up to %ums"
+		, c->stalls, c->target);
+}
+
 static void* httpcli_open(fmed_filt *d)
 {
 	const char *url = d->track->getvalstr(d->trk, "input");
@@ -636,43 +1052,69 @@ static void* httpcli_open(fmed_filt *d)
 		return NULL;
 	c->trk = d->trk;
 	c->d = d;
+	net->track->setval(d->trk, "httpcli_ptr", (size_t)c);
+	c->floor = net->conf.buf_min;
+	c->target = c->floor;
+	c->prebuffer = 1;
 	return c;
 }
 
 static void httpcli_close(void *ctx)
 {
 	struct httpclient *c = ctx;
-	http_iface.close(c->con);
+	httpreq_close(c->req);
+	httppool_free(c->pool);
+
+	if (c->total != 0) {
+		uint64 ms = httpcli_now() - c->start_time;
+		fmed_infolog(core, c->trk, FILT_NAME, "received: %U bytes  avg. throughput: %U kbit/s  buffer: target:%ums  jitter:%ums  stalls:%u  refills:%u"
+			, c->total, c->total * 8 / ffmax(ms, 1)
+			, c->target, c->jitter / 16, c->stalls, c->refills);
+	}
+
+	if (c->nranges != 0)
+		dbglog(c->trk, "range requests: %u  seeks: %u", c->nranges, c->nseek);
+
+	netbuf **pb;
+	FFARR_WALKT(&c->bufs, pb, netbuf*) {
+		netbuf_release(*pb);
+	}
+	ffarr_free(&c->bufs);
+	if (c->seekable && c->outblk != NULL)
+		netbuf_release(c->outblk);
 	ffmem_free(c);
 }
 
 /** Process response: add appropriate filters to the chain */
-static int httpcli_resp(struct httpclient *c, ffhttp_response *resp)
+static int httpcli_resp(struct httpclient *c, const httpreq_resp *resp)
 {
 	if (resp->code != 200) {
-		ffstr ln = ffhttp_respstatus(resp);
-		errlog(c->trk, "resource unavailable: %S", &ln);
+		errlog(c->trk, "resource unavailable: %S", &resp->status);
 		return FMED_RERR;
 	}
 
 	ffstr s, ext;
-	if (0 != ffhttp_findihdr(&resp->h, FFHTTP_CONTENT_TYPE, &s)) {
+	if (httpreq_hdr(resp, "Content-Type", &s)) {
 		if (ffstr_ieqz(&s, "audio/mpeg"))
 			ffstr_setz(&ext, "mp3");
 		else if (ffstr_ieqz(&s, "audio/aac") || ffstr_ieqz(&s, "audio/aacp"))
 			ffstr_setz(&ext, "aac");
 		else if (ffstr_ieqz(&s, "audio/ogg") || ffstr_ieqz(&s, "application/ogg"))
 			ffstr_setz(&ext, "ogg");
+		else if (ffstr_ieqz(&s, "audio/mp4") || ffstr_ieqz(&s, "audio/x-m4a") || ffstr_ieqz(&s, "audio/m4a"))
+			ffstr_setz(&ext, "m4a");
+		else if (ffstr_ieqz(&s, "audio/flac") || ffstr_ieqz(&s, "audio/x-flac"))
+			ffstr_setz(&ext, "flac");
 		else {
-			errlog(c->trk, "unsupported Content-Type: %S", &s);
-			return FMED_RERR;
+			ffstr_setz(&ext, "");
+			dbglog(c->trk, "unknown Content-Type: %S, detecting format from data", &s);
 		}
 	} else {
-		ffstr_setz(&ext, "mp3");
-		dbglog(c->trk, "no Content-Type HTTP header in response, assuming MPEG");
+		ffstr_setz(&ext, "");
+		dbglog(c->trk, "no Content-Type HTTP header in response, detecting format from data");
 	}
 
-	if (c->next_filt_ext.len != 0) {
+	if (c->filt_added) {
 
 		if (!ffstr_eq2(&c->next_filt_ext, &ext)) {
 			errlog(c->trk, "unsupported behaviour: stream is changing audio format from %S to %S"
@@ -682,17 +1124,39 @@ static int httpcli_resp(struct httpclient *c, ffhttp_response *resp)
 		return FMED_RDATA;
 	}
 
-	const fmed_modinfo *mi;
-	if (NULL == (mi = core->getmod2(FMED_MOD_INEXT, ext.ptr, ext.len))) {
-		errlog(c->trk, "no module configured to open .%S stream", &ext);
-		return FMED_RERR;
+	// a file that can be read from any offset
+	uint64 size;
+	if (httpreq_hdr(resp, "Accept-Ranges", &s) && ffstr_ieqz(&s, "bytes")
+		&& httpreq_hdr(resp, "Content-Length", &s) && ffstr_toint(&s, &size, FFS_INT64)
+		&& !httpreq_hdr(resp, "icy-metaint", &s)) {
+		c->seekable = 1;
+		c->fsize = size;
+		c->d->input.size = size;
+		dbglog(c->trk, "server supports range requests.  File size: %U", size);
+	}
+
+	const char *filt = "#file.probe";
+	if (ext.len != 0) {
+		const fmed_modinfo *mi;
+		if (NULL == (mi = core->getmod2(FMED_MOD_INEXT, ext.ptr, ext.len))) {
+			errlog(c->trk, "no module configured to open .%S stream", &ext);
+			return FMED_RERR;
+		}
+		filt = mi->name;
 	}
-	if (0 == net->track->cmd(c->trk, FMED_TRACK_FILT_ADD, mi->name))
+	if (0 == net->track->cmd(c->trk, FMED_TRACK_FILT_ADD, filt))
 		return FMED_RERR;
 	c->next_filt_ext = ext;
+	c->filt_added = 1;
 
-	s = fficy_shdr[FFICY_HMETAINT];
-	if (0 != ffhttp_findhdr(&resp->h, s.ptr, s.len, &s)) {
+	// "icy-br: 128" (kbit/s)
+	if (httpreq_hdr(resp, "icy-br", &s)) {
+		uint n;
+		if (ffstr_toint(&s, &n, FFS_INT32) && n != 0)
+			c->br_rate = n * 1000 / 8;
+	}
+
+	if (httpreq_hdr(resp, "icy-metaint", &s)) {
 		uint n;
 		if (ffstr_toint(&s, &n, FFS_INT32)) {
 			if (0 == net->track->cmd(c->trk, FMED_TRACK_FILT_ADD, "net.icy"))
@@ -709,74 +1173,465 @@ static int httpcli_resp(struct httpclient *c, ffhttp_response *resp)
 	return FMED_RDATA;
 }
 
-/** Handle events from 'httpif'. */
+/** Update jitter estimate after a data block has arrived. */
+static void httpcli_jitter(struct httpclient *c, size_t n)
+{
+	uint64 now = httpcli_now();
+	if (c->total == 0)
+		c->start_time = now;
+	c->total += n;
+
+	// transit time of data relative to its position in the stream
+	int transit = (int)((now - c->start_time) - c->media_time / 1000);
+	c->media_time += (uint64)n * 1000000 / httpcli_rate(c);
+
+	if (c->total != n && !c->resumed) {
+		// only late data increases the jitter: the data that comes early is just buffered
+		int d = ffmax(transit - c->transit, 0);
+		c->jitter += d - (c->jitter + 8) / 16;
+	}
+	c->transit = transit;
+	c->resumed = 0;
+}
+
+/** Get the max. memory size for buffered data: it must be able to hold 2 * target depth. */
+static size_t httpcli_bufcap(struct httpclient *c)
+{
+	return (uint64)2 * c->target * httpcli_rate(c) / 1000 + 2 * net->conf.bufsize;
+}
+
+/** Store received data in buffer.
+Return 1 if all data is stored. */
+static int httpcli_store(struct httpclient *c)
+{
+	while (c->data.len != 0) {
+		netbuf *b = NULL;
+		if (c->bufs.len != 0)
+			b = *ffarr_itemT(&c->bufs, c->bufs.len - 1, netbuf*);
+
+		if (b == NULL || b->len == b->cap || c->recon) {
+			netbuf **pb;
+			if (c->size + net->conf.bufsize > httpcli_bufcap(c)
+				|| NULL == (pb = ffarr_pushgrowT(&c->bufs, 8, netbuf*)))
+				return 0;
+			if (NULL == (b = netbuf_alloc(net->conf.bufsize))) {
+				c->bufs.len--;
+				return 0;
+			}
+			*pb = b;
+			b->recon = c->recon;
+			c->recon = 0;
+			c->size += b->cap;
+		}
+
+		size_t n = ffmin(c->data.len, b->cap - b->len);
+		ffmemcpy(b->data + b->len, c->data.ptr, n);
+		b->len += n;
+		c->unread += n;
+		ffstr_shift(&c->data, n);
+	}
+	return 1;
+}
+
+/** Free the cached block that is the farthest from 'pos'.
+Return 0 if there's nothing to free. */
+static int httpcli_evict(struct httpclient *c)
+{
+	uint64 end = c->pos + httpcli_avail(c, c->pos);
+	ssize_t k = -1;
+	uint64 dist = 0;
+	for (size_t i = 0;  i != c->bufs.len;  i++) {
+		const netbuf *b = *ffarr_itemT(&c->bufs, i, netbuf*);
+		if (b == c->wblk
+			|| (b->off < end && b->off + b->len > c->pos))
+			continue; // the data for the next filter
+		uint64 d = (b->off >= end) ? b->off - end : c->pos - b->off;
+		if (k == -1 || d > dist) {
+			k = i;
+			dist = d;
+		}
+	}
+	if (k == -1)
+		return 0;
+
+	netbuf *b = *ffarr_itemT(&c->bufs, k, netbuf*);
+	c->size -= b->cap;
+	netbuf_release(b);
+	_ffarr_rm(&c->bufs, k, 1, sizeof(netbuf*));
+	return 1;
+}
+
+/** Store received data of a seekable input in cache.
+Return 1 if all data is stored. */
+static int httpcli_store_range(struct httpclient *c)
+{
+	while (c->data.len != 0) {
+		size_t n;
+
+		if (c->range_ignored && c->recv_off < c->pos) {
+			// reading from the beginning up to the seek position
+			n = ffmin(c->data.len, c->pos - c->recv_off);
+			ffstr_shift(&c->data, n);
+			c->recv_off += n;
+			c->wblk = NULL;
+			continue;
+		}
+
+		ssize_t i = httpcli_find(c, c->recv_off);
+		if (i != -1) {
+			// skip the data that is already cached
+			const netbuf *b = *ffarr_itemT(&c->bufs, i, netbuf*);
+			n = ffmin(c->data.len, b->off + b->len - c->recv_off);
+			ffstr_shift(&c->data, n);
+			c->recv_off += n;
+			c->wblk = NULL;
+			continue;
+		}
+
+		// the next cached block after the offset
+		for (i = 0;  (size_t)i != c->bufs.len;  i++) {
+			if ((*ffarr_itemT(&c->bufs, i, netbuf*))->off > c->recv_off)
+				break;
+		}
+		uint64 next = ((size_t)i != c->bufs.len) ? (*ffarr_itemT(&c->bufs, i, netbuf*))->off : (uint64)-1;
+
+		netbuf *b = c->wblk;
+		if (b == NULL || b->len == b->cap) {
+			while (c->size + net->conf.bufsize > net->conf.range_cache) {
+				if (!httpcli_evict(c))
+					return 0;
+			}
+			// the evicted block might be the next one
+			for (i = 0;  (size_t)i != c->bufs.len;  i++) {
+				if ((*ffarr_itemT(&c->bufs, i, netbuf*))->off > c->recv_off)
+					break;
+			}
+
+			netbuf **pb;
+			if (NULL == (pb = ffarr_pushgrowT(&c->bufs, 8, netbuf*)))
+				return 0;
+			if (NULL == (b = netbuf_alloc(net->conf.bufsize))) {
+				c->bufs.len--;
+				return 0;
+			}
+			// insert the block so that 'bufs' stays sorted by offset
+			pb = ffarr_itemT(&c->bufs, i, netbuf*);
+			memmove(pb + 1, pb, (c->bufs.len - 1 - i) * sizeof(netbuf*));
+			*pb = b;
+			b->off = c->recv_off;
+			c->size += b->cap;
+			c->wblk = b;
+		}
+
+		n = ffmin(c->data.len, b->cap - b->len);
+		n = ffmin(n, next - c->recv_off);
+		ffmemcpy(b->data + b->len, c->data.ptr, n);
+		b->len += n;
+		c->recv_off += n;
+		ffstr_shift(&c->data, n);
+	}
+	return 1;
+}
+
+/** Receive more data unless the buffer is full. */
+static void httpcli_recv(struct httpclient *c)
+{
+	if (c->req == NULL)
+		return;
+	int stored = (c->seekable) ? httpcli_store_range(c) : httpcli_store(c);
+	if (!stored
+		|| httpcli_level(c) >= 2 * c->target) {
+		c->recv_paused = 1;
+		return;
+	}
+	httpreq_send(c->req);
+}
+
+/** Continue receiving if there's free space in buffer. */
+static void httpcli_resume(struct httpclient *c)
+{
+	if (!c->recv_paused
+		|| httpcli_level(c) >= 2 * c->target)
+		return;
+	c->recv_paused = 0;
+	c->resumed = 1;
+	httpcli_recv(c);
+}
+
+/** Wake up the track if it's waiting for data and the data is ready. */
+static void httpcli_wake(struct httpclient *c)
+{
+	if (!c->async)
+		return;
+	if (!c->prebuffer && !c->fin
+		&& httpcli_lead(c) <= 0)
+		httpcli_stall(c);
+	if (c->prebuffer && !c->fin && !c->recv_paused
+		&& httpcli_level(c) < c->target)
+		return;
+	c->async = 0;
+	net->track->cmd(c->trk, FMED_TRACK_WAKE);
+}
+
+static int httpcli_request(struct httpclient *c);
+
+/** Request the data of a seekable input from file offset.
+The data is requested from the beginning if the server doesn't support range requests. */
+static int httpcli_range(struct httpclient *c, uint64 off)
+{
+	if (c->range_ignored)
+		off = 0;
+
+	// note: the current request is freed after its handler returns
+	httpreq_close(c->req);
+	c->req = NULL;
+	c->data.len = 0;
+	c->wblk = NULL;
+	c->recv_paused = 0;
+	c->resumed = 1;
+	c->fin = 0;
+	c->recv_off = off;
+	c->range_req = 1;
+	c->nranges++;
+
+	if (0 != httpcli_request(c))
+		return -1;
+	if (!c->range_ignored) {
+		char buf[64];
+		ffstr name, val;
+		ffstr_setz(&name, "Range");
+		ffstr_set(&val, buf, ffs_fmt(buf, buf + sizeof(buf), "bytes=%U-", off));
+		if (0 != httpreq_header(c->req, &name, &val))
+			return -1;
+	}
+	dbglog(c->trk, "requesting data from offset %xU", off);
+	httpreq_send(c->req);
+	return 0;
+}
+
+/** Check the response to a range request. */
+static int httpcli_range_resp(struct httpclient *c, const httpreq_resp *resp)
+{
+	ffstr s;
+	uint64 off;
+	switch (resp->code) {
+	case 206:
+		// "Content-Range: bytes START-END/SIZE"
+		if (httpreq_hdr(resp, "Content-Range", &s)
+			&& ffstr_matchz(&s, "bytes ")) {
+			ffstr_shift(&s, FFSLEN("bytes "));
+			if (0 != ffs_toint(s.ptr, s.len, &off, FFS_INT64)
+				&& off == c->recv_off)
+				return 0;
+		}
+		break;
+
+	case 200:
+		if (!c->range_ignored) {
+			warnlog(c->trk, "server has ignored range request: seeking by receiving from the beginning");
+			c->range_ignored = 1;
+		}
+		c->recv_off = 0;
+		c->wblk = NULL;
+		return 0;
+	}
+	errlog(c->trk, "bad response to range request: %S", &resp->status);
+	return -1;
+}
+
+/** The connection is lost: send the request again via a new connection.
+Return 0 on success. */
+static int httpcli_reconnect(struct httpclient *c)
+{
+	if (!c->filt_added
+		|| c->status == FFHTTPCL_ENOADDR
+		|| c->reconnect_tries == net->conf.max_reconnect)
+		return -1;
+	c->reconnect_tries++;
+	warnlog(c->trk, "reconnecting (try %u of %u)..."
+		, c->reconnect_tries, net->conf.max_reconnect);
+
+	if (c->seekable) {
+		// continue from the offset where the connection was lost
+		c->reconnects++;
+		return httpcli_range(c, c->recv_off);
+	}
+
+	// note: the current request is freed after its handler returns
+	httpreq_close(c->req);
+	c->req = NULL;
+	if (0 != httpcli_request(c))
+		return -1;
+	httpreq_send(c->req);
+	return 0;
+}
+
+/** Handle events from the HTTP request. */
 static void httpcli_handler(void *param)
 {
 	struct httpclient *c = param;
-	ffhttp_response *resp;
+	const httpreq_resp *resp;
 	ffstr data;
-	int r = http_iface.recv(c->con, &resp, &data);
+	int r = httpreq_recv(c->req, &resp, &data);
 	c->status = r;
 
 	switch (r) {
 
 	case FFHTTPCL_RESP:
-		c->d->net_reconnect = 1;
-		r = httpcli_resp(c, resp);
-		if (r == FMED_RERR) {
-			c->st = 3;
-			net->track->cmd(c->trk, FMED_TRACK_WAKE);
+		if (c->range_req) {
+			if (0 != httpcli_range_resp(c, resp)) {
+				c->status = FFHTTPCL_ERR;
+				c->fin = 1;
+				httpcli_wake(c);
+				return;
+			}
+			break;
+		}
+
+		if (c->filt_added)
+			c->reconnects++;
+		if (FMED_RERR == httpcli_resp(c, resp)) {
+			c->status = FFHTTPCL_ERR;
+			c->fin = 1;
+			httpcli_wake(c);
 			return;
 		}
+
+		// the next filters must reinitialize when they get the data from a new connection
+		// (a seekable input continues from the same offset)
+		c->recon = !c->seekable;
+		c->resumed = 1;
 		break;
 
 	case FFHTTPCL_RESP_RECV:
+		c->reconnect_tries = 0;
+		httpcli_jitter(c, data.len);
 		c->data = data;
-		//fallthrough
+		httpcli_recv(c);
+		httpcli_wake(c);
+		return;
+
 	case FFHTTPCL_DONE:
-		net->track->cmd(c->trk, FMED_TRACK_WAKE);
+		c->fin = 1;
+		httpcli_wake(c);
 		return;
 	}
 
 	if (r < 0) {
-		net->track->cmd(c->trk, FMED_TRACK_WAKE);
+		if (0 == httpcli_reconnect(c))
+			return;
+		c->fin = 1;
+		httpcli_wake(c);
 		return;
 	}
 
-	http_iface.send(c->con, NULL);
+	httpreq_send(c->req);
 }
 
-static void httpcli_log(void *udata, uint level, const char *fmt, ...)
+/** Adjust target depth. */
+static void httpcli_target(struct httpclient *c)
 {
-	struct httpclient *c = udata;
+	uint64 now = httpcli_now();
+	if (c->floor > net->conf.buf_min
+		&& now - c->stable_time >= HTTP_FLOOR_STABLE) {
+		c->floor = ffmax(c->floor * 3 / 4, net->conf.buf_min);
+		c->stable_time = now;
+		dbglog(c->trk, "network is stable, decreasing buffer floor to %ums", c->floor);
+	}
 
-	uint lev;
-	switch (level & 0x0f) {
-	case FFHTTPCL_LOG_ERR:
-		lev = FMED_LOG_ERR; break;
-	case FFHTTPCL_LOG_WARN:
-		lev = FMED_LOG_WARN; break;
-	case FFHTTPCL_LOG_USER:
-		lev = FMED_LOG_USER; break;
-	case FFHTTPCL_LOG_INFO:
-		lev = FMED_LOG_INFO; break;
-	case FFHTTPCL_LOG_DEBUG:
-		lev = FMED_LOG_DEBUG; break;
-	default:
+	uint target = c->floor + 4 * c->jitter / 16;
+	target = ffmin(target, net->conf.buf_max);
+	if (target != c->target) {
+		dbglog(c->trk, "buffer target: %ums  (jitter: %ums)", target, c->jitter / 16);
+		c->target = target;
+	}
+}
+
+/** Release the blocks that the next filter has processed.
+The block is still referenced by net.in if it records the stream. */
+static void httpcli_compact(struct httpclient *c)
+{
+	if (c->seekable) {
+		// the block stays in cache
+		if (c->outblk != NULL)
+			netbuf_release(c->outblk);
+		c->outblk = NULL;
 		return;
 	}
-	if (level & FFHTTPCL_LOG_SYS)
-		lev |= FMED_LOG_SYS;
 
-	va_list va;
-	va_start(va, fmt);
-	core->logv(lev, c->d->trk, "net.httpif", fmt, va);
-	va_end(va);
+	c->outblk = NULL;
+	while (c->bufs.len != 0) {
+		netbuf *b = *ffarr_itemT(&c->bufs, 0, netbuf*);
+		if (c->off != b->len
+			|| (c->bufs.len == 1 && b->len != b->cap))
+			break; // unread data, or the block is being filled
+		c->size -= b->cap;
+		netbuf_release(b);
+		_ffarr_rmleft(&c->bufs, 1, sizeof(netbuf*));
+		c->off = 0;
+	}
+}
+
+/** Get the block passed to the next filter. */
+static netbuf* httpcli_outblk(struct httpclient *c)
+{
+	return c->outblk;
+}
+
+/** The next filter requests data from another offset of a seekable input. */
+static void httpcli_seek(struct httpclient *c, uint64 off)
+{
+	dbglog(c->trk, "seeking to %xU", off);
+	c->pos = off;
+	c->nseek++;
+	if (!c->prebuffer) {
+		c->prebuffer = 1;
+		c->prebuf_time = httpcli_now();
+	}
+}
+
+/** There's no data at 'pos' of a seekable input.
+Return 1 if the data is being received;  0 if there's no more data;  -1 on error. */
+static int httpcli_range_wait(struct httpclient *c)
+{
+	if (c->pos >= c->fsize)
+		return 0;
+
+	// note: the data before 'pos' is dropped if the server ignores range requests
+	if (c->req != NULL && !c->fin
+		&& c->recv_off <= c->pos
+		&& (c->range_ignored || c->pos - c->recv_off <= HTTP_RANGE_GAP))
+		return 1; // the data will be received soon
+
+	if (c->fin && c->status < 0)
+		return -1;
+
+	if (0 != httpcli_range(c, c->pos))
+		return -1;
+	return 1;
+}
+
+/** Create request. */
+static int httpcli_request(struct httpclient *c)
+{
+	const char *url = net->track->getvalstr(c->trk, "input");
+	if (NULL == (c->req = httpreq_create(c->pool, url)))
+		return -1;
+
+	if (net->conf.meta) {
+		ffstr val;
+		ffstr_setz(&val, "1");
+		if (0 != httpreq_header(c->req, &fficy_shdr[FFICY_HMETADATA], &val))
+			return -1;
+	}
+
+	httpreq_sethandler(c->req, &httpcli_handler, c);
+	return 0;
 }
 
 /**
-Make request via 'httpif'.
-Get data from 'httpif' and pass further through the chain. */
+Make request via the connection pool: host name is resolved asynchronously, so the worker isn't blocked.
+Get data from the request, buffer it and pass further through the chain. */
 static int httpcli_process(void *ctx, fmed_filt *d)
 {
 	struct httpclient *c = ctx;
@@ -787,64 +1642,107 @@ static int httpcli_process(void *ctx, fmed_filt *d)
 	}
 
 	switch (c->st) {
-	case 0: {
-		const char *url = d->track->getvalstr(d->trk, "input");
-		if (NULL == (c->con = http_iface.request("GET", url, 0)))
-			return FMED_RERR;
-
-		struct ffhttpcl_conf conf;
-		http_iface.conf(c->con, &conf, FFHTTPCL_CONF_GET);
-		if (d->trk != NULL)
-			conf.kq = (fffd)net->track->cmd(d->trk, FMED_TRACK_KQ);
-		conf.log = &httpcli_log;
-		http_iface.conf(c->con, &conf, FFHTTPCL_CONF_SET);
-
+	case 0:
 		core->getmod("net.icy"); // load net.icy config
-		if (net->conf.meta) {
-			ffstr val;
-			ffstr_setz(&val, "1");
-			http_iface.header(c->con, &fficy_shdr[FFICY_HMETADATA], &val, 0);
-		}
-
-		if (net->conf.user_agent != 0) {
-			ffstr s;
-			ffstr_setz(&s, http_ua[net->conf.user_agent - 1]);
-			http_iface.header(c->con, &ffhttp_shdr[FFHTTP_USERAGENT], &s, 0);
-		}
+		if (NULL == (c->pool = httppool_create(d->trk))
+			|| 0 != httpcli_request(c))
+			return FMED_RERR;
 
-		http_iface.sethandler(c->con, &httpcli_handler, c);
 		c->st = 1;
-		http_iface.send(c->con, NULL);
+		c->prebuf_time = httpcli_now();
+		c->stable_time = c->prebuf_time;
+		c->async = 1;
+		httpreq_send(c->req);
 		return FMED_RASYNC;
 	}
 
-	case 1:
-		switch (c->status) {
-		case FFHTTPCL_RESP_RECV:
-			c->st = 2;
-			d->out = c->data.ptr,  d->outlen = c->data.len;
-			return FMED_RDATA;
+	c->async = 0;
+	httpcli_compact(c);
 
-		case FFHTTPCL_DONE:
-			d->outlen = 0;
-			return FMED_RDONE;
+	if ((int64)d->input.seek != FMED_NULL) {
+		if (c->seekable)
+			httpcli_seek(c, d->input.seek);
+		d->input.seek = FMED_NULL;
+	}
 
-		case FFHTTPCL_ENOADDR:
-			c->d->e_no_source = 1;
-			break;
+	httpcli_target(c);
+	httpcli_resume(c);
+
+	d->net_buf.level = httpcli_level(c) + ffmax(httpcli_lead(c), 0);
+	d->net_buf.target = c->target;
+	d->net_buf.stalls = c->stalls;
+	d->net_buf.reconnects = c->reconnects;
+	d->net_buf.received = c->total;
+	d->net_buf.prebuffer = c->prebuffer;
+
+	if (httpcli_unread(c) == 0) {
+		if (c->seekable) {
+			switch (httpcli_range_wait(c)) {
+			case 0:
+				d->outlen = 0;
+				return FMED_RDONE;
+			case -1:
+				return FMED_RERR;
+			}
+
+		} else if (c->fin) {
+			if (c->status == FFHTTPCL_DONE) {
+				d->outlen = 0;
+				return FMED_RDONE;
+			} else if (c->status == FFHTTPCL_ENOADDR) {
+				d->e_no_source = 1;
+			}
+			return FMED_RERR;
 		}
-		return FMED_RERR;
 
-	case 2:
-		c->st = 1;
-		http_iface.send(c->con, NULL);
+		if (!c->prebuffer
+			&& httpcli_lead(c) <= 0)
+			httpcli_stall(c);
+		c->async = 1;
 		return FMED_RASYNC;
+	}
 
-	case 3:
-		return FMED_RERR;
+	if (c->prebuffer) {
+		if (httpcli_filling(c) && !c->recv_paused
+			&& httpcli_level(c) < c->target) {
+			c->async = 1;
+			return FMED_RASYNC;
+		}
+		c->prebuffer = 0;
+		if (c->stalls != 0)
+			c->refills++;
+		c->play_time = httpcli_now();
+		c->out_bytes = 0;
+		c->play_paused = d->paused_time;
+		dbglog(c->trk, "buffered %ums in %Ums", httpcli_level(c), c->play_time - c->prebuf_time);
 	}
 
-	return FMED_RERR;
+	netbuf *b;
+	size_t off;
+	if (c->seekable) {
+		b = *ffarr_itemT(&c->bufs, httpcli_find(c, c->pos), netbuf*);
+		off = c->pos - b->off;
+		ffatom_inc(&b->refs); // the block may be evicted from cache while the next filter uses its data
+	} else {
+		b = *ffarr_itemT(&c->bufs, 0, netbuf*);
+		off = c->off;
+	}
+	if (b->recon && off == 0) {
+		// the next filters will get the data from a new connection
+		d->net_reconnect = 1;
+	}
+	size_t n = b->len - off;
+	d->out = b->data + off,  d->outlen = n;
+	c->outblk = b;
+	if (c->seekable) {
+		c->pos += n;
+	} else {
+		c->off += n;
+		c->unread -= n;
+	}
+	c->out_bytes += n;
+	httpcli_resume(c);
+	return FMED_RDATA;
 }
 
 #undef FILT_NAME
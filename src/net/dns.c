@@ -0,0 +1,425 @@
+/** Asynchronous DNS resolver with cache.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+Host names are resolved by resolver threads, so a slow DNS server never blocks a worker thread.
+
+dns_resolve():
+. an entry for "host:port" is in cache and isn't expired: the result is ready
+. the entry is being resolved: the query waits for it
+. otherwise a new entry is added to cache and to the resolver queue;
+   a new resolver thread is started if all threads are busy and the limit isn't reached
+Resolver thread: take the next entry from the queue -> getaddrinfo() -> add the entry to 'done' list
+ -> post the task to the main thread.
+Main thread: set expiration time of the resolved entries
+ -> post the tasks of the waiting queries to their workers, where the handlers are called.
+
+Queries are made within any worker, so the cache and the entries are protected by the lock.
+
+On close, the resolver threads are waited for DNS_QUIT_TMOUT:
+ a thread blocked in getaddrinfo() is detached and drops its result when it returns.
+
+getaddrinfo() doesn't return TTL values from DNS response,
+ so the entries expire after 'dns_cache_ttl' seconds.
+Failed lookups are cached for DNS_NEG_TTL.
+An entry is freed when it's removed from cache and no query references it.
+*/
+
+#include <net/net.h>
+#include <FFOS/socket.h>
+#include <FFOS/error.h>
+#include <FFOS/thread.h>
+#include <FFOS/semaphore.h>
+
+
+#define FILT_NAME  "net.dns"
+
+/** Max. number of resolver threads. */
+#define DNS_MAXTHREADS  4
+
+/** Cache failed lookups for (msec). */
+#define DNS_NEG_TTL  5000
+
+/** Wait for resolver threads to exit on close (msec). */
+#define DNS_QUIT_TMOUT  1000
+
+struct dns_ent {
+	struct dns_ent *next; // next entry in the resolver queue or in 'done' list
+	char *host;
+	char *port;
+	ffaddrinfo *addrs;
+	int rc; // ffaddr_info() result
+	int err; // system error code
+	uint64 expire; // msec
+	uint refs; // cache + queries
+	ffarr queries; // dnsquery*[]: waiting queries
+	uint resolving :1;
+};
+
+struct dnsquery {
+	struct dns_ent *ent;
+	dns_handler handler;
+	void *udata;
+	fftask tsk;
+	uint wid; // the worker which calls the handler
+	uint waiting :1;
+	uint posted :1;
+};
+
+struct dns {
+	fflock lk;
+	ffarr cache; // struct dns_ent*[]
+
+	ffsem sem; // posted for each job
+	struct dns_ent *jobs, *jobs_last; // resolver queue
+	uint njobs;
+	struct dns_ent *done; // resolved entries
+	ffthd threads[DNS_MAXTHREADS];
+	uint nthreads;
+	uint busy; // threads resolving a host
+	uint quit :1;
+	uint posted :1;
+	fftask tsk;
+
+	// statistics
+	uint hits;
+	uint misses;
+};
+
+static struct dns *g_dns;
+
+static void dns_done(void *param);
+
+static uint64 dns_now(void)
+{
+	fftime t;
+	fftime_now(&t);
+	return fftime_ms(&t);
+}
+
+static void ent_release(struct dns_ent *e)
+{
+	if (--e->refs != 0)
+		return;
+	FF_ASSERT(e->queries.len == 0);
+	if (e->addrs != NULL)
+		ffaddr_infofree(e->addrs);
+	ffmem_free(e->host);
+	ffmem_free(e->port);
+	ffarr_free(&e->queries);
+	ffmem_free(e);
+}
+
+/** Remove entry from cache. */
+static void cache_rm(struct dns *d, size_t i)
+{
+	struct dns_ent *e = *ffarr_itemT(&d->cache, i, struct dns_ent*);
+	_ffarr_rm(&d->cache, i, 1, sizeof(struct dns_ent*));
+	ent_release(e);
+}
+
+/** Remove expired entries from cache and find the entry for "host:port". */
+static struct dns_ent* cache_find(struct dns *d, const char *host, const char *port)
+{
+	uint64 now = dns_now();
+	struct dns_ent *r = NULL;
+	for (size_t i = 0;  i != d->cache.len;  ) {
+		struct dns_ent *e = *ffarr_itemT(&d->cache, i, struct dns_ent*);
+		if (!e->resolving && now >= e->expire) {
+			cache_rm(d, i);
+			continue;
+		}
+		if (ffsz_eq(e->host, host) && ffsz_eq(e->port, port))
+			r = e;
+		i++;
+	}
+	return r;
+}
+
+static FFTHDCALL int dns_worker(void *param)
+{
+	struct dns *d = param;
+	for (;;) {
+		ffsem_wait(d->sem, -1);
+		if (d->quit)
+			break;
+
+		fflk_lock(&d->lk);
+		struct dns_ent *e = d->jobs;
+		d->jobs = e->next;
+		d->njobs--;
+		d->busy++;
+		fflk_unlock(&d->lk);
+
+		e->rc = ffaddr_info(&e->addrs, e->host, e->port, 0);
+		if (e->rc != 0) {
+			e->err = fferr_last();
+			e->addrs = NULL;
+		}
+
+		fflk_lock(&d->lk);
+		d->busy--;
+		if (d->quit) {
+			// the module is closing: drop the result
+			fflk_unlock(&d->lk);
+			break;
+		}
+		e->next = d->done;
+		d->done = e;
+		if (!d->posted) {
+			d->posted = 1;
+			core->task(&d->tsk, FMED_TASK_POST);
+		}
+		fflk_unlock(&d->lk);
+	}
+	return 0;
+}
+
+int dns_init(void)
+{
+	struct dns *d;
+	if (NULL == (d = ffmem_new(struct dns)))
+		return -1;
+	fflk_init(&d->lk);
+	if (FFSEM_INV == (d->sem = ffsem_open(NULL, 0, 0))) {
+		syserrlog(core, NULL, FILT_NAME, "%s", "ffsem_open");
+		ffmem_free(d);
+		return -1;
+	}
+	d->tsk.handler = &dns_done;
+	d->tsk.param = d;
+	g_dns = d;
+	return 0;
+}
+
+void dns_destroy(void)
+{
+	struct dns *d = g_dns;
+	if (d == NULL)
+		return;
+	g_dns = NULL;
+
+	fflk_lock(&d->lk);
+	d->quit = 1;
+	fflk_unlock(&d->lk);
+	for (uint i = 0;  i != d->nthreads;  i++) {
+		ffsem_post(d->sem);
+	}
+	core->task(&d->tsk, FMED_TASK_DEL);
+
+	dbglog(NULL, "cache: hits:%u  misses:%u", d->hits, d->misses);
+
+	// note: a thread may wait for getaddrinfo() to return for a long time:
+	//  don't wait for it more than DNS_QUIT_TMOUT.
+	// It will exit without using anything but 'd', so 'd' isn't freed then.
+	uint nleft = 0;
+	uint64 until = dns_now() + DNS_QUIT_TMOUT;
+	for (uint i = 0;  i != d->nthreads;  i++) {
+		uint64 now = dns_now();
+		uint ms = (until > now) ? until - now : 0;
+		if (0 != ffthd_join(d->threads[i], ms, NULL)) {
+			ffthd_detach(d->threads[i]);
+			nleft++;
+		}
+	}
+	if (nleft != 0) {
+		warnlog(NULL, "%u resolver threads are still running", nleft);
+		return;
+	}
+	ffsem_close(d->sem);
+
+	// the queued and resolved entries are referenced by cache
+	while (d->cache.len != 0) {
+		struct dns_ent *e = *ffarr_itemT(&d->cache, 0, struct dns_ent*);
+		e->queries.len = 0;
+		cache_rm(d, 0);
+	}
+	ffarr_free(&d->cache);
+	ffmem_free(d);
+}
+
+/** Add entry to the resolver queue.  The lock is held. */
+static int dns_job(struct dns *d, struct dns_ent *e)
+{
+	int r = -1;
+	if (d->nthreads - d->busy <= d->njobs
+		&& d->nthreads != DNS_MAXTHREADS) {
+		ffthd th;
+		if (FFTHD_INV == (th = ffthd_create(&dns_worker, d, 0))) {
+			syserrlog(core, NULL, FILT_NAME, "%s", "thread create");
+			if (d->nthreads == 0)
+				goto end;
+		} else {
+			d->threads[d->nthreads++] = th;
+			dbglog(NULL, "started resolver thread #%u", d->nthreads);
+		}
+	}
+
+	e->next = NULL;
+	if (d->jobs == NULL)
+		d->jobs = e;
+	else
+		d->jobs_last->next = e;
+	d->jobs_last = e;
+	d->njobs++;
+	r = 0;
+	ffsem_post(d->sem);
+
+end:
+	return r;
+}
+
+/** Call the handler of the query.  Thread: the query's worker. */
+static void dns_query_ev(void *param)
+{
+	dnsquery *q = param;
+	struct dns *d = g_dns;
+	fflk_lock(&d->lk);
+	q->posted = 0;
+	fflk_unlock(&d->lk);
+	q->handler(q->udata);
+}
+
+/** Resolved entries: wake the waiting queries.  Thread: main. */
+static void dns_done(void *param)
+{
+	struct dns *d = param;
+
+	fflk_lock(&d->lk);
+	struct dns_ent *done = d->done;
+	d->done = NULL;
+	d->posted = 0;
+
+	uint64 now = dns_now();
+	while (done != NULL) {
+		struct dns_ent *e = done;
+		done = e->next;
+		e->resolving = 0;
+		if (e->rc == 0) {
+			e->expire = now + net->conf.dns_cache_ttl * 1000;
+			dbglog(NULL, "%s: resolved", e->host);
+		} else {
+			e->expire = now + ffmin(net->conf.dns_cache_ttl * 1000, DNS_NEG_TTL);
+			dbglog(NULL, "%s: resolve: %E", e->host, e->err);
+		}
+
+		dnsquery **pq;
+		FFARR_WALKT(&e->queries, pq, dnsquery*) {
+			dnsquery *q = *pq;
+			q->waiting = 0;
+			q->posted = 1;
+			fftask_set(&q->tsk, &dns_query_ev, q);
+			core->cmd(FMED_TASK_XPOST, &q->tsk, q->wid);
+		}
+		e->queries.len = 0;
+	}
+
+	fflk_unlock(&d->lk);
+}
+
+dnsquery* dns_resolve(const char *host, const char *port, uint wid, dns_handler handler, void *udata)
+{
+	struct dns *d = g_dns;
+	dnsquery *q;
+	if (NULL == (q = ffmem_new(dnsquery)))
+		return NULL;
+	q->handler = handler;
+	q->udata = udata;
+	q->wid = wid;
+
+	fflk_lock(&d->lk);
+	struct dns_ent *e = cache_find(d, host, port);
+	if (e != NULL) {
+		d->hits++;
+		if (e->resolving) {
+			dnsquery **pq;
+			if (NULL == (pq = ffarr_pushgrowT(&e->queries, 4, dnsquery*)))
+				goto err;
+			*pq = q;
+			q->waiting = 1;
+		}
+		e->refs++;
+		q->ent = e;
+		fflk_unlock(&d->lk);
+		return q;
+	}
+
+	d->misses++;
+	struct dns_ent **pe;
+	if (NULL == (e = ffmem_new(struct dns_ent)))
+		goto err;
+	e->refs = 1;
+	dnsquery **pq;
+	if (NULL == (e->host = ffsz_alcopyz(host))
+		|| NULL == (e->port = ffsz_alcopyz(port))
+		|| NULL == (pq = ffarr_pushgrowT(&e->queries, 4, dnsquery*)))
+		goto err_ent;
+	*pq = q;
+	q->waiting = 1;
+
+	if (NULL == (pe = ffarr_pushgrowT(&d->cache, 8, struct dns_ent*)))
+		goto err_ent;
+	*pe = e;
+	e->resolving = 1;
+	if (0 != dns_job(d, e)) {
+		e->queries.len = 0;
+		cache_rm(d, d->cache.len - 1);
+		goto err;
+	}
+
+	e->refs++;
+	q->ent = e;
+	fflk_unlock(&d->lk);
+	return q;
+
+err_ent:
+	e->queries.len = 0;
+	ent_release(e);
+err:
+	fflk_unlock(&d->lk);
+	ffmem_free(q);
+	return NULL;
+}
+
+int dns_result(dnsquery *q, const ffaddrinfo **addrs, int *err)
+{
+	struct dns *d = g_dns;
+	const struct dns_ent *e = q->ent;
+	int r = 0;
+	fflk_lock(&d->lk);
+	if (e->resolving) {
+		r = 1;
+	} else if (e->rc != 0) {
+		*err = e->err;
+		r = -1;
+	} else {
+		*addrs = e->addrs;
+	}
+	fflk_unlock(&d->lk);
+	return r;
+}
+
+void dns_free(dnsquery *q)
+{
+	if (q == NULL)
+		return;
+	struct dns *d = g_dns;
+	struct dns_ent *e = q->ent;
+	fflk_lock(&d->lk);
+	if (q->posted)
+		core->cmd(FMED_TASK_XDEL, &q->tsk, q->wid);
+	if (q->waiting) {
+		dnsquery **pq;
+		FFARR_WALKT(&e->queries, pq, dnsquery*) {
+			if (*pq == q) {
+				_ffarr_rm(&e->queries, pq - (dnsquery**)e->queries.ptr, 1, sizeof(dnsquery*));
+				break;
+			}
+		}
+	}
+	ent_release(e);
+	fflk_unlock(&d->lk);
+	ffmem_free(q);
+}
+
+#undef FILT_NAME
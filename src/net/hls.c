@@ -14,194 +14,331 @@ const fmed_filter nethls = {
 	&hls_open, &hls_process, &hls_close
 };
 
+static const ffpars_arg hls_conf_args[] = {
+	{ "prefetch",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, hls_prefetch) },
+	{ "max_buffer",	FFPARS_TSIZE | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, hls_max_buffer) },
+};
+
 
 #define FILT_NAME "net.hls"
 
+/** Refresh interval (msec) until #EXT-X-TARGETDURATION is known. */
+#define HLS_TARGET_DUR  10000
+
+/** Playlist refreshes without new data files before giving up (when there's nothing to play). */
+#define HLS_MAX_STALE  6
+
+struct hls_ent {
+	ffstr name;
+	uint64 seq;
+};
+
+/** Data file download. */
+struct hls_seg {
+	struct hls *c;
+	httpreq *con;
+	uint64 seq;
+	char *url;
+	ffarr data; // received data which isn't yet passed to the next filter
+	ffarr out; // data passed to the next filter
+	uint64 size; // total bytes received
+	uint64 start_time; // msec
+	uint status; // enum FFHTTPCL_ST
+	uint done :1;
+	uint err :1;
+	uint paused :1; // reading is suspended because the buffer is full (never set for the first file)
+};
+
 struct hls {
-	uint state;
-	uint http_status;
-	uint64 seq, m3u_seq;
-	void *con;
 	void *trk;
 	const char *m3u_url;
-	char *file_url;
 	ffstr base_url;
-	ffstr http_data;
-	ffm3u m3u;
-	ffarr qu; //ffstr[]
 	ffstr file_ext;
+
+	httppool *pool;
+
+	// playlist
+	httpreq *m3u_con;
+	int m3u_status;
+	ffarr m3u_data;
+	ffm3u m3u;
+	uint64 m3u_seq; // sequence number of the next file in the playlist being parsed
+	uint64 next_seq; // sequence number of the next file to be added to the queue
+	uint64 m3u_time; // when to refresh the playlist (msec)
+	uint target_dur; // msec
+	uint nstale; // refreshes in a row without new data files
+	ffarr qu; //struct hls_ent[]
+
+	// data files being downloaded, in the order of playback
+	struct hls_seg *segs; // ring buffer
+	uint nsegs;
+	uint head;
+	uint nactive;
+	size_t buffered; // bytes received but not yet passed further
+
+	fftmrq_entry tmr;
+
+	// statistics
+	uint nfiles;
+	uint underruns;
+	uint64 total_bytes;
+	uint64 total_ms;
+
 	uint first :1;
-	uint have_media_seq :1;
+	uint m3u_loaded :1;
+	uint m3u_err :1;
+	uint m3u_new :1;
+	uint endlist :1;
+	uint async :1; // waiting for an event
+	uint tmr_active :1;
+	uint started :1; // passed data to the next filter
+	uint stalled :1;
+	uint err :1;
 };
 
-enum {
-	HLS_GETM3U, HLS_PARSEM3U,
-	HLS_GETTRACK, HLS_FILERESP, HLS_FILECONT,
-	HLS_ERR
-};
+int hls_config(ffpars_ctx *ctx)
+{
+	ffpars_setargs(ctx, &net->conf, hls_conf_args, FFCNT(hls_conf_args));
+	return 0;
+}
+
+static uint64 hls_now(void)
+{
+	fftime t;
+	fftime_now(&t);
+	return fftime_ms(&t);
+}
 
 static void* hls_open(fmed_filt *d)
 {
 	struct hls *c;
 	if (NULL == (c = ffmem_new(struct hls)))
 		return NULL;
+	c->nsegs = net->conf.hls_prefetch;
+	if (NULL == (c->segs = ffmem_callocT(c->nsegs, struct hls_seg))
+		|| NULL == (c->pool = httppool_create(d->trk))) {
+		ffmem_free(c->segs);
+		ffmem_free(c);
+		return NULL;
+	}
 	c->m3u_url = d->track->getvalstr(d->trk, "input");
 	ffpath_split2(c->m3u_url, ffsz_len(c->m3u_url), &c->base_url, NULL);
 	ffm3u_init(&c->m3u);
 	c->trk = d->trk;
 	c->first = 1;
+	c->target_dur = HLS_TARGET_DUR;
 	return c;
 }
 
+static void hls_seg_free(struct hls *c, struct hls_seg *s)
+{
+	httpreq_close(s->con);
+	ffmem_free(s->url);
+	c->buffered -= s->data.len;
+	ffarr_free(&s->data);
+	ffarr_free(&s->out);
+	ffmem_tzero(s);
+}
+
 static void hls_close(void *ctx)
 {
 	struct hls *c = ctx;
-	ffstr_free(&c->file_ext);
-	http_iface.close(c->con);
+
+	if (c->tmr_active)
+		core->timer(&c->tmr, 0, 0);
+
+	if (c->nfiles != 0)
+		fmed_infolog(core, c->trk, FILT_NAME, "data files: %u  received: %U bytes  avg. throughput: %U kbit/s  buffer underruns: %u"
+			, c->nfiles, c->total_bytes, c->total_bytes * 8 / ffmax(c->total_ms, 1), c->underruns);
+
+	for (uint i = 0;  i != c->nactive;  i++) {
+		hls_seg_free(c, &c->segs[(c->head + i) % c->nsegs]);
+	}
+	ffmem_free(c->segs);
+
+	httpreq_close(c->m3u_con);
+	httppool_free(c->pool);
+	ffarr_free(&c->m3u_data);
 	ffm3u_close(&c->m3u);
-	ffmem_free(c->file_url);
+	ffstr_free(&c->file_ext);
 
-	ffstr *ps;
-	FFARR_WALKT(&c->qu, ps, ffstr) {
-		ffstr_free(ps);
+	struct hls_ent *e;
+	FFARR_WALKT(&c->qu, e, struct hls_ent) {
+		ffstr_free(&e->name);
 	}
+	ffarr_free(&c->qu);
 
 	ffmem_free(c);
 }
 
-/** HTTP handler. */
-static void hls_httpsig(void *param)
+/** Wake up the track if the filter is waiting for an event. */
+static void hls_wake(struct hls *c)
+{
+	if (!c->async)
+		return;
+	c->async = 0;
+	net->track->cmd(c->trk, FMED_TRACK_WAKE);
+}
+
+static void hls_timer(void *param)
 {
 	struct hls *c = param;
-	ffhttp_response *resp;
+	net->track->cmd(c->trk, FMED_TRACK_WAKE);
+}
+
+/** HTTP handler for .m3u8 request. */
+static void hls_m3u_sig(void *param)
+{
+	struct hls *c = param;
+	const httpreq_resp *resp;
 	ffstr data;
-	int r = http_iface.recv(c->con, &resp, &data);
-	c->http_status = r;
+	int r = httpreq_recv(c->m3u_con, &resp, &data);
+	c->m3u_status = r;
 
 	switch (r) {
 
 	case FFHTTPCL_RESP: {
 		if (resp->code != 200) {
-			c->state = HLS_ERR;
+			if (!c->m3u_loaded)
+				errlog(c->trk, "%s: %S", c->m3u_url, &resp->status);
+			else
+				warnlog(c->trk, "%s: %S", c->m3u_url, &resp->status);
+			c->m3u_err = 1;
 			goto wake;
 		}
 
 		ffstr val;
-		if (0 != ffhttp_findihdr(&resp->h, FFHTTP_CONTENT_TYPE, &val)) {
-			if (c->state == HLS_PARSEM3U) {
-				if (!ffstr_eqz(&val, "application/vnd.apple.mpegurl")) {
-					errlog(c->trk, "unsupported Content-Type: %S", &val);
-					c->state = HLS_ERR;
-					goto wake;
-				}
+		if (httpreq_hdr(resp, "Content-Type", &val)) {
+			if (!ffstr_eqz(&val, "application/vnd.apple.mpegurl")) {
+				errlog(c->trk, "unsupported Content-Type: %S", &val);
+				c->m3u_err = 1;
+				goto wake;
 			}
 		}
 		break;
 	}
 
 	case FFHTTPCL_RESP_RECV:
-		c->http_data = data;
-		//fallthrough
+		if (NULL == ffarr_append(&c->m3u_data, data.ptr, data.len)) {
+			c->m3u_err = 1;
+			goto wake;
+		}
+		break;
+
 	case FFHTTPCL_DONE:
 		goto wake;
 	}
 
 	if (r < 0) {
+		c->m3u_err = 1;
 		goto wake;
 	}
 
-	http_iface.send(c->con, NULL);
+	httpreq_send(c->m3u_con);
 	return;
 
 wake:
-	net->track->cmd(c->trk, FMED_TRACK_WAKE);
+	hls_wake(c);
 }
 
-/** HTTP logger. */
-static void hls_log(void *udata, uint level, const char *fmt, ...)
+/** HTTP handler for a data file request. */
+static void hls_seg_sig(void *param)
 {
-	struct hls *c = udata;
-
-	uint lev;
-	switch (level & 0x0f) {
-	case FFHTTPCL_LOG_ERR:
-		lev = FMED_LOG_ERR; break;
-	case FFHTTPCL_LOG_WARN:
-		lev = FMED_LOG_WARN; break;
-	case FFHTTPCL_LOG_USER:
-		lev = FMED_LOG_USER; break;
-	case FFHTTPCL_LOG_INFO:
-		lev = FMED_LOG_INFO; break;
-	case FFHTTPCL_LOG_DEBUG:
-		lev = FMED_LOG_DEBUG; break;
-	default:
-		return;
+	struct hls_seg *s = param;
+	struct hls *c = s->c;
+	const httpreq_resp *resp;
+	ffstr data;
+	int r = httpreq_recv(s->con, &resp, &data);
+	s->status = r;
+
+	switch (r) {
+
+	case FFHTTPCL_RESP:
+		if (resp->code != 200) {
+			errlog(c->trk, "%s: %S", s->url, &resp->status);
+			s->err = 1;
+			goto wake;
+		}
+		break;
+
+	case FFHTTPCL_RESP_RECV:
+		if (NULL == ffarr_append(&s->data, data.ptr, data.len)) {
+			s->err = 1;
+			goto wake;
+		}
+		s->size += data.len;
+		c->buffered += data.len;
+
+		if (s == &c->segs[c->head]) {
+			httpreq_send(s->con);
+			goto wake;
+		}
+
+		if (c->buffered >= net->conf.hls_max_buffer) {
+			// don't prefetch more data until the buffer is drained by the next filters
+			s->paused = 1;
+			return;
+		}
+		break;
+
+	case FFHTTPCL_DONE: {
+		s->done = 1;
+		uint64 ms = ffmax(hls_now() - s->start_time, 1);
+		c->nfiles++;
+		c->total_bytes += s->size;
+		c->total_ms += ms;
+		dbglog(c->trk, "downloaded data file #%U: %U bytes in %Ums (%U kbit/s)  buffer: %u files, %L bytes"
+			, s->seq, s->size, ms, s->size * 8 / ms
+			, c->nactive, c->buffered);
+		goto wake;
+	}
 	}
-	if (level & FFHTTPCL_LOG_SYS)
-		lev |= FMED_LOG_SYS;
 
-	va_list va;
-	va_start(va, fmt);
-	core->logv(lev, c->trk, FILT_NAME, fmt, va);
-	va_end(va);
+	if (r < 0) {
+		s->err = 1;
+		goto wake;
+	}
+
+	httpreq_send(s->con);
+	return;
+
+wake:
+	hls_wake(c);
 }
 
 /** Add an element to the queue. */
 static int hls_list_add(struct hls *c, const ffstr *name, uint64 seq)
 {
-	if (seq < c->seq) {
+	if (seq < c->next_seq) {
 		dbglog(c->trk, "skipping data file #%U", seq);
 		return 0;
 	}
 
-	ffstr *ps = ffarr_pushgrowT(&c->qu, 4, ffstr);
-	if (NULL == ffstr_alcopystr(ps, name))
+	struct hls_ent *e = ffarr_pushgrowT(&c->qu, 4, struct hls_ent);
+	if (e == NULL
+		|| NULL == ffstr_alcopystr(&e->name, name))
 		return -1;
-	if (c->qu.len == 1)
-		c->seq = seq;
+	e->seq = seq;
+	c->next_seq = seq + 1;
+	c->m3u_new = 1;
 	dbglog(c->trk, "added data file #%U: %S [%L]"
 		, seq, name, c->qu.len);
 	return 0;
 }
 
-/** Get the first element from the queue and remove it.
-name: User must free the value with ffstr_free(). */
-static int hls_list_pop(struct hls *c, ffstr *name)
+/** Start an HTTP request. */
+static int hls_request(struct hls *c, httpreq **pcon, const char *url, ffhttpcl_handler func, void *udata)
 {
-	if (c->qu.len == 0)
+	httpreq *con;
+	if (NULL == (con = httpreq_create(c->pool, url)))
 		return -1;
-	*name = *ffarr_itemT(&c->qu, 0, ffstr);
-	_ffarr_rmleft(&c->qu, 1, sizeof(ffstr));
-	dbglog(c->trk, "playing data file #%U: %S [%L]"
-		, c->seq, name, c->qu.len);
-	c->seq++;
-	return 0;
-}
-
-static int hls_request(struct hls *c, const char *url)
-{
-	FF_ASSERT(c->con == NULL);
-	if (NULL == (c->con = http_iface.request("GET", url, 0)))
-		return FMED_RERR;
-
-	struct ffhttpcl_conf conf;
-	http_iface.conf(c->con, &conf, FFHTTPCL_CONF_GET);
-	conf.kq = (fffd)net->track->cmd(c->trk, FMED_TRACK_KQ);
-	conf.log = &hls_log;
-	http_iface.conf(c->con, &conf, FFHTTPCL_CONF_SET);
-
-	if (net->conf.user_agent != 0) {
-		ffstr s;
-		ffstr_setz(&s, http_ua[net->conf.user_agent - 1]);
-		http_iface.header(c->con, &ffhttp_shdr[FFHTTP_USERAGENT], &s, 0);
-	}
-
-	http_iface.sethandler(c->con, &hls_httpsig, c);
-	http_iface.send(c->con, NULL);
+	*pcon = con;
+	httpreq_sethandler(con, func, udata);
+	httpreq_send(con);
 	return 0;
 }
 
-/** Parse a chunk of .m3u data and add elements to the queue.
+/** Parse .m3u data and add elements to the queue.
 Return FMED_RMORE or an error. */
 static int hls_m3u_parse(struct hls *c, const ffstr *data)
 {
@@ -213,11 +350,6 @@ static int hls_m3u_parse(struct hls *c, const ffstr *data)
 
 		switch (r) {
 		case FFM3U_URL: {
-			if (!c->have_media_seq) {
-				errlog(c->trk, ".m3u8 parser: expecting #EXT-X-MEDIA-SEQUENCE before the first data file", 0);
-				return FMED_RERR;
-			}
-
 			ffstr name, ext;
 			name = ffm3u_value(&c->m3u);
 			ffpath_split3(name.ptr, name.len, NULL, NULL, &ext);
@@ -250,21 +382,31 @@ static int hls_m3u_parse(struct hls *c, const ffstr *data)
 			return FMED_RMORE;
 
 		case FFM3U_EXT: {
-			if (c->have_media_seq)
-				break;
-			//get sequence number from "#EXT-X-MEDIA-SEQUENCE:1234"
 			ffstr line, name, val;
 			line = ffm3u_value(&c->m3u);
 			ffs_split2by(line.ptr, line.len, ':', &name, &val);
-			if (!ffstr_eqz(&name, "#EXT-X-MEDIA-SEQUENCE"))
-				break;
-			uint64 seq;
-			if (!ffstr_toint(&val, &seq, FFS_INT64)) {
-				errlog(c->trk, "incorrect value: %S", &line);
-				return FMED_RERR;
+
+			if (ffstr_eqz(&name, "#EXT-X-MEDIA-SEQUENCE")) {
+				//"#EXT-X-MEDIA-SEQUENCE:1234": sequence number of the first data file
+				uint64 seq;
+				if (!ffstr_toint(&val, &seq, FFS_INT64)) {
+					errlog(c->trk, "incorrect value: %S", &line);
+					return FMED_RERR;
+				}
+				c->m3u_seq = seq;
+
+			} else if (ffstr_eqz(&name, "#EXT-X-TARGETDURATION")) {
+				//"#EXT-X-TARGETDURATION:10": max. duration of a data file (sec)
+				uint n;
+				if (!ffstr_toint(&val, &n, FFS_INT32) || n == 0) {
+					warnlog(c->trk, "incorrect value: %S", &line);
+					break;
+				}
+				c->target_dur = n * 1000;
+
+			} else if (ffstr_eqz(&name, "#EXT-X-ENDLIST")) {
+				c->endlist = 1;
 			}
-			c->m3u_seq = seq;
-			c->have_media_seq = 1;
 			break;
 		}
 
@@ -280,100 +422,210 @@ static int hls_m3u_parse(struct hls *c, const ffstr *data)
 	}
 }
 
+/** Process the received .m3u8 data and schedule the next refresh.
+Return 0 on success. */
+static int hls_m3u_done(struct hls *c)
+{
+	int r = FMED_RERR;
+	uint64 now = hls_now();
+
+	if (!c->m3u_err) {
+		ffstr data;
+		ffstr_set2(&data, &c->m3u_data);
+		c->m3u_new = 0;
+		r = hls_m3u_parse(c, &data);
+	}
+
+	httpreq_close(c->m3u_con);
+	c->m3u_con = NULL;
+	c->m3u_data.len = 0;
+	c->m3u_err = 0;
+	ffm3u_close(&c->m3u);
+	ffm3u_init(&c->m3u);
+	c->m3u_seq = 0;
+
+	if (r != FMED_RMORE) {
+		if (!c->m3u_loaded || r != FMED_RERR)
+			return -1;
+		// keep playing the files we already have
+		warnlog(c->trk, "can't refresh playlist, retrying", 0);
+		c->m3u_time = now + c->target_dur / 2;
+		return 0;
+	}
+	c->m3u_loaded = 1;
+
+	if (c->m3u_new) {
+		c->nstale = 0;
+		c->m3u_time = now + c->target_dur;
+	} else {
+		// the playlist hasn't changed: try again after half the target duration
+		c->nstale++;
+		c->m3u_time = now + c->target_dur / 2;
+	}
+	dbglog(c->trk, "playlist: new files:%u  queued:%L  buffer: %u files, %L bytes  next refresh in %ums%s"
+		, (int)c->m3u_new, c->qu.len, c->nactive, c->buffered
+		, (int)(c->m3u_time - now), (c->endlist) ? "  (end of list)" : "");
+	return 0;
+}
+
+/** Start new downloads and resume the paused ones while there's free space in the buffer.
+Return 0 on success. */
+static int hls_seg_start(struct hls *c)
+{
+	struct hls_seg *s;
+
+	for (uint i = 0;  i != c->nactive;  i++) {
+		s = &c->segs[(c->head + i) % c->nsegs];
+		if (s->paused
+			&& (i == 0 || c->buffered < net->conf.hls_max_buffer)) {
+			s->paused = 0;
+			httpreq_send(s->con);
+		}
+	}
+
+	while (c->nactive != c->nsegs
+		&& c->qu.len != 0
+		&& c->buffered < net->conf.hls_max_buffer) {
+
+		struct hls_ent *e = ffarr_itemT(&c->qu, 0, struct hls_ent);
+		s = &c->segs[(c->head + c->nactive) % c->nsegs];
+		c->nactive++;
+		s->c = c;
+		s->seq = e->seq;
+		s->url = ffsz_alfmt("%S/%S", &c->base_url, &e->name);
+		ffstr_free(&e->name);
+		_ffarr_rmleft(&c->qu, 1, sizeof(struct hls_ent));
+		if (s->url == NULL)
+			return -1;
+
+		dbglog(c->trk, "downloading data file #%U: %s  [in progress:%u  queued:%L]"
+			, s->seq, s->url, c->nactive, c->qu.len);
+		s->start_time = hls_now();
+		if (0 != hls_request(c, &s->con, s->url, &hls_seg_sig, s))
+			return -1;
+	}
+	return 0;
+}
+
+/** Pass the data of the first file in the ring buffer to the next filter.
+Return FMED_RDATA, FMED_RERR or FMED_RASYNC if there's no data yet. */
+static int hls_seg_out(struct hls *c, fmed_filt *d)
+{
+	while (c->nactive != 0) {
+		struct hls_seg *s = &c->segs[c->head];
+
+		// the previous chunk is consumed by the next filter
+		ffarr_free(&s->out);
+
+		if (s->err) {
+			errlog(c->trk, "data file #%U: download failed", s->seq);
+			return FMED_RERR;
+		}
 
+		if (s->data.len != 0) {
+			s->out = s->data;
+			ffarr_null(&s->data);
+			c->buffered -= s->out.len;
+			c->started = 1;
+			c->stalled = 0;
+			if (0 != hls_seg_start(c))
+				return FMED_RERR;
+			d->out = s->out.ptr,  d->outlen = s->out.len;
+			return FMED_RDATA;
+		}
+
+		if (!s->done) {
+			if (s->size == 0 && c->started && !c->stalled) {
+				// the next file isn't prefetched in time
+				c->stalled = 1;
+				c->underruns++;
+				dbglog(c->trk, "buffer underrun: waiting for data file #%U", s->seq);
+			}
+			break;
+		}
+
+		dbglog(c->trk, "finished data file #%U", s->seq);
+		hls_seg_free(c, s);
+		c->head = (c->head + 1) % c->nsegs;
+		c->nactive--;
+		if (0 != hls_seg_start(c))
+			return FMED_RERR;
+	}
+
+	return FMED_RASYNC;
+}
 
 /** HLS client:
-. Repeat:
- . Request .m3u8 by HTTP and receive its data
- . Parse the data and get file names
+. Request .m3u8 by HTTP and parse its data
  . Add appropriate filter by file extension (only once)
- . Determine which files are new from the last time (using #EXT-X-MEDIA-SEQUENCE value)
- . If there's no new files, exit
- . Add new files to the queue
- . Get the first file from the queue
- . Prepare a complete URL for the file (base URL for .m3u8 file + file name)
- . Request the file by HTTP
- . Pass file data to the next filters
- . Remove the file from the queue
+ . Add new files to the queue (using #EXT-X-MEDIA-SEQUENCE value to skip the files seen before)
+ . Refresh the playlist in background after #EXT-X-TARGETDURATION interval
+   (half the interval if the playlist hasn't changed);
+   don't refresh after #EXT-X-ENDLIST
+. Download up to 'prefetch' files in parallel;
+   suspend reading the next files when 'max_buffer' bytes are received but not yet processed
+. Pass the data of the first file to the next filters as soon as it's received
+. When the first file is complete, remove it and start downloading the next file from the queue
 */
 static int hls_process(void *ctx, fmed_filt *d)
 {
 	struct hls *c = ctx;
 	int r;
 
-	for (;;) {
-	switch (c->state) {
+	c->async = 0;
+	if (c->tmr_active) {
+		c->tmr_active = 0;
+		core->timer(&c->tmr, 0, 0);
+	}
 
-	case HLS_GETM3U: {
-		if (0 != hls_request(c, c->m3u_url))
-			return FMED_RERR;
-		c->state = HLS_PARSEM3U;
-		return FMED_RASYNC;
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RDONE;
 	}
-		//fallthrough
 
-	case HLS_PARSEM3U:
-		r = hls_m3u_parse(c, &c->http_data);
-		switch (r) {
-		case FMED_RMORE:
-			if (c->http_status == FFHTTPCL_DONE) {
-				ffm3u_close(&c->m3u);
-				ffm3u_init(&c->m3u);
-				c->m3u_seq = 0;
-				c->have_media_seq = 0;
-				http_iface.close(c->con);
-				c->con = NULL;
-				if (c->qu.len == 0) {
-					errlog(c->trk, "no new data files in m3u list", 0);
-					return FMED_RERR;
-				}
-				c->state = HLS_GETTRACK;
-				break;
-			}
-			http_iface.send(c->con, NULL);
-			return FMED_RASYNC;
-		default:
-			c->state = HLS_ERR;
-			continue;
-		}
-		//fallthrough
-
-	case HLS_GETTRACK: {
-		ffstr name;
-		r = hls_list_pop(c, &name);
-		if (r != 0) {
-			c->state = HLS_GETM3U;
-			continue;
-		}
-		ffmem_free(c->file_url);
-		c->file_url = ffsz_alfmt("%S/%S", &c->base_url, &name);
-		ffstr_free(&name);
-		if (0 != hls_request(c, c->file_url))
+	if (c->m3u_con != NULL) {
+		if ((c->m3u_status == FFHTTPCL_DONE || c->m3u_err)
+			&& 0 != hls_m3u_done(c))
+			return FMED_RERR;
+
+	} else if (!c->endlist && hls_now() >= c->m3u_time) {
+		if (0 != hls_request(c, &c->m3u_con, c->m3u_url, &hls_m3u_sig, c))
 			return FMED_RERR;
-		c->state = HLS_FILERESP;
-		return FMED_RASYNC;
 	}
 
-	case HLS_FILERESP:
-		c->state = HLS_FILECONT;
-		d->out = c->http_data.ptr,  d->outlen = c->http_data.len;
-		return FMED_RDATA;
-
-	case HLS_FILECONT:
-		if (c->http_status == FFHTTPCL_DONE) {
-			http_iface.close(c->con);
-			c->con = NULL;
-			c->state = HLS_GETTRACK;
-			continue;
-		}
-		http_iface.send(c->con, NULL);
-		c->state = HLS_FILERESP;
-		return FMED_RASYNC;
+	if (!c->m3u_loaded)
+		goto async;
 
-	case HLS_ERR:
+	if (0 != hls_seg_start(c))
 		return FMED_RERR;
+
+	r = hls_seg_out(c, d);
+	if (r != FMED_RASYNC)
+		return r;
+
+	if (c->nactive == 0 && c->qu.len == 0) {
+		if (c->endlist) {
+			d->outlen = 0;
+			return FMED_RDONE;
+		}
+		if (c->nstale >= HLS_MAX_STALE) {
+			errlog(c->trk, "no new data files in m3u list", 0);
+			return FMED_RERR;
+		}
+
+		if (c->m3u_con == NULL) {
+			// nothing to do until the next playlist refresh
+			int64 ms = (int64)(c->m3u_time - hls_now());
+			c->tmr.handler = &hls_timer;
+			c->tmr.param = c;
+			core->timer(&c->tmr, -ffmax(ms, 1), 0);
+			c->tmr_active = 1;
+		}
 	}
-	}
+
+async:
+	c->async = 1;
+	return FMED_RASYNC;
 }
 
 #undef FILT_NAME
@@ -0,0 +1,1211 @@
+/** HTTP/1.1 client with a pool of persistent connections.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+A pool is created by a filter that sends requests to HTTP servers (net.in, HLS):
+ its requests are run within the track's worker: timers are set and DNS results are delivered there,
+ and it's freed there too (FMED_TRACK_KQ makes the track close its filters within the worker).
+
+Idle connections are kept in the module-global list, keyed by "host:port",
+ so the next track (e.g. after switching to another station on the same server,
+ or after reconnect) continues to use them.
+A connection stays attached to the kqueue of the worker which has created it,
+ so it's reused and closed only within this worker.
+The normal playback runs all tracks within the main worker;
+ the tracks spread over the workers ("--parallel") share the connections of their worker.
+
+Request:
+. Get an idle connection to the host from the global list
+   (or create a new one if the track's limit of connections to this host isn't reached)
+. Resolve host name via the asynchronous resolver
+. Connect: try the resolved addresses (IPv6 and IPv4 interleaved);
+   start the next attempt if there's no connection after HTTP_RACE_DELAY while the previous ones are in progress;
+   the first established connection is used, the others are closed
+. Send request; receive response headers
+. Follow redirects
+. Receive body (Content-Length, chunked or until the connection is closed)
+. Return the connection to the pool if the response is complete and the server allows keep-alive
+
+A connection that was idle in the pool may be closed by the server at any time:
+ if there's no response on a reused connection, the request is sent again via a new connection.
+Idle connections are closed after 'keepalive_timeout' (checked when a connection is taken or returned);
+ no more than 'max_host_connections' idle connections to a host are kept per worker.
+*/
+
+#include <net/net.h>
+#include <FFOS/asyncio.h>
+#include <FFOS/socket.h>
+#include <FFOS/error.h>
+
+
+#define FILT_NAME  "net.httppool"
+
+/** Max. size of response headers. */
+#define HTTP_MAXHDR  (64 * 1024)
+
+/** Start a connection attempt to the next address after (msec). */
+#define HTTP_RACE_DELAY  250
+
+struct httpconn {
+	ffaio_task aio;
+	char *host; // "host:port" of the server (or proxy)
+	uint64 idle_since; // msec
+	uint nreqs; // requests served
+	uint wid; // the worker whose kqueue the connection is attached to
+
+	// connection attempt:
+	httpreq *req;
+	const ffaddrinfo *addr;
+	uint64 conn_start; // msec
+	uint conn_ev :1; // connect operation is signalled
+};
+
+enum REQ_ST {
+	R_INIT, R_CONN, R_WAITSLOT, R_RESOLVE, R_CONNECTING, R_SEND, R_RECVHDR, R_BODY, R_BODYRECV, R_DONE, R_ERR, R_FIN
+};
+
+enum BODY_T {
+	B_NONE, B_LENGTH, B_CHUNKED, B_CLOSE
+};
+
+enum CHUNK_ST {
+	CH_SIZE, CH_DATA, CH_DATA_CRLF, CH_TRAILER
+};
+
+struct httpreq {
+	httppool *pool;
+	struct httpconn *conn;
+	uint state;
+	int status; // enum FFHTTPCL_ST
+	void *trk;
+
+	char *url;
+	char *host; // "host:port" to connect to
+	ffstr path; // absolute URL when requesting via proxy
+	ffstr hostname; // "host[:port]" for Host header
+	ffarr hdrs; // user's request headers
+	ffarr req;
+	size_t req_off;
+	dnsquery *dns;
+	ffarr addrs; // const ffaddrinfo*[]: addresses in the order of connection attempts
+	uint addr_next;
+	ffarr tries; // struct httpconn*[]: connection attempts in progress
+
+	ffarr buf;
+	size_t off; // processed bytes in 'buf'
+	ffstr data;
+	httpreq_resp resp;
+	uint body;
+	uint64 body_left;
+	uint chunk_st;
+
+	fftmrq_entry tmr;
+	uint nredirect;
+
+	ffhttpcl_handler handler;
+	void *udata;
+
+	uint reused :1;
+	uint retried :1;
+	uint keepalive :1;
+	uint running :1;
+	uint again :1;
+	uint user_wait :1;
+	uint closing :1;
+	uint tmr_active :1;
+	uint race :1; // start the next connection attempt
+};
+
+struct httppool {
+	void *trk;
+	fffd kq;
+	uint wid; // the track's worker
+	ffarr conns; //struct httpconn*[]: connections used by the requests
+	ffarr reqs; //httpreq*[]
+	fftmrq_entry tmr;
+	uint tmr_active :1;
+
+	// statistics
+	uint hits; // reused connections
+	uint misses; // new connections
+	uint stale; // reused connections closed by server
+	uint expired; // idle connections closed by timeout
+};
+
+/** Idle connections shared by all pools. */
+static struct {
+	fflock lk;
+	ffarr conns; //struct httpconn*[]
+} g_idle;
+
+static void req_run(httpreq *r);
+static void req_ev(void *udata);
+static void pool_schedule(httppool *p);
+
+void http_trim(ffstr *s)
+{
+	const char *p = ffs_skipof(s->ptr, s->len, " \t\r", 3);
+	const char *end = ffs_rskipof(p, s->ptr + s->len - p, " \t\r", 3);
+	ffstr_set(s, p, end - p);
+}
+
+/** Return TRUE if "host:port" or "[addr]:port" contains port number. */
+static int http_hasport(const ffstr *host)
+{
+	ffstr h, port;
+	uint n;
+	ffs_rsplit2by(host->ptr, host->len, ':', &h, &port);
+	return ffstr_toint(&port, &n, FFS_INT32);
+}
+
+static uint64 http_now(void)
+{
+	fftime t;
+	fftime_now(&t);
+	return fftime_ms(&t);
+}
+
+
+static void conn_free(struct httpconn *c)
+{
+	if (c->aio.sk != FF_BADSKT)
+		ffskt_close(c->aio.sk);
+	ffmem_free(c->host);
+	ffmem_free(c);
+}
+
+/** Remove the connection from the array. */
+static void conn_rm(ffarr *conns, struct httpconn *c)
+{
+	struct httpconn **pc;
+	FFARR_WALKT(conns, pc, struct httpconn*) {
+		if (*pc == c) {
+			_ffarr_rm(conns, pc - (struct httpconn**)conns->ptr, 1, sizeof(struct httpconn*));
+			break;
+		}
+	}
+}
+
+static void conn_close(httppool *p, struct httpconn *c)
+{
+	conn_rm(&p->conns, c);
+	conn_free(c);
+}
+
+/** Close the idle connections of this worker that are unused for too long.
+The lock is held. */
+static void pool_expire(httppool *p)
+{
+	uint64 now = http_now();
+	for (size_t i = 0;  i != g_idle.conns.len;  ) {
+		struct httpconn *c = *ffarr_itemT(&g_idle.conns, i, struct httpconn*);
+		if (c->wid == p->wid && now - c->idle_since >= net->conf.keepalive_tmout) {
+			dbglog(p->trk, "%s: closing idle connection (served %u requests)"
+				, c->host, c->nreqs);
+			p->expired++;
+			_ffarr_rm(&g_idle.conns, i, 1, sizeof(struct httpconn*));
+			conn_free(c);
+			continue;
+		}
+		i++;
+	}
+}
+
+/** Get an idle connection to the host which is attached to the pool's kqueue.
+Return NULL if there's none. */
+static struct httpconn* pool_get(httppool *p, const char *host)
+{
+	struct httpconn *c = NULL, **pc;
+	fflk_lock(&g_idle.lk);
+	pool_expire(p);
+	// the most recently used one is less likely to be closed by server
+	for (size_t i = g_idle.conns.len;  i != 0;  i--) {
+		struct httpconn *it = *ffarr_itemT(&g_idle.conns, i - 1, struct httpconn*);
+		if (it->wid == p->wid && ffsz_eq(it->host, host)) {
+			_ffarr_rm(&g_idle.conns, i - 1, 1, sizeof(struct httpconn*));
+			c = it;
+			break;
+		}
+	}
+	fflk_unlock(&g_idle.lk);
+
+	if (c == NULL)
+		return NULL;
+	if (NULL == (pc = ffarr_pushgrowT(&p->conns, 4, struct httpconn*))) {
+		conn_free(c);
+		return NULL;
+	}
+	*pc = c;
+	return c;
+}
+
+/** Put the connection to the global list of idle connections.
+Return 0 on success;  -1 if the connection must be closed. */
+static int pool_put(httppool *p, struct httpconn *c)
+{
+	int r = -1;
+	uint n = 0;
+	struct httpconn **pc;
+	fflk_lock(&g_idle.lk);
+	pool_expire(p);
+	FFARR_WALKT(&g_idle.conns, pc, struct httpconn*) {
+		if ((*pc)->wid == c->wid && ffsz_eq((*pc)->host, c->host))
+			n++;
+	}
+	if (n < net->conf.max_host_conns
+		&& NULL != (pc = ffarr_pushgrowT(&g_idle.conns, 4, struct httpconn*))) {
+		*pc = c;
+		r = 0;
+	}
+	fflk_unlock(&g_idle.lk);
+	return r;
+}
+
+/** Get the number of connections to the host used by the pool's requests. */
+static uint pool_nconns(httppool *p, const char *host)
+{
+	uint n = 0;
+	struct httpconn **pc;
+	FFARR_WALKT(&p->conns, pc, struct httpconn*) {
+		if (ffsz_eq((*pc)->host, host))
+			n++;
+	}
+	return n;
+}
+
+/** Return TRUE if the request can get a connection now. */
+static int pool_slot(httppool *p, const httpreq *r)
+{
+	return pool_nconns(p, r->host) < net->conf.max_host_conns;
+}
+
+/** Start the requests waiting for a free connection. */
+static void pool_process(void *param)
+{
+	httppool *p = param;
+	p->tmr_active = 0;
+
+	for (;;) {
+		httpreq *r = NULL, **pr;
+		FFARR_WALKT(&p->reqs, pr, httpreq*) {
+			if ((*pr)->state == R_WAITSLOT
+				&& pool_slot(p, *pr)) {
+				r = *pr;
+				break;
+			}
+		}
+		if (r == NULL)
+			break;
+
+		r->state = R_CONN;
+		// note: user's handler may close any request
+		req_run(r);
+	}
+}
+
+/** Call pool_process() on the next timer tick if there are requests waiting for a free connection. */
+static void pool_schedule(httppool *p)
+{
+	if (p->tmr_active)
+		return;
+
+	httpreq **pr;
+	FFARR_WALKT(&p->reqs, pr, httpreq*) {
+		if ((*pr)->state == R_WAITSLOT) {
+			p->tmr.handler = &pool_process;
+			p->tmr.param = p;
+			core->timer(&p->tmr, -1, 0);
+			p->tmr_active = 1;
+			break;
+		}
+	}
+}
+
+/** Return the connection to the pool or close it. */
+static void req_release(httpreq *r, uint keep)
+{
+	struct httpconn *c = r->conn;
+	if (c == NULL)
+		return;
+	r->conn = NULL;
+	c->aio.udata = NULL;
+
+	if (keep && r->keepalive) {
+		c->idle_since = http_now();
+		c->nreqs++;
+		conn_rm(&r->pool->conns, c);
+		if (0 == pool_put(r->pool, c)) {
+			dbglog(r->trk, "%s: connection is kept alive", c->host);
+		} else {
+			dbglog(r->trk, "%s: too many idle connections, closing", c->host);
+			conn_free(c);
+		}
+	} else {
+		conn_close(r->pool, c);
+	}
+	pool_schedule(r->pool);
+}
+
+void httppool_init(void)
+{
+	fflk_init(&g_idle.lk);
+}
+
+void httppool_destroy(void)
+{
+	struct httpconn **pc;
+	FFARR_WALKT(&g_idle.conns, pc, struct httpconn*) {
+		conn_free(*pc);
+	}
+	ffarr_free(&g_idle.conns);
+}
+
+httppool* httppool_create(void *trk)
+{
+	httppool *p;
+	if (NULL == (p = ffmem_new(httppool)))
+		return NULL;
+	p->trk = trk;
+	p->kq = (fffd)net->track->cmd(trk, FMED_TRACK_KQ);
+	p->wid = net->track->cmd(trk, FMED_TRACK_WORKER);
+	return p;
+}
+
+void httppool_free(httppool *p)
+{
+	if (p == NULL)
+		return;
+	FF_ASSERT(p->reqs.len == 0);
+	if (p->tmr_active)
+		core->timer(&p->tmr, 0, 0);
+	dbglog(p->trk, "connection pool: reused:%u  new:%u  closed by server:%u  idle timeouts:%u"
+		, p->hits, p->misses, p->stale, p->expired);
+	while (p->conns.len != 0) {
+		conn_close(p, *ffarr_itemT(&p->conns, 0, struct httpconn*));
+	}
+	ffarr_free(&p->conns);
+
+	fflk_lock(&g_idle.lk);
+	pool_expire(p);
+	fflk_unlock(&g_idle.lk);
+	ffarr_free(&p->reqs);
+	ffmem_free(p);
+}
+
+/** Split URL "http://host[:port]/path" */
+static int url_split(const char *url, ffstr *host, ffstr *path)
+{
+	ffstr s;
+	ffstr_setz(&s, url);
+	if (!ffstr_matchz(&s, "http://"))
+		return -1;
+	ffstr_shift(&s, FFSLEN("http://"));
+	const char *p = ffs_findof(s.ptr, s.len, "/?", 2);
+	ffstr_set(host, s.ptr, p - s.ptr);
+	ffstr_set(path, p, s.ptr + s.len - p);
+	if (host->len == 0)
+		return -1;
+	return 0;
+}
+
+/** Prepare request data. */
+static int req_prepare(httpreq *r)
+{
+	ffstr host, path;
+	if (0 != url_split(r->url, &host, &path)) {
+		errlog(r->trk, "unsupported URL: %s", r->url);
+		return -1;
+	}
+	r->hostname = host;
+	r->path = path;
+	if (path.len == 0)
+		ffstr_setz(&r->path, "/");
+
+	ffmem_free0(r->host);
+	if (net->conf.proxy.host != NULL) {
+		r->host = ffsz_alfmt("%s:%u", net->conf.proxy.host, net->conf.proxy.port);
+		ffstr_setz(&r->path, r->url);
+	} else if (http_hasport(&host)) {
+		r->host = ffsz_alcopystr(&host);
+	} else {
+		r->host = ffsz_alfmt("%S:%u", &host, FFHTTP_PORT);
+	}
+	if (r->host == NULL)
+		return -1;
+
+	r->req.len = 0;
+	if (0 == ffstr_catfmt(&r->req, "GET %S HTTP/1.1\r\nHost: %S\r\n"
+		, &r->path, &r->hostname))
+		return -1;
+	if (net->conf.user_agent != 0
+		&& 0 == ffstr_catfmt(&r->req, "User-Agent: %s\r\n", http_ua[net->conf.user_agent - 1]))
+		return -1;
+	ffstr hdrs;
+	ffstr_set2(&hdrs, &r->hdrs);
+	if (0 == ffstr_catfmt(&r->req, "Connection: %s\r\n%S\r\n"
+		, (net->conf.keepalive) ? "keep-alive" : "close", &hdrs))
+		return -1;
+	r->req_off = 0;
+	return 0;
+}
+
+httpreq* httpreq_create(httppool *p, const char *url)
+{
+	httpreq *r;
+	if (NULL == (r = ffmem_new(httpreq)))
+		return NULL;
+	r->pool = p;
+	r->trk = p->trk;
+	httpreq **pr;
+	if (NULL == (r->url = ffsz_alcopyz(url))
+		|| NULL == (pr = ffarr_pushgrowT(&p->reqs, 4, httpreq*))) {
+		ffmem_free(r->url);
+		ffmem_free(r);
+		return NULL;
+	}
+	*pr = r;
+	return r;
+}
+
+/** Close all connection attempts. */
+static void req_tries_close(httpreq *r)
+{
+	struct httpconn **pc;
+	FFARR_WALKT(&r->tries, pc, struct httpconn*) {
+		conn_free(*pc);
+	}
+	r->tries.len = 0;
+}
+
+static void req_free(httpreq *r)
+{
+	httppool *p = r->pool;
+	httpreq **pr;
+	FFARR_WALKT(&p->reqs, pr, httpreq*) {
+		if (*pr == r) {
+			_ffarr_rm(&p->reqs, pr - (httpreq**)p->reqs.ptr, 1, sizeof(httpreq*));
+			break;
+		}
+	}
+
+	if (r->tmr_active)
+		core->timer(&r->tmr, 0, 0);
+	req_release(r, 0);
+	req_tries_close(r);
+	ffarr_free(&r->tries);
+	dns_free(r->dns);
+	ffarr_free(&r->addrs);
+	ffmem_free(r->url);
+	ffmem_free(r->host);
+	ffarr_free(&r->hdrs);
+	ffarr_free(&r->req);
+	ffarr_free(&r->buf);
+	ffmem_free(r);
+}
+
+void httpreq_close(httpreq *r)
+{
+	if (r == NULL)
+		return;
+	if (r->running) {
+		r->closing = 1;
+		return;
+	}
+	req_free(r);
+}
+
+void httpreq_sethandler(httpreq *r, ffhttpcl_handler func, void *udata)
+{
+	r->handler = func;
+	r->udata = udata;
+}
+
+int httpreq_header(httpreq *r, const ffstr *name, const ffstr *val)
+{
+	if (0 == ffstr_catfmt(&r->hdrs, "%S: %S\r\n", name, val))
+		return -1;
+	return 0;
+}
+
+void httpreq_send(httpreq *r)
+{
+	r->user_wait = 0;
+	req_run(r);
+}
+
+int httpreq_recv(httpreq *r, const httpreq_resp **resp, ffstr *data)
+{
+	*resp = &r->resp;
+	*data = r->data;
+	return r->status;
+}
+
+int httpreq_hdr(const httpreq_resp *resp, const char *name, ffstr *val)
+{
+	ffstr s = resp->headers, line, k, v;
+	while (s.len != 0) {
+		ffstr_shift(&s, ffstr_nextval(s.ptr, s.len, &line, '\n'));
+		if (NULL == ffs_split2by(line.ptr, line.len, ':', &k, &v))
+			continue;
+		if (ffstr_ieqz(&k, name)) {
+			http_trim(&v);
+			*val = v;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/** I/O timeout. */
+static void req_timer(void *param)
+{
+	httpreq *r = param;
+	r->tmr_active = 0;
+	errlog(r->trk, "%s: timeout", r->host);
+	r->state = R_ERR;
+	req_run(r);
+}
+
+/** Start I/O timer. */
+static void req_timer_start(httpreq *r, uint ms)
+{
+	r->tmr.handler = &req_timer;
+	r->tmr.param = r;
+	core->timer(&r->tmr, -(int)ms, 0);
+	r->tmr_active = 1;
+}
+
+/** Host name is resolved. */
+static void req_dns_ev(void *udata)
+{
+	httpreq *r = udata;
+	req_run(r);
+}
+
+/** Connection attempt is complete. */
+static void conn_ev(void *udata)
+{
+	struct httpconn *c = udata;
+	c->conn_ev = 1;
+	req_run(c->req);
+}
+
+/** Connection attempt timer. */
+static void req_conn_timer(void *param)
+{
+	httpreq *r = param;
+	r->tmr_active = 0;
+	r->race = 1;
+	req_run(r);
+}
+
+/** Set the order of connection attempts: interleave address families, starting with the first one. */
+static int req_addrs(httpreq *r, const ffaddrinfo *addrs)
+{
+	const ffaddrinfo *a = addrs, *b = addrs, **pa;
+	int family = addrs->ai_family;
+	r->addrs.len = 0;
+	r->addr_next = 0;
+	for (;;) {
+		while (a != NULL && a->ai_family != family)
+			a = a->ai_next;
+		while (b != NULL && b->ai_family == family)
+			b = b->ai_next;
+		if (a == NULL && b == NULL)
+			break;
+
+		if (a != NULL) {
+			if (NULL == (pa = ffarr_pushgrowT(&r->addrs, 4, const ffaddrinfo*)))
+				return -1;
+			*pa = a;
+			a = a->ai_next;
+		}
+		if (b != NULL) {
+			if (NULL == (pa = ffarr_pushgrowT(&r->addrs, 4, const ffaddrinfo*)))
+				return -1;
+			*pa = b;
+			b = b->ai_next;
+		}
+	}
+	return 0;
+}
+
+/** Start connection attempt to the next address. */
+static int req_try(httpreq *r)
+{
+	httppool *p = r->pool;
+	struct httpconn *c, **pc;
+	if (NULL == (c = ffmem_new(struct httpconn)))
+		return -1;
+	ffaio_init(&c->aio);
+	c->aio.udata = c;
+	c->req = r;
+	c->addr = *ffarr_itemT(&r->addrs, r->addr_next, const ffaddrinfo*);
+	c->conn_start = http_now();
+	c->wid = p->wid;
+	c->conn_ev = 1;
+	if (NULL == (c->host = ffsz_alcopyz(r->host))
+		|| NULL == (pc = ffarr_pushgrowT(&r->tries, 4, struct httpconn*))) {
+		c->aio.sk = FF_BADSKT;
+		conn_free(c);
+		return -1;
+	}
+	*pc = c;
+	r->addr_next++;
+
+	if (FF_BADSKT == (c->aio.sk = ffskt_create(c->addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP))) {
+		syserrlog(core, r->trk, FILT_NAME, "%s", "socket create");
+		return -1;
+	}
+	if (0 != ffaio_attach(&c->aio, p->kq, FFKQU_READ | FFKQU_WRITE)) {
+		syserrlog(core, r->trk, FILT_NAME, "%s", "kqueue attach");
+		return -1;
+	}
+	dbglog(r->trk, "%s: connecting (address %u of %L)..."
+		, r->host, r->addr_next, r->addrs.len);
+	return 0;
+}
+
+/** Connect to the server.
+Return 0 if connected;  1 if in progress;  -1 on error. */
+static int req_connect(httpreq *r)
+{
+	uint64 now = http_now();
+	for (;;) {
+		for (size_t i = 0;  i != r->tries.len;  ) {
+			struct httpconn *c = *ffarr_itemT(&r->tries, i, struct httpconn*);
+			int rc;
+			if (c->conn_ev) {
+				c->conn_ev = 0;
+				rc = ffaio_connect(&c->aio, &conn_ev, c->addr->ai_addr, c->addr->ai_addrlen);
+				if (rc == 0) {
+					_ffarr_rm(&r->tries, i, 1, sizeof(struct httpconn*));
+					req_tries_close(r);
+					r->conn = c;
+					return 0;
+				} else if (rc != FFAIO_ASYNC) {
+					fmed_syswarnlog(core, r->trk, FILT_NAME, "%s: %s", r->host, "connect");
+				}
+			} else {
+				rc = (now - c->conn_start < net->conf.conn_tmout) ? FFAIO_ASYNC : FFAIO_ERROR;
+				if (rc != FFAIO_ASYNC)
+					warnlog(r->trk, "%s: connect: timeout", r->host);
+			}
+
+			if (rc != FFAIO_ASYNC) {
+				_ffarr_rm(&r->tries, i, 1, sizeof(struct httpconn*));
+				conn_free(c);
+				continue;
+			}
+			i++;
+		}
+
+		if (r->addr_next == r->addrs.len) {
+			if (r->tries.len == 0) {
+				errlog(r->trk, "%s: can't connect", r->host);
+				return -1;
+			}
+			break;
+		}
+		if (r->tries.len != 0 && !r->race)
+			break;
+		r->race = 0;
+		if (0 != req_try(r))
+			return -1;
+	}
+
+	// wait until an attempt is complete, or until it's time to start the next one
+	uint64 ms = (r->addr_next != r->addrs.len) ? HTTP_RACE_DELAY : (uint64)-1;
+	struct httpconn **pc;
+	FFARR_WALKT(&r->tries, pc, struct httpconn*) {
+		uint64 t = (*pc)->conn_start + net->conf.conn_tmout;
+		ms = ffmin(ms, (t > now) ? t - now : 1);
+	}
+	r->tmr.handler = &req_conn_timer;
+	r->tmr.param = r;
+	core->timer(&r->tmr, -(int)ms, 0);
+	r->tmr_active = 1;
+	return 1;
+}
+
+/** The connection was reused but the server closed it: send the request via a new connection. */
+static int req_retry(httpreq *r)
+{
+	if (!r->reused || r->retried)
+		return -1;
+	dbglog(r->trk, "%s: connection is closed by server, reconnecting", r->host);
+	r->pool->stale++;
+	r->retried = 1;
+	req_release(r, 0);
+	r->req_off = 0;
+	r->buf.len = 0;
+	r->off = 0;
+	r->state = R_CONN;
+	return 0;
+}
+
+/** Parse response headers.
+Return 1 if complete;  0 if need more data;  -1 on error. */
+static int resp_parse(httpreq *r)
+{
+	ffstr s, line;
+	ffstr_set2(&s, &r->buf);
+	ssize_t end = ffstr_ifind(&s, "\r\n\r\n", 4);
+	if (end < 0)
+		return (s.len < HTTP_MAXHDR) ? 0 : -1;
+	s.len = end + 4;
+	r->off = s.len;
+
+	ffstr_shift(&s, ffstr_nextval(s.ptr, s.len, &line, '\n'));
+	http_trim(&line);
+	r->resp.status = line;
+	r->resp.headers = s;
+
+	// "HTTP/1.1 200 OK" or "ICY 200 OK" (SHOUTcast server)
+	ffstr ver, code, reason;
+	ffs_split2by(line.ptr, line.len, ' ', &ver, &line);
+	ffs_split2by(line.ptr, line.len, ' ', &code, &reason);
+	if (!(ffstr_matchz(&ver, "HTTP/1.") || ffstr_eqz(&ver, "ICY"))
+		|| !ffstr_toint(&code, &r->resp.code, FFS_INT32))
+		return -1;
+	uint http11 = ffstr_matchz(&ver, "HTTP/1.") && !ffstr_eqz(&ver, "HTTP/1.0");
+
+	ffstr val;
+	r->keepalive = 0;
+	if (net->conf.keepalive) {
+		if (httpreq_hdr(&r->resp, "Connection", &val))
+			r->keepalive = ffstr_ieqz(&val, "keep-alive");
+		else
+			r->keepalive = http11;
+	}
+
+	r->body = B_CLOSE;
+	if (r->resp.code == 204 || r->resp.code == 304 || r->resp.code / 100 == 1) {
+		r->body = B_NONE;
+	} else if (httpreq_hdr(&r->resp, "Transfer-Encoding", &val)
+		&& ffstr_ieqz(&val, "chunked")) {
+		r->body = B_CHUNKED;
+		r->chunk_st = CH_SIZE;
+	} else if (httpreq_hdr(&r->resp, "Content-Length", &val)) {
+		if (!ffstr_toint(&val, &r->body_left, FFS_INT64))
+			return -1;
+		r->body = B_LENGTH;
+	}
+	if (r->body == B_CLOSE)
+		r->keepalive = 0;
+
+	dbglog(r->trk, "response: %S  body:%u  keep-alive:%u"
+		, &r->resp.status, r->body, r->keepalive);
+	return 1;
+}
+
+/** Handle redirection.
+Return 1 if the request is redirected. */
+static int req_redirect(httpreq *r)
+{
+	ffstr loc;
+	switch (r->resp.code) {
+	case 301: case 302: case 303: case 307: case 308:
+		break;
+	default:
+		return 0;
+	}
+	if (!httpreq_hdr(&r->resp, "Location", &loc)
+		|| r->nredirect == net->conf.max_redirect)
+		return 0;
+	r->nredirect++;
+
+	char *url;
+	if (ffstr_matchz(&loc, "/"))
+		url = ffsz_alfmt("http://%S%S", &r->hostname, &loc);
+	else
+		url = ffsz_alcopystr(&loc);
+	if (url == NULL)
+		return -1;
+	dbglog(r->trk, "redirecting to %s", url);
+
+	req_release(r, 0);
+	ffmem_free(r->url);
+	r->url = url;
+	if (0 != req_prepare(r))
+		return -1;
+	r->buf.len = 0;
+	r->off = 0;
+	r->reused = 0;
+	r->retried = 0;
+	r->state = R_CONN;
+	return 1;
+}
+
+/** Get the next chunk of body data from 'buf'.
+Return 1 if there's data;  0 if need more input;  2 if the body is complete;  -1 on error. */
+static int body_get(httpreq *r)
+{
+	ffstr s;
+	ffstr_set(&s, r->buf.ptr + r->off, r->buf.len - r->off);
+
+	switch (r->body) {
+	case B_NONE:
+		return 2;
+
+	case B_CLOSE:
+		if (s.len == 0)
+			return 0;
+		r->data = s;
+		r->off += s.len;
+		return 1;
+
+	case B_LENGTH: {
+		if (r->body_left == 0)
+			return 2;
+		if (s.len == 0)
+			return 0;
+		size_t n = ffmin(s.len, r->body_left);
+		ffstr_set(&r->data, s.ptr, n);
+		r->off += n;
+		r->body_left -= n;
+		return 1;
+	}
+	}
+
+	for (;;) {
+		ffstr line;
+		const char *lf;
+
+		switch (r->chunk_st) {
+		case CH_SIZE:
+		case CH_DATA_CRLF:
+		case CH_TRAILER:
+			lf = ffs_find(s.ptr, s.len, '\n');
+			if (lf == s.ptr + s.len) {
+				if (s.len >= HTTP_MAXHDR)
+					return -1; // the line is too long
+				return 0;
+			}
+			ffstr_set(&line, s.ptr, lf - s.ptr);
+			ffstr_shift(&s, line.len + 1);
+			r->off += line.len + 1;
+			http_trim(&line);
+
+			if (r->chunk_st == CH_DATA_CRLF) {
+				if (line.len != 0)
+					return -1;
+				r->chunk_st = CH_SIZE;
+				break;
+
+			} else if (r->chunk_st == CH_TRAILER) {
+				if (line.len == 0)
+					return 2;
+				break;
+			}
+
+			// "size[;ext]"
+			ffstr ext;
+			ffs_split2by(line.ptr, line.len, ';', &line, &ext);
+			http_trim(&line);
+			if (line.len == 0
+				|| line.len != ffs_toint(line.ptr, line.len, &r->body_left, FFS_INT64 | FFS_INTHEX))
+				return -1;
+			r->chunk_st = (r->body_left != 0) ? CH_DATA : CH_TRAILER;
+			break;
+
+		case CH_DATA: {
+			if (s.len == 0)
+				return 0;
+			size_t n = ffmin(s.len, r->body_left);
+			ffstr_set(&r->data, s.ptr, n);
+			r->off += n;
+			r->body_left -= n;
+			if (r->body_left == 0)
+				r->chunk_st = CH_DATA_CRLF;
+			return 1;
+		}
+		}
+	}
+}
+
+/** Move unprocessed data to the beginning of the buffer. */
+static void buf_compact(httpreq *r)
+{
+	if (r->off == 0)
+		return;
+	_ffarr_rmleft(&r->buf, r->off, sizeof(char));
+	r->off = 0;
+}
+
+enum {
+	STEP_CONT, STEP_ASYNC, STEP_USER,
+};
+
+static int req_step(httpreq *r)
+{
+	httppool *p = r->pool;
+	ssize_t n;
+
+	switch (r->state) {
+
+	case R_INIT:
+		if (0 != req_prepare(r))
+			goto err;
+		r->state = R_CONN;
+		// fallthrough
+
+	case R_CONN:
+		if (!r->retried
+			&& NULL != (r->conn = pool_get(p, r->host))) {
+			p->hits++;
+			r->reused = 1;
+			dbglog(r->trk, "%s: reusing connection (served %u requests)"
+				, r->host, r->conn->nreqs);
+			r->conn->aio.udata = r;
+			r->state = R_SEND;
+			return STEP_CONT;
+		}
+
+		// a retried request doesn't trust the idle connections: they may be closed by server too
+		if (pool_nconns(p, r->host) >= net->conf.max_host_conns) {
+			dbglog(r->trk, "%s: waiting for a free connection", r->host);
+			r->state = R_WAITSLOT;
+			return STEP_ASYNC;
+		}
+
+		r->reused = 0;
+		dns_free(r->dns);
+		r->dns = NULL;
+		r->state = R_RESOLVE;
+		// fallthrough
+
+	case R_RESOLVE: {
+		if (r->dns == NULL) {
+			ffstr host, port;
+			char *shost, *sport = NULL;
+			ffs_rsplit2by(r->host, ffsz_len(r->host), ':', &host, &port);
+			if (host.len >= 2 && host.ptr[0] == '[') {
+				host.ptr++;
+				host.len -= 2;
+			}
+			if (NULL == (shost = ffsz_alcopystr(&host))
+				|| NULL == (sport = ffsz_alcopystr(&port))) {
+				ffmem_free(shost);
+				goto err;
+			}
+			dbglog(r->trk, "resolving host %s...", shost);
+			r->dns = dns_resolve(shost, sport, p->wid, &req_dns_ev, r);
+			ffmem_free(shost);
+			ffmem_free(sport);
+			if (r->dns == NULL)
+				goto err;
+		}
+
+		const ffaddrinfo *addrs;
+		int e;
+		switch (dns_result(r->dns, &addrs, &e)) {
+		case 1:
+			req_timer_start(r, net->conf.tmout);
+			return STEP_ASYNC;
+		case -1:
+			errlog(r->trk, "%s: resolve: %E", r->host, e);
+			r->status = FFHTTPCL_ENOADDR;
+			goto err;
+		}
+		if (0 != req_addrs(r, addrs))
+			goto err;
+		p->misses++;
+		r->race = 1;
+		r->state = R_CONNECTING;
+	}
+		// fallthrough
+
+	case R_CONNECTING: {
+		switch (req_connect(r)) {
+		case 1:
+			return STEP_ASYNC;
+		case -1:
+			goto err;
+		}
+
+		struct httpconn **pc;
+		if (NULL == (pc = ffarr_pushgrowT(&p->conns, 4, struct httpconn*))) {
+			conn_free(r->conn);
+			r->conn = NULL;
+			goto err;
+		}
+		*pc = r->conn;
+		r->conn->req = NULL;
+		r->conn->aio.udata = r;
+		dbglog(r->trk, "%s: connected", r->host);
+		dns_free(r->dns);
+		r->dns = NULL;
+		r->state = R_SEND;
+	}
+		// fallthrough
+
+	case R_SEND:
+		while (r->req_off != r->req.len) {
+			n = ffaio_send(&r->conn->aio, &req_ev, r->req.ptr + r->req_off, r->req.len - r->req_off);
+			if (n == FFAIO_ASYNC) {
+				req_timer_start(r, net->conf.tmout);
+				return STEP_ASYNC;
+			} else if (n < 0) {
+				if (0 == req_retry(r))
+					return STEP_CONT;
+				syserrlog(core, r->trk, FILT_NAME, "%s: %s", r->host, "send");
+				goto err;
+			}
+			r->req_off += n;
+		}
+		dbglog(r->trk, "%s: sent request: %S", r->host, &r->path);
+		r->buf.len = 0;
+		r->off = 0;
+		r->state = R_RECVHDR;
+		// fallthrough
+
+	case R_RECVHDR:
+		if (ffarr_unused(&r->buf) == 0
+			&& NULL == ffarr_grow(&r->buf, net->conf.bufsize, 0))
+			goto err;
+		n = ffaio_recv(&r->conn->aio, &req_ev, ffarr_end(&r->buf), ffarr_unused(&r->buf));
+		if (n == FFAIO_ASYNC) {
+			req_timer_start(r, net->conf.tmout);
+			return STEP_ASYNC;
+		} else if (n <= 0) {
+			if (r->buf.len == 0
+				&& 0 == req_retry(r))
+				return STEP_CONT;
+			if (n == 0)
+				errlog(r->trk, "%s: connection is closed by server", r->host);
+			else
+				syserrlog(core, r->trk, FILT_NAME, "%s: %s", r->host, "recv");
+			goto err;
+		}
+		r->buf.len += n;
+
+		switch (resp_parse(r)) {
+		case 0:
+			return STEP_CONT;
+		case -1:
+			errlog(r->trk, "%s: bad response", r->host);
+			goto err;
+		}
+
+		switch (req_redirect(r)) {
+		case 1:
+			return STEP_CONT;
+		case -1:
+			goto err;
+		}
+
+		r->status = FFHTTPCL_RESP;
+		r->state = R_BODY;
+		return STEP_USER;
+
+	case R_BODY:
+		switch (body_get(r)) {
+		case 1:
+			r->status = FFHTTPCL_RESP_RECV;
+			return STEP_USER;
+		case 2:
+			r->state = R_DONE;
+			return STEP_CONT;
+		case -1:
+			errlog(r->trk, "%s: bad chunked data", r->host);
+			goto err;
+		}
+		r->state = R_BODYRECV;
+		// fallthrough
+
+	case R_BODYRECV:
+		buf_compact(r);
+		if (ffarr_unused(&r->buf) == 0
+			&& NULL == ffarr_grow(&r->buf, net->conf.bufsize, 0))
+			goto err;
+		n = ffaio_recv(&r->conn->aio, &req_ev, ffarr_end(&r->buf), ffarr_unused(&r->buf));
+		if (n == FFAIO_ASYNC) {
+			req_timer_start(r, net->conf.tmout);
+			return STEP_ASYNC;
+		} else if (n < 0) {
+			syserrlog(core, r->trk, FILT_NAME, "%s: %s", r->host, "recv");
+			goto err;
+		} else if (n == 0) {
+			if (r->body != B_CLOSE) {
+				errlog(r->trk, "%s: connection is closed before the end of data", r->host);
+				goto err;
+			}
+			r->state = R_DONE;
+			return STEP_CONT;
+		}
+		r->buf.len += n;
+		r->state = R_BODY;
+		return STEP_CONT;
+
+	case R_DONE:
+		// don't reuse the connection if the server sent more data than expected
+		req_release(r, (r->off == r->buf.len && r->body != B_CLOSE));
+		r->data.len = 0;
+		r->status = FFHTTPCL_DONE;
+		r->state = R_FIN;
+		return STEP_USER;
+
+	case R_ERR:
+		goto err;
+
+	case R_WAITSLOT:
+	case R_FIN:
+		return STEP_ASYNC;
+	}
+
+err:
+	if (r->status >= 0)
+		r->status = FFHTTPCL_ERR;
+	req_release(r, 0);
+	req_tries_close(r);
+	r->data.len = 0;
+	r->state = R_FIN;
+	return STEP_USER;
+}
+
+/** Process the request until it needs to wait for I/O or for the user. */
+static void req_run(httpreq *r)
+{
+	if (r->running) {
+		r->again = 1;
+		return;
+	}
+	r->running = 1;
+
+	if (r->tmr_active) {
+		r->tmr_active = 0;
+		core->timer(&r->tmr, 0, 0);
+	}
+
+	while (!r->user_wait) {
+		int rc = req_step(r);
+		if (rc == STEP_ASYNC)
+			break;
+		if (rc == STEP_USER) {
+			r->user_wait = 1;
+			r->again = 0;
+			r->handler(r->udata);
+			if (r->closing)
+				break;
+			if (r->again) // user has called httpreq_send()
+				r->user_wait = 0;
+		}
+	}
+
+	r->running = 0;
+	if (r->closing)
+		req_free(r);
+}
+
+/** Asynchronous I/O is complete. */
+static void req_ev(void *udata)
+{
+	httpreq *r = udata;
+	if (r == NULL)
+		return; // event on an idle connection
+	req_run(r);
+}
+
+#undef FILT_NAME
@@ -0,0 +1,832 @@
+/** HTTP/ICY streaming server output.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+The encoded stream is served over HTTP to any number of listeners:
+
+TRACK -> ... -> ENCODER -> net.httpsrv --(ring buffer)--> client #1
+                                                       -> client #2 ...
+
+The data is encoded only once: net.httpsrv appends it to the ring buffer shared by all clients,
+ and each client has its own read position in it.
+The server outlives a track, so all tracks of a playlist (or a mix, or a recording)
+ are sent as one continuous stream to the same listeners.
+
+Writer (net.httpsrv filter, any worker):
+. add the data block to the ring buffer with its stream time
+. wake the main thread which sends the new data to clients
+. a file is encoded faster than realtime: suspend the track while the stream is 'burst' msec ahead
+   of the wall clock;  the timer wakes it up
+
+Client (main thread):
+. receive HTTP request -> send response header -> send data from the ring buffer
+. a new client starts at the data block which is 'burst' msec older than the latest one,
+   so the player can fill its buffer quickly
+. "Icy-MetaData: 1" request header: insert ICY metadata block after every 'metaint' bytes of data
+. a client that doesn't receive the data fast enough and its data in the ring buffer is overwritten
+   is either disconnected or moved to the latest data (config: 'slow_client')
+*/
+
+#include <net/net.h>
+#include <FF/path.h>
+#include <FFOS/asyncio.h>
+#include <FFOS/socket.h>
+#include <FFOS/error.h>
+
+
+#define FILT_NAME  "net.httpsrv"
+
+/** Timer interval (msec) for waking the writer and closing idle clients. */
+#define SRV_TIMER  100
+
+/** Max. size of HTTP request. */
+#define SRV_MAXREQ  4096
+
+enum SRV_SLOW {
+	SRV_SLOW_DROP,
+	SRV_SLOW_SKIP,
+};
+
+static const char *const slow_enumstr[] = {
+	"drop", "skip",
+};
+static const ffpars_enumlist slow_enum = { slow_enumstr, FFCNT(slow_enumstr), FFPARS_DSTOFF(net_conf, srv.slow_client) };
+
+static int srv_conf_listen(ffparser_schem *p, void *obj, ffstr *val);
+
+static const ffpars_arg srv_conf_args[] = {
+	{ "listen",	FFPARS_TSTR | FFPARS_FNOTEMPTY,  FFPARS_DST(&srv_conf_listen) },
+	{ "max_clients",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, srv.max_clients) },
+	{ "buffer",	FFPARS_TSIZE | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, srv.buffer) },
+	{ "burst",	FFPARS_TINT,  FFPARS_DSTOFF(net_conf, srv.burst) },
+	{ "metaint",	FFPARS_TINT,  FFPARS_DSTOFF(net_conf, srv.metaint) },
+	{ "slow_client",	FFPARS_TENUM | FFPARS_F8BIT,  FFPARS_DST(&slow_enum) },
+};
+
+/** Data block in the ring buffer. */
+struct srv_chunk {
+	uint64 off; // stream offset
+	uint64 time; // stream time (msec)
+};
+
+enum C_STATE {
+	C_REQ,
+	C_HDR,
+	C_DATA,
+};
+
+struct srvclient {
+	ffaio_task aio;
+	uint id;
+	uint state; // enum C_STATE
+	uint64 start_time; // msec
+	ffarr buf; // request;  response header;  ICY metadata block
+	size_t buf_off; // sent bytes of 'buf'
+	uint64 cur; // stream offset of the next data
+	uint64 sent; // data bytes
+	uint metaint; // 0: no ICY metadata
+	uint meta_left; // data bytes until the next metadata block
+	uint meta_ver; // version of the metadata sent to client
+	uint async :1; // waiting for I/O event
+	uint head :1; // HEAD request
+};
+
+struct httpsrv {
+	ffskt lsk;
+	ffaio_acceptor acc;
+	ffarr clients; // struct srvclient*[]
+	uint nclients; // statistics
+	fftmrq_entry tmr;
+	uint started :1; // main thread: accepting connections, the timer is set
+
+	/* writer and main thread: */
+	fflock lk;
+	ffarr ring;
+	uint64 woff; // stream offset of the next data
+	ffarr chunks; // struct srv_chunk[]: the blocks in the ring buffer
+	uint64 base_time; // stream time of the current track's start (msec)
+	uint64 wtime; // stream time of the latest data (msec)
+	uint64 start; // wall clock time of stream time 0 (msec)
+	const char *ctype; // Content-Type
+	char *title; // ICY metadata "StreamTitle"
+	uint meta_ver;
+	void *wtrk; // the writer track
+	const fmed_track *track;
+	uint posted :1;
+	uint wsuspended :1; // the writer is waiting until the stream time is close to the wall clock
+	fftask tsk;
+};
+
+static struct httpsrv *g_srv;
+
+static void srv_task(void *param);
+static void srv_accept(void *param);
+static void client_ev(void *param);
+
+static uint64 srv_now(void)
+{
+	fftime t;
+	fftime_now(&t);
+	return fftime_ms(&t);
+}
+
+int httpsrv_config(ffpars_ctx *ctx)
+{
+	net->conf.srv.port = 8000;
+	net->conf.srv.max_clients = 64;
+	net->conf.srv.buffer = 1024 * 1024;
+	net->conf.srv.burst = 3000;
+	net->conf.srv.metaint = 16000;
+	ffpars_setargs(ctx, &net->conf, srv_conf_args, FFCNT(srv_conf_args));
+	return 0;
+}
+
+/** "[IP:]PORT" */
+static int srv_conf_listen(ffparser_schem *p, void *obj, ffstr *val)
+{
+	ffstr host, port;
+	if (NULL == ffs_rsplit2by(val->ptr, val->len, ':', &host, &port))
+		ffstr_set2(&port, val);
+	else if (host.len == 0)
+		return FFPARS_EBADVAL;
+
+	uint n;
+	if (!ffstr_toint(&port, &n, FFS_INT32)
+		|| n == 0 || n > 0xffff)
+		return FFPARS_EBADVAL;
+	net->conf.srv.port = n;
+
+	ffmem_safefree0(net->conf.srv.host);
+	if (port.ptr != val->ptr
+		&& NULL == (net->conf.srv.host = ffsz_alcopystr(&host)))
+		return FFPARS_ESYS;
+	return 0;
+}
+
+
+static void client_free(struct httpsrv *s, struct srvclient *c)
+{
+	dbglog(NULL, "client #%u: closing connection.  Sent %U bytes in %Ums"
+		, c->id, c->sent, srv_now() - c->start_time);
+	ffskt_close(c->aio.sk);
+	ffarr_free(&c->buf);
+
+	struct srvclient **pc;
+	FFARR_WALKT(&s->clients, pc, struct srvclient*) {
+		if (*pc == c) {
+			_ffarr_rm(&s->clients, pc - (struct srvclient**)s->clients.ptr, 1, sizeof(struct srvclient*));
+			break;
+		}
+	}
+	ffmem_free(c);
+}
+
+/** Parse HTTP request.
+Return 0 if complete;  1 if more data is needed;  -1 on error. */
+static int client_req(struct srvclient *c)
+{
+	ffstr req, line, name, val;
+	ffstr_set2(&req, &c->buf);
+	ssize_t end = ffstr_ifind(&req, "\r\n\r\n", 4);
+	if (end < 0)
+		return (c->buf.len < SRV_MAXREQ) ? 1 : -1;
+	req.len = end + 4;
+
+	// "GET /path HTTP/1.1"
+	ffstr_shift(&req, ffstr_nextval(req.ptr, req.len, &line, '\n'));
+	http_trim(&line);
+	dbglog(NULL, "client #%u: request: %S", c->id, &line);
+	if (ffstr_matchz(&line, "HEAD "))
+		c->head = 1;
+	else if (!ffstr_matchz(&line, "GET "))
+		return -1;
+
+	while (req.len != 0) {
+		ffstr_shift(&req, ffstr_nextval(req.ptr, req.len, &line, '\n'));
+		if (NULL == ffs_split2by(line.ptr, line.len, ':', &name, &val))
+			continue;
+		http_trim(&val);
+		if (ffstr_ieqz(&name, "Icy-MetaData") && ffstr_eqz(&val, "1"))
+			c->metaint = net->conf.srv.metaint;
+	}
+	return 0;
+}
+
+/** Prepare response header. */
+static int client_hdr(struct httpsrv *s, struct srvclient *c)
+{
+	c->buf.len = 0;
+	c->buf_off = 0;
+	if (0 == ffstr_catfmt(&c->buf,
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: %s\r\n"
+		"Server: %s\r\n"
+		"icy-name: %s\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Connection: close\r\n"
+		, s->ctype, http_ua[1], http_ua[0]))
+		return -1;
+	if (c->metaint != 0
+		&& 0 == ffstr_catfmt(&c->buf, "icy-metaint: %u\r\n", c->metaint))
+		return -1;
+	if (0 == ffstr_catfmt(&c->buf, "\r\n"))
+		return -1;
+	return 0;
+}
+
+/** Find the data block 'burst' msec older than the latest one,
+ but not farther than the half of the ring buffer, so a client doesn't fall behind immediately.
+Thread: any (locked). */
+static uint64 srv_startoff(struct httpsrv *s)
+{
+	const struct srv_chunk *ch;
+	FFARR_WALKT(&s->chunks, ch, struct srv_chunk) {
+		if (ch->time + net->conf.srv.burst >= s->wtime
+			&& s->woff - ch->off <= s->ring.cap / 2)
+			return ch->off;
+	}
+	return s->woff;
+}
+
+/** Prepare ICY metadata block: "N StreamTitle='...';" padded to N*16 bytes. */
+static int client_meta(struct httpsrv *s, struct srvclient *c)
+{
+	c->buf.len = 0;
+	c->buf_off = 0;
+	if (NULL == ffarr_realloc(&c->buf, 1 + 255 * 16))
+		return -1;
+
+	fflk_lock(&s->lk);
+	size_t n = 0;
+	if (c->meta_ver != s->meta_ver) {
+		c->meta_ver = s->meta_ver;
+		n = ffs_fmt(c->buf.ptr + 1, c->buf.ptr + c->buf.cap, "StreamTitle='%s';"
+			, (s->title != NULL) ? s->title : "");
+	}
+	fflk_unlock(&s->lk);
+
+	size_t nblk = (n + 15) / 16;
+	ffmem_zero(c->buf.ptr + 1 + n, nblk * 16 - n);
+	c->buf.ptr[0] = (byte)nblk;
+	c->buf.len = 1 + nblk * 16;
+	c->meta_left = c->metaint;
+	return 0;
+}
+
+/** Send data from the ring buffer.
+Return 0 if all data is sent;  1 if waiting for I/O;  -1 on error. */
+static int client_data(struct httpsrv *s, struct srvclient *c)
+{
+	int r = 0;
+	fflk_lock(&s->lk);
+	for (;;) {
+		if (s->woff - c->cur > s->ring.cap) {
+			// the data is overwritten by the writer
+			if (net->conf.srv.slow_client == SRV_SLOW_DROP) {
+				warnlog(NULL, "client #%u: too slow, dropping", c->id);
+				r = -1;
+				break;
+			}
+			uint64 off = srv_startoff(s);
+			warnlog(NULL, "client #%u: too slow, skipping %U bytes", c->id, off - c->cur);
+			c->cur = off;
+		}
+
+		if (c->cur == s->woff)
+			break;
+
+		size_t i = c->cur % s->ring.cap;
+		size_t n = ffmin(s->woff - c->cur, s->ring.cap - i);
+		if (c->metaint != 0)
+			n = ffmin(n, c->meta_left);
+		ssize_t k = ffaio_send(&c->aio, &client_ev, s->ring.ptr + i, n);
+		if (k == FFAIO_ASYNC) {
+			r = 1;
+			break;
+		} else if (k < 0) {
+			dbglog(NULL, "client #%u: send: %E", c->id, fferr_last());
+			r = -1;
+			break;
+		}
+		c->cur += k;
+		c->sent += k;
+		if (c->metaint != 0) {
+			c->meta_left -= k;
+			if (c->meta_left == 0) {
+				r = 2;
+				break;
+			}
+		}
+	}
+	fflk_unlock(&s->lk);
+
+	if (r == 2) {
+		if (0 != client_meta(s, c))
+			return -1;
+		return 2;
+	}
+	return r;
+}
+
+/** Send the contents of 'buf'.
+Return 0 if all data is sent;  1 if waiting for I/O;  -1 on error. */
+static int client_sendbuf(struct srvclient *c)
+{
+	while (c->buf_off != c->buf.len) {
+		ssize_t k = ffaio_send(&c->aio, &client_ev, c->buf.ptr + c->buf_off, c->buf.len - c->buf_off);
+		if (k == FFAIO_ASYNC)
+			return 1;
+		else if (k < 0) {
+			dbglog(NULL, "client #%u: send: %E", c->id, fferr_last());
+			return -1;
+		}
+		c->buf_off += k;
+	}
+	c->buf.len = 0;
+	c->buf_off = 0;
+	return 0;
+}
+
+static void client_process(struct httpsrv *s, struct srvclient *c)
+{
+	ssize_t r;
+	c->async = 0;
+
+	for (;;) {
+		switch (c->state) {
+
+		case C_REQ:
+			r = ffaio_recv(&c->aio, &client_ev, ffarr_end(&c->buf), ffarr_unused(&c->buf));
+			if (r == FFAIO_ASYNC) {
+				c->async = 1;
+				return;
+			} else if (r <= 0) {
+				if (r < 0)
+					dbglog(NULL, "client #%u: recv: %E", c->id, fferr_last());
+				goto err;
+			}
+			c->buf.len += r;
+
+			switch (client_req(c)) {
+			case 1:
+				continue;
+			case -1:
+				warnlog(NULL, "client #%u: bad request", c->id);
+				goto err;
+			}
+			if (0 != client_hdr(s, c))
+				goto err;
+			c->state = C_HDR;
+			// fallthrough
+
+		case C_HDR:
+			switch (client_sendbuf(c)) {
+			case 1:
+				c->async = 1;
+				return;
+			case -1:
+				goto err;
+			}
+			if (c->head)
+				goto err;
+			fflk_lock(&s->lk);
+			c->cur = srv_startoff(s);
+			fflk_unlock(&s->lk);
+			c->meta_left = c->metaint;
+			c->state = C_DATA;
+			dbglog(NULL, "client #%u: sending data", c->id);
+			// fallthrough
+
+		case C_DATA:
+			switch (client_sendbuf(c)) {
+			case 1:
+				c->async = 1;
+				return;
+			case -1:
+				goto err;
+			}
+
+			switch (client_data(s, c)) {
+			case 0:
+				return; // wait for more data from the writer
+			case 1:
+				c->async = 1;
+				return;
+			case -1:
+				goto err;
+			}
+			continue; // send ICY metadata
+		}
+	}
+
+err:
+	client_free(s, c);
+}
+
+static void client_ev(void *param)
+{
+	struct srvclient *c = param;
+	client_process(g_srv, c);
+}
+
+static void srv_accept(void *param)
+{
+	struct httpsrv *s = param;
+	for (;;) {
+		ffaddr local, peer;
+		ffskt sk = ffaio_accept(&s->acc, &local, &peer, SOCK_NONBLOCK, &srv_accept);
+		if (sk == FF_BADSKT) {
+			if (!fferr_again(fferr_last()))
+				syserrlog(core, NULL, FILT_NAME, "%s", "accept");
+			return;
+		}
+
+		if (s->clients.len == net->conf.srv.max_clients) {
+			warnlog(NULL, "reached max. number of clients: %u", net->conf.srv.max_clients);
+			ffskt_close(sk);
+			continue;
+		}
+
+		struct srvclient *c, **pc;
+		if (NULL == (c = ffmem_new(struct srvclient))
+			|| NULL == ffarr_alloc(&c->buf, SRV_MAXREQ)
+			|| NULL == (pc = ffarr_pushgrowT(&s->clients, 8, struct srvclient*))) {
+			if (c != NULL)
+				ffarr_free(&c->buf);
+			ffmem_free(c);
+			ffskt_close(sk);
+			continue;
+		}
+		*pc = c;
+		c->id = ++s->nclients;
+		c->start_time = srv_now();
+		ffaio_init(&c->aio);
+		c->aio.sk = sk;
+		c->aio.udata = c;
+		if (0 != ffaio_attach(&c->aio, core->kq, FFKQU_READ | FFKQU_WRITE)) {
+			syserrlog(core, NULL, FILT_NAME, "%s", "kqueue attach");
+			client_free(s, c);
+			continue;
+		}
+
+		dbglog(NULL, "client #%u: connected.  Clients: %L"
+			, c->id, s->clients.len);
+		client_process(s, c);
+	}
+}
+
+/** Wake the writer if the stream time is close to the wall clock.  Thread: any (locked). */
+static void srv_wake(struct httpsrv *s, uint64 now)
+{
+	if (s->wsuspended
+		&& s->wtime < now - s->start + net->conf.srv.burst) {
+		s->wsuspended = 0;
+		s->track->cmd(s->wtrk, FMED_TRACK_WAKE);
+	}
+}
+
+static void srv_timer(void *param)
+{
+	struct httpsrv *s = param;
+	uint64 now = srv_now();
+
+	fflk_lock(&s->lk);
+	srv_wake(s, now);
+	uint64 woff = s->woff;
+	fflk_unlock(&s->lk);
+
+	for (size_t i = 0;  i != s->clients.len;  ) {
+		struct srvclient *c = *ffarr_itemT(&s->clients, i, struct srvclient*);
+		if (c->state == C_REQ
+			&& now - c->start_time >= net->conf.tmout) {
+			warnlog(NULL, "client #%u: request timeout", c->id);
+			client_free(s, c);
+			continue;
+		}
+		if (c->state == C_DATA && c->async
+			&& net->conf.srv.slow_client == SRV_SLOW_DROP
+			&& woff - c->cur > s->ring.cap) {
+			// the client doesn't receive data at all
+			warnlog(NULL, "client #%u: too slow, dropping", c->id);
+			client_free(s, c);
+			continue;
+		}
+		i++;
+	}
+}
+
+/** Start accepting connections;  send new data to clients.  Thread: main. */
+static void srv_task(void *param)
+{
+	struct httpsrv *s = param;
+	fflk_lock(&s->lk);
+	s->posted = 0;
+	fflk_unlock(&s->lk);
+
+	if (!s->started) {
+		s->started = 1;
+		s->tmr.handler = &srv_timer;
+		s->tmr.param = s;
+		core->timer(&s->tmr, SRV_TIMER, 0);
+		srv_accept(s);
+	}
+
+	// note: a client may be freed
+	for (size_t i = 0;  i != s->clients.len;  ) {
+		struct srvclient *c = *ffarr_itemT(&s->clients, i, struct srvclient*);
+		if (c->state == C_DATA && !c->async) {
+			client_process(s, c);
+			if (i == s->clients.len
+				|| c != *ffarr_itemT(&s->clients, i, struct srvclient*))
+				continue;
+		}
+		i++;
+	}
+}
+
+/** Post the task to the main thread.  Thread: any (locked). */
+static void srv_post(struct httpsrv *s)
+{
+	if (!s->posted) {
+		s->posted = 1;
+		core->task(&s->tsk, FMED_TASK_POST);
+	}
+}
+
+static int srv_listen(struct httpsrv *s)
+{
+	char port[8];
+	ffs_fmt(port, port + sizeof(port), "%u%Z", net->conf.srv.port);
+	const char *host = (net->conf.srv.host != NULL) ? net->conf.srv.host : "0.0.0.0";
+	ffaddrinfo *a;
+	if (0 != ffaddr_info(&a, host, port, 0)) {
+		syserrlog(core, NULL, FILT_NAME, "%s: resolve", host);
+		return -1;
+	}
+
+	int r = -1;
+	if (FF_BADSKT == (s->lsk = ffskt_create(a->ai_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP))) {
+		syserrlog(core, NULL, FILT_NAME, "%s", "socket create");
+		goto end;
+	}
+	if (0 != ffskt_setopt(s->lsk, SOL_SOCKET, SO_REUSEADDR, 1)
+		|| 0 != ffskt_bind(s->lsk, a->ai_addr, a->ai_addrlen)
+		|| 0 != ffskt_listen(s->lsk, SOMAXCONN)) {
+		syserrlog(core, NULL, FILT_NAME, "listen on %s:%s", host, port);
+		goto end;
+	}
+	if (0 != ffaio_acceptinit(&s->acc, core->kq, s->lsk, s, a->ai_family, SOCK_STREAM)) {
+		syserrlog(core, NULL, FILT_NAME, "%s", "kqueue attach");
+		goto end;
+	}
+	fmed_infolog(core, NULL, FILT_NAME, "listening on %s:%s", host, port);
+	r = 0;
+
+end:
+	ffaddr_infofree(a);
+	return r;
+}
+
+static struct httpsrv* srv_init(void)
+{
+	struct httpsrv *s;
+	if (NULL == (s = ffmem_new(struct httpsrv)))
+		return NULL;
+	s->lsk = FF_BADSKT;
+	fflk_init(&s->lk);
+	s->tsk.handler = &srv_task;
+	s->tsk.param = s;
+	if (NULL == ffarr_alloc(&s->ring, net->conf.srv.buffer)
+		|| 0 != srv_listen(s)) {
+		if (s->lsk != FF_BADSKT)
+			ffskt_close(s->lsk);
+		ffarr_free(&s->ring);
+		ffmem_free(s);
+		return NULL;
+	}
+	return s;
+}
+
+void httpsrv_destroy(void)
+{
+	struct httpsrv *s = g_srv;
+	if (s == NULL)
+		return;
+	g_srv = NULL;
+
+	core->task(&s->tsk, FMED_TASK_DEL);
+	if (s->started)
+		core->timer(&s->tmr, 0, 0);
+	while (s->clients.len != 0) {
+		client_free(s, *ffarr_itemT(&s->clients, 0, struct srvclient*));
+	}
+	ffarr_free(&s->clients);
+	ffaio_acceptfin(&s->acc);
+	ffskt_close(s->lsk);
+	dbglog(NULL, "streamed %U bytes to %u clients", s->woff, s->nclients);
+	ffarr_free(&s->ring);
+	ffarr_free(&s->chunks);
+	ffmem_free(s->title);
+	ffmem_free(s);
+}
+
+/** Add data to the ring buffer.  Thread: any (locked). */
+static void srv_write(struct httpsrv *s, ffstr data, uint64 time)
+{
+	if (data.len > s->ring.cap) {
+		size_t n = data.len - s->ring.cap;
+		ffstr_shift(&data, n);
+		s->woff += n;
+	}
+
+	struct srv_chunk *ch;
+	if (NULL != (ch = ffarr_pushgrowT(&s->chunks, 256, struct srv_chunk))) {
+		ch->off = s->woff;
+		ch->time = time;
+	}
+
+	while (data.len != 0) {
+		size_t i = s->woff % s->ring.cap;
+		size_t n = ffmin(data.len, s->ring.cap - i);
+		ffmemcpy(s->ring.ptr + i, data.ptr, n);
+		ffstr_shift(&data, n);
+		s->woff += n;
+	}
+	s->wtime = time;
+
+	// forget the blocks overwritten by new data
+	size_t n = 0;
+	FFARR_WALKT(&s->chunks, ch, struct srv_chunk) {
+		if (s->woff - ch->off <= s->ring.cap)
+			break;
+		n++;
+	}
+	_ffarr_rmleft(&s->chunks, n, sizeof(struct srv_chunk));
+
+	srv_post(s);
+}
+
+
+struct srvout {
+	void *trk;
+	struct httpsrv *s;
+	uint64 time; // track time (msec)
+	uint seeked :1;
+};
+
+static const char* srv_ctype(const ffstr *ext)
+{
+	static const char *const types[][2] = {
+		{ "mp3", "audio/mpeg" },
+		{ "aac", "audio/aac" },
+	};
+	for (uint i = 0;  i != FFCNT(types);  i++) {
+		if (ffstr_ieqz(ext, types[i][0]))
+			return types[i][1];
+	}
+	return NULL;
+}
+
+/** Set ICY metadata from track meta.  Thread: any (locked). */
+static void srv_settitle(struct httpsrv *s, fmed_filt *d)
+{
+	ffstr artist = {0}, title = {0};
+	fmed_trk_meta meta;
+	ffmem_tzero(&meta);
+	meta.flags = FMED_QUE_UNIQ;
+	while (0 == d->track->cmd2(d->trk, FMED_TRACK_META_ENUM, &meta)) {
+		if (ffstr_ieqz(&meta.name, "artist"))
+			artist = meta.val;
+		else if (ffstr_ieqz(&meta.name, "title"))
+			title = meta.val;
+	}
+
+	char *t;
+	if (artist.len != 0)
+		t = ffsz_alfmt("%S - %S", &artist, &title);
+	else
+		t = ffsz_alcopystr(&title);
+	if (t == NULL)
+		return;
+
+	// note: the quote can't be escaped
+	for (char *p = t;  *p != '\0';  p++) {
+		if (*p == '\'')
+			*p = '`';
+	}
+	ffmem_free(s->title);
+	s->title = t;
+	s->meta_ver++;
+	dbglog(d->trk, "stream title: %s", t);
+}
+
+static void* srvout_open(fmed_filt *d)
+{
+	const char *ofn = d->track->getvalstr(d->trk, "output");
+	ffstr name, ext;
+	ffpath_split2(ofn, ffsz_len(ofn), NULL, &name);
+	ffstr_rsplitby(&name, '.', NULL, &ext);
+	const char *ctype;
+	if (NULL == (ctype = srv_ctype(&ext))) {
+		errlog(d->trk, ".%S: format isn't supported for streaming", &ext);
+		return NULL;
+	}
+
+	struct httpsrv *s = g_srv;
+	if (s == NULL
+		&& NULL == (s = g_srv = srv_init()))
+		return NULL;
+
+	struct srvout *o;
+	if (NULL == (o = ffmem_new(struct srvout)))
+		return NULL;
+	o->trk = d->trk;
+	o->s = s;
+
+	fflk_lock(&s->lk);
+	if (s->wtrk != NULL) {
+		fflk_unlock(&s->lk);
+		errlog(d->trk, "the stream is used by another track");
+		ffmem_free(o);
+		return NULL;
+	}
+	if (s->ctype != NULL && !ffsz_eq(s->ctype, ctype)) {
+		fflk_unlock(&s->lk);
+		errlog(d->trk, "can't change stream format from %s to %s", s->ctype, ctype);
+		ffmem_free(o);
+		return NULL;
+	}
+	s->ctype = ctype;
+	s->wtrk = d->trk;
+	s->track = d->track;
+	srv_settitle(s, d);
+	srv_post(s);
+	fflk_unlock(&s->lk);
+	return o;
+}
+
+static void srvout_close(void *ctx)
+{
+	struct srvout *o = ctx;
+	struct httpsrv *s = o->s;
+	fflk_lock(&s->lk);
+	s->wtrk = NULL;
+	s->wsuspended = 0;
+	s->base_time += o->time;
+	fflk_unlock(&s->lk);
+	ffmem_free(o);
+}
+
+static int srvout_process(void *ctx, fmed_filt *d)
+{
+	struct srvout *o = ctx;
+	struct httpsrv *s = o->s;
+
+	if ((int64)d->output.seek != FMED_NULL) {
+		// e.g. mpeg.out updates the header at the end: the data is already sent
+		if (!o->seeked)
+			dbglog(d->trk, "can't seek in a live stream: skipping the rest of data");
+		o->seeked = 1;
+		d->output.seek = FMED_NULL;
+	}
+
+	if ((int64)d->audio.pos != FMED_NULL && d->audio.fmt.sample_rate != 0)
+		o->time = ffpcm_time(d->audio.pos, d->audio.fmt.sample_rate);
+
+	uint64 now = srv_now();
+	int suspend = 0;
+	fflk_lock(&s->lk);
+	if (d->meta_changed)
+		srv_settitle(s, d);
+
+	if (d->datalen != 0 && !o->seeked) {
+		ffstr data;
+		ffstr_set(&data, d->data, d->datalen);
+		uint64 time = s->base_time + o->time;
+		if (s->woff == 0
+			|| time + net->conf.srv.burst < now - s->start) {
+			// the stream has started or it's too late: the wall clock is reset
+			s->start = now - time;
+		}
+		srv_write(s, data, time);
+
+		if (time >= now - s->start + net->conf.srv.burst) {
+			s->wsuspended = 1;
+			suspend = 1;
+		}
+	}
+	fflk_unlock(&s->lk);
+	d->datalen = 0;
+
+	if (d->flags & FMED_FLAST)
+		return FMED_RDONE;
+	if (suspend)
+		return FMED_RASYNC; // srv_timer() wakes us up
+	return FMED_RMORE;
+}
+
+const fmed_filter nethttpsrv = {
+	&srvout_open, &srvout_process, &srvout_close
+};
+
+#undef FILT_NAME
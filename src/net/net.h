@@ -2,6 +2,7 @@
 Copyright (c) 2019 Simon Zolin */
 
 #include <fmedia.h>
+#include <FFOS/socket.h>
 
 
 #undef dbglog
@@ -15,17 +16,35 @@ Copyright (c) 2019 Simon Zolin */
 typedef struct net_conf {
 	uint bufsize;
 	uint nbufs;
-	uint buf_lowat;
+	uint buf_lowat; // obsolete
+	uint buf_min; // msec
+	uint buf_max; // msec
 	uint conn_tmout;
 	uint tmout;
 	byte user_agent;
 	byte max_redirect;
 	byte max_reconnect;
 	byte meta;
+	byte keepalive;
+	uint keepalive_tmout;
+	uint max_host_conns;
+	uint hls_prefetch;
+	size_t hls_max_buffer;
+	uint dns_cache_ttl; // sec
+	size_t range_cache;
 	struct {
 		char *host;
 		uint port;
 	} proxy;
+	struct {
+		char *host; // listening address;  NULL: any
+		uint port;
+		uint max_clients;
+		size_t buffer;
+		uint burst; // msec
+		uint metaint;
+		byte slow_client; // enum SRV_SLOW
+	} srv; // net.httpsrv
 } net_conf;
 
 typedef struct netmod {
@@ -39,4 +58,88 @@ extern const fmed_core *core;
 extern const char *const http_ua[];
 
 extern const fmed_net_http http_iface;
+
+
+/** Asynchronous DNS resolver with cache.
+Thread: any worker;  a query is used within one worker. */
+typedef struct dnsquery dnsquery;
+typedef void (*dns_handler)(void *udata);
+
+int dns_init(void);
+
+/** Start resolving host name.
+If the result isn't ready yet, 'handler' is called later when it is, within worker 'wid'. */
+dnsquery* dns_resolve(const char *host, const char *port, uint wid, dns_handler handler, void *udata);
+
+/** Get the result.
+@addrs: valid until dns_free()
+@err: system error code
+Return 0 if resolved;  1 if in progress;  -1 on error. */
+int dns_result(dnsquery *q, const ffaddrinfo **addrs, int *err);
+
+void dns_free(dnsquery *q);
+
+/** Stop resolver threads and free the cache. */
+void dns_destroy(void);
+
+
+/** HTTP client with a pool of persistent connections.
+The pool and its requests are used within one track, in the track's worker.
+Idle connections are shared by all pools within the same worker. */
+typedef struct httppool httppool;
+typedef struct httpreq httpreq;
+
+typedef struct httpreq_resp {
+	uint code;
+	ffstr status; // "HTTP/1.1 200 OK"
+	ffstr headers; // "Name: Value\r\n..."
+} httpreq_resp;
+
+void httppool_init(void);
+
+/** Close idle connections. */
+void httppool_destroy(void);
+
+httppool* httppool_create(void *trk);
+
+/** Close all connections.
+All requests must be closed before. */
+void httppool_free(httppool *p);
+
+/** Create GET request. */
+httpreq* httpreq_create(httppool *p, const char *url);
+
+/** Close request.  Return the connection to the pool if the response is complete. */
+void httpreq_close(httpreq *r);
+
+/** Set callback function which is called every time the request status changes.
+Processing is suspended until user calls httpreq_send(). */
+void httpreq_sethandler(httpreq *r, ffhttpcl_handler func, void *udata);
+
+/** Add request header. */
+int httpreq_header(httpreq *r, const ffstr *name, const ffstr *val);
+
+/** Start or continue processing. */
+void httpreq_send(httpreq *r);
+
+/** Get response.
+@data: response body
+Return enum FFHTTPCL_ST. */
+int httpreq_recv(httpreq *r, const httpreq_resp **resp, ffstr *data);
+
+/** Find response header value (case-insensitive name).
+Return 1 if found. */
+int httpreq_hdr(const httpreq_resp *resp, const char *name, ffstr *val);
+
+/** Skip whitespace around a line of HTTP header. */
+void http_trim(ffstr *s);
+
 extern const fmed_filter nethls;
+extern int hls_config(ffpars_ctx *ctx);
+
+/** HTTP/ICY streaming server output. */
+extern const fmed_filter nethttpsrv;
+extern int httpsrv_config(ffpars_ctx *ctx);
+
+/** Close all connections. */
+void httpsrv_destroy(void);
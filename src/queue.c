@@ -362,18 +362,21 @@ end:
 	return rc;
 }
 
-/** Start multiple tracks. */
+/** Start multiple tracks.
+Network streams don't need a free worker:
+ they are all started at once and are spread over the workers, whose kernel queues serve their sockets. */
 static void que_xplay(entry *e)
 {
 	for (;;) {
 		e->plist->xcursor = e;
 		ffbool last = (e->sib.next == fflist_sentl(&e->plist->ents));
 		que_play2(e, 1);
-		if (0 == core->cmd(FMED_WORKER_AVAIL))
-			break;
 		if (last)
 			break;
 		e = FF_GETPTR(entry, sib, e->sib.next);
+		if (!ffstr_matchz(&e->e.url, "http://")
+			&& 0 == core->cmd(FMED_WORKER_AVAIL))
+			break;
 	}
 }
 
@@ -0,0 +1,714 @@
+/** Tag editor: .mp3: ID3v2, ID3v1, APEv2.
+Copyright (c) 2020 Simon Zolin */
+
+#include <tag/tag.h>
+
+
+enum {
+	ID3_HDR = 10,
+	ID3_FLAG_UNSYNC = 0x80,
+	ID3_FLAG_EXTHDR = 0x40,
+	ID3_FLAG_FOOTER = 0x10,
+	ID3_MAXSIZE = 0x0fffffff,
+	ID31_SIZE = 128,
+	APE_FOOTER = 32,
+	APE_FLAG_HDR = 0x80000000,
+	APE_MAXSIZE = 16 * 1024 * 1024,
+};
+
+static uint id3_syncsafe(const byte *d)
+{
+	return ((uint)(d[0] & 0x7f) << 21) | ((uint)(d[1] & 0x7f) << 14) | ((uint)(d[2] & 0x7f) << 7) | (d[3] & 0x7f);
+}
+
+static void id3_wsyncsafe(byte *d, uint n)
+{
+	d[0] = (n >> 21) & 0x7f,  d[1] = (n >> 14) & 0x7f,  d[2] = (n >> 7) & 0x7f,  d[3] = n & 0x7f;
+}
+
+struct id3_map {
+	const char *name; // fmedia tag name
+	const char *id; // ID3v2.3/2.4 frame
+	const char *id22; // ID3v2.2 frame
+};
+
+/* Note: "date" is TDRC in ID3v2.4 and TYER in ID3v2.3 */
+static const struct id3_map id3_frames[] = {
+	{ "album", "TALB", "TAL" },
+	{ "albumartist", "TPE2", "TP2" },
+	{ "artist", "TPE1", "TP1" },
+	{ "comment", "COMM", "COM" },
+	{ "composer", "TCOM", "TCM" },
+	{ "copyright", "TCOP", "TCR" },
+	{ "date", "TDRC", "TYE" },
+	{ "date", "TYER", NULL },
+	{ "discnumber", "TPOS", "TPA" },
+	{ "genre", "TCON", "TCO" },
+	{ "lyrics", "USLT", "ULT" },
+	{ "picture", "APIC", NULL },
+	{ "publisher", "TPUB", "TPB" },
+	{ "title", "TIT2", "TT2" },
+	{ "tracknumber", "TRCK", "TRK" },
+	{ "tracktotal", "TRCK", NULL },
+	{ "", "TXXX", "TXX" },
+};
+
+static const struct id3_map* id3_find_name(const ffstr *name)
+{
+	for (uint i = 0;  i != FFCNT(id3_frames) - 1;  i++) {
+		if (ffstr_ieqz(name, id3_frames[i].name))
+			return &id3_frames[i];
+	}
+	return NULL;
+}
+
+static const struct id3_map* id3_find_id(const char *id, uint v22)
+{
+	for (uint i = 0;  i != FFCNT(id3_frames);  i++) {
+		const char *fid = (v22) ? id3_frames[i].id22 : id3_frames[i].id;
+		if (fid != NULL && !ffmemcmp(fid, id, (v22) ? 3 : 4))
+			return &id3_frames[i];
+	}
+	return NULL;
+}
+
+/** Get ASCII characters from ID3v2 text frame data (e.g. digits from TRCK). */
+static void id3_text_ascii(const ffstr *data, char *buf, size_t cap)
+{
+	size_t n = 0;
+	for (size_t i = 1;  i < data->len && n + 1 < cap;  i++) {
+		byte c = data->ptr[i];
+		if (c >= 0x20 && c < 0x7f)
+			buf[n++] = c;
+	}
+	buf[n] = '\0';
+}
+
+/** Return 1 if UTF-8 text can be stored as ISO-8859-1. */
+static int utf8_latin1(const ffstr *s, ffarr *out)
+{
+	for (size_t i = 0;  i != s->len;  i++) {
+		byte c = s->ptr[i];
+		if (c < 0x80) {
+			if (out != NULL)
+				ffarr_append(out, &c, 1);
+		} else if ((c & 0xfe) == 0xc2 && i + 1 != s->len) {
+			byte c2 = ((c & 0x03) << 6) | (s->ptr[++i] & 0x3f);
+			if (out != NULL)
+				ffarr_append(out, &c2, 1);
+		} else
+			return 0;
+	}
+	return 1;
+}
+
+/** Convert UTF-8 to UTF-16LE. */
+static int utf8_utf16le(const ffstr *s, ffarr *out)
+{
+	byte d[4];
+	for (size_t i = 0;  i != s->len; ) {
+		uint c = (byte)s->ptr[i], n = 0;
+		if (c < 0x80)
+			n = 0;
+		else if ((c & 0xe0) == 0xc0)
+			c &= 0x1f,  n = 1;
+		else if ((c & 0xf0) == 0xe0)
+			c &= 0x0f,  n = 2;
+		else if ((c & 0xf8) == 0xf0)
+			c &= 0x07,  n = 3;
+		else
+			c = '?';
+		i++;
+		for (;  n != 0 && i != s->len;  n--, i++) {
+			c = (c << 6) | (s->ptr[i] & 0x3f);
+		}
+
+		if (c >= 0x10000) {
+			c -= 0x10000;
+			uint hi = 0xd800 | (c >> 10),  lo = 0xdc00 | (c & 0x3ff);
+			d[0] = (byte)hi,  d[1] = (byte)(hi >> 8),  d[2] = (byte)lo,  d[3] = (byte)(lo >> 8);
+			if (NULL == ffarr_append(out, d, 4))
+				return -1;
+		} else {
+			d[0] = (byte)c,  d[1] = (byte)(c >> 8);
+			if (NULL == ffarr_append(out, d, 2))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+struct id3w {
+	tagedit *t;
+	uint ver; // 3 or 4
+	ffarr buf; // frames
+};
+
+/** Add frame header;  the size is set by id3w_frame_end(). */
+static size_t id3w_frame_begin(struct id3w *w, const char *id)
+{
+	size_t off = w->buf.len;
+	byte h[ID3_HDR] = {};
+	ffmemcpy(h, id, 4);
+	ffarr_append(&w->buf, h, ID3_HDR);
+	return off;
+}
+
+static int id3w_frame_end(struct id3w *w, size_t off)
+{
+	if (w->buf.ptr == NULL)
+		return -1;
+	uint n = w->buf.len - off - ID3_HDR;
+	byte *h = (byte*)w->buf.ptr + off;
+	if (w->ver == 4)
+		id3_wsyncsafe(h + 4, n);
+	else
+		tag_wbe32(h + 4, n);
+	return 0;
+}
+
+/** Get text encoding for the value:
+ UTF-8 for ID3v2.4;  ISO-8859-1 or UTF-16 with BOM for ID3v2.3. */
+static byte id3w_enc(struct id3w *w, const ffstr *s)
+{
+	if (w->ver == 4)
+		return 3;
+	return utf8_latin1(s, NULL) ? 0 : 1;
+}
+
+/** Add text in the specified encoding.
+@nul: add terminating NUL */
+static void id3w_put(struct id3w *w, const ffstr *s, byte enc, uint nul)
+{
+	switch (enc) {
+	case 0:
+		utf8_latin1(s, &w->buf);
+		break;
+	case 1:
+		ffarr_append(&w->buf, "\xff\xfe", 2);
+		utf8_utf16le(s, &w->buf);
+		break;
+	case 3:
+		ffarr_append(&w->buf, s->ptr, s->len);
+		break;
+	}
+	if (nul)
+		ffarr_append(&w->buf, "\0\0", (enc == 1) ? 2 : 1);
+}
+
+/** Add frame from --meta value. */
+static int id3w_field(struct id3w *w, struct tagfield *f, const ffstr *trck)
+{
+	const struct id3_map *m = id3_find_name(&f->name);
+	const char *id = (m != NULL) ? m->id : "TXXX";
+	if (ffsz_eq(id, "TDRC") && w->ver == 3)
+		id = "TYER";
+	size_t off = id3w_frame_begin(w, id);
+	const ffstr *val = (ffsz_eq(id, "TRCK")) ? trck : &f->val;
+	byte enc = id3w_enc(w, val);
+
+	if (ffsz_eq(id, "COMM") || ffsz_eq(id, "USLT")) {
+		// encoding, language, description, text
+		ffstr empty = {};
+		ffarr_append(&w->buf, &enc, 1);
+		ffarr_append(&w->buf, "eng", 3);
+		id3w_put(w, &empty, enc, 1);
+		id3w_put(w, val, enc, 0);
+
+	} else if (ffsz_eq(id, "APIC")) {
+		// encoding, MIME, picture type, description, data
+		const char *mime = tag_pic_mime(val);
+		ffarr_append(&w->buf, "\x00", 1);
+		ffarr_append(&w->buf, mime, ffsz_len(mime) + 1);
+		ffarr_append(&w->buf, "\x03", 1); // front cover
+		ffarr_append(&w->buf, "\x00", 1);
+		ffarr_append(&w->buf, val->ptr, val->len);
+
+	} else if (ffsz_eq(id, "TXXX")) {
+		// encoding, description, text
+		if (enc == 0 && !utf8_latin1(&f->name, NULL))
+			enc = 1;
+		ffarr_append(&w->buf, &enc, 1);
+		id3w_put(w, &f->name, enc, 1);
+		id3w_put(w, val, enc, 0);
+
+	} else {
+		ffarr_append(&w->buf, &enc, 1);
+		id3w_put(w, val, enc, 0);
+	}
+
+	return id3w_frame_end(w, off);
+}
+
+/** Copy the existing frame. */
+static int id3w_copy(struct id3w *w, const char *id, uint flags, const ffstr *data)
+{
+	size_t off = id3w_frame_begin(w, id);
+	byte *h = (byte*)w->buf.ptr + off;
+	if (w->buf.ptr != NULL)
+		tag_wbe16(h + 8, flags);
+	ffarr_append(&w->buf, data->ptr, data->len);
+	return id3w_frame_end(w, off);
+}
+
+/** Remove unsynchronisation. */
+static void id3_unsync(ffarr *buf)
+{
+	byte *d = (void*)buf->ptr;
+	size_t k = 0;
+	for (size_t i = 0;  i != buf->len;  i++) {
+		d[k++] = d[i];
+		if (d[i] == 0xff && i + 1 != buf->len && d[i + 1] == 0x00)
+			i++;
+	}
+	buf->len = k;
+}
+
+/** Get TXXX description as fmedia tag name. */
+static void id3_txxx_name(const ffstr *data, ffstr *name)
+{
+	name->len = 0;
+	if (data->len < 2 || (data->ptr[0] != 0 && data->ptr[0] != 3))
+		return; // UTF-16 descriptions aren't matched
+	ffstr_set(name, data->ptr + 1, ffs_find(data->ptr + 1, data->len - 1, '\0') - (data->ptr + 1));
+}
+
+/** Write the new ID3v2 tag.
+@hdr: the existing tag header
+@frames: the existing frames */
+static int id3v2_edit(tagedit *t, const byte *hdr, ffarr *frames)
+{
+	int rc = -1;
+	struct id3w w = {};
+	w.t = t;
+	uint oldver = (hdr != NULL) ? hdr[3] : 0;
+	w.ver = (oldver == 3) ? 3 : 4;
+	uint64 region = 0;
+	if (hdr != NULL)
+		region = ID3_HDR + id3_syncsafe(hdr + 6) + ((hdr[5] & ID3_FLAG_FOOTER) ? ID3_HDR : 0);
+
+	char trck_buf[64] = {};
+	ffstr trck = {};
+
+	// copy the existing frames which aren't replaced
+	ffstr d;
+	ffstr_set2(&d, frames);
+	uint v22 = (oldver == 2);
+	uint fhdr = (v22) ? 6 : ID3_HDR;
+	while (d.len >= fhdr && d.ptr[0] != '\0') {
+		char id[5] = {};
+		uint size, flags = 0;
+		if (v22) {
+			ffmemcpy(id, d.ptr, 3);
+			size = ((uint)(byte)d.ptr[3] << 16) | tag_be16(d.ptr + 4);
+		} else {
+			ffmemcpy(id, d.ptr, 4);
+			size = (oldver == 4) ? id3_syncsafe((byte*)d.ptr + 4) : tag_be32(d.ptr + 4);
+			flags = tag_be16(d.ptr + 8);
+		}
+		if (fhdr + size > d.len) {
+			warnlog(t, "ID3v2: frame %s: bad size", id);
+			break;
+		}
+		ffstr data;
+		ffstr_set(&data, d.ptr + fhdr, size);
+		ffstr_shift(&d, fhdr + size);
+
+		const struct id3_map *m = id3_find_id(id, v22);
+		ffstr name = {};
+		if (m != NULL) {
+			ffstr_setz(&name, m->name);
+			if (m->name[0] == '\0')
+				id3_txxx_name(&data, &name);
+		}
+
+		if (m != NULL && ffsz_eq(m->id, "TRCK"))
+			id3_text_ascii(&data, trck_buf, sizeof(trck_buf));
+
+		if (t->clear
+			|| (name.len != 0 && tag_replaced(t, name.ptr, name.len))
+			|| (m != NULL && ffsz_eq(m->id, "TRCK") && NULL != tag_field(t, FFSTR("tracktotal"))))
+			continue;
+
+		if (v22) {
+			if (m == NULL || m->id22 == NULL || ffsz_eq(m->id, "APIC")) {
+				dbglog(t, "ID3v2.2: skipping frame %s", id);
+				continue;
+			}
+			if (0 != id3w_copy(&w, m->id, 0, &data))
+				goto end;
+			continue;
+		}
+
+		if (0 != id3w_copy(&w, id, flags, &data))
+			goto end;
+	}
+
+	// "tracknumber[/tracktotal]"
+	struct tagfield *tn = tag_field(t, FFSTR("tracknumber")), *tt = tag_field(t, FFSTR("tracktotal"));
+	if (tn != NULL || tt != NULL) {
+		ffstr num, total = {};
+		ffstr_setz(&num, trck_buf);
+		ffs_split2by(num.ptr, num.len, '/', &num, &total);
+		if (tn != NULL)
+			num = tn->val;
+		if (tt != NULL)
+			total = tt->val;
+		if (t->clear && tn == NULL)
+			num.len = 0;
+		uint n = 0;
+		if (num.len != 0)
+			n = ffs_fmt(trck_buf, trck_buf + sizeof(trck_buf), "%S", &num);
+		if (total.len != 0 && n != 0)
+			n += ffs_fmt(trck_buf + n, trck_buf + sizeof(trck_buf), "/%S", &total);
+		ffstr_set(&trck, trck_buf, n);
+	}
+
+	struct tagfield *f;
+	FFARR_WALKT(&t->fields, f, struct tagfield) {
+		if (ffstr_ieqz(&f->name, "tracktotal")) {
+			if (tn == NULL && trck.len != 0 && 0 != id3w_field(&w, f, &trck))
+				goto end;
+			f->used = 1;
+			continue;
+		}
+		if (ffstr_ieqz(&f->name, "tracknumber") && trck.len == 0)
+			continue;
+		if (f->val.len == 0)
+			continue;
+		if (0 != id3w_field(&w, f, &trck))
+			goto end;
+		f->used = 1;
+	}
+
+	// header + frames + padding
+	uint64 size = ID3_HDR + w.buf.len;
+	if (size > region) {
+		if (w.buf.len + t->padding > ID3_MAXSIZE) {
+			errlog(t, "ID3v2: tag is too large");
+			goto end;
+		}
+		size += t->padding;
+	} else {
+		size = region;
+	}
+
+	ffarr out = {};
+	if (NULL == ffarr_alloc(&out, size)) {
+		ffarr_free(&w.buf);
+		return -1;
+	}
+	byte *h = (void*)out.ptr;
+	ffmemcpy(h, "ID3", 3);
+	h[3] = w.ver,  h[4] = 0,  h[5] = 0;
+	id3_wsyncsafe(h + 6, size - ID3_HDR);
+	ffmemcpy(out.ptr + ID3_HDR, w.buf.ptr, w.buf.len);
+	ffmem_zero(out.ptr + ID3_HDR + w.buf.len, size - ID3_HDR - w.buf.len);
+	out.len = size;
+
+	dbglog(t, "ID3v2.%u: frames: %L bytes, padding: %U bytes"
+		, w.ver, w.buf.len, size - ID3_HDR - w.buf.len);
+	ffstr s;
+	ffstr_set2(&s, &out);
+	rc = tag_replace(t, 0, region, &s);
+	ffarr_free(&out);
+
+end:
+	ffarr_free(&w.buf);
+	return rc;
+}
+
+static int id3v2(tagedit *t)
+{
+	int rc = -1;
+	byte hdr[ID3_HDR];
+	ffarr frames = {};
+
+	if (t->size < ID3_HDR || 0 != tag_read(t, 0, hdr, ID3_HDR))
+		return -1;
+
+	if (ffmemcmp(hdr, "ID3", 3)) {
+		rc = id3v2_edit(t, NULL, &frames);
+		goto end;
+	}
+
+	uint size = id3_syncsafe(hdr + 6);
+	if (hdr[3] < 2 || hdr[3] > 4 || ID3_HDR + (uint64)size > t->size) {
+		errlog(t, "ID3v2: unsupported or corrupted tag");
+		goto end;
+	}
+	dbglog(t, "ID3v2.%u: %u bytes, flags:%xu", hdr[3], size, hdr[5]);
+
+	if (0 != tag_readarr(t, ID3_HDR, size, &frames))
+		goto end;
+
+	if (hdr[3] != 4 && (hdr[5] & ID3_FLAG_UNSYNC))
+		id3_unsync(&frames);
+
+	if (hdr[5] & ID3_FLAG_EXTHDR) {
+		uint n = (frames.len >= 4) ? tag_be32(frames.ptr) : 0;
+		if (hdr[3] == 4)
+			n = id3_syncsafe((byte*)frames.ptr);
+		else
+			n += 4;
+		if (n > frames.len) {
+			errlog(t, "ID3v2: bad extended header");
+			goto end;
+		}
+		_ffarr_rmleft(&frames, n, sizeof(char));
+	}
+
+	rc = id3v2_edit(t, hdr, &frames);
+
+end:
+	ffarr_free(&frames);
+	return rc;
+}
+
+
+static const char *const id31_genres[] = {
+	"Blues", "Classic Rock", "Country", "Dance", "Disco", "Funk", "Grunge", "Hip-Hop",
+	"Jazz", "Metal", "New Age", "Oldies", "Other", "Pop", "R&B", "Rap",
+	"Reggae", "Rock", "Techno", "Industrial", "Alternative", "Ska", "Death Metal", "Pranks",
+	"Soundtrack", "Euro-Techno", "Ambient", "Trip-Hop", "Vocal", "Jazz+Funk", "Fusion", "Trance",
+	"Classical", "Instrumental", "Acid", "House", "Game", "Sound Clip", "Gospel", "Noise",
+	"AlternRock", "Bass", "Soul", "Punk", "Space", "Meditative", "Instrumental Pop", "Instrumental Rock",
+	"Ethnic", "Gothic", "Darkwave", "Techno-Industrial", "Electronic", "Pop-Folk", "Eurodance", "Dream",
+	"Southern Rock", "Comedy", "Cult", "Gangsta", "Top 40", "Christian Rap", "Pop/Funk", "Jungle",
+	"Native American", "Cabaret", "New Wave", "Psychadelic", "Rave", "Showtunes", "Trailer", "Lo-Fi",
+	"Tribal", "Acid Punk", "Acid Jazz", "Polka", "Retro", "Musical", "Rock & Roll", "Hard Rock",
+};
+
+/** Set ID3v1 field: ISO-8859-1, padded with zeros. */
+static void id31_set(byte *dst, size_t cap, const ffstr *val)
+{
+	ffarr a = {};
+	ffmem_zero(dst, cap);
+	if (!utf8_latin1(val, NULL)) {
+		// non-Latin text can't be stored:  replace non-ASCII characters
+		for (size_t i = 0, n = 0;  i != val->len && n != cap;  i++) {
+			byte c = val->ptr[i];
+			if (c < 0x80)
+				dst[n++] = c;
+			else if ((c & 0xc0) == 0xc0)
+				dst[n++] = '?';
+		}
+		return;
+	}
+	utf8_latin1(val, &a);
+	ffmemcpy(dst, a.ptr, ffmin(a.len, cap));
+	ffarr_free(&a);
+}
+
+/** Update ID3v1 tag if it exists.
+Return 1 if there's no tag. */
+static int id31(tagedit *t, uint64 off)
+{
+	byte d[ID31_SIZE];
+	if (t->size < ID31_SIZE)
+		return 1;
+	if (0 != tag_read(t, off, d, ID31_SIZE))
+		return -1;
+	if (ffmemcmp(d, "TAG", 3))
+		return 1;
+
+	if (t->clear) {
+		ffmem_zero(d + 3, ID31_SIZE - 3 - 1);
+		d[ID31_SIZE - 1] = 0xff;
+	}
+
+	static const struct { const char *name; byte off, len; } fields[] = {
+		{ "title", 3, 30 },
+		{ "artist", 33, 30 },
+		{ "album", 63, 30 },
+		{ "date", 93, 4 },
+		{ "comment", 97, 28 },
+	};
+	struct tagfield *f;
+	for (uint i = 0;  i != FFCNT(fields);  i++) {
+		if (NULL != (f = tag_field(t, fields[i].name, ffsz_len(fields[i].name))))
+			id31_set(d + fields[i].off, fields[i].len, &f->val);
+	}
+
+	if (NULL != (f = tag_field(t, FFSTR("tracknumber")))) {
+		uint n = 0;
+		ffs_toint(f->val.ptr, f->val.len, &n, FFS_INT32);
+		d[125] = 0;
+		d[126] = (byte)ffmin(n, 255);
+	}
+
+	if (NULL != (f = tag_field(t, FFSTR("genre")))) {
+		d[127] = 0xff;
+		for (uint i = 0;  i != FFCNT(id31_genres);  i++) {
+			if (ffstr_ieqz(&f->val, id31_genres[i])) {
+				d[127] = i;
+				break;
+			}
+		}
+	}
+
+	dbglog(t, "ID3v1: updating");
+	return tag_write(t, off, d, ID31_SIZE);
+}
+
+
+struct ape_map {
+	const char *name;
+	const char *key;
+};
+
+static const struct ape_map ape_keys[] = {
+	{ "album", "Album" },
+	{ "albumartist", "Album Artist" },
+	{ "artist", "Artist" },
+	{ "comment", "Comment" },
+	{ "composer", "Composer" },
+	{ "copyright", "Copyright" },
+	{ "date", "Year" },
+	{ "discnumber", "Disc" },
+	{ "genre", "Genre" },
+	{ "lyrics", "Lyrics" },
+	{ "publisher", "Publisher" },
+	{ "title", "Title" },
+	{ "tracknumber", "Track" },
+};
+
+/** Get fmedia tag name by APE key. */
+static void ape_name(const ffstr *key, ffstr *name)
+{
+	*name = *key;
+	for (uint i = 0;  i != FFCNT(ape_keys);  i++) {
+		if (ffstr_ieqz(key, ape_keys[i].key)) {
+			ffstr_setz(name, ape_keys[i].name);
+			return;
+		}
+	}
+}
+
+static void ape_item(ffarr *buf, const ffstr *key, const ffstr *val)
+{
+	byte h[8];
+	tag_wle32(h, val->len);
+	tag_wle32(h + 4, 0); // UTF-8 text
+	ffarr_append(buf, h, 8);
+	ffarr_append(buf, key->ptr, key->len);
+	ffarr_append(buf, "\0", 1);
+	ffarr_append(buf, val->ptr, val->len);
+}
+
+/** Rewrite APEv2 tag if it exists.
+@end: the end offset of APE tag (i.e. the start of ID3v1 tag)
+Return 1 if there's no tag. */
+static int ape(tagedit *t, uint64 end)
+{
+	int rc = -1;
+	byte ft[APE_FOOTER];
+	ffarr items = {}, out = {};
+
+	if (end < APE_FOOTER)
+		return 1;
+	if (0 != tag_read(t, end - APE_FOOTER, ft, APE_FOOTER))
+		return -1;
+	if (ffmemcmp(ft, "APETAGEX", 8))
+		return 1;
+
+	uint size = tag_le32(ft + 12), n = tag_le32(ft + 16), flags = tag_le32(ft + 20);
+	uint hdr = (flags & APE_FLAG_HDR) ? APE_FOOTER : 0;
+	if (size < APE_FOOTER || size > APE_MAXSIZE || size + hdr > end) {
+		errlog(t, "APEv2: corrupted tag");
+		return -1;
+	}
+	uint64 off = end - size - hdr;
+	if (0 != tag_readarr(t, end - size, size - APE_FOOTER, &items))
+		goto end;
+	dbglog(t, "APEv2: %u items, %u bytes", n, size);
+
+	ffstr d;
+	ffstr_set2(&d, &items);
+	uint count = 0;
+	for (uint i = 0;  i != n;  i++) {
+		if (d.len < 8)
+			break;
+		uint vlen = tag_le32(d.ptr);
+		ffstr key, name;
+		ffstr_set(&key, d.ptr + 8, ffs_find(d.ptr + 8, d.len - 8, '\0') - (d.ptr + 8));
+		if (8 + key.len + 1 + (uint64)vlen > d.len)
+			break;
+		size_t itemlen = 8 + key.len + 1 + vlen;
+		ape_name(&key, &name);
+		if (!tag_replaced(t, name.ptr, name.len)) {
+			ffarr_append(&out, d.ptr, itemlen);
+			count++;
+		}
+		ffstr_shift(&d, itemlen);
+	}
+
+	struct tagfield *f;
+	FFARR_WALKT(&t->fields, f, struct tagfield) {
+		if (f->val.len == 0 || ffstr_ieqz(&f->name, "picture"))
+			continue;
+		ffstr key = f->name;
+		for (uint i = 0;  i != FFCNT(ape_keys);  i++) {
+			if (ffstr_ieqz(&f->name, ape_keys[i].name)) {
+				ffstr_setz(&key, ape_keys[i].key);
+				break;
+			}
+		}
+		ape_item(&out, &key, &f->val);
+		count++;
+		f->used = 1;
+	}
+	if (out.ptr == NULL && count != 0)
+		goto end;
+
+	// header, items, footer, ID3v1
+	ffarr tag = {};
+	if (NULL == ffarr_alloc(&tag, APE_FOOTER + out.len + APE_FOOTER + ID31_SIZE))
+		goto end;
+	byte h[APE_FOOTER] = {};
+	ffmemcpy(h, "APETAGEX", 8);
+	tag_wle32(h + 8, 2000);
+	tag_wle32(h + 12, out.len + APE_FOOTER);
+	tag_wle32(h + 16, count);
+	tag_wle32(h + 20, APE_FLAG_HDR | 0x20000000);
+	ffarr_append(&tag, h, APE_FOOTER);
+	ffarr_append(&tag, out.ptr, out.len);
+	tag_wle32(h + 20, APE_FLAG_HDR);
+	ffarr_append(&tag, h, APE_FOOTER);
+
+	uint tail = t->size - end;
+	if (tail != 0 && 0 != tag_read(t, end, tag.ptr + tag.len, tail)) {
+		ffarr_free(&tag);
+		goto end;
+	}
+	tag.len += tail;
+
+	dbglog(t, "APEv2: writing %u items, %L bytes", count, out.len);
+	rc = tag_write(t, off, tag.ptr, tag.len);
+	if (rc == 0 && off + tag.len < t->size)
+		rc = tag_trunc(t, off + tag.len);
+	if (rc == 0)
+		t->size = ffmax(t->size, off + tag.len);
+	ffarr_free(&tag);
+
+end:
+	ffarr_free(&items);
+	ffarr_free(&out);
+	return rc;
+}
+
+int tag_mpeg(tagedit *t)
+{
+	int r;
+	uint64 end = t->size;
+
+	// the tags at the end of file are updated first:  they don't change the offsets of audio data
+	if (0 > (r = id31(t, (t->size >= ID31_SIZE) ? t->size - ID31_SIZE : 0)))
+		return -1;
+	if (r == 0)
+		end = t->size - ID31_SIZE;
+	if (0 > (r = ape(t, end)))
+		return -1;
+
+	return id3v2(t);
+}
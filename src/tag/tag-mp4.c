@@ -0,0 +1,510 @@
+/** Tag editor: iTunes-style tags (moov.udta.meta.ilst) in .mp4, .m4a.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+moov
+  trak/mdia/minf/stbl/stco|co64  (chunk offsets are shifted when moov size is changed and mdat follows it)
+  udta
+    meta (FullBox)
+      hdlr ("mdir")
+      ilst
+        ITEM
+          data (type, locale, value)
+        "----"
+          mean
+          name
+          data
+      free (padding for the next edit)
+*/
+
+#include <tag/tag.h>
+
+
+struct mp4_map {
+	const char *name; // fmedia tag name
+	char type[4];
+	uint data_type;
+};
+
+enum {
+	MP4_DATA_BINARY = 0,
+	MP4_DATA_UTF8 = 1,
+	MP4_DATA_JPEG = 13,
+	MP4_DATA_PNG = 14,
+};
+
+static const struct mp4_map mp4_items[] = {
+	{ "album", "\xa9""alb", MP4_DATA_UTF8 },
+	{ "albumartist", "aART", MP4_DATA_UTF8 },
+	{ "artist", "\xa9""ART", MP4_DATA_UTF8 },
+	{ "comment", "\xa9""cmt", MP4_DATA_UTF8 },
+	{ "composer", "\xa9""wrt", MP4_DATA_UTF8 },
+	{ "copyright", "cprt", MP4_DATA_UTF8 },
+	{ "date", "\xa9""day", MP4_DATA_UTF8 },
+	{ "discnumber", "disk", MP4_DATA_BINARY },
+	{ "genre", "\xa9""gen", MP4_DATA_UTF8 },
+	{ "genre", "gnre", MP4_DATA_BINARY }, // ID3v1 genre index;  only removed
+	{ "lyrics", "\xa9""lyr", MP4_DATA_UTF8 },
+	{ "picture", "covr", MP4_DATA_JPEG },
+	{ "title", "\xa9""nam", MP4_DATA_UTF8 },
+	{ "tracknumber", "trkn", MP4_DATA_BINARY },
+};
+
+static const struct mp4_map* mp4_find_type(const char *type)
+{
+	for (uint i = 0;  i != FFCNT(mp4_items);  i++) {
+		if (!ffmemcmp(type, mp4_items[i].type, 4))
+			return &mp4_items[i];
+	}
+	return NULL;
+}
+
+static const struct mp4_map* mp4_find_name(const ffstr *name)
+{
+	for (uint i = 0;  i != FFCNT(mp4_items);  i++) {
+		if (ffstr_ieqz(name, mp4_items[i].name))
+			return &mp4_items[i];
+	}
+	return NULL;
+}
+
+/** Parse box header.
+Return header length;  0 if incomplete;  -1 on error. */
+static int box_hdr(const byte *d, size_t len, char *type, uint64 *size)
+{
+	if (len < 8)
+		return 0;
+	ffmemcpy(type, d + 4, 4);
+	*size = tag_be32(d);
+	if (*size == 1) {
+		if (len < 16)
+			return 0;
+		*size = tag_be64(d + 8);
+		return (*size >= 16) ? 16 : -1;
+	}
+	if (*size == 0)
+		*size = (uint64)-1; // up to the end of file
+	else if (*size < 8)
+		return -1;
+	return 8;
+}
+
+/** Box within moov data. */
+struct mp4_box {
+	size_t off; // offset from moov start
+	uint hlen; // header length (+ FullBox fields)
+	uint64 size;
+};
+
+/** Find child box within [off..end). */
+static int box_find(const ffarr *m, size_t off, size_t end, const char *type, struct mp4_box *b)
+{
+	char t[4];
+	uint64 sz;
+	while (off + 8 <= end) {
+		int n = box_hdr((byte*)m->ptr + off, end - off, t, &sz);
+		if (n <= 0 || sz > end - off)
+			return -1;
+		if (!ffmemcmp(t, type, 4)) {
+			b->off = off;
+			b->hlen = n;
+			b->size = sz;
+			return 0;
+		}
+		off += sz;
+	}
+	return -1;
+}
+
+static void box_write(ffarr *out, const char *type, size_t size)
+{
+	byte h[8];
+	tag_wbe32(h, size);
+	ffmemcpy(h + 4, type, 4);
+	ffarr_append(out, h, 8);
+}
+
+/** Set the new size in the box header. */
+static int box_setsize(tagedit *t, char *d, uint64 size)
+{
+	if (tag_be32(d) == 1) {
+		tag_wbe64(d + 8, size);
+		return 0;
+	}
+	if (size > 0xffffffff) {
+		errlog(t, "MP4: box is too large");
+		return -1;
+	}
+	tag_wbe32(d, size);
+	return 0;
+}
+
+/** Add ilst item with "data" box. */
+static void item_write(ffarr *out, const char *type, uint data_type, const void *val, size_t len)
+{
+	byte d[8];
+	box_write(out, type, 8 + 16 + len);
+	box_write(out, "data", 16 + len);
+	tag_wbe32(d, data_type); // version (1 byte), type (3 bytes)
+	tag_wbe32(d + 4, 0); // locale
+	ffarr_append(out, d, 8);
+	ffarr_append(out, val, len);
+}
+
+/** Add freeform item: "----" (mean "com.apple.iTunes", name NAME, data) */
+static void item_write_freeform(ffarr *out, const ffstr *name, const ffstr *val)
+{
+	static const char mean[] = "com.apple.iTunes";
+	byte d[8];
+	ffmem_zero(d, 4);
+	box_write(out, "----", 8 + (12 + FFSLEN(mean)) + (12 + name->len) + (16 + val->len));
+	box_write(out, "mean", 12 + FFSLEN(mean));
+	ffarr_append(out, d, 4);
+	ffarr_append(out, mean, FFSLEN(mean));
+	box_write(out, "name", 12 + name->len);
+	ffarr_append(out, d, 4);
+	ffarr_append(out, name->ptr, name->len);
+	box_write(out, "data", 16 + val->len);
+	tag_wbe32(d, MP4_DATA_UTF8);
+	tag_wbe32(d + 4, 0);
+	ffarr_append(out, d, 8);
+	ffarr_append(out, val->ptr, val->len);
+}
+
+/** Get the name of freeform item. */
+static void item_freeform_name(const ffarr *m, size_t off, size_t end, ffstr *name)
+{
+	struct mp4_box b;
+	name->len = 0;
+	if (0 == box_find(m, off, end, "name", &b) && b.size >= b.hlen + 4)
+		ffstr_set(name, m->ptr + b.off + b.hlen + 4, b.size - b.hlen - 4);
+}
+
+/** Build the new ilst items.
+@ilst: the existing items;  NULL: no ilst box */
+static int ilst_edit(tagedit *t, const ffarr *m, const struct mp4_box *ilst, ffarr *out)
+{
+	uint trk_num = 0, trk_total = 0;
+
+	if (ilst != NULL) {
+		size_t off = ilst->off + ilst->hlen, end = ilst->off + ilst->size;
+		while (off + 8 <= end) {
+			char type[4];
+			uint64 sz;
+			int n = box_hdr((byte*)m->ptr + off, end - off, type, &sz);
+			if (n <= 0 || sz > end - off) {
+				warnlog(t, "MP4: bad ilst item at offset %L", off);
+				break;
+			}
+			const char *item = m->ptr + off;
+			size_t item_off = off;
+			off += sz;
+
+			const struct mp4_map *map = mp4_find_type(type);
+			if (!ffmemcmp(type, "trkn", 4)) {
+				struct mp4_box data;
+				if (0 == box_find(m, item_off + n, item_off + sz, "data", &data)
+					&& data.size >= data.hlen + 8 + 6) {
+					const char *v = m->ptr + data.off + data.hlen + 8;
+					trk_num = tag_be16(v + 2);
+					trk_total = tag_be16(v + 4);
+				}
+				continue; // written below
+			}
+
+			if (t->clear)
+				continue;
+			if (map != NULL && tag_replaced(t, map->name, ffsz_len(map->name)))
+				continue;
+			if (!ffmemcmp(type, "----", 4)) {
+				ffstr name;
+				item_freeform_name(m, item_off + n, item_off + sz, &name);
+				if (name.len != 0 && tag_replaced(t, name.ptr, name.len))
+					continue;
+			}
+
+			ffarr_append(out, item, sz);
+		}
+	}
+
+	// "trkn": 0 (2 bytes), number (2 bytes), total (2 bytes), 0 (2 bytes)
+	struct tagfield *tn = tag_field(t, FFSTR("tracknumber")), *tt = tag_field(t, FFSTR("tracktotal"));
+	if (t->clear && tn == NULL)
+		trk_num = 0;
+	if (t->clear && tt == NULL)
+		trk_total = 0;
+	if (tn != NULL) {
+		trk_num = 0;
+		ffs_toint(tn->val.ptr, tn->val.len, &trk_num, FFS_INT32);
+		tn->used = 1;
+	}
+	if (tt != NULL) {
+		trk_total = 0;
+		ffs_toint(tt->val.ptr, tt->val.len, &trk_total, FFS_INT32);
+		tt->used = 1;
+	}
+	if (trk_num != 0) {
+		byte v[8] = {};
+		tag_wbe16(v + 2, trk_num);
+		tag_wbe16(v + 4, trk_total);
+		item_write(out, "trkn", MP4_DATA_BINARY, v, 8);
+	}
+
+	struct tagfield *f;
+	FFARR_WALKT(&t->fields, f, struct tagfield) {
+		if (f->val.len == 0
+			|| ffstr_ieqz(&f->name, "tracknumber")
+			|| ffstr_ieqz(&f->name, "tracktotal"))
+			continue;
+
+		const struct mp4_map *map = mp4_find_name(&f->name);
+		if (map == NULL) {
+			item_write_freeform(out, &f->name, &f->val);
+
+		} else if (!ffmemcmp(map->type, "disk", 4)) {
+			// "disk": 0 (2 bytes), number (2 bytes), total (2 bytes)
+			uint n = 0;
+			byte v[6] = {};
+			ffs_toint(f->val.ptr, f->val.len, &n, FFS_INT32);
+			tag_wbe16(v + 2, n);
+			item_write(out, "disk", MP4_DATA_BINARY, v, 6);
+
+		} else if (!ffmemcmp(map->type, "covr", 4)) {
+			uint type = ffsz_eq(tag_pic_mime(&f->val), "image/png") ? MP4_DATA_PNG : MP4_DATA_JPEG;
+			item_write(out, "covr", type, f->val.ptr, f->val.len);
+
+		} else {
+			item_write(out, map->type, map->data_type, f->val.ptr, f->val.len);
+		}
+		f->used = 1;
+	}
+
+	return (out->len != 0 && out->ptr == NULL) ? -1 : 0;
+}
+
+/** Shift chunk offsets in all tracks. */
+static int mp4_chunks_shift(tagedit *t, ffarr *m, uint64 moov_off, int64 delta)
+{
+	static const char *const p_stbl[] = { "mdia", "minf", "stbl" };
+	struct mp4_box trak, b;
+	char type[4];
+	uint64 sz;
+	int n = box_hdr((byte*)m->ptr, m->len, type, &sz);
+
+	for (size_t off = n;  0 == box_find(m, off, m->len, "trak", &trak);  off = trak.off + trak.size) {
+		b = trak;
+		uint i;
+		for (i = 0;  i != FFCNT(p_stbl);  i++) {
+			if (0 != box_find(m, b.off + b.hlen, b.off + b.size, p_stbl[i], &b))
+				break;
+		}
+		if (i != FFCNT(p_stbl))
+			continue;
+
+		struct mp4_box co;
+		uint co64 = 0;
+		if (0 != box_find(m, b.off + b.hlen, b.off + b.size, "stco", &co)) {
+			if (0 != box_find(m, b.off + b.hlen, b.off + b.size, "co64", &co))
+				continue;
+			co64 = 1;
+		}
+
+		// FullBox, number of entries, offsets
+		byte *d = (byte*)m->ptr + co.off + co.hlen;
+		size_t len = co.size - co.hlen;
+		if (len < 8)
+			continue;
+		uint cnt = tag_be32(d + 4);
+		uint el = (co64) ? 8 : 4;
+		if ((uint64)cnt * el > len - 8) {
+			errlog(t, "MP4: bad chunk offsets table");
+			return -1;
+		}
+		d += 8;
+		for (uint k = 0;  k != cnt;  k++, d += el) {
+			uint64 o = (co64) ? tag_be64(d) : tag_be32(d);
+			if (o < moov_off)
+				continue;
+			o += delta;
+			if (co64) {
+				tag_wbe64(d, o);
+			} else {
+				if (o > 0xffffffff) {
+					errlog(t, "MP4: chunk offset is too large for stco");
+					return -1;
+				}
+				tag_wbe32(d, o);
+			}
+		}
+	}
+	return 0;
+}
+
+int tag_mp4(tagedit *t)
+{
+	int rc = -1;
+	ffarr m = {}, items = {}, box = {}, out = {};
+	uint64 moov_off = 0, moov_size = 0;
+	uint data_after_moov = 0, fragmented = 0;
+
+	// find moov
+	for (uint64 off = 0;  off + 8 <= t->size; ) {
+		byte h[16];
+		char type[4];
+		uint64 size;
+		uint n = ffmin(sizeof(h), t->size - off);
+		if (0 != tag_read(t, off, h, n))
+			return -1;
+		if (0 >= box_hdr(h, n, type, &size)) {
+			errlog(t, "MP4: bad box at offset %xU", off);
+			return -1;
+		}
+		if (size == (uint64)-1 || size > t->size - off)
+			size = t->size - off;
+
+		if (!ffmemcmp(type, "moov", 4)) {
+			moov_off = off;
+			moov_size = size;
+		} else if (moov_size != 0 && !ffmemcmp(type, "mdat", 4)) {
+			data_after_moov = 1;
+		} else if (!ffmemcmp(type, "moof", 4)) {
+			fragmented = 1;
+		}
+		off += size;
+	}
+	if (moov_size == 0) {
+		errlog(t, "MP4: no moov box");
+		return -1;
+	}
+	if (moov_size > 64 * 1024 * 1024) {
+		errlog(t, "MP4: moov box is too large");
+		return -1;
+	}
+	if (0 != tag_readarr(t, moov_off, moov_size, &m))
+		goto end;
+
+	// moov.udta.meta.ilst
+	struct mp4_box path[4] = {};
+	uint depth = 1;
+	char type[4];
+	uint64 sz;
+	path[0].hlen = box_hdr((byte*)m.ptr, m.len, type, &sz);
+	path[0].size = m.len;
+	static const char *const p_ilst[] = { "udta", "meta", "ilst" };
+	for (uint i = 0;  i != FFCNT(p_ilst);  i++) {
+		const struct mp4_box *parent = &path[depth - 1];
+		if (0 != box_find(&m, parent->off + parent->hlen, parent->off + parent->size, p_ilst[i], &path[depth]))
+			break;
+		if (i == 1) {
+			// FullBox
+			if (path[depth].size < path[depth].hlen + 4)
+				break;
+			path[depth].hlen += 4;
+		}
+		depth++;
+	}
+	const struct mp4_box *ilst = (depth == 4) ? &path[3] : NULL;
+
+	if (0 != ilst_edit(t, &m, ilst, &items))
+		goto end;
+
+	// the space for ilst:  ilst box + the following padding box
+	size_t region_off, region = 0;
+	if (ilst != NULL) {
+		region_off = ilst->off;
+		region = ilst->size;
+		const struct mp4_box *meta = &path[2];
+		size_t next = ilst->off + ilst->size;
+		if (next + 8 <= meta->off + meta->size
+			&& 0 < box_hdr((byte*)m.ptr + next, meta->off + meta->size - next, type, &sz)
+			&& !ffmemcmp(type, "free", 4)
+			&& sz <= meta->off + meta->size - next)
+			region += sz;
+	} else {
+		const struct mp4_box *parent = &path[depth - 1];
+		region_off = parent->off + parent->size;
+	}
+
+	uint64 ilst_size = 8 + items.len;
+	if (ilst != NULL && (ilst_size == region || ilst_size + 8 <= region)) {
+		// in place
+		box_write(&box, "ilst", ilst_size);
+		ffarr_append(&box, items.ptr, items.len);
+		if (ilst_size != region) {
+			size_t pad = region - ilst_size;
+			box_write(&box, "free", pad);
+			if (NULL == ffarr_grow(&box, pad - 8, 0))
+				goto end;
+			ffmem_zero(box.ptr + box.len, pad - 8);
+			box.len += pad - 8;
+		}
+		if (box.ptr == NULL)
+			goto end;
+		dbglog(t, "MP4: ilst: %U bytes, padding: %U bytes", ilst_size, region - ilst_size);
+		rc = tag_write(t, moov_off + region_off, box.ptr, box.len);
+		goto end;
+	}
+
+	if (data_after_moov && fragmented) {
+		errlog(t, "MP4: fragmented file with moov before data isn't supported");
+		goto end;
+	}
+
+	// the new boxes:  [udta [meta hdlr]] ilst free
+	if (depth < 3) {
+		// meta: FullBox;  hdlr: FullBox, pre_defined, handler type, reserved (12 bytes), name (empty)
+		static const byte hdlr[] = "\0\0\0\0" "\0\0\0\0" "mdir" "appl" "\0\0\0\0" "\0\0\0\0" "";
+		size_t meta_size = 8 + 4 + (8 + sizeof(hdlr)) + ilst_size + 8 + t->padding;
+		if (depth < 2)
+			box_write(&box, "udta", 8 + meta_size);
+		box_write(&box, "meta", meta_size);
+		ffarr_append(&box, "\0\0\0\0", 4);
+		box_write(&box, "hdlr", 8 + sizeof(hdlr));
+		ffarr_append(&box, hdlr, sizeof(hdlr));
+	}
+	box_write(&box, "ilst", ilst_size);
+	ffarr_append(&box, items.ptr, items.len);
+	box_write(&box, "free", 8 + t->padding);
+	if (NULL == ffarr_grow(&box, t->padding, 0))
+		goto end;
+	ffmem_zero(box.ptr + box.len, t->padding);
+	box.len += t->padding;
+
+	// the new moov
+	int64 delta = (int64)box.len - (int64)region;
+	ffarr_append(&out, m.ptr, region_off);
+	ffarr_append(&out, box.ptr, box.len);
+	ffarr_append(&out, m.ptr + region_off + region, m.len - (region_off + region));
+	if (out.ptr == NULL)
+		goto end;
+	for (uint i = 0;  i != ffmin(depth, 3);  i++) {
+		if (0 != box_setsize(t, out.ptr + path[i].off, path[i].size + delta))
+			goto end;
+	}
+
+	dbglog(t, "MP4: ilst: %U bytes, padding: %u bytes, moov: %U -> %L bytes"
+		, ilst_size, t->padding, moov_size, out.len);
+
+	ffstr s;
+	ffstr_set2(&s, &out);
+	if (!data_after_moov && moov_off + moov_size == t->size) {
+		// moov is at the end of file
+		if (0 != tag_write(t, moov_off, out.ptr, out.len)
+			|| (delta < 0 && 0 != tag_trunc(t, moov_off + out.len)))
+			goto end;
+		rc = 0;
+		goto end;
+	}
+
+	if (data_after_moov
+		&& 0 != mp4_chunks_shift(t, &out, moov_off, delta))
+		goto end;
+	rc = tag_replace(t, moov_off, moov_size, &s);
+
+end:
+	ffarr_free(&m);
+	ffarr_free(&items);
+	ffarr_free(&box);
+	ffarr_free(&out);
+	return rc;
+}
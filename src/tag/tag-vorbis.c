@@ -0,0 +1,599 @@
+/** Tag editor: Vorbis comments in .flac, .ogg (Vorbis, Opus).
+Copyright (c) 2020 Simon Zolin */
+
+#include <tag/tag.h>
+#include <FF/mformat/ogg.h>
+#include <FF/string.h>
+
+
+/** Get Vorbis comment field name for fmedia tag. */
+static void vc_name(const ffstr *name, ffarr *buf)
+{
+	buf->len = 0;
+	if (ffstr_ieqz(name, "picture")) {
+		ffarr_append(buf, "METADATA_BLOCK_PICTURE", FFSLEN("METADATA_BLOCK_PICTURE"));
+		return;
+	}
+	if (NULL == ffarr_realloc(buf, name->len))
+		return;
+	for (size_t i = 0;  i != name->len;  i++) {
+		char c = name->ptr[i];
+		buf->ptr[i] = (c >= 'a' && c <= 'z') ? c - 0x20 : c;
+	}
+	buf->len = name->len;
+}
+
+/** Add FLAC picture block data. */
+static void flac_pic(ffarr *out, const ffstr *data)
+{
+	byte d[4];
+	const char *mime = tag_pic_mime(data);
+	uint n = ffsz_len(mime);
+
+	tag_wbe32(d, 3); // front cover
+	ffarr_append(out, d, 4);
+	tag_wbe32(d, n);
+	ffarr_append(out, d, 4);
+	ffarr_append(out, mime, n);
+	tag_wbe32(d, 0); // description
+	ffarr_append(out, d, 4);
+	for (uint i = 0;  i != 4;  i++) {
+		ffarr_append(out, d, 4); // width, height, depth, colors
+	}
+	tag_wbe32(d, data->len);
+	ffarr_append(out, d, 4);
+	ffarr_append(out, data->ptr, data->len);
+}
+
+/** Build the new Vorbis comment data.
+@vc: the existing data (vendor, comments)
+@pic: store "picture" tag as METADATA_BLOCK_PICTURE field (otherwise it's skipped) */
+static int vc_edit(tagedit *t, const ffstr *vc, ffarr *out, uint pic)
+{
+	int rc = -1;
+	ffstr d = *vc, vendor;
+	byte n4[4];
+	uint n = 0, count = 0;
+	ffarr name = {}, val = {};
+
+	ffstr_setz(&vendor, "fmedia");
+	if (d.len >= 4 && 4 + (uint64)tag_le32(d.ptr) + 4 <= d.len) {
+		ffstr_set(&vendor, d.ptr + 4, tag_le32(d.ptr));
+		ffstr_shift(&d, 4 + vendor.len);
+		n = tag_le32(d.ptr);
+		ffstr_shift(&d, 4);
+	} else if (d.len != 0) {
+		warnlog(t, "Vorbis comment: bad data");
+		d.len = 0;
+	}
+
+	tag_wle32(n4, vendor.len);
+	ffarr_append(out, n4, 4);
+	ffarr_append(out, vendor.ptr, vendor.len);
+	size_t off_count = out->len;
+	ffarr_append(out, n4, 4);
+
+	// copy the existing fields which aren't replaced
+	for (uint i = 0;  i != n;  i++) {
+		if (d.len < 4 || 4 + (uint64)tag_le32(d.ptr) > d.len) {
+			warnlog(t, "Vorbis comment: bad field #%u", i);
+			break;
+		}
+		ffstr fld, fname, fval;
+		ffstr_set(&fld, d.ptr + 4, tag_le32(d.ptr));
+		ffstr_shift(&d, 4 + fld.len);
+
+		ffs_split2by(fld.ptr, fld.len, '=', &fname, &fval);
+		if (ffstr_ieqz(&fname, "METADATA_BLOCK_PICTURE"))
+			ffstr_setz(&fname, "picture");
+		if (tag_replaced(t, fname.ptr, fname.len))
+			continue;
+
+		tag_wle32(n4, fld.len);
+		ffarr_append(out, n4, 4);
+		ffarr_append(out, fld.ptr, fld.len);
+		count++;
+	}
+
+	struct tagfield *f;
+	FFARR_WALKT(&t->fields, f, struct tagfield) {
+		if (f->val.len == 0)
+			continue;
+
+		ffstr v = f->val;
+		if (ffstr_ieqz(&f->name, "picture")) {
+			if (!pic)
+				continue;
+			ffarr pd = {};
+			flac_pic(&pd, &f->val);
+			val.len = 0;
+			if (NULL != ffarr_realloc(&val, ffbase64_encodesize(pd.len)))
+				val.len = ffbase64_encode(val.ptr, val.cap, pd.ptr, pd.len);
+			ffarr_free(&pd);
+			ffstr_set2(&v, &val);
+		}
+
+		vc_name(&f->name, &name);
+		tag_wle32(n4, name.len + 1 + v.len);
+		ffarr_append(out, n4, 4);
+		ffarr_append(out, name.ptr, name.len);
+		ffarr_append(out, "=", 1);
+		ffarr_append(out, v.ptr, v.len);
+		count++;
+		f->used = 1;
+	}
+
+	if (out->ptr == NULL)
+		goto end;
+	tag_wle32(out->ptr + off_count, count);
+	rc = 0;
+
+end:
+	ffarr_free(&name);
+	ffarr_free(&val);
+	return rc;
+}
+
+
+enum {
+	FLAC_STREAMINFO = 0,
+	FLAC_PADDING = 1,
+	FLAC_VORBISCOMMENT = 4,
+	FLAC_PICTURE = 6,
+	FLAC_LAST = 0x80,
+	FLAC_MAXBLOCK = 0xffffff,
+};
+
+static void flac_blockhdr(ffarr *out, uint type, uint len)
+{
+	byte h[4];
+	h[0] = type;
+	h[1] = (byte)(len >> 16),  h[2] = (byte)(len >> 8),  h[3] = (byte)len;
+	ffarr_append(out, h, 4);
+}
+
+int tag_flac(tagedit *t)
+{
+	int rc = -1;
+	byte h[4];
+	ffarr meta = {}, out = {}, vc = {};
+	ffstr vc_old = {};
+
+	if (0 != tag_read(t, 0, h, 4))
+		return -1;
+	if (ffmemcmp(h, "fLaC", 4)) {
+		errlog(t, "FLAC: bad signature");
+		return -1;
+	}
+
+	// find the end of metadata blocks
+	uint64 off = 4;
+	for (;;) {
+		if (off + 4 > t->size || 0 != tag_read(t, off, h, 4)) {
+			errlog(t, "FLAC: incomplete metadata");
+			return -1;
+		}
+		off += 4 + (((uint)h[1] << 16) | tag_be16(h + 2));
+		if (h[0] & FLAC_LAST)
+			break;
+	}
+	uint64 region = off - 4;
+	if (off > t->size || region > 64 * 1024 * 1024) {
+		errlog(t, "FLAC: bad metadata size");
+		return -1;
+	}
+	if (0 != tag_readarr(t, 4, region, &meta))
+		goto end;
+
+	// copy the blocks except Vorbis comment, padding and replaced pictures;  the new Vorbis comment goes after STREAMINFO
+	ffstr d;
+	ffstr_set2(&d, &meta);
+	uint i = 0;
+	size_t last_hdr = 0;
+	uint replace_pic = tag_replaced(t, FFSTR("picture"));
+	while (d.len >= 4) {
+		uint type = d.ptr[0] & 0x7f;
+		uint len = ((uint)(byte)d.ptr[1] << 16) | tag_be16(d.ptr + 2);
+		ffstr data;
+		ffstr_set(&data, d.ptr + 4, len);
+		ffstr_shift(&d, 4 + len);
+
+		if (type == FLAC_VORBISCOMMENT) {
+			vc_old = data;
+		} else if (type == FLAC_PADDING
+			|| (type == FLAC_PICTURE && replace_pic)) {
+		} else {
+			last_hdr = out.len;
+			flac_blockhdr(&out, type, len);
+			ffarr_append(&out, data.ptr, data.len);
+		}
+
+		if (i++ == 0) {
+			if (type != FLAC_STREAMINFO) {
+				errlog(t, "FLAC: no STREAMINFO block");
+				goto end;
+			}
+			last_hdr = out.len;
+			flac_blockhdr(&out, FLAC_VORBISCOMMENT, 0); // size is set later
+		}
+	}
+	size_t vc_hdr = sizeof(h) + (((uint)(byte)meta.ptr[1] << 16) | tag_be16(meta.ptr + 2));
+
+	if (0 != vc_edit(t, &vc_old, &vc, 0))
+		goto end;
+	if (vc.len > FLAC_MAXBLOCK) {
+		errlog(t, "FLAC: Vorbis comment is too large");
+		goto end;
+	}
+	if (NULL == ffarr_grow(&out, vc.len, 0))
+		goto end;
+	ffmemmove(out.ptr + vc_hdr + 4 + vc.len, out.ptr + vc_hdr + 4, out.len - (vc_hdr + 4));
+	ffmemcpy(out.ptr + vc_hdr + 4, vc.ptr, vc.len);
+	out.len += vc.len;
+	out.ptr[vc_hdr + 1] = (byte)(vc.len >> 16),  out.ptr[vc_hdr + 2] = (byte)(vc.len >> 8),  out.ptr[vc_hdr + 3] = (byte)vc.len;
+	if (last_hdr > vc_hdr)
+		last_hdr += vc.len;
+
+	struct tagfield *f = tag_field(t, FFSTR("picture"));
+	if (f != NULL && f->val.len != 0) {
+		ffarr pic = {};
+		flac_pic(&pic, &f->val);
+		if (pic.len > FLAC_MAXBLOCK) {
+			errlog(t, "FLAC: picture is too large");
+			ffarr_free(&pic);
+			goto end;
+		}
+		last_hdr = out.len;
+		flac_blockhdr(&out, FLAC_PICTURE, pic.len);
+		ffarr_append(&out, pic.ptr, pic.len);
+		ffarr_free(&pic);
+		f->used = 1;
+	}
+
+	// padding fills the rest of the old metadata region, or is added with the default size
+	uint64 pad;
+	if (out.len == region) {
+		pad = (uint64)-1;
+	} else if (out.len + 4 <= region) {
+		pad = region - out.len - 4;
+	} else {
+		pad = ffmin(t->padding, FLAC_MAXBLOCK);
+	}
+	if (pad != (uint64)-1) {
+		last_hdr = out.len;
+		flac_blockhdr(&out, FLAC_PADDING, pad);
+		if (NULL == ffarr_grow(&out, pad, 0))
+			goto end;
+		ffmem_zero(out.ptr + out.len, pad);
+		out.len += pad;
+	}
+	if (out.ptr == NULL)
+		goto end;
+	out.ptr[last_hdr] |= FLAC_LAST;
+
+	dbglog(t, "FLAC: Vorbis comment: %L bytes, padding: %D bytes, metadata: %U -> %L bytes"
+		, vc.len, (int64)pad, region, out.len);
+	ffstr s;
+	ffstr_set2(&s, &out);
+	rc = tag_replace(t, 4, region, &s);
+
+end:
+	ffarr_free(&meta);
+	ffarr_free(&out);
+	ffarr_free(&vc);
+	return rc;
+}
+
+
+enum {
+	OGG_HDR = sizeof(ogg_hdr),
+	OGG_MAXSEGS = 255,
+};
+
+/** Set sequence number and CRC of the page. */
+static void ogg_page_set(byte *page, size_t len, uint seq)
+{
+	tag_wle32(page + 18, seq);
+	tag_wle32(page + 22, ogg_checksum((void*)page, len));
+}
+
+struct ogg_hdrpkts {
+	uint serial;
+	uint seq; // sequence number of the first page
+	uint64 off, end; // offsets of the pages with comment packet (and setup packet for Vorbis)
+	uint npages;
+	ffarr pkt[2]; // comment and setup packets
+	uint npkt;
+	uint opus :1;
+};
+
+/** Read the page header and lacing values at 'off'. */
+static int ogg_page_hdr(tagedit *t, uint64 off, byte *hdr)
+{
+	if (off + OGG_HDR > t->size
+		|| 0 != tag_read(t, off, hdr, OGG_HDR)
+		|| ffmemcmp(hdr, "OggS", 4)
+		|| off + OGG_HDR + hdr[26] > t->size
+		|| 0 != tag_read(t, off + OGG_HDR, hdr + OGG_HDR, hdr[26])) {
+		errlog(t, "OGG: bad page at offset %xU", off);
+		return -1;
+	}
+	return 0;
+}
+
+/** Read the header packets following the first page. */
+static int ogg_hdr_read(tagedit *t, struct ogg_hdrpkts *h)
+{
+	byte hdr[OGG_HDR + 255];
+	ffarr body = {}, first = {};
+	int rc = -1;
+
+	// the first page contains the identification header
+	if (0 != ogg_page_hdr(t, 0, hdr))
+		goto end;
+	uint len = 0;
+	for (uint i = 0;  i != hdr[26];  i++) {
+		len += hdr[OGG_HDR + i];
+	}
+	if (0 != tag_readarr(t, OGG_HDR + hdr[26], ffmin(len, 8), &first))
+		goto end;
+	ffstr sig;
+	ffstr_set2(&sig, &first);
+	if (ffstr_match(&sig, "OpusHead", 8))
+		h->opus = 1;
+	else if (!ffstr_match(&sig, "\x01vorbis", 7)) {
+		errlog(t, "OGG: unsupported codec");
+		goto end;
+	}
+	h->serial = tag_le32(hdr + 14);
+	h->seq = tag_le32(hdr + 18) + 1;
+	h->off = OGG_HDR + hdr[26] + len;
+
+	uint need = (h->opus) ? 1 : 2;
+	uint64 off = h->off;
+	while (h->npkt != need) {
+		if (0 != ogg_page_hdr(t, off, hdr))
+			goto end;
+		if (tag_le32(hdr + 14) != h->serial) {
+			errlog(t, "OGG: multiplexed streams aren't supported");
+			goto end;
+		}
+		len = 0;
+		for (uint i = 0;  i != hdr[26];  i++) {
+			len += hdr[OGG_HDR + i];
+		}
+		if (0 != tag_readarr(t, off + OGG_HDR + hdr[26], len, &body))
+			goto end;
+		off += OGG_HDR + hdr[26] + len;
+		h->npages++;
+
+		const char *p = body.ptr;
+		for (uint i = 0;  i != hdr[26];  i++) {
+			uint n = hdr[OGG_HDR + i];
+			if (h->npkt == need) {
+				errlog(t, "OGG: audio data on the header page");
+				goto end;
+			}
+			ffarr_append(&h->pkt[h->npkt], p, n);
+			p += n;
+			if (n < 255)
+				h->npkt++;
+		}
+	}
+	h->end = off;
+	rc = 0;
+
+end:
+	ffarr_free(&body);
+	ffarr_free(&first);
+	return rc;
+}
+
+/** Get the number of pages and bytes for the header packets. */
+static void ogg_hdr_size(const size_t *pkt, uint n, uint *pages, uint64 *bytes)
+{
+	uint64 segs = 0, data = 0;
+	for (uint i = 0;  i != n;  i++) {
+		segs += pkt[i] / 255 + 1;
+		data += pkt[i];
+	}
+	*pages = (segs + OGG_MAXSEGS - 1) / OGG_MAXSEGS;
+	*bytes = (uint64)*pages * OGG_HDR + segs + data;
+}
+
+/** Write pages for the header packets. */
+static int ogg_hdr_write(const struct ogg_hdrpkts *h, const ffstr *pkt, uint n, ffarr *out)
+{
+	byte lacing[OGG_MAXSEGS];
+	uint nseg = 0, continued = 0, seq = h->seq;
+	uint64 gpos = 0;
+	size_t page_off = 0;
+
+	for (uint i = 0;  i != n;  i++) {
+		size_t len = pkt[i].len;
+		const char *d = pkt[i].ptr;
+		for (;;) {
+			if (nseg == 0) {
+				// start a new page;  the header is filled when the page is complete
+				page_off = out->len;
+				if (NULL == ffarr_grow(out, OGG_HDR, 0))
+					return -1;
+				ffmem_zero(out->ptr + out->len, OGG_HDR);
+				out->len += OGG_HDR;
+			}
+
+			uint seg = ffmin(len, 255);
+			lacing[nseg++] = seg;
+			ffarr_append(out, d, seg);
+			d += seg;
+			len -= seg;
+			uint pkt_end = (seg < 255);
+
+			if (nseg == OGG_MAXSEGS || (pkt_end && i == n - 1)) {
+				// insert lacing values after the page header
+				size_t body = out->len - (page_off + OGG_HDR);
+				if (NULL == ffarr_grow(out, nseg, 0))
+					return -1;
+				char *pg = out->ptr + page_off;
+				ffmemmove(pg + OGG_HDR + nseg, pg + OGG_HDR, body);
+				ffmemcpy(pg + OGG_HDR, lacing, nseg);
+				out->len += nseg;
+
+				ffmemcpy(pg, "OggS", 4);
+				pg[4] = 0;
+				pg[5] = (continued) ? OGG_FCONTINUED : 0;
+				uint64 g = (pkt_end) ? gpos : (uint64)-1;
+				tag_wle32(pg + 6, (uint)g);
+				tag_wle32(pg + 10, (uint)(g >> 32));
+				tag_wle32(pg + 14, h->serial);
+				pg[26] = nseg;
+				ogg_page_set((byte*)pg, OGG_HDR + nseg + body, seq++);
+				continued = !pkt_end;
+				nseg = 0;
+			}
+
+			if (pkt_end)
+				break;
+		}
+	}
+	return 0;
+}
+
+/** Rewrite the file:  header pages are replaced;  sequence numbers of the next pages are shifted. */
+static int ogg_rewrite(tagedit *t, const struct ogg_hdrpkts *h, const ffstr *pages, int delta)
+{
+	int rc = -1;
+	ffarr buf = {};
+	if (0 != tag_tmp_open(t)
+		|| 0 != tag_tmp_copy(t, 0, h->off)
+		|| 0 != tag_tmp_write(t, pages->ptr, pages->len))
+		return -1;
+
+	if (NULL == ffarr_alloc(&buf, 1 * 1024 * 1024))
+		goto end;
+	uint64 off = h->end;
+	while (off != t->size) {
+		size_t n = ffmin(buf.cap - buf.len, t->size - off);
+		if (0 != tag_read(t, off, buf.ptr + buf.len, n))
+			goto end;
+		off += n;
+		buf.len += n;
+
+		// process complete pages
+		size_t i = 0;
+		while (i + OGG_HDR <= buf.len) {
+			byte *pg = (byte*)buf.ptr + i;
+			if (ffmemcmp(pg, "OggS", 4)) {
+				errlog(t, "OGG: bad page at offset %xU", off - buf.len + i);
+				goto end;
+			}
+			if (i + OGG_HDR + pg[26] > buf.len)
+				break;
+			size_t len = OGG_HDR + pg[26];
+			for (uint k = 0;  k != pg[26];  k++) {
+				len += pg[OGG_HDR + k];
+			}
+			if (i + len > buf.len)
+				break;
+			if (tag_le32(pg + 14) == h->serial)
+				ogg_page_set(pg, len, tag_le32(pg + 18) + delta);
+			i += len;
+		}
+
+		if (off == t->size && i != buf.len) {
+			warnlog(t, "OGG: incomplete page at the end of file");
+			i = buf.len;
+		}
+		if (0 != tag_tmp_write(t, buf.ptr, i))
+			goto end;
+		_ffarr_rmleft(&buf, i, sizeof(char));
+	}
+
+	rc = tag_tmp_commit(t);
+
+end:
+	ffarr_free(&buf);
+	return rc;
+}
+
+int tag_ogg(tagedit *t)
+{
+	int rc = -1;
+	struct ogg_hdrpkts h = {};
+	ffarr pkt = {}, vc = {}, pages = {};
+
+	if (0 != ogg_hdr_read(t, &h))
+		goto end;
+	uint64 region = h.end - h.off;
+	dbglog(t, "OGG: header pages: %u, %U bytes", h.npages, region);
+
+	// the comment packet:  signature, Vorbis comment, [framing bit (Vorbis)], [padding]
+	const char *sig = (h.opus) ? "OpusTags" : "\x03vorbis";
+	uint siglen = (h.opus) ? 8 : 7;
+	ffstr old;
+	ffstr_set2(&old, &h.pkt[0]);
+	if (!ffstr_match(&old, sig, siglen)) {
+		errlog(t, "OGG: bad comment packet");
+		goto end;
+	}
+	ffstr_shift(&old, siglen);
+	if (0 != vc_edit(t, &old, &vc, 1))
+		goto end;
+
+	ffarr_append(&pkt, sig, siglen);
+	ffarr_append(&pkt, vc.ptr, vc.len);
+	if (!h.opus)
+		ffarr_append(&pkt, "\x01", 1);
+	if (pkt.ptr == NULL)
+		goto end;
+
+	// find padding size with which the new header pages have the same size as the old ones
+	size_t sizes[2] = { pkt.len, h.pkt[1].len };
+	uint npages;
+	uint64 bytes, pad = (uint64)-1;
+	for (uint64 p = 0;  p <= region;  p++) {
+		sizes[0] = pkt.len + p;
+		ogg_hdr_size(sizes, h.npkt, &npages, &bytes);
+		if (npages == h.npages && bytes == region) {
+			pad = p;
+			break;
+		}
+		if (bytes > region)
+			break;
+	}
+	int delta = 0;
+	if (pad == (uint64)-1) {
+		pad = t->padding;
+		sizes[0] = pkt.len + pad;
+		ogg_hdr_size(sizes, h.npkt, &npages, &bytes);
+		delta = (int)npages - (int)h.npages;
+	}
+	if (NULL == ffarr_grow(&pkt, pad, 0))
+		goto end;
+	ffmem_zero(pkt.ptr + pkt.len, pad);
+	pkt.len += pad;
+
+	ffstr p[2];
+	ffstr_set2(&p[0], &pkt);
+	ffstr_set2(&p[1], &h.pkt[1]);
+	if (0 != ogg_hdr_write(&h, p, h.npkt, &pages))
+		goto end;
+
+	dbglog(t, "OGG: comment packet: %L bytes, padding: %U bytes, header pages: %u -> %u"
+		, pkt.len, pad, h.npages, npages);
+
+	ffstr s;
+	ffstr_set2(&s, &pages);
+	if (delta == 0)
+		rc = tag_replace(t, h.off, region, &s);
+	else
+		rc = ogg_rewrite(t, &h, &s, delta);
+
+end:
+	ffarr_free(&h.pkt[0]);
+	ffarr_free(&h.pkt[1]);
+	ffarr_free(&pkt);
+	ffarr_free(&vc);
+	ffarr_free(&pages);
+	return rc;
+}
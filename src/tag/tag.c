@@ -0,0 +1,382 @@
+/** Edit tags of media files in place.
+Copyright (c) 2020 Simon Zolin */
+
+/*
+The new tags are written over the existing ones if they fit into the space which is
+ occupied by the old tags and padding (ID3v2, FLAC, Ogg, MP4).
+Otherwise the file is rewritten once with the new tags and more padding,
+ so the next edit can be done in place.
+Tags at the end of file (ID3v1, APEv2) are rewritten in place.
+*/
+
+#include <tag/tag.h>
+#include <FF/path.h>
+#include <FFOS/error.h>
+
+
+const fmed_core *tag_core;
+
+//FMEDIA MODULE
+static const void* tag_iface(const char *name);
+static int tag_sig(uint signo);
+static void tag_destroy(void);
+static int tag_mod_conf(const char *name, ffpars_ctx *ctx);
+static const fmed_mod fmed_tag_mod = {
+	.ver = FMED_VER_FULL, .ver_core = FMED_VER_CORE,
+	&tag_iface, &tag_sig, &tag_destroy, &tag_mod_conf
+};
+
+//EDIT
+static void* tagedit_open(fmed_filt *d);
+static void tagedit_close(void *ctx);
+static int tagedit_process(void *ctx, fmed_filt *d);
+static const fmed_filter tag_edit = {
+	&tagedit_open, &tagedit_process, &tagedit_close
+};
+
+static struct tagedit_conf_t {
+	uint padding;
+} tagedit_conf;
+
+static const ffpars_arg tagedit_conf_args[] = {
+	{ "padding",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct tagedit_conf_t, padding) },
+};
+
+
+FF_EXP const fmed_mod* fmed_getmod(const fmed_core *_core)
+{
+	tag_core = _core;
+	return &fmed_tag_mod;
+}
+
+static const void* tag_iface(const char *name)
+{
+	if (ffsz_eq(name, "edit"))
+		return &tag_edit;
+	return NULL;
+}
+
+static int tag_sig(uint signo)
+{
+	switch (signo) {
+	case FMED_SIG_INIT:
+		ffmem_init();
+		return 0;
+	}
+	return 0;
+}
+
+static void tag_destroy(void)
+{
+}
+
+static int tag_mod_conf(const char *name, ffpars_ctx *ctx)
+{
+	if (ffsz_eq(name, "edit")) {
+		tagedit_conf.padding = 4 * 1024;
+		ffpars_setargs(ctx, &tagedit_conf, tagedit_conf_args, FFCNT(tagedit_conf_args));
+		return 0;
+	}
+	return -1;
+}
+
+
+struct tagfield* tag_field(tagedit *t, const char *name, size_t len)
+{
+	struct tagfield *f;
+	FFARR_WALKT(&t->fields, f, struct tagfield) {
+		if (ffstr_ieq(&f->name, name, len))
+			return f;
+	}
+	return NULL;
+}
+
+int tag_read(tagedit *t, uint64 off, void *buf, size_t n)
+{
+	if (0 > fffile_seek(t->fd, off, SEEK_SET)
+		|| n != (size_t)fffile_read(t->fd, buf, n)) {
+		syserrlog(t, "%s: %s", fffile_read_S, t->fn);
+		return -1;
+	}
+	return 0;
+}
+
+int tag_readarr(tagedit *t, uint64 off, size_t n, ffarr *buf)
+{
+	if (NULL == ffarr_realloc(buf, n))
+		return -1;
+	buf->len = 0;
+	if (0 != tag_read(t, off, buf->ptr, n))
+		return -1;
+	buf->len = n;
+	return 0;
+}
+
+int tag_write(tagedit *t, uint64 off, const void *data, size_t n)
+{
+	if (0 > fffile_seek(t->fd, off, SEEK_SET)
+		|| n != (size_t)fffile_write(t->fd, data, n)) {
+		syserrlog(t, "%s: %s", fffile_write_S, t->fn);
+		return -1;
+	}
+	dbglog(t, "written %L bytes at offset %xU", n, off);
+	return 0;
+}
+
+int tag_trunc(tagedit *t, uint64 size)
+{
+	if (0 != fffile_trunc(t->fd, size)) {
+		syserrlog(t, "file truncate: %s", t->fn);
+		return -1;
+	}
+	t->size = size;
+	return 0;
+}
+
+int tag_tmp_open(tagedit *t)
+{
+	if (NULL == (t->tmp_fn = ffsz_alfmt("%s.fmedia-tmp", t->fn)))
+		return -1;
+	if (FF_BADFD == (t->tmp_fd = fffile_open(t->tmp_fn, FFO_CREATE | FFO_TRUNC | FFO_WRONLY))) {
+		syserrlog(t, "%s: %s", fffile_open_S, t->tmp_fn);
+		return -1;
+	}
+	t->tmp_size = 0;
+	return 0;
+}
+
+int tag_tmp_write(tagedit *t, const void *data, size_t n)
+{
+	if (n != (size_t)fffile_write(t->tmp_fd, data, n)) {
+		syserrlog(t, "%s: %s", fffile_write_S, t->tmp_fn);
+		return -1;
+	}
+	t->tmp_size += n;
+	return 0;
+}
+
+int tag_tmp_copy(tagedit *t, uint64 off, uint64 n)
+{
+	int rc = -1;
+	ffarr buf = {};
+	if (NULL == ffarr_alloc(&buf, ffmin(n, 1 * 1024 * 1024) + 1))
+		return -1;
+
+	while (n != 0) {
+		size_t k = ffmin(n, buf.cap - 1);
+		if (0 != tag_read(t, off, buf.ptr, k)
+			|| 0 != tag_tmp_write(t, buf.ptr, k))
+			goto end;
+		off += k;
+		n -= k;
+	}
+	rc = 0;
+
+end:
+	ffarr_free(&buf);
+	return rc;
+}
+
+int tag_tmp_commit(tagedit *t)
+{
+	fffile_close(t->tmp_fd);
+	t->tmp_fd = FF_BADFD;
+	fffile_close(t->fd);
+	t->fd = FF_BADFD;
+	if (0 != fffile_rename(t->tmp_fn, t->fn)) {
+		syserrlog(t, "file rename: %s -> %s", t->tmp_fn, t->fn);
+		return -1;
+	}
+	ffmem_free0(t->tmp_fn);
+	fmed_infolog(tag_core, t->trk, "tag", "rewritten file: %U bytes", t->tmp_size);
+	t->size = t->tmp_size;
+
+	if (FF_BADFD == (t->fd = fffile_open(t->fn, FFO_RDWR | FFO_NOATIME))) {
+		syserrlog(t, "%s: %s", fffile_open_S, t->fn);
+		return -1;
+	}
+	return 0;
+}
+
+int tag_replace(tagedit *t, uint64 off, uint64 oldlen, const ffstr *data)
+{
+	if (data->len == oldlen)
+		return tag_write(t, off, data->ptr, data->len);
+
+	dbglog(t, "rewriting file: %U bytes at offset %xU are replaced with %L bytes"
+		, oldlen, off, data->len);
+	if (0 != tag_tmp_open(t)
+		|| 0 != tag_tmp_copy(t, 0, off)
+		|| 0 != tag_tmp_write(t, data->ptr, data->len)
+		|| 0 != tag_tmp_copy(t, off + oldlen, t->size - (off + oldlen))
+		|| 0 != tag_tmp_commit(t))
+		return -1;
+	return 0;
+}
+
+const char* tag_pic_mime(const ffstr *data)
+{
+	if (ffstr_match(data, "\x89PNG", 4))
+		return "image/png";
+	return "image/jpeg";
+}
+
+
+/** Parse --meta value: "[clear;]NAME=STR;..." */
+static int tagedit_fields(tagedit *t, const char *meta)
+{
+	ffstr s, m, name, val;
+	struct tagfield *f;
+
+	ffstr_setz(&s, meta);
+	while (s.len != 0) {
+		ffstr_shift(&s, ffstr_nextval(s.ptr, s.len, &m, ';'));
+
+		if (ffstr_eqcz(&m, "clear")) {
+			t->clear = 1;
+			continue;
+		}
+
+		if (NULL == ffs_split2by(m.ptr, m.len, '=', &name, &val)
+			|| name.len == 0) {
+			errlog(t, "--meta: invalid data");
+			return -1;
+		}
+
+		if (NULL == (f = tag_field(t, name.ptr, name.len))) {
+			if (NULL == (f = ffarr_pushgrowT(&t->fields, 4, struct tagfield)))
+				return -1;
+			ffmem_tzero(f);
+		}
+		ffstr_free(&f->name);
+		ffstr_free(&f->val);
+		if (NULL == ffstr_alcopystr(&f->name, &name))
+			return -1;
+
+		if (ffstr_matchz(&val, "@file:")) {
+			ffstr_shift(&val, FFSLEN("@file:"));
+			ffarr buf = {};
+			char *fn;
+			if (NULL == (fn = ffsz_alcopy(val.ptr, val.len)))
+				return -1;
+			int r = fffile_readall(&buf, fn, -1);
+			if (r != 0)
+				syserrlog(t, "%s: %s", fffile_read_S, fn);
+			ffmem_free(fn);
+			if (r != 0)
+				return -1;
+			ffstr_acqstr3(&f->val, &buf);
+			continue;
+		}
+
+		if (val.len != 0
+			&& NULL == ffstr_alcopystr(&f->val, &val))
+			return -1;
+	}
+	return 0;
+}
+
+static void* tagedit_open(fmed_filt *d)
+{
+	tagedit *t;
+	const char *meta;
+
+	if (NULL == (t = ffmem_new(tagedit)))
+		return NULL;
+	t->trk = d->trk;
+	t->fd = FF_BADFD;
+	t->tmp_fd = FF_BADFD;
+	t->padding = tagedit_conf.padding;
+
+	if (FMED_PNULL == (t->fn = d->track->getvalstr(d->trk, "input")))
+		goto err;
+
+	if (FMED_PNULL == (meta = d->track->getvalstr(d->trk, "meta"))) {
+		errlog(t, "--meta isn't set");
+		goto err;
+	}
+	if (0 != tagedit_fields(t, meta))
+		goto err;
+
+	return t;
+
+err:
+	tagedit_close(t);
+	return NULL;
+}
+
+static void tagedit_close(void *ctx)
+{
+	tagedit *t = ctx;
+	struct tagfield *f;
+	FFARR_WALKT(&t->fields, f, struct tagfield) {
+		ffstr_free(&f->name);
+		ffstr_free(&f->val);
+	}
+	ffarr_free(&t->fields);
+
+	if (t->tmp_fd != FF_BADFD) {
+		fffile_close(t->tmp_fd);
+		fffile_rm(t->tmp_fn);
+	}
+	ffmem_safefree(t->tmp_fn);
+	FF_SAFECLOSE(t->fd, FF_BADFD, fffile_close);
+	ffmem_free(t);
+}
+
+struct tag_fmt {
+	const char *ext;
+	int (*edit)(tagedit *t);
+};
+
+static const struct tag_fmt tag_fmts[] = {
+	{ "flac", &tag_flac },
+	{ "m4a", &tag_mp4 },
+	{ "m4b", &tag_mp4 },
+	{ "mp3", &tag_mpeg },
+	{ "mp4", &tag_mp4 },
+	{ "oga", &tag_ogg },
+	{ "ogg", &tag_ogg },
+	{ "opus", &tag_ogg },
+};
+
+static int tagedit_process(void *ctx, fmed_filt *d)
+{
+	tagedit *t = ctx;
+	ffstr name, ext;
+	const struct tag_fmt *fmt = NULL;
+
+	ffpath_split2(t->fn, ffsz_len(t->fn), NULL, &name);
+	ffpath_splitname(name.ptr, name.len, NULL, &ext);
+	for (uint i = 0;  i != FFCNT(tag_fmts);  i++) {
+		if (ffstr_ieqz(&ext, tag_fmts[i].ext)) {
+			fmt = &tag_fmts[i];
+			break;
+		}
+	}
+	if (fmt == NULL) {
+		errlog(t, "%s: editing tags isn't supported for this file type", t->fn);
+		return FMED_RERR;
+	}
+
+	if (FF_BADFD == (t->fd = fffile_open(t->fn, FFO_RDWR | FFO_NOATIME))) {
+		syserrlog(t, "%s: %s", fffile_open_S, t->fn);
+		return FMED_RERR;
+	}
+	t->size = fffile_size(t->fd);
+
+	if (0 != fmt->edit(t)) {
+		errlog(t, "%s: tags weren't saved", t->fn);
+		return FMED_RERR;
+	}
+
+	struct tagfield *f;
+	FFARR_WALKT(&t->fields, f, struct tagfield) {
+		if (!f->used && f->val.len != 0)
+			warnlog(t, "%s: tag isn't supported by the file format: %S", t->fn, &f->name);
+	}
+
+	fmed_infolog(tag_core, t->trk, "tag", "%s: saved tags", t->fn);
+	d->outlen = 0;
+	return FMED_RFIN;
+}
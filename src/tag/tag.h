@@ -0,0 +1,130 @@
+/** Tag editor: common definitions.
+Copyright (c) 2020 Simon Zolin */
+
+#pragma once
+#include <fmedia.h>
+#include <FF/array.h>
+
+
+#undef dbglog
+#undef errlog
+#undef warnlog
+#undef syserrlog
+#define dbglog(t, ...)  fmed_dbglog(tag_core, (t)->trk, "tag", __VA_ARGS__)
+#define errlog(t, ...)  fmed_errlog(tag_core, (t)->trk, "tag", __VA_ARGS__)
+#define warnlog(t, ...)  fmed_warnlog(tag_core, (t)->trk, "tag", __VA_ARGS__)
+#define syserrlog(t, ...)  fmed_syserrlog(tag_core, (t)->trk, "tag", __VA_ARGS__)
+
+extern const fmed_core *tag_core;
+
+/** Tag from --meta. */
+struct tagfield {
+	ffstr name; // fmedia tag name, e.g. "artist"
+	ffstr val; // empty: remove the tag
+	uint used :1; // the value is written
+};
+
+typedef struct tagedit {
+	void *trk;
+	const char *fn;
+	fffd fd;
+	uint64 size; // file size
+	ffarr fields; // struct tagfield[]
+	uint clear :1; // remove all existing tags
+	uint padding; // padding size (bytes) reserved when the file is rewritten
+
+	fffd tmp_fd; // the new file being written
+	char *tmp_fn;
+	uint64 tmp_size;
+} tagedit;
+
+/** Find the --meta value for the tag.
+Return NULL if the tag isn't set by user. */
+extern struct tagfield* tag_field(tagedit *t, const char *name, size_t len);
+
+/** Return 1 if the existing tag must be removed: it's either replaced or all tags are cleared. */
+static inline int tag_replaced(tagedit *t, const char *name, size_t len)
+{
+	return t->clear || NULL != tag_field(t, name, len);
+}
+
+/** Read data from file.
+Return 0 on success. */
+extern int tag_read(tagedit *t, uint64 off, void *buf, size_t n);
+
+/** Read data from file into array. */
+extern int tag_readarr(tagedit *t, uint64 off, size_t n, ffarr *buf);
+
+/** Overwrite data in file. */
+extern int tag_write(tagedit *t, uint64 off, const void *data, size_t n);
+
+extern int tag_trunc(tagedit *t, uint64 size);
+
+/** Rewriting the file:
+ data is written into a new file which then replaces the original one. */
+extern int tag_tmp_open(tagedit *t);
+extern int tag_tmp_write(tagedit *t, const void *data, size_t n);
+/** Copy data from the original file. */
+extern int tag_tmp_copy(tagedit *t, uint64 off, uint64 n);
+extern int tag_tmp_commit(tagedit *t);
+
+/** Replace 'oldlen' bytes at 'off' with 'data' and copy the rest of the file:
+ overwrite in place if the size is the same, otherwise rewrite the file. */
+extern int tag_replace(tagedit *t, uint64 off, uint64 oldlen, const ffstr *data);
+
+/** Get picture MIME type by its data. */
+extern const char* tag_pic_mime(const ffstr *data);
+
+static inline uint tag_be16(const void *p)
+{
+	const byte *d = p;
+	return ((uint)d[0] << 8) | d[1];
+}
+
+static inline uint tag_be32(const void *p)
+{
+	const byte *d = p;
+	return ((uint)d[0] << 24) | ((uint)d[1] << 16) | ((uint)d[2] << 8) | d[3];
+}
+
+static inline uint64 tag_be64(const void *p)
+{
+	return ((uint64)tag_be32(p) << 32) | tag_be32((byte*)p + 4);
+}
+
+static inline uint tag_le32(const void *p)
+{
+	const byte *d = p;
+	return ((uint)d[3] << 24) | ((uint)d[2] << 16) | ((uint)d[1] << 8) | d[0];
+}
+
+static inline void tag_wbe16(void *p, uint n)
+{
+	byte *d = p;
+	d[0] = (byte)(n >> 8),  d[1] = (byte)n;
+}
+
+static inline void tag_wbe32(void *p, uint n)
+{
+	byte *d = p;
+	d[0] = (byte)(n >> 24),  d[1] = (byte)(n >> 16),  d[2] = (byte)(n >> 8),  d[3] = (byte)n;
+}
+
+static inline void tag_wbe64(void *p, uint64 n)
+{
+	tag_wbe32(p, (uint)(n >> 32));
+	tag_wbe32((byte*)p + 4, (uint)n);
+}
+
+static inline void tag_wle32(void *p, uint n)
+{
+	byte *d = p;
+	d[0] = (byte)n,  d[1] = (byte)(n >> 8),  d[2] = (byte)(n >> 16),  d[3] = (byte)(n >> 24);
+}
+
+/** Editors for each format.
+Return 0 on success. */
+extern int tag_mpeg(tagedit *t);
+extern int tag_flac(tagedit *t);
+extern int tag_ogg(tagedit *t);
+extern int tag_mp4(tagedit *t);
@@ -27,6 +27,7 @@ enum {
 struct tracks {
 	ffatomic trkid;
 	fflist trks; //fm_trk[]
+	fflock trks_lk; // tracks may be started by filters within any worker
 	const struct fmed_trk_mon *mon;
 	const fmed_queue *qu;
 	uint stop_sig :1;
@@ -90,7 +91,18 @@ typedef struct fm_trk {
 	char sid[FFSLEN("*") + FFINT_MAXCHARS];
 
 	uint state; //enum TRK_ST
+	uint64 pause_start; // msec
 	uint wflags;
+	uint close_wrk :1; // close filters within the worker (FMED_TRACK_KQ)
+
+	// status for FMED_TRACK_STATUS: written by the track's worker, read by the main thread
+	fflock stat_lk;
+	struct {
+		uint64 pos;
+		uint sample_rate;
+		struct fmed_netbuf net_buf;
+		char *input, *output;
+	} stat;
 } fm_trk;
 
 
@@ -98,9 +110,12 @@ static int trk_setout_file(fm_trk *t);
 static int trk_setout(fm_trk *t);
 static int trk_opened(fm_trk *t);
 static int trk_open(fm_trk *t, const char *fn);
+static void trk_input_joined(fm_trk *t);
+static int trk_input_tagedit(fm_trk *t);
 static void trk_open_capt(fm_trk *t);
 static void trk_free(fm_trk *t);
 static void trk_fin(fm_trk *t);
+static void trk_filters_close(fm_trk *t);
 static void trk_process(void *udata);
 static void trk_stop(fm_trk *t, uint flags);
 static fmed_f* trk_modbyext(fm_trk *t, uint flags, const ffstr *ext);
@@ -108,6 +123,8 @@ static void trk_printtime(fm_trk *t);
 static int trk_meta_enum(fm_trk *t, fmed_trk_meta *meta);
 static int trk_meta_copy(fm_trk *t, fm_trk *src);
 static char* chain_print(fm_trk *t, const ffchain_item *mark, char *buf, size_t cap);
+static void trk_status(fm_trk *t, ffarr *buf);
+static void trk_stat_update(fm_trk *t);
 
 static fmed_f* addfilter(fm_trk *t, const char *modname);
 static fmed_f* addfilter1(fm_trk *t, const fmed_modinfo *mod);
@@ -148,6 +165,7 @@ int tracks_init(void)
 		return -1;
 	g->qu = core->getmod("#queue.queue");
 	fflist_init(&g->trks);
+	fflk_init(&g->trks_lk);
 	return 0;
 }
 
@@ -208,12 +226,22 @@ static int trk_open(fm_trk *t, const char *fn)
 	} else {
 		uint have_path = (NULL != ffpath_split2(fn, ffsz_len(fn), NULL, &name));
 		ffpath_splitname(name.ptr, name.len, &name, &ext);
+
+		// probe the data only if the file has no extension or has the extension of a supported format
+		if (ext.len != 0
+			&& NULL == core->getmod2(FMED_MOD_INEXT, ext.ptr, ext.len)) {
+			errlog(t, "can't open file: \"%s\": unknown file extension", fn);
+			return 1;
+		}
+
 		if (!have_path && ffstr_eqcz(&name, "@stdin"))
 			addfilter(t, "#file.stdin");
 		else
 			addfilter(t, "#file.in");
 
-		if (NULL == trk_modbyext(t, FMED_MOD_INEXT, &ext)) {
+		// input module is chosen by #file.probe after the first data is read
+		if (NULL == filt_add_optional(t, "#file.probe")
+			&& NULL == trk_modbyext(t, FMED_MOD_INEXT, &ext)) {
 			errlog(t, "can't open file: \"%s\"", fn);
 			return 1;
 		}
@@ -222,6 +250,101 @@ static int trk_open(fm_trk *t, const char *fn)
 	return 0;
 }
 
+/** Open input for a segment track: no queue and no sleep filters. */
+static int trk_open_segment(fm_trk *t, const char *fn)
+{
+	ffstr name, ext;
+	trk_setvalstr(t, "input", fn);
+	addfilter(t, "#file.in");
+	ffpath_split2(fn, ffsz_len(fn), NULL, &name);
+	ffpath_splitname(name.ptr, name.len, &name, &ext);
+	if (NULL == trk_modbyext(t, FMED_MOD_INEXT, &ext)) {
+		errlog(t, "can't open file: \"%s\"", fn);
+		return 1;
+	}
+	return 0;
+}
+
+static const char *const segdec_exts[] = {
+	"caf", "flac", "m4a", "mp4", "wav",
+};
+
+/** Replace input and decoder filters with #soundmod.segdec
+ which decodes segments of the file on several workers in parallel. */
+static void trk_input_segmented(fm_trk *t)
+{
+	ffstr name, ext;
+	fmed_f *f;
+
+	if (!t->props.parallel_decode || t->props.join
+		|| t->props.stream_copy || t->props.input_info
+		|| (int64)t->props.audio.seek != FMED_NULL
+		|| t->props.audio.until != FMED_NULL
+		|| (int64)t->props.audio.split != FMED_NULL
+		|| t->props.audio.abs_seek != 0
+		|| !(t->props.pcm_peaks || t->props.loudness
+			|| FMED_PNULL != trk_getvalstr(t, "output")))
+		return;
+
+	const char *fn = trk_getvalstr(t, "input");
+	ffpath_split2(fn, ffsz_len(fn), NULL, &name);
+	ffpath_splitname(name.ptr, name.len, &name, &ext);
+	if (0 > ffszarr_ifindsorted(segdec_exts, FFCNT(segdec_exts), ext.ptr, ext.len))
+		return;
+
+	FFARR_WALK(&t->filters, f) {
+		if (ffsz_eq(f->name, "#file.in")) {
+			if (f->ctx != NULL)
+				return;
+			ffchain_split(f->sib.prev, ffchain_sentl(&t->filt_chain));
+			addfilter(t, "#soundmod.segdec");
+			return;
+		}
+	}
+}
+
+/** Replace input filters with #soundmod.join
+ which reads all input files one by one. */
+static void trk_input_joined(fm_trk *t)
+{
+	fmed_f *f;
+
+	if (!t->props.join || t->props.input_info
+		|| FMED_PNULL == trk_getvalstr(t, "join_input"))
+		return;
+
+	FFARR_WALK(&t->filters, f) {
+		if (ffsz_eq(f->name, "#file.in")) {
+			if (f->ctx != NULL)
+				return;
+			ffchain_split(f->sib.prev, ffchain_sentl(&t->filt_chain));
+			addfilter(t, "#soundmod.join");
+			return;
+		}
+	}
+}
+
+/** Replace all filters with tag.edit which writes --meta tags into the input file.
+Return 1 if the track is set up for editing tags. */
+static int trk_input_tagedit(fm_trk *t)
+{
+	fmed_f *f;
+
+	if (!t->props.edit_tags)
+		return 0;
+
+	FFARR_WALK(&t->filters, f) {
+		if (ffsz_eq(f->name, "#file.in")) {
+			if (f->ctx != NULL)
+				return 0;
+			ffchain_split(f->sib.prev, ffchain_sentl(&t->filt_chain));
+			addfilter(t, "tag.edit");
+			return 1;
+		}
+	}
+	return 0;
+}
+
 static void trk_open_capt(fm_trk *t)
 {
 	filt_add_optional(t, "#winsleep.sleep");
@@ -252,6 +375,16 @@ static int trk_setout(fm_trk *t)
 		if (0 != trk_setout_file(t))
 			return 1;
 		return 0;
+
+	case FMED_TRK_TYPE_SEGMENT:
+		return 0; // the last filter is added by #soundmod.segdec
+
+	case FMED_TRK_TYPE_PLAYBACK:
+		if (trk_input_tagedit(t))
+			return 0;
+		trk_input_joined(t);
+		trk_input_segmented(t);
+		break;
 	}
 
 	if (t->props.type == FMED_TRK_TYPE_NETIN) {
@@ -285,6 +418,10 @@ static int trk_setout(fm_trk *t)
 	if (t->props.use_dynanorm)
 		addfilter(t, "dynanorm.filter");
 
+	if (FMED_PNULL != trk_getvalstr(t, "output_tee")
+		&& FMED_PNULL != trk_getvalstr(t, "output"))
+		addfilter(t, "#soundmod.tee");
+
 	if ((int64)t->props.audio.split != FMED_NULL) {
 		addfilter(t, "#soundmod.split");
 		return 0;
@@ -295,8 +432,11 @@ static int trk_setout(fm_trk *t)
 	if (t->props.type == FMED_TRK_TYPE_MIXIN) {
 		addfilter(t, "mixer.in");
 
-	} else if (t->props.pcm_peaks) {
-		addfilter(t, "#soundmod.peaks");
+	} else if (t->props.pcm_peaks || t->props.loudness) {
+		if (t->props.pcm_peaks)
+			addfilter(t, "#soundmod.peaks");
+		if (t->props.loudness)
+			addfilter(t, "#soundmod.loudness");
 
 	} else if (FMED_PNULL != (s = trk_getvalstr(t, "output"))) {
 		if (0 != trk_setout_file(t))
@@ -315,7 +455,9 @@ static int trk_opened(fm_trk *t)
 		dbglog(t, "properties: %*xb", sizeof(t->props), &t->props);
 	}
 
+	fflk_lock(&g->trks_lk);
 	fflist_ins(&g->trks, &t->sib);
+	fflk_unlock(&g->trks_lk);
 	t->state = TRK_ST_ACTIVE;
 	t->cur = ffchain_first(&t->filt_chain);
 	return 0;
@@ -325,7 +467,7 @@ static int trk_opened(fm_trk *t)
 Example of a typical chain:
  #queue.track
  -> INPUT
- -> DECODER -> (#soundmod.until) -> UI -> #soundmod.gain -> (#soundmod.conv/conv-soxr) -> (ENCODER)
+ -> DECODER -> (#soundmod.until) -> UI -> #soundmod.gain -> (#soundmod.conv/resampler) -> (ENCODER)
  -> OUTPUT
 */
 static void* trk_create(uint cmd, const char *fn)
@@ -338,6 +480,7 @@ static void* trk_create(uint cmd, const char *fn)
 	ffrbt_init(&t->dict);
 	ffrbt_init(&t->meta);
 	fftask_set(&t->tsk, &trk_process, t);
+	fflk_init(&t->stat_lk);
 
 	trk_copy_info(&t->props, NULL);
 	t->props.track = &_fmed_track;
@@ -367,6 +510,13 @@ static void* trk_create(uint cmd, const char *fn)
 		trk_open_capt(t);
 		break;
 
+	case FMED_TRK_TYPE_SEGMENT:
+		if (0 != trk_open_segment(t, fn)) {
+			trk_free(t);
+			return FMED_TRK_EFMT;
+		}
+		break;
+
 	case FMED_TRK_TYPE_MIXOUT:
 		addfilter(t, "#queue.track");
 		addfilter(t, "mixer.out");
@@ -404,6 +554,10 @@ static int trk_setout_file(fm_trk *t)
 	if (!have_path && ffstr_eqcz(&name, "@stdout")) {
 		addfilter(t, "#file.stdout");
 		t->props.out_seekable = 0;
+	} else if (!have_path && ffstr_eqcz(&name, "@http")) {
+		addfilter(t, "net.httpsrv");
+		t->props.out_seekable = 0;
+		t->props.out_stream = 1;
 	} else {
 		addfilter(t, "#file.out");
 		t->props.out_seekable = 1;
@@ -500,15 +654,33 @@ static void trk_free_tsk(void *param)
 /** Finish processing for the track.  Thread: worker. */
 static void trk_fin(fm_trk *t)
 {
+	if (t->close_wrk && t->wid != 0) {
+		trk_filters_close(t);
+		core->cmd(FMED_TASK_XDEL, &t->tsk, t->wid);
+	}
+
 	fftask_set(&t->tsk_main, &trk_free_tsk, t);
 	core->task(&t->tsk_main, FMED_TASK_POST);
 }
 
-/** Free memory associated with the track.  Thread: main. */
-static void trk_free(fm_trk *t)
+/** Close all filters in reverse order. */
+static void trk_filters_close(fm_trk *t)
 {
 	fmed_f *pf;
+	FFARR_RWALK(&t->filters, pf) {
+		if (pf->ctx != NULL) {
+			t->cur = &pf->sib;
+			dbglog(t, "closing %s", pf->name);
+			pf->filt->close(pf->ctx);
+			pf->ctx = NULL;
+		}
+	}
+	t->cur = NULL;
+}
 
+/** Free memory associated with the track.  Thread: main. */
+static void trk_free(fm_trk *t)
+{
 	dbglog(t, "closing...");
 	core->task(&t->tsk_main, FMED_TASK_DEL);
 	core->cmd(FMED_TASK_XDEL, &t->tsk, t->wid);
@@ -529,14 +701,7 @@ static void trk_free(fm_trk *t)
 			);
 	}
 
-	FFARR_RWALK(&t->filters, pf) {
-		if (pf->ctx != NULL) {
-			t->cur = &pf->sib;
-			dbglog(t, "closing %s", pf->name);
-			pf->filt->close(pf->ctx);
-		}
-	}
-	t->cur = NULL;
+	trk_filters_close(t);
 
 	if (core->loglev == FMED_LOG_DEBUG)
 		trk_printtime(t);
@@ -546,10 +711,13 @@ static void trk_free(fm_trk *t)
 	ffrbt_freeall(&t->dict, (ffrbt_free_t)&dict_ent_free, FFOFF(dict_ent, nod));
 	ffrbt_freeall(&t->meta, (ffrbt_free_t)&dict_ent_free, FFOFF(dict_ent, nod));
 
-	if (fflist_exists(&g->trks, &t->sib)) {
+	fflk_lock(&g->trks_lk);
+	ffbool active = fflist_exists(&g->trks, &t->sib);
+	if (active)
 		fflist_rm(&g->trks, &t->sib);
+	fflk_unlock(&g->trks_lk);
+	if (active)
 		core->cmd(FMED_WORKER_RELEASE, t->wid, t->wflags);
-	}
 
 	if (g->mon != NULL) {
 		g->mon->onsig(&t->props, FMED_TRK_ONCLOSE);
@@ -557,6 +725,8 @@ static void trk_free(fm_trk *t)
 			g->mon->onsig(&t->props, FMED_TRK_ONLAST);
 	}
 
+	ffmem_free(t->stat.input);
+	ffmem_free(t->stat.output);
 	dbglog(t, "closed");
 	ffmem_free(t);
 
@@ -670,6 +840,7 @@ static void trk_process(void *udata)
 		}
 
 		if (core_job_shouldyield(t->wid, &jobdata)) {
+			trk_stat_update(t);
 			trk_cmd(t, FMED_TRACK_WAKE);
 			return;
 		}
@@ -687,6 +858,7 @@ static void trk_process(void *udata)
 			goto fin;
 
 		case FMED_RASYNC:
+			trk_stat_update(t);
 			return;
 
 		case FMED_RMORE:
@@ -1058,6 +1230,71 @@ static char* chain_print(fm_trk *t, const ffchain_item *mark, char *buf, size_t
 	return buf;
 }
 
+static void stat_setstr(char **dst, const char *val)
+{
+	if (val == FMED_PNULL) {
+		ffmem_free0(*dst);
+		return;
+	}
+	if (*dst != NULL && ffsz_eq(*dst, val))
+		return;
+	ffmem_free(*dst);
+	*dst = ffsz_alcopyz(val);
+}
+
+/** Copy the values shown by FMED_TRACK_STATUS.  Thread: worker. */
+static void trk_stat_update(fm_trk *t)
+{
+	const char *in = trk_getvalstr(t, "input");
+	const char *out = trk_getvalstr(t, "output");
+
+	fflk_lock(&t->stat_lk);
+	t->stat.pos = t->props.audio.pos;
+	t->stat.sample_rate = t->props.audio.fmt.sample_rate;
+	t->stat.net_buf = t->props.net_buf;
+	stat_setstr(&t->stat.input, in);
+	stat_setstr(&t->stat.output, out);
+	fflk_unlock(&t->stat_lk);
+}
+
+/** Add a status line for the track:
+"*ID  STATE  TIME  in:INPUT  out:OUTPUT  net:STATE received:BYTES buffer:LEVEL/TARGET stalls:N reconnects:N"
+Thread: main. */
+static void trk_status(fm_trk *t, ffarr *buf)
+{
+	static const char *const states[] = { "stopped", "active", "paused", "error" };
+	const char *s;
+	uint64 sec = 0;
+
+	fflk_lock(&t->stat_lk);
+
+	if (t->stat.sample_rate != 0)
+		sec = t->stat.pos / t->stat.sample_rate;
+
+	ffstr_catfmt(buf, "%S  %s  %U:%02u"
+		, &t->id, states[FF_READONCE(t->state)], sec / 60, (uint)(sec % 60));
+
+	if (t->stat.input != NULL)
+		ffstr_catfmt(buf, "  in:%s", t->stat.input);
+	if (t->stat.output != NULL)
+		ffstr_catfmt(buf, "  out:%s", t->stat.output);
+
+	struct fmed_netbuf nb = t->stat.net_buf;
+	fflk_unlock(&t->stat_lk);
+
+	if (nb.target != 0) {
+		if (nb.prebuffer)
+			s = (nb.stalls != 0) ? "refilling" : "buffering";
+		else
+			s = "ok";
+		ffstr_catfmt(buf, "  net:%s received:%U buffer:%u/%ums stalls:%u reconnects:%u"
+			, s, nb.received, nb.level, nb.target
+			, nb.stalls, nb.reconnects);
+	}
+
+	ffarr_append(buf, "\n", 1);
+}
+
 static ssize_t trk_cmd(void *trk, uint cmd, ...)
 {
 	fm_trk *t = trk;
@@ -1080,12 +1317,14 @@ static ssize_t trk_cmd(void *trk, uint cmd, ...)
 
 	case FMED_TRACK_STOPALL:
 		FF_ASSERT(core_ismainthr());
+		fflk_lock(&g->trks_lk);
 		FFLIST_WALKSAFE(&g->trks, t, sib, next) {
 			if (t->props.type == FMED_TRK_TYPE_REC && trk == NULL)
 				continue;
 
 			trk_stop(t, cmd);
 		}
+		fflk_unlock(&g->trks_lk);
 		break;
 
 	case FMED_TRACK_STOP:
@@ -1107,19 +1346,29 @@ static ssize_t trk_cmd(void *trk, uint cmd, ...)
 		if (t->props.print_time)
 			ffps_perf(&t->psperf, FFPS_PERF_REALTIME | FFPS_PERF_CPUTIME | FFPS_PERF_RUSAGE);
 
+		trk_stat_update(t);
 		t->wflags = (cmd == FMED_TRACK_XSTART) ? FMED_WORKER_FPARALLEL : 0;
 		t->wid = core->cmd(FMED_WORKER_ASSIGN, &t->kq, t->wflags);
 
 		core->cmd(FMED_TASK_XPOST, &t->tsk, t->wid);
 		break;
 
-	case FMED_TRACK_PAUSE:
+	case FMED_TRACK_PAUSE: {
+		fftime now;
+		fftime_now(&now);
+		t->pause_start = fftime_ms(&now);
 		t->state = TRK_ST_PAUSED;
 		break;
-	case FMED_TRACK_UNPAUSE:
+	}
+	case FMED_TRACK_UNPAUSE: {
+		fftime now;
+		fftime_now(&now);
+		if (t->state == TRK_ST_PAUSED)
+			t->props.paused_time += fftime_ms(&now) - t->pause_start;
 		t->state = TRK_ST_ACTIVE;
 		trk_process(t);
 		break;
+	}
 
 	case FMED_TRACK_LAST:
 		g->last = 1;
@@ -1211,9 +1460,24 @@ static ssize_t trk_cmd(void *trk, uint cmd, ...)
 		break;
 
 	case FMED_TRACK_KQ:
+		t->close_wrk = 1;
 		r = (size_t)t->kq;
 		break;
 
+	case FMED_TRACK_STATUS: {
+		ffarr *buf = va_arg(va, ffarr*);
+		fflk_lock(&g->trks_lk);
+		FFLIST_WALKSAFE(&g->trks, t, sib, next) {
+			trk_status(t, buf);
+		}
+		fflk_unlock(&g->trks_lk);
+		break;
+	}
+
+	case FMED_TRACK_WORKER:
+		r = t->wid;
+		break;
+
 	default:
 		errlog(t, "invalid command:%u", cmd);
 	}
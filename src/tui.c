@@ -528,6 +528,12 @@ static int tui_process(void *ctx, fmed_filt *d)
 			, (size_t)t->nback, '\r'
 			, playtime / 60, playtime % 60);
 
+		if (d->net_buf.target != 0)
+			ffstr_catfmt(&t->buf, "  buffer: %u.%us / %u.%us  stalls: %u  "
+				, d->net_buf.level / 1000, d->net_buf.level % 1000 / 100
+				, d->net_buf.target / 1000, d->net_buf.target % 1000 / 100
+				, d->net_buf.stalls);
+
 		goto print;
 	}
 
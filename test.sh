@@ -218,6 +218,137 @@ if test "$1" = "filters_dynanorm" ; then
 	$BIN dynanorm.wav --pcm-peaks
 fi
 
+if test "$1" = "hls" ; then
+	# play HLS stream from a local HTTP server
+	PORT=18002
+	rm -rf hls
+	mkdir hls
+	printf '#EXTM3U\n#EXT-X-TARGETDURATION:1\n#EXT-X-MEDIA-SEQUENCE:0\n' >hls/list.m3u8
+	# rec.mp3 (2 sec) -> 4 data files
+	i=0
+	for T in 0.000 0.500 1.000 1.500 2.000 ; do
+		if test $i -ne 0 ; then
+			$BIN rec.mp3 --seek=$PREV --until=$T --stream-copy -o hls/$i.mp3 -y
+			printf '#EXTINF:0.5,\n%s.mp3\n' $i >>hls/list.m3u8
+		fi
+		PREV=$T
+		i=$((i+1))
+	done
+	python3 -m http.server $PORT --bind 127.0.0.1 --directory hls 2>hls-srv.txt &
+	SRV=$!
+	sleep 1
+
+	# the stream ends after the playlist stops changing
+	$BIN http://127.0.0.1:$PORT/list.m3u8 -o hls.wav -y
+	kill $SRV
+	cat hls-srv.txt
+
+	# every data file is downloaded once
+	for i in 1 2 3 4 ; do
+		test $(grep -c "GET /$i.mp3 " hls-srv.txt) -eq 1
+	done
+	$BIN hls.wav --pcm-peaks
+	rm -rf hls hls-srv.txt
+fi
+
+if test "$1" = "http_srv" ; then
+	# serve the output stream to several local clients (fmedia.conf::net.httpsrv.listen 8000)
+	N=8
+	rm -f srv-*.mp3
+	$BIN rec.mp3 rec.mp3 rec.mp3 -o @http.mp3 &
+	FM=$!
+	sleep 1
+	for i in $(seq $N) ; do
+		if test $((i % 2)) -eq 0 ; then
+			curl -s -m 10 -H 'Icy-MetaData: 1' -o srv-icy-$i.mp3 http://127.0.0.1:8000/ &
+		else
+			curl -s -m 10 -o srv-$i.mp3 http://127.0.0.1:8000/ &
+		fi
+	done
+	wait $FM
+	sleep 1
+
+	# every client has received the stream
+	for i in $(seq $N) ; do
+		test -s srv-$i.mp3 || test -s srv-icy-$i.mp3
+	done
+	$BIN srv-[0-9]*.mp3 --pcm-peaks
+	rm srv-*.mp3
+fi
+
+if test "$1" = "radio_load" ; then
+	# record many streams at once from a local ICY server (stand-in for internet radio)
+	N=64
+	PORT=18001
+	cat >icy-srv.py <<'EOF'
+import socketserver, sys, time
+DATA = open(sys.argv[2], 'rb').read()
+METAINT = 8192
+class H(socketserver.StreamRequestHandler):
+	def handle(self):
+		while self.rfile.readline() not in (b'\r\n', b'\n', b''):
+			pass
+		self.wfile.write(b'ICY 200 OK\r\ncontent-type: audio/mpeg\r\nicy-br: 128\r\nicy-metaint: %d\r\n\r\n' % METAINT)
+		off = 0
+		n = 0
+		try:
+			while True:
+				blk = (DATA[off:] + DATA)[:METAINT]
+				off = (off + METAINT) % len(DATA)
+				meta = b"StreamTitle='A - T%d';" % (n // 8)
+				meta += b'\0' * (-len(meta) % 16)
+				self.wfile.write(blk + bytes([len(meta) // 16]) + meta)
+				n += 1
+				time.sleep(METAINT / (128000 / 8))
+		except OSError:
+			pass
+class S(socketserver.ThreadingMixIn, socketserver.TCPServer):
+	daemon_threads = True
+	allow_reuse_address = True
+S(('127.0.0.1', int(sys.argv[1])), H).serve_forever()
+EOF
+	python3 icy-srv.py $PORT rec.mp3 &
+	SRV=$!
+	sleep 1
+
+	URLS=""
+	for i in $(seq $N) ; do
+		URLS="$URLS http://127.0.0.1:$PORT/$i"
+	done
+	rm -f radio-*.mp3
+	$BIN --globcmd=listen $URLS --parallel --out-copy=rec --stream-copy -o 'radio-$counter-$title.mp3' -y &
+	FM=$!
+	sleep 5
+	$BIN --globcmd=status >radio-status.txt
+	cat radio-status.txt
+	$BIN --globcmd=quit
+	wait $FM
+	kill $SRV
+
+	# every stream is active and has received data
+	test $(grep -c "net:ok" radio-status.txt) -eq $N
+	test $(ls radio-*.mp3 | wc -l) -ge $N
+	$BIN radio-*.mp3 --pcm-peaks --parallel
+	rm icy-srv.py radio-status.txt
+fi
+
+if test "$1" = "bench_resample" ; then
+	# built-in resampler vs soxr: 5 minutes of audio (rec.wav joined 150 times)
+	IN=""
+	for i in $(seq 150) ; do
+		IN="$IN rec.wav"
+	done
+	$BIN $IN --join -o bench-src.wav --format=float32 -y
+	for RS in soxr native ; do
+		sed "s/resampler auto/resampler $RS/" fmedia.conf >bench-$RS.conf
+		for F in int16 float32 ; do
+			time $BIN bench-src.wav -o bench-$RS-$F.wav --rate=48000 --format=$F -y --print-time --conf=bench-$RS.conf
+		done
+	done
+	$BIN bench-soxr-*.wav bench-native-*.wav --pcm-peaks
+	rm bench-*.conf
+fi
+
 if test "$1" = "all" ; then
 	$BIN --list-dev
 	sh $0 record